@@ -0,0 +1,175 @@
+//
+//  AudioClock.c
+//  Equalizer
+//
+
+#include "AudioClock.h"
+#include <mach/mach_time.h>
+#include <string.h>
+#include <math.h>
+
+#define AUDIO_CLOCK_MAX_RATE_ERROR 0.01 // a fitted rate further than this from the nominal one is noise, not drift
+#define AUDIO_CLOCK_STALE_SECONDS 0.25  // callbacks this far behind have stopped coming (the output stopped, or we were taken off it)
+
+void AudioClockInit(AudioClock *clock, Float64 sampleRate)
+{
+    mach_timebase_info_data_t timeBaseInfo;
+    mach_timebase_info(&timeBaseInfo);
+
+    memset(clock, 0, sizeof(AudioClock));
+    clock->sampleRate = sampleRate;
+    clock->hostTicksPerSecond = 1000000000.0 * timeBaseInfo.denom / timeBaseInfo.numer;
+    for (int i=0;i<AUDIO_CLOCK_MAX_POINTS;i++) atomic_init(&clock->slotSequences[i], 0);
+    atomic_init(&clock->numPointsPublished, 0);
+    atomic_init(&clock->outputLatencyTicks, 0);
+}
+
+void AudioClockSetOutputLatency(AudioClock *clock, Float64 seconds)
+{
+    atomic_store_explicit(&clock->outputLatencyTicks, (UInt64)llround(seconds * clock->hostTicksPerSecond), memory_order_relaxed);
+}
+
+void AudioClockAddPoint(AudioClock *clock, UInt64 hostTime, Float64 sampleTime, SInt64 frame, UInt32 numFrames, UInt32 numFramesPlayed, Float64 frameRate)
+{
+    UInt64 pointIndex = atomic_load_explicit(&clock->numPointsPublished, memory_order_relaxed);
+    UInt32 slot = (UInt32)(pointIndex % AUDIO_CLOCK_MAX_POINTS);
+    if (isnan(sampleTime)) sampleTime = clock->nextSampleTime;
+
+    // mark the slot as being written first, like SpectrumBroadcastRing does
+    atomic_store_explicit(&clock->slotSequences[slot], 2 * pointIndex + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    AudioClockPoint *point = &clock->points[slot];
+    point->hostTime = hostTime;
+    point->sampleTime = sampleTime;
+    point->frame = frame;
+    point->numFrames = numFrames;
+    point->numFramesPlayed = numFramesPlayed;
+    point->frameRate = frameRate;
+    point->isDiscontinuity = pointIndex == 0 || fabs(sampleTime - clock->nextSampleTime) > 0.5;
+
+    atomic_store_explicit(&clock->slotSequences[slot], 2 * pointIndex + 2, memory_order_release);
+    atomic_store_explicit(&clock->numPointsPublished, pointIndex + 1, memory_order_release);
+
+    clock->nextSampleTime = sampleTime + numFrames;
+}
+
+// Copies the points since the last discontinuity, oldest first, and returns how many there are.
+// Stops at a slot being overwritten, which only the oldest can be
+static int CopyRecentPoints(AudioClock *clock, AudioClockPoint points[AUDIO_CLOCK_MAX_POINTS])
+{
+    UInt64 numPointsPublished = atomic_load_explicit(&clock->numPointsPublished, memory_order_acquire);
+    UInt64 numPointsKept = numPointsPublished < AUDIO_CLOCK_MAX_POINTS ? numPointsPublished : AUDIO_CLOCK_MAX_POINTS;
+
+    int numPoints = 0;
+    AudioClockPoint newestFirst[AUDIO_CLOCK_MAX_POINTS];
+    for (UInt64 pointIndex=numPointsPublished;pointIndex>numPointsPublished-numPointsKept;pointIndex--)
+    {
+        UInt32 slot = (UInt32)((pointIndex - 1) % AUDIO_CLOCK_MAX_POINTS);
+        UInt64 expectedSequence = 2 * (pointIndex - 1) + 2;
+        if (atomic_load_explicit(&clock->slotSequences[slot], memory_order_acquire) != expectedSequence) break;
+
+        AudioClockPoint point = clock->points[slot];
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&clock->slotSequences[slot], memory_order_relaxed) != expectedSequence) break;
+
+        newestFirst[numPoints++] = point;
+        if (point.isDiscontinuity) break;
+    }
+
+    for (int i=0;i<numPoints;i++) points[i] = newestFirst[numPoints - 1 - i];
+    return numPoints;
+}
+
+// Least squares line of the device sample time over host time, relative to the newest point.
+// Returns the slope in samples per host tick, and the fitted sample time at the newest point's host time
+static double FitSampleTime(AudioClock *clock, const AudioClockPoint *points, int numPoints, double *sampleTimeAtNewest)
+{
+    const AudioClockPoint *newest = &points[numPoints - 1];
+    double nominalSlope = clock->sampleRate / clock->hostTicksPerSecond;
+
+    double meanX = 0, meanY = 0;
+    for (int i=0;i<numPoints;i++)
+    {
+        meanX += (double)((SInt64)(points[i].hostTime - newest->hostTime));
+        meanY += points[i].sampleTime - newest->sampleTime;
+    }
+    meanX /= numPoints;
+    meanY /= numPoints;
+
+    double sumXX = 0, sumXY = 0;
+    for (int i=0;i<numPoints;i++)
+    {
+        double x = (double)((SInt64)(points[i].hostTime - newest->hostTime)) - meanX;
+        double y = points[i].sampleTime - newest->sampleTime - meanY;
+        sumXX += x * x;
+        sumXY += x * y;
+    }
+
+    // With one point, or callbacks too few or too irregular to tell the drift, the nominal rate does
+    double slope = sumXX > 0 ? sumXY / sumXX : nominalSlope;
+    if (fabs(slope / nominalSlope - 1) > AUDIO_CLOCK_MAX_RATE_ERROR) slope = nominalSlope;
+
+    *sampleTimeAtNewest = newest->sampleTime + meanY - slope * meanX;
+    return slope;
+}
+
+Boolean AudioClockFrameAtHostTime(AudioClock *clock, UInt64 hostTime, Float64 *frame)
+{
+    AudioClockPoint points[AUDIO_CLOCK_MAX_POINTS];
+    int numPoints = CopyRecentPoints(clock, points);
+    if (numPoints == 0) return false;
+
+    // What's heard at hostTime was handed to the hardware the output latency before
+    const AudioClockPoint *newest = &points[numPoints - 1];
+    double sampleTimeAtNewest;
+    double slope = FitSampleTime(clock, points, numPoints, &sampleTimeAtNewest);
+    double ticksSinceNewest = (double)((SInt64)(hostTime - newest->hostTime)) - (double)atomic_load_explicit(&clock->outputLatencyTicks, memory_order_relaxed);
+    if (ticksSinceNewest > AUDIO_CLOCK_STALE_SECONDS * clock->hostTicksPerSecond) return false;
+    double sampleTime = sampleTimeAtNewest + slope * ticksSinceNewest;
+
+    // The buffer that sample is in tells which of our frames it is. Past what a buffer played (a pause,
+    // an underrun, or a time after the newest buffer) the play head stands still. Before the oldest point
+    // we know of, the oldest buffer's start is the best there is
+    int i = numPoints - 1;
+    while (i > 0 && points[i].sampleTime > sampleTime) i--;
+    double offset = sampleTime - points[i].sampleTime;
+    if (offset < 0) offset = 0;
+    if (offset > points[i].numFramesPlayed) offset = points[i].numFramesPlayed;
+
+    *frame = points[i].frame + offset * points[i].frameRate;
+    return true;
+}
+
+Boolean AudioClockHostTimeAtFrame(AudioClock *clock, Float64 frame, UInt64 *hostTime)
+{
+    AudioClockPoint points[AUDIO_CLOCK_MAX_POINTS];
+    int numPoints = CopyRecentPoints(clock, points);
+    if (numPoints == 0) return false;
+
+    // The newest buffer that started at or before the frame. A frame a buffer didn't play (it was paused
+    // then) gets where the buffer's played part ended
+    int i = numPoints - 1;
+    while (i > 0 && points[i].frame > frame) i--;
+    double offset = (frame - points[i].frame) / points[i].frameRate;
+    if (offset > points[i].numFramesPlayed && i < numPoints - 1) offset = points[i].numFramesPlayed;
+    double sampleTime = points[i].sampleTime + offset;
+
+    const AudioClockPoint *newest = &points[numPoints - 1];
+    double sampleTimeAtNewest;
+    double slope = FitSampleTime(clock, points, numPoints, &sampleTimeAtNewest);
+    double ticksSinceNewest = (sampleTime - sampleTimeAtNewest) / slope + (double)atomic_load_explicit(&clock->outputLatencyTicks, memory_order_relaxed);
+
+    *hostTime = (UInt64)((SInt64)newest->hostTime + (SInt64)llround(ticksSinceNewest));
+    return true;
+}
+
+Float64 AudioClockMeasuredSampleRate(AudioClock *clock)
+{
+    AudioClockPoint points[AUDIO_CLOCK_MAX_POINTS];
+    int numPoints = CopyRecentPoints(clock, points);
+    if (numPoints == 0) return clock->sampleRate;
+
+    double sampleTimeAtNewest;
+    return FitSampleTime(clock, points, numPoints, &sampleTimeAtNewest) * clock->hostTicksPerSecond;
+}
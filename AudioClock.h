@@ -0,0 +1,67 @@
+//
+//  AudioClock.h
+//  Equalizer
+//
+
+// Which frame is being heard at a given host time, to a fraction of a render buffer.
+//
+// The render thread adds a point per callback: the host time and device sample time of its timestamp,
+// the frame of ours it started the buffer at, how many of its samples it played (none while paused or
+// starved) and how many of our frames each one stood for. Readers fit a line from host time to device
+// sample time over the recent points, which takes out the device clock's drift against the host's and the
+// jitter of when callbacks run, and walk the points to turn the device sample time into our frame. The output latency is added on top, so the
+// answer is what comes out of the speaker, not what was handed to the hardware.
+//
+// The render thread never waits: points go into a ring, and a reader copying a slot that's being
+// overwritten just goes without it.
+
+#include <stdatomic.h>
+#include <MacTypes.h>
+
+#define AUDIO_CLOCK_MAX_POINTS 128  // about 1.5 seconds of callbacks of 512 frames at 44.1 kHz
+
+typedef struct AudioClockPoint
+{
+    UInt64 hostTime;
+    Float64 sampleTime;     // the device's
+    SInt64 frame;           // ours, where the buffer started
+    UInt32 numFrames;       // the buffer's
+    UInt32 numFramesPlayed; // of the buffer's, from frame on. The rest of it was silence
+    Float64 frameRate;      // our frames per frame played. 1 unless playback is stretched
+    Boolean isDiscontinuity;// the device's sample time jumped (it restarted), so the fit starts over here
+} AudioClockPoint;
+
+typedef struct AudioClock
+{
+    Float64 sampleRate;     // nominal, for when there's too little to fit
+    Float64 hostTicksPerSecond;
+    _Atomic UInt64 outputLatencyTicks;
+
+    AudioClockPoint points[AUDIO_CLOCK_MAX_POINTS];
+    _Atomic UInt64 slotSequences[AUDIO_CLOCK_MAX_POINTS];  // 2 * index + 1 while being written, 2 * index + 2 once it's there
+    _Atomic UInt64 numPointsPublished;
+
+    // The render thread's own
+    Float64 nextSampleTime;
+} AudioClock;
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+void AudioClockInit(AudioClock *clock, Float64 sampleRate);
+void AudioClockSetOutputLatency(AudioClock *clock, Float64 seconds);
+
+// Render thread
+void AudioClockAddPoint(AudioClock *clock, UInt64 hostTime, Float64 sampleTime, SInt64 frame, UInt32 numFrames, UInt32 numFramesPlayed, Float64 frameRate);
+
+// Any thread. Returns false until the render thread has added a point, and once it stops adding them
+Boolean AudioClockFrameAtHostTime(AudioClock *clock, UInt64 hostTime, Float64 *frame);
+// The other way: when one of our frames is heard. Frames before the oldest point known go by the fitted line from there
+Boolean AudioClockHostTimeAtFrame(AudioClock *clock, Float64 frame, UInt64 *hostTime);
+// The fitted device rate, in samples per host second. Off from the nominal rate by the clocks' drift
+Float64 AudioClockMeasuredSampleRate(AudioClock *clock);
+
+#if defined __cplusplus
+};
+#endif
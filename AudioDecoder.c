@@ -0,0 +1,348 @@
+//
+//  AudioDecoder.c
+//  Equalizer
+//
+
+#include "AudioDecoder.h"
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WAVE_FORMAT_PCM 0x0001
+#define WAVE_FORMAT_IEEE_FLOAT 0x0003
+#define WAVE_FORMAT_EXTENSIBLE 0xFFFE
+
+static const AudioDecoderInterface *const AudioDecoderInterfaces[] = { &AudioDecoderMappedPCM };
+
+Boolean AudioDecoderOpenWithInterface(AudioDecoder *decoder, const AudioDecoderInterface *interface, const char *path)
+{
+    memset(decoder, 0, sizeof(AudioDecoder));
+    decoder->numFrames = -1;
+    if (!interface->open(decoder, path))
+    {
+        memset(decoder, 0, sizeof(AudioDecoder));
+        return false;
+    }
+    
+    decoder->interface = interface;
+    return true;
+}
+
+Boolean AudioDecoderOpen(AudioDecoder *decoder, const char *path)
+{
+    for (size_t i=0;i<sizeof(AudioDecoderInterfaces) / sizeof(AudioDecoderInterfaces[0]);i++)
+    {
+        if (AudioDecoderOpenWithInterface(decoder, AudioDecoderInterfaces[i], path)) return true;
+    }
+    return false;
+}
+
+void AudioDecoderClose(AudioDecoder *decoder)
+{
+    if (decoder->interface) decoder->interface->close(decoder);
+    memset(decoder, 0, sizeof(AudioDecoder));
+}
+
+Boolean AudioDecoderIsOpen(const AudioDecoder *decoder)
+{
+    return decoder->interface != NULL;
+}
+
+const float *AudioDecoderReadBlock(AudioDecoder *decoder, UInt32 maxFrames, UInt32 *numFramesRead)
+{
+    *numFramesRead = 0;
+    if (!decoder->interface || maxFrames == 0) return NULL;
+    return decoder->interface->readBlock(decoder, maxFrames, numFramesRead);
+}
+
+UInt32 AudioDecoderReadInto(AudioDecoder *decoder, float *destination, UInt32 maxFrames)
+{
+    if (!decoder->interface || maxFrames == 0) return 0;
+    if (decoder->interface->readInto) return decoder->interface->readInto(decoder, destination, maxFrames);
+    
+    UInt32 numFramesRead = 0;
+    const float *block = decoder->interface->readBlock(decoder, maxFrames, &numFramesRead);
+    if (block) memcpy(destination, block, (size_t)numFramesRead * decoder->numChannels * sizeof(float));
+    return numFramesRead;
+}
+
+Boolean AudioDecoderSeek(AudioDecoder *decoder, SInt64 frame)
+{
+    if (!decoder->interface || frame < 0) return false;
+    return decoder->interface->seek(decoder, frame);
+}
+
+Float64 AudioDecoderDuration(const AudioDecoder *decoder)
+{
+    return decoder->numFrames >= 0 && decoder->sampleRate > 0 ? decoder->numFrames / decoder->sampleRate : 0;
+}
+
+#pragma mark - Memory-mapped PCM
+
+typedef enum MappedPCMSampleType
+{
+    MappedPCMSampleType_Float32,
+    MappedPCMSampleType_Int16,
+    MappedPCMSampleType_Int24,
+} MappedPCMSampleType;
+
+typedef struct MappedPCMState
+{
+    UInt8 *map;
+    size_t mapLength;
+    const UInt8 *data;
+    UInt64 dataLength;
+    UInt32 bytesPerFrame;
+    MappedPCMSampleType sampleType;
+    
+    float *convertedBlock;      // for the sample types that can't be handed out as they are
+    UInt32 convertedBlockCapacity;
+} MappedPCMState;
+
+static inline UInt16 ReadUInt16(const UInt8 *bytes)
+{
+    return (UInt16)(bytes[0] | bytes[1] << 8);
+}
+
+static inline UInt32 ReadUInt32(const UInt8 *bytes)
+{
+    return (UInt32)bytes[0] | (UInt32)bytes[1] << 8 | (UInt32)bytes[2] << 16 | (UInt32)bytes[3] << 24;
+}
+
+static inline UInt64 ReadUInt64(const UInt8 *bytes)
+{
+    return (UInt64)ReadUInt32(bytes) | (UInt64)ReadUInt32(bytes + 4) << 32;
+}
+
+static MappedPCMState *MapFile(const char *path)
+{
+    int fileDescriptor = open(path, O_RDONLY);
+    if (fileDescriptor < 0) return NULL;
+    
+    struct stat fileStatus;
+    MappedPCMState *state = NULL;
+    if (fstat(fileDescriptor, &fileStatus) == 0 && fileStatus.st_size > 0)
+    {
+        void *map = mmap(NULL, (size_t)fileStatus.st_size, PROT_READ, MAP_PRIVATE, fileDescriptor, 0);
+        if (map != MAP_FAILED)
+        {
+            state = calloc(1, sizeof(MappedPCMState));
+            if (state)
+            {
+                state->map = map;
+                state->mapLength = (size_t)fileStatus.st_size;
+                madvise(map, state->mapLength, MADV_SEQUENTIAL);
+            }
+            else munmap(map, (size_t)fileStatus.st_size);
+        }
+    }
+    
+    // the mapping stays valid without the descriptor
+    close(fileDescriptor);
+    return state;
+}
+
+static void UnmapFile(MappedPCMState *state)
+{
+    if (!state) return;
+    munmap(state->map, state->mapLength);
+    free(state->convertedBlock);
+    free(state);
+}
+
+// Finds the fmt and data chunks of a RIFF or RF64 WAVE file
+static Boolean ParseWave(AudioDecoder *decoder, MappedPCMState *state)
+{
+    const UInt8 *bytes = state->map;
+    size_t length = state->mapLength;
+    if (length < 12 || memcmp(bytes + 8, "WAVE", 4) != 0) return false;
+    
+    Boolean isRF64 = memcmp(bytes, "RF64", 4) == 0;
+    if (!isRF64 && memcmp(bytes, "RIFF", 4) != 0) return false;
+    
+    UInt64 dataLength64 = 0;
+    const UInt8 *format = NULL;
+    UInt32 formatLength = 0;
+    
+    size_t position = 12;
+    while (position + 8 <= length)
+    {
+        const UInt8 *chunk = bytes + position;
+        UInt64 chunkLength = ReadUInt32(chunk + 4);
+        
+        if (memcmp(chunk, "ds64", 4) == 0 && chunkLength >= 16 && position + 8 + 16 <= length)
+            dataLength64 = ReadUInt64(chunk + 8 + 8);
+        else if (memcmp(chunk, "fmt ", 4) == 0 && chunkLength >= 16 && position + 8 + chunkLength <= length)
+        {
+            format = chunk + 8;
+            formatLength = (UInt32)chunkLength;
+        }
+        else if (memcmp(chunk, "data", 4) == 0)
+        {
+            // RF64 keeps the real size in ds64. Files that were never finalized say 0 or -1: take what's there
+            if (isRF64 && chunkLength == 0xFFFFFFFF) chunkLength = dataLength64;
+            if (chunkLength == 0 || chunkLength == 0xFFFFFFFF || position + 8 + chunkLength > length) chunkLength = length - position - 8;
+            state->data = chunk + 8;
+            state->dataLength = chunkLength;
+            break;
+        }
+        
+        position += 8 + chunkLength + (chunkLength & 1);
+    }
+    if (!format || !state->data) return false;
+    
+    UInt16 formatTag = ReadUInt16(format);
+    UInt32 numChannels = ReadUInt16(format + 2);
+    UInt32 sampleRate = ReadUInt32(format + 4);
+    UInt32 bitsPerSample = ReadUInt16(format + 14);
+    if (formatTag == WAVE_FORMAT_EXTENSIBLE && formatLength >= 40) formatTag = ReadUInt16(format + 24); // the sub-format GUID starts with it
+    
+    if (formatTag == WAVE_FORMAT_IEEE_FLOAT && bitsPerSample == 32) state->sampleType = MappedPCMSampleType_Float32;
+    else if (formatTag == WAVE_FORMAT_PCM && bitsPerSample == 16) state->sampleType = MappedPCMSampleType_Int16;
+    else if (formatTag == WAVE_FORMAT_PCM && bitsPerSample == 24) state->sampleType = MappedPCMSampleType_Int24;
+    else return false;
+    if (numChannels == 0 || sampleRate == 0) return false;
+    
+    decoder->numChannels = numChannels;
+    decoder->sampleRate = sampleRate;
+    state->bytesPerFrame = numChannels * bitsPerSample / 8;
+    return true;
+}
+
+static void SetUpMappedPCM(AudioDecoder *decoder, MappedPCMState *state)
+{
+    decoder->state = state;
+    decoder->numFrames = (SInt64)(state->dataLength / state->bytesPerFrame);
+    decoder->position = 0;
+    
+    // floats can only be handed out in place if they're aligned, which they are in any sane file
+    decoder->isZeroCopy = state->sampleType == MappedPCMSampleType_Float32 && ((uintptr_t)state->data % sizeof(float)) == 0;
+}
+
+static Boolean MappedPCMOpen(AudioDecoder *decoder, const char *path)
+{
+    MappedPCMState *state = MapFile(path);
+    if (!state) return false;
+    
+    if (!ParseWave(decoder, state))
+    {
+        UnmapFile(state);
+        return false;
+    }
+    
+    SetUpMappedPCM(decoder, state);
+    return true;
+}
+
+Boolean AudioDecoderOpenRawFloat(AudioDecoder *decoder, const char *path, Float64 sampleRate, UInt32 numChannels)
+{
+    memset(decoder, 0, sizeof(AudioDecoder));
+    if (sampleRate <= 0 || numChannels == 0) return false;
+    
+    MappedPCMState *state = MapFile(path);
+    if (!state) return false;
+    
+    state->data = state->map;
+    state->dataLength = state->mapLength;
+    state->sampleType = MappedPCMSampleType_Float32;
+    state->bytesPerFrame = numChannels * sizeof(float);
+    decoder->sampleRate = sampleRate;
+    decoder->numChannels = numChannels;
+    SetUpMappedPCM(decoder, state);
+    decoder->interface = &AudioDecoderMappedPCM;
+    return true;
+}
+
+static void MappedPCMClose(AudioDecoder *decoder)
+{
+    UnmapFile(decoder->state);
+    decoder->state = NULL;
+}
+
+static void ConvertSamples(const MappedPCMState *state, const UInt8 *frames, UInt32 numSamples, float *converted)
+{
+    switch (state->sampleType)
+    {
+        case MappedPCMSampleType_Float32:
+            memcpy(converted, frames, numSamples * sizeof(float));
+            break;
+        case MappedPCMSampleType_Int16:
+            for (UInt32 i=0;i<numSamples;i++) converted[i] = (SInt16)ReadUInt16(frames + 2 * i) / 32768.0f;
+            break;
+        case MappedPCMSampleType_Int24:
+            for (UInt32 i=0;i<numSamples;i++)
+            {
+                const UInt8 *sample = frames + 3 * i;
+                SInt32 value = (SInt32)((UInt32)sample[0] << 8 | (UInt32)sample[1] << 16 | (UInt32)sample[2] << 24) >> 8;
+                converted[i] = value / 8388608.0f;
+            }
+            break;
+    }
+}
+
+static UInt32 FramesLeft(const AudioDecoder *decoder, UInt32 maxFrames)
+{
+    if (decoder->position >= decoder->numFrames) return 0;
+    return decoder->numFrames - decoder->position < maxFrames ? (UInt32)(decoder->numFrames - decoder->position) : maxFrames;
+}
+
+static const float *MappedPCMReadBlock(AudioDecoder *decoder, UInt32 maxFrames, UInt32 *numFramesRead)
+{
+    MappedPCMState *state = decoder->state;
+    UInt32 numFrames = FramesLeft(decoder, maxFrames);
+    if (numFrames == 0) return NULL;
+    
+    const UInt8 *frames = state->data + (UInt64)decoder->position * state->bytesPerFrame;
+    UInt32 numSamples = numFrames * decoder->numChannels;
+    
+    const float *block = (const float *)frames;
+    if (!decoder->isZeroCopy)
+    {
+        if (state->convertedBlockCapacity < numSamples)
+        {
+            float *convertedBlock = realloc(state->convertedBlock, numSamples * sizeof(float));
+            if (!convertedBlock) return NULL;
+            state->convertedBlock = convertedBlock;
+            state->convertedBlockCapacity = numSamples;
+        }
+        
+        ConvertSamples(state, frames, numSamples, state->convertedBlock);
+        block = state->convertedBlock;
+    }
+    
+    decoder->position += numFrames;
+    *numFramesRead = numFrames;
+    return block;
+}
+
+// Integer samples are converted straight into the destination, without going through convertedBlock
+static UInt32 MappedPCMReadInto(AudioDecoder *decoder, float *destination, UInt32 maxFrames)
+{
+    MappedPCMState *state = decoder->state;
+    UInt32 numFrames = FramesLeft(decoder, maxFrames);
+    if (numFrames == 0) return 0;
+    
+    ConvertSamples(state, state->data + (UInt64)decoder->position * state->bytesPerFrame, numFrames * decoder->numChannels, destination);
+    decoder->position += numFrames;
+    return numFrames;
+}
+
+static Boolean MappedPCMSeek(AudioDecoder *decoder, SInt64 frame)
+{
+    decoder->position = frame < decoder->numFrames ? frame : decoder->numFrames;
+    return true;
+}
+
+const AudioDecoderInterface AudioDecoderMappedPCM =
+{
+    "Memory-mapped PCM",
+    MappedPCMOpen,
+    MappedPCMClose,
+    MappedPCMReadBlock,
+    MappedPCMReadInto,
+    MappedPCMSeek,
+};
@@ -0,0 +1,67 @@
+//
+//  AudioDecoder.h
+//  Equalizer
+//
+
+// Where decoded audio comes from, behind one interface: open a source, learn its format, read it block
+// by block and seek in it. Blocks are always interleaved 32-bit floats, at the source's own rate.
+// A block stays valid until the next read, seek or close. AudioDecoderReadInto decodes into the caller's
+// memory instead (say, the head of a ring), which saves the copy out of the block.
+//
+// Backends:
+// - AudioDecoderMappedPCM: WAV, RF64 and raw float files, memory-mapped. Float files are handed out
+//   straight from the mapping, with no copy at all. 16 and 24-bit integer WAVs are converted block by block.
+//
+// Plain C, so the pipeline can be fed (and benchmarked) without AVFoundation.
+
+#include <stddef.h>
+#include "AudioTypes.h"
+
+typedef struct AudioDecoder AudioDecoder;
+
+typedef struct AudioDecoderInterface
+{
+    const char *name;
+    Boolean (*open)(AudioDecoder *decoder, const char *path);
+    void (*close)(AudioDecoder *decoder);
+    const float *(*readBlock)(AudioDecoder *decoder, UInt32 maxFrames, UInt32 *numFramesRead);
+    UInt32 (*readInto)(AudioDecoder *decoder, float *destination, UInt32 maxFrames); // optional
+    Boolean (*seek)(AudioDecoder *decoder, SInt64 frame);
+} AudioDecoderInterface;
+
+struct AudioDecoder
+{
+    const AudioDecoderInterface *interface;    // NULL when closed
+    void *state;
+    
+    Float64 sampleRate;
+    UInt32 numChannels;
+    SInt64 numFrames;       // -1 if the source doesn't say
+    SInt64 position;        // the frame the next block starts at
+    Boolean isZeroCopy;     // blocks point right into the source
+};
+
+extern const AudioDecoderInterface AudioDecoderMappedPCM;
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+// Tries every backend in turn. Fails if none of them can read the file
+Boolean AudioDecoderOpen(AudioDecoder *decoder, const char *path);
+Boolean AudioDecoderOpenWithInterface(AudioDecoder *decoder, const AudioDecoderInterface *interface, const char *path);
+// Headerless interleaved floats, in the machine's byte order
+Boolean AudioDecoderOpenRawFloat(AudioDecoder *decoder, const char *path, Float64 sampleRate, UInt32 numChannels);
+void AudioDecoderClose(AudioDecoder *decoder);
+Boolean AudioDecoderIsOpen(const AudioDecoder *decoder);
+
+// Returns NULL (and no frames) at the end of the source
+const float *AudioDecoderReadBlock(AudioDecoder *decoder, UInt32 maxFrames, UInt32 *numFramesRead);
+// Returns the number of frames written to destination, 0 at the end of the source
+UInt32 AudioDecoderReadInto(AudioDecoder *decoder, float *destination, UInt32 maxFrames);
+Boolean AudioDecoderSeek(AudioDecoder *decoder, SInt64 frame);
+Float64 AudioDecoderDuration(const AudioDecoder *decoder);
+
+#if defined __cplusplus
+};
+#endif
@@ -8,12 +8,25 @@
 
 #import <Foundation/Foundation.h>
 #import "AudioUtility.h"
+#import "PhaseVocoder.h"
 #import "AEAudioController.h"
 
+// Gets offline analysis' spectra (CHUNK_SIZE floats each), in time order, every channel of one time before the next
+typedef void (^AudioFileSpectrumSink)(SInt64 timeInFrames, UInt32 channelIndex, const float *spectrum);
+
+typedef struct AudioFileOfflineAnalysisResult
+{
+    SInt64 numFrames;       // of audio analysed
+    UInt64 numSpectra;      // per channel
+    double seconds;
+    double realtimeFactor;  // seconds of audio analysed per second
+} AudioFileOfflineAnalysisResult;
+
 @protocol AudioFileDelegate<NSObject>
 @optional
 - (void)audioFilePlaybackFinished:(AudioFile *)audioFile;
 - (void)audioFileReadingErrorOccurred:(AudioFile *)audioFile withError:(NSError *)error;
+- (void)audioFile:(AudioFile *)audioFile didStartPlayingQueuedURL:(NSURL *)url; // URL and the formats are the new track's by now
 @end
 
 
@@ -24,20 +37,22 @@
 @property NSString *title;
 @property(readonly) NSURL *URL;
 
-@property(readonly) SInt64 currentlyPlayingFrame;
+@property(readonly) SInt64 currentlyPlayingFrame; // on the rings' timeline, which queued tracks continue (see enqueueURL:)
+@property(readonly) SInt64 currentTrackStartFrame; // where the playing track starts on that timeline. 0 until a queued track plays
 @property(readonly) LiveAudioData liveAudioData;
 @property(readonly) BOOL isPlaying;
 @property(readonly) BOOL canPlay;
 
 @property AudioStreamBasicDescription sourceAudioFormat;
 @property AudioStreamBasicDescription playedAudioFormat;
+@property(readonly) Float64 sampleRate; // what the rings and the analysis run at: the output's, whatever the file's is
 @property NSTimeInterval durationInSeconds;
 @property SInt64 totalFramesCount;
 
 @property BOOL reverbOnPause;
 @property CGFloat amplitudeFactor;
 @property UInt32 fftOverlapJumpSize;
-@property CGFloat timeDelay;
+@property CGFloat timeDelay; // how far after now liveAudioData looks, for a consumer that shows it that much later. 0 by default
 @property CGFloat reverbDecayTime;
 @property CGFloat reverbDryWetMix;
 
@@ -47,6 +62,38 @@
 @property BOOL isStopped;
 @property(readonly) BOOL isStereo;
 @property(readonly) BOOL isMono;
+@property(readonly) UInt32 numChannels; // channels being decoded and analysed, up to MAX_AUDIO_CHANNELS
+@property(readonly) AudioStreamMemoryUsage memoryUsage; // what this file's buffers take right now
+@property(readonly) double sampleBytesCopiedPerFrame; // bytes written on the way from the decoder to the rings, per frame
+
+// Lazy analysis computes an FFT frame only when something first reads it, instead of every frame
+// ahead of time. liveAudioData then has lazyFramesPerRead frames (1 by default). Takes effect on the
+// next load or seek.
+@property BOOL lazyAnalysis;
+@property int lazyFramesPerRead;
+@property(readonly) CGFloat fractionOfFramesAnalysed; // frames computed / frames stored, since the last load
+
+// Decoded audio goes through a pipeline of stages that run in parallel on the shared worker pool (see
+// AudioPipeline in AudioUtility.h). Center extraction, for stereo files, is a stage of its own and fills
+// liveAudioData's extractedChannel. Takes effect on the next load.
+@property BOOL extractsCenterChannel;
+- (int)getPipelineStats:(AudioPipelineStageStats *)stats maxStages:(int)maxStages; // the decoder first. Returns how many stages there are
+
+// Local files are analysed once: playing a track from its start saves its spectra, band energies and
+// peaks under this directory (see SpectrogramCache.h), and on later loads they're read from there
+// instead of computed. Defaults to Caches/Spectrograms; nil turns the cache off. Takes effect on the next load.
+// Entries are of the unscaled audio, so the cache is only written and read while amplitudeFactor is 1.
+@property NSString *spectrogramCacheDirectory;
+@property(readonly) BOOL isUsingSpectrogramCache;
+- (const float *)bandEnergiesAtFrame:(SInt64)frame forChannel:(UInt32)channelID; // SPECTROGRAM_CACHE_NUM_BANDS values, NULL if not cached
+- (const SpectrogramCachePeak *)peakAtFrame:(SInt64)frame forChannel:(UInt32)channelID;
+
+// A consumer that reads at a steady rate (e.g. 60 for a display) can say so. With lazy analysis, the
+// frames it will read are then computed as audio is read from the file, and the rest stay lazy.
+// With averaging, each read gets the power average of the frames since the previous read.
+- (int)addSpectrumReadScheduleWithRate:(Float64)readRate alignment:(SInt64)alignment averageSkippedFrames:(BOOL)averageSkippedFrames;
+- (void)removeSpectrumReadSchedule:(int)scheduleID;
+- (BOOL)getScheduledSpectrum:(float *)result forSchedule:(int)scheduleID channel:(UInt32)channelID;
 
 @property(nonatomic) AVAssetReader *assetReader;
 @property(nonatomic) AVAssetReaderTrackOutput *samplesReader;
@@ -61,7 +108,68 @@
 -(NSError *)stop;
 -(NSError *)pause;
 -(NSError *)resume;
--(void)seekToOffset:(SInt64)offset withCompletionCallback:(void (^)(NSError *))completion;
+-(void)seekToOffset:(SInt64)offset withCompletionCallback:(void (^)(NSError *))completion; // offset in the playing track
+
+// Gapless playback. The first queued URL is opened in the background while the current track plays, and
+// once the current track has been read to the end its audio follows right on in the same buffers, so it's
+// analysed ahead of time and plays without a gap. The delegate hears about it when it starts playing.
+// A track with a different number of channels can't follow on, and is loaded when the current one finishes.
+- (void)enqueueURL:(NSURL *)url;
+- (void)clearQueue;
+@property(readonly) NSArray *queuedURLs;
+
+// A seek starts analysing seekPreRollFrames (CHUNK_SIZE by default) before its target, so the frames
+// around the target are there when it starts playing. Recently decoded audio is kept (see AudioSeekCache.h),
+// and a seek into it doesn't wait for the decoder.
+@property UInt32 seekPreRollFrames;
+@property(readonly) NSTimeInterval lastSeekLatency; // from the seek call until there was a spectrum at the target
+@property(readonly) BOOL lastSeekUsedCachedAudio;
+
+// Playback speed (1 is as recorded, PHASE_VOCODER_MIN_RATE to PHASE_VOCODER_MAX_RATE) and pitch shift in
+// semitones (up to PHASE_VOCODER_MAX_PITCH either way). Either can change while playing, and takes effect
+// from the next chunk. Anything but 1 and 0 plays through a phase vocoder (see PhaseVocoder.h), which then
+// stays on until the next seek or load. Analysis and every frame number stay in the track's own time: the
+// play head moves by the source frames the output stands for
+@property Float64 playbackRate;
+@property Float64 playbackPitch;
+
+// Copies the current live data into caller-owned buffers, one per channel (numChannels of them are used).
+// Returns NO if a consistent copy couldn't be made because the data kept being reclaimed while copying.
+- (BOOL)getLiveAudioDataSnapshot:(LiveAudioData *)snapshot withBuffers:(LiveAudioSnapshotBuffer[MAX_AUDIO_CHANNELS])buffers;
+
+// Each reader gets every FFT frame of the channel exactly once, at its own pace (see SpectrumBroadcastRing.h).
+// Every channel the file has broadcasts. Returns -1 if all reader slots are taken, or there's no such channel.
+- (int)addSpectrumReaderForChannel:(UInt32)channelID;
+- (void)removeSpectrumReader:(int)readerID forChannel:(UInt32)channelID;
+- (SpectrumBroadcastRing *)spectrumBroadcastForChannel:(UInt32)channelID; // NULL if there's no such channel
+
+// Spectra that fell off the live buffers are kept for `seconds` in memory, and after that in files under
+// `directory` (if not nil), for every channel. Defaults to the memory budget's history duration, and gets less if the budget
+// doesn't have room for it. Must be called while no audio is being read.
+- (NSError *)configureSpectrogramHistoryWithDuration:(NSTimeInterval)seconds fileDirectory:(NSString *)directory;
+
+// Headless analysis of the loaded track, from its start and as fast as the pipeline goes, with nothing played
+// and the audio controller left alone. Each chunk's spectra go to the sink once every stage is done with it,
+// on the pull thread, and the play head follows them instead of the render thread. A spectrogram cache entry
+// (see spectrogramCacheDirectory) is written along the way, so a nil sink just fills the cache. Can't be
+// done while playing. Afterwards reading is back at the start, ready to play
+- (void)analyseOfflineWithSpectrumSink:(AudioFileSpectrumSink)sink completion:(void (^)(AudioFileOfflineAnalysisResult result, NSError *error))completion;
+- (void)cancelOfflineAnalysis;
+@property(readonly) BOOL isAnalysingOffline;
++ (AudioFileSpectrumSink)spectrumSinkWritingToFile:(NSString *)path; // the spectra one after the other, raw, in the order the sink gets them
+
+// Which frame is coming out of the speaker at a host time (mach_absolute_time), to a fraction of a frame.
+// Fitted to the render callbacks' timestamps and the output latency (see AudioClock.h). A time ahead of the
+// last buffer rendered gets the end of that buffer, and one that's older than the clock remembers (about
+// 1.5 seconds) gets the oldest it has. While nothing's being rendered (stopped), it's the play head.
+- (Float64)frameHeardAtHostTime:(uint64_t)hostTime;
+- (LiveAudioData)liveAudioDataAtHostTime:(uint64_t)hostTime; // liveAudioData is this at now plus timeDelay
+- (BOOL)getSpectrum:(float *)result atHostTime:(uint64_t)hostTime forChannel:(UInt32)channelID;
+@property(readonly) Float64 measuredOutputSampleRate; // the output's rate against the host clock, drift and all
+
+// Spectrum lookups by absolute frame, reaching back into the history
+- (BOOL)getSpectrum:(float *)result atFrame:(SInt64)frame forChannel:(UInt32)channelID;
+- (int)getSpectra:(float *)results fromFrame:(SInt64)startFrame toFrame:(SInt64)endFrame maxChunks:(int)maxChunks forChannel:(UInt32)channelID;
 
 - (id)initWithDelegate:(id<AudioFileDelegate>)delegate andAudioController:(AEAudioController *)audioController;
 - (id)initWithAudioController:(AEAudioController *)audioController;
@@ -9,24 +9,47 @@
 #import <AVFoundation/AVFoundation.h>
 #import <MediaPlayer/MediaPlayer.h>
 #import <AudioToolbox/AudioToolbox.h>
+#import <Accelerate/Accelerate.h>
 #import "Configuration.h"
 #import "AudioFile.h"
 #import "AEBlockChannel.h"
 #import "AppDelegate.h"
 #import "AEBlockScheduler.h"
+#import "TPCircularBuffer+SPSC.h"
+#import "AudioSeekCache.h"
+#import "AudioDecoder.h"
+#import "AudioResampler.h"
+#import "AudioClock.h"
+#import "AEUtilities.h"
 #include <mach/mach_time.h>
 
+#define NO_PENDING_TRACK -1
+#define PENDING_TRACK_REACHED -2    // the render thread passed the handed-over track's start, the main thread's yet to announce it
+#define PLAYBACK_SPANS_BYTES 4096   // a few hundred spans, more than the play rings hold at any rate
+
+// How many source frames a run of played frames stands for. The play stage writes one for every run it adds
+// to the play rings, before the run, and the render thread moves the play head by them
+typedef struct PlaybackSpan
+{
+    UInt32 numFrames;
+    Float64 numSourceFrames;
+} PlaybackSpan;
+
 @interface AudioFile ()
 
 @property NSURL *URL;
 @property BOOL isPlaying;
+@property BOOL isAnalysingOffline;
+@property NSTimeInterval lastSeekLatency;
+@property BOOL lastSeekUsedCachedAudio;
 
 @end
 
 @implementation AudioFile
 {
     @private
-    TPCircularBuffer toPlayBuffer;
+    TPSPSCCircularBuffer *toPlayBuffers; // one per channel. Produced by the pull thread, consumed by the render thread
+    UInt32 numPlayBuffers;
     TPCircularBuffer toProcessBuffer;
     volatile BOOL shouldFillBuffersAsync;
     volatile BOOL isFillingBuffers;
@@ -34,6 +57,83 @@
     AEAudioUnitFilter *reverb;
     uint64_t reverbStartTime;
     CircularAudioStorage processedAudioData;
+    SpectrumBroadcastRing spectrumBroadcasts[MAX_AUDIO_CHANNELS];   // one per channel, kept like the play rings
+    UInt32 numSpectrumBroadcasts;
+    SpectrogramHistory spectrogramHistories[MAX_AUDIO_CHANNELS];
+    UInt32 numSpectrogramHistories;
+    NSTimeInterval historyDuration;     // as configured, to configure again for more channels
+    NSString *historyDirectory;
+    AudioStreamMemoryPlan memoryPlan;
+    size_t historyBytesReserved;
+    BOOL requestedLazyAnalysis;
+    SpectrogramCache spectrogramCache;          // the loaded track's entry, being either read or written
+    SpectrogramCache retiredSpectrogramCache;   // the previous track's, kept mapped for readers still holding its frames
+    
+    AudioDecoder decoder;               // used instead of the asset reader for files it can read
+    AudioResampler resampler;           // from the decoding track's own rate to the rings' (the output's), when they differ
+    AudioPipeline pipeline;             // takes chunks from the toProcess ring to the streams and the play rings
+    AudioClock playbackClock;           // the render callbacks' timestamps, for which frame is heard when
+    
+    // Time-stretching and pitch-shifting. The vocoder and isStretching belong to the play stage, the span
+    // state past the ring to the render thread
+    PhaseVocoder vocoder;
+    BOOL isStretching;                  // set once playback leaves 1x and no shift, until the rings are cleared
+    _Atomic Float64 playbackRate;
+    _Atomic Float64 playbackPitch;
+    TPSPSCCircularBuffer playbackSpans; // PlaybackSpans, play stage -> render thread
+    UInt32 playbackSpanFramesLeft;      // of the span the render thread is in
+    Float64 playbackSpanRate;           // its source frames per played frame
+    Float64 playHeadFraction;           // source frames played past currentlyPlayingFrame
+    
+    // Only the render thread consumes the play rings, so it's the one that clears them: clearBuffers leaves
+    // where the producers were, and the render thread drops everything before that when it sees the request
+    uint32_t playRingsClearHeads[MAX_AUDIO_CHANNELS];
+    uint32_t playbackSpansClearHead;
+    _Atomic UInt32 numPlayRingsClearsRequested;
+    UInt32 numPlayRingsClearsApplied;   // the render thread's
+    
+    // Offline analysis. Nothing plays: retiring a chunk hands the sink the spectra it completed and moves the
+    // play head past them, which is what makes room for more
+    AudioFileSpectrumSink offlineSink;
+    SInt64 offlineAnalysedEnd;          // where the retired chunks end
+    SInt64 offlineNextSpectrumTime;     // the next spectrum the sink gets
+    UInt64 offlineNumSpectra;
+    
+    // Gapless playback. The prefetch queue opens the first queued URL (and reads its first buffer) while the
+    // current track plays, and the pull thread hands over to it once the current track's been read to the end.
+    // The queued track's audio then goes into the same rings, right after the current track's last frame.
+    NSMutableArray *queuedURLs;
+    dispatch_queue_t prefetchQueue;
+    NSURL *prefetchedURL;               // nil while nothing's prefetched. The prefetched* ivars belong to prefetchQueue
+    AudioDecoder prefetchedDecoder;
+    AVAssetReader *prefetchedAssetReader;
+    AVAssetReaderTrackOutput *prefetchedSamplesReader;
+    CMSampleBufferRef prefetchedBlockRef;
+    AudioStreamBasicDescription prefetchedFormat;
+    SInt64 prefetchedTotalFrames;
+    CMSampleBufferRef firstBlockRef;    // the prefetched first buffer of the track being read, until readSamplesFromFile takes it
+    
+    SInt64 decodingTrackStartFrame;     // where the track being read starts on the rings' timeline
+    SInt64 playingTrackStartFrame;      // same for the track being played. They differ between a handover and the play head reaching it
+    _Atomic SInt64 nextTrackStartFrame; // a handed-over track's start, or NO_PENDING_TRACK / PENDING_TRACK_REACHED
+    NSURL *handedOverURL;
+    SInt64 handedOverTotalFrames;
+    AudioStreamBasicDescription handedOverFormat;
+    
+    AudioSeekCache seekCache;
+    size_t seekCacheBytesReserved;
+    SInt64 nextDecodedFrame;            // the file frame (at the rings' rate) of the next sample decodeSamples writes
+    SInt64 nextSourceFrame;             // the same, at the track's own rate, of the next sample the decoder or reader hands out
+    SInt64 cachedAudioCursor;           // after a seek, cached audio from here up to cachedAudioEnd goes in before decoding resumes
+    SInt64 cachedAudioEnd;
+    BOOL readerNeedsRestart;
+    UInt32 framesToSkipPlaying;         // the rest of a seek's pre-roll, which is analysed but not played
+    SInt64 seekTarget;
+    uint64_t seekStartTime;             // 0 once the seek has its first spectrum
+    
+    AudioWakeup playHeadAdvanced;       // render thread -> pull thread, once the play head passes playHeadWakeupFrame
+    _Atomic SInt64 playHeadWakeupFrame;
+    AudioWakeup pullLoopProgressed;     // pull thread -> whoever waits for it to start, stop or buffer audio
     
     float *currentBlock;
     size_t currentBlockSize;
@@ -80,19 +180,46 @@
     
     self.reverbOnPause = YES;
     
-    self.timeDelay = 0.1345;
+    self.timeDelay = 0;
     self.fftOverlapJumpSize = 512;
+    self.seekPreRollFrames = CHUNK_SIZE;
     self.synchronizationQueue = dispatch_queue_create("audioProcessQueue", DISPATCH_QUEUE_CONCURRENT);
+    AudioWakeupInit(&playHeadAdvanced);
+    AudioWakeupInit(&pullLoopProgressed);
+    atomic_init(&playHeadWakeupFrame, 0);
+    atomic_init(&numPlayRingsClearsRequested, 0);
+    atomic_init(&nextTrackStartFrame, NO_PENDING_TRACK);
+    AudioClockInit(&playbackClock, audioController.audioDescription.mSampleRate);
+    atomic_init(&playbackRate, 1);
+    atomic_init(&playbackPitch, 0);
+    TPSPSCCircularBufferInit(&playbackSpans, PLAYBACK_SPANS_BYTES);
+    [self updateOutputLatency];
+    queuedURLs = [NSMutableArray array];
+    prefetchQueue = dispatch_queue_create("audioPrefetchQueue", DISPATCH_QUEUE_SERIAL);
     
-    UInt32 samplesBufferSize = CHUNK_SIZE * 16 * sizeof(float);
-    UInt32 fftResultsBufferSize = samplesBufferSize * CHUNK_SIZE / self.fftOverlapJumpSize;
+    // All the ring sizes come from the memory budget. Stereo until a file says otherwise
+    AudioMemoryBudgetPlanStream(&memoryPlan, 2, CHUNK_SIZE, AUDIO_MEMORY_FILE_LIVE_CHUNKS, self.fftOverlapJumpSize, 2, YES);
+    if (!AudioMemoryBudgetReserve(AudioMemoryBudgetShared(), memoryPlan.liveBytes))
+        NSLog(@"AudioFile's buffers take the process over its audio memory budget");
     
-    AudioStreamInit(&self->processedAudioData.channel1, samplesBufferSize, fftResultsBufferSize, &self->processedAudioData);
-    AudioStreamInit(&self->processedAudioData.channel2, samplesBufferSize, fftResultsBufferSize, &self->processedAudioData);
-    AudioStreamInit(&self->processedAudioData.extractedChannel, samplesBufferSize, fftResultsBufferSize, &self->processedAudioData);
+    CircularAudioStorageInit(&self->processedAudioData, 2, memoryPlan.samplesRingBytes, memoryPlan.fftResultsRingBytes, CHUNK_SIZE);
+    [self resetPipeline];
     
-    TPCircularBufferInit(&toPlayBuffer, samplesBufferSize * 2);
-    TPCircularBufferInit(&toProcessBuffer, fftResultsBufferSize * 2);
+    posix_memalign((void **)&toPlayBuffers, kTPCircularBufferCacheLineSize, MAX_AUDIO_CHANNELS * sizeof(TPSPSCCircularBuffer));
+    for (numPlayBuffers=0;numPlayBuffers<2;numPlayBuffers++)
+        TPSPSCCircularBufferInit(&toPlayBuffers[numPlayBuffers], memoryPlan.playRingBytes);
+    TPCircularBufferInit(&toProcessBuffer, memoryPlan.processRingBytes);
+    
+    for (numSpectrumBroadcasts=0;numSpectrumBroadcasts<2;numSpectrumBroadcasts++)
+        SpectrumBroadcastRingInit(&spectrumBroadcasts[numSpectrumBroadcasts], memoryPlan.broadcastFrames, CHUNK_SIZE);
+    
+    [self configureSpectrogramHistoryWithDuration:AudioMemoryBudgetShared()->historySeconds fileDirectory:nil];
+    [self attachChannelTaps];
+    
+    spectrogramCache.fileDescriptor = -1;
+    retiredSpectrogramCache.fileDescriptor = -1;
+    NSString *cachesDirectory = [NSSearchPathForDirectoriesInDomains(NSCachesDirectory, NSUserDomainMask, YES) firstObject];
+    self.spectrogramCacheDirectory = [cachesDirectory stringByAppendingPathComponent:@"Spectrograms"];
     
     [self.audioController addChannels:@[self]];
     
@@ -130,27 +257,45 @@
     
     dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^
     {
+        // Everything from the rings on runs at the output's rate
+        self->processedAudioData.sampleRate = self.audioController.audioDescription.mSampleRate;
+        
         AudioStreamBasicDescription format;
-        NSError *error = [self initializeReaderWithURL:url andTimeRange:nil resultFormat:&format];
+        NSError *error = nil;
+        if (![self openDecoderWithURL:url resultFormat:&format])
+            error = [self initializeReaderWithURL:url andTimeRange:nil resultFormat:&format];
         if (error)
             completion(error);
         else
         {
             self.sourceAudioFormat = format;
             self.playedAudioFormat = self.audioController.audioDescription;
+            [self applyMemoryPlanForChannels:[self numChannelsToDecodeForFormat:format]];
+            CircularAudioStorageSetNumChannels(&self->processedAudioData, [self numChannelsToDecodeForFormat:format]);
+            [self attachChannelTaps];
+            [self setUpResamplerForFormat:format];
+            [self resetPipeline];
+            [self openSpectrogramCacheForURL:url numChannels:[self numChannelsToDecodeForFormat:format]];
+            [self resetSeekCacheForChannels:[self numChannelsToDecodeForFormat:format]];
+            [self resetTrackTimeline];
+            cachedAudioCursor = cachedAudioEnd = 0;
+            readerNeedsRestart = NO;
+            framesToSkipPlaying = 0;
+            seekStartTime = 0;
             
             self.isFinished = NO;
             self.isStopped = NO;
             LiveAudioDataReset(&self->processedAudioData);
+            for (UInt32 i=0;i<self->numSpectrogramHistories;i++) SpectrogramHistoryReset(&self->spectrogramHistories[i]);
             
             [self startFillingBufferAsync]; // start reading samples
             
             // wait until the buffer contains some audio
-            uint64_t timeout = machToMiliseconds(mach_absolute_time()) + 500;
-            while (self->processedAudioData.channel1.samples.circularBuffer.fillCount < CHUNK_SIZE * 1 * sizeof(float) &&
-                   isFillingBuffers && machToMiliseconds(mach_absolute_time()) < timeout) {}
+            BOOL finishedWaiting = [self waitForPullLoop:^BOOL{
+                return self->processedAudioData.channels[0].samples.circularBuffer.fillCount >= CHUNK_SIZE * 1 * sizeof(float) || !self->isFillingBuffers;
+            } timeout:0.5];
             
-            if (self->processedAudioData.channel1.samples.circularBuffer.fillCount < CHUNK_SIZE * 1 * sizeof(float) && machToMiliseconds(mach_absolute_time()) > timeout)
+            if (self->processedAudioData.channels[0].samples.circularBuffer.fillCount < CHUNK_SIZE * 1 * sizeof(float) && !finishedWaiting)
             {
                 [self.assetReader cancelReading];
                 completion([NSError errorWithDomain:@"Could not read the audio file fast enough" code:0 userInfo:nil]);
@@ -162,6 +307,7 @@
                     [self.audioController start:&error];
                     if (error) completion(error);
                 }
+                dispatch_async(self->prefetchQueue, ^{ [self prefetchNextQueuedURL]; });
                 completion(nil); // OK
             }
         }
@@ -169,86 +315,529 @@
     });
 }
 
+- (void)enqueueURL:(NSURL *)url
+{
+    if (url == nil) return;
+    
+    BOOL isNext;
+    @synchronized(queuedURLs)
+    {
+        [queuedURLs addObject:url];
+        isNext = queuedURLs.count == 1;
+    }
+    if (isNext) dispatch_async(prefetchQueue, ^{ [self prefetchNextQueuedURL]; });
+}
+
+// A track that was already handed over (see currentTrackStartFrame) is in the rings, and still plays
+- (void)clearQueue
+{
+    @synchronized(queuedURLs)
+    {
+        [queuedURLs removeAllObjects];
+    }
+    dispatch_async(prefetchQueue, ^{ [self discardPrefetchedURL]; });
+}
+
+- (NSArray *)queuedURLs
+{
+    @synchronized(queuedURLs)
+    {
+        return [queuedURLs copy];
+    }
+}
+
+- (SInt64)currentTrackStartFrame
+{
+    return playingTrackStartFrame;
+}
+
+// Runs on prefetchQueue. Opens the first queued URL, so that moving on to it doesn't have to wait for
+// the file to open and the first buffer to decode (which is most of what a load takes)
+- (void)prefetchNextQueuedURL
+{
+    NSURL *url;
+    @synchronized(queuedURLs)
+    {
+        url = queuedURLs.firstObject;
+    }
+    if (url == prefetchedURL) return;
+    
+    [self discardPrefetchedURL];
+    if (url == nil) return;
+    
+    AudioStreamBasicDescription format;
+    if (OpenPlayableDecoder(&prefetchedDecoder, url, self->processedAudioData.sampleRate, &format))
+        prefetchedTotalFrames = FramesAtRate(prefetchedDecoder.numFrames, prefetchedDecoder.sampleRate, self->processedAudioData.sampleRate);
+    else
+    {
+        AVAssetReader *reader = nil;
+        AVAssetReaderTrackOutput *output = nil;
+        NSError *error = [self createReaderWithURL:url timeRange:nil reader:&reader output:&output format:&format totalFrames:&prefetchedTotalFrames];
+        if (error)
+        {
+            NSLog(@"can't prefetch %@: %@", url, error);
+            return;
+        }
+        prefetchedAssetReader = reader;
+        prefetchedSamplesReader = output;
+        prefetchedBlockRef = [output copyNextSampleBuffer];
+    }
+    
+    prefetchedFormat = format;
+    prefetchedURL = url;
+}
+
+// Runs on prefetchQueue
+- (void)discardPrefetchedURL
+{
+    AudioDecoderClose(&prefetchedDecoder);
+    [prefetchedAssetReader cancelReading];
+    prefetchedAssetReader = nil;
+    prefetchedSamplesReader = nil;
+    if (prefetchedBlockRef)
+    {
+        CFRelease(prefetchedBlockRef);
+        prefetchedBlockRef = NULL;
+    }
+    prefetchedURL = nil;
+}
+
+// Back to one track, starting at frame 0 of the rings. Must be called while no audio is being read
+- (void)resetTrackTimeline
+{
+    decodingTrackStartFrame = playingTrackStartFrame = 0;
+    atomic_store_explicit(&nextTrackStartFrame, NO_PENDING_TRACK, memory_order_release);
+    handedOverURL = nil;
+    if (firstBlockRef)
+    {
+        CFRelease(firstBlockRef);
+        firstBlockRef = NULL;
+    }
+}
+
+// The pipeline's play stage, on a worker. Until playback is stretched the vocoder just keeps the latest
+// frames, skipped ones included, so it can start from whole frames whenever it's switched on
+static void PlayPipelineChunk(void *context, const float *samples, UInt32 numFrames, UInt32 numFramesToSkip)
+{
+    __unsafe_unretained AudioFile *THIS = (__bridge AudioFile *)context;
+    if (THIS->_isAnalysingOffline) return;
+    
+    UInt32 numChannels = THIS->processedAudioData.numChannels;
+    Float64 rate = atomic_load_explicit(&THIS->playbackRate, memory_order_relaxed);
+    Float64 pitch = atomic_load_explicit(&THIS->playbackPitch, memory_order_relaxed);
+    if (rate != 1 || pitch != 0) THIS->isStretching = YES;
+    
+    if (!THIS->isStretching)
+    {
+        PhaseVocoderAddHistory(&THIS->vocoder, samples, numFrames);
+        if (numFrames > numFramesToSkip)
+            [THIS addSamplesToPlay:samples + numFramesToSkip * numChannels numFrames:numFrames - numFramesToSkip];
+        return;
+    }
+    
+    PhaseVocoderAddHistory(&THIS->vocoder, samples, numFramesToSkip);
+    [THIS stretchSamplesToPlay:samples + numFramesToSkip * numChannels numFrames:numFrames - numFramesToSkip rate:rate pitch:pitch];
+}
+
+// Sets the pipeline up with a stage for every channel being decoded. Only while the pull loop isn't running
+- (void)resetPipeline
+{
+    AudioPipelineCleanup(&self->pipeline);
+    if (!AudioPipelineInit(&self->pipeline, &self->processedAudioData, AudioWorkerPoolShared(), self.extractsCenterChannel, PlayPipelineChunk, (__bridge void *)self))
+        NSLog(@"can't set the analysis pipeline up, the worker pool has no lanes left");
+    
+    PhaseVocoderCleanup(&self->vocoder);
+    if (!PhaseVocoderInit(&self->vocoder, self->processedAudioData.numChannels, CHUNK_SIZE))
+        NSLog(@"can't set the phase vocoder up, playback rate and pitch will be ignored");
+}
+
+- (int)getPipelineStats:(AudioPipelineStageStats *)stats maxStages:(int)maxStages
+{
+    return AudioPipelineGetStats(&self->pipeline, stats, maxStages);
+}
+
+// Must be called while no audio is being read or played. Channel rings are never freed (see
+// CircularAudioStorageSetNumChannels), so the plan only ever grows to the widest file seen.
+- (void)applyMemoryPlanForChannels:(UInt32)numChannels
+{
+    if (numChannels <= memoryPlan.numChannels) return;
+    
+    AudioMemoryBudget *budget = AudioMemoryBudgetShared();
+    AudioMemoryBudgetRelease(budget, memoryPlan.liveBytes);
+    AudioMemoryBudgetPlanStream(&memoryPlan, numChannels, CHUNK_SIZE, AUDIO_MEMORY_FILE_LIVE_CHUNKS, self.fftOverlapJumpSize, numChannels, YES);
+    if (!AudioMemoryBudgetReserve(budget, memoryPlan.liveBytes))
+        NSLog(@"AudioFile's buffers for %u channels take the process over its audio memory budget", (unsigned)numChannels);
+    
+    // Play and broadcast rings are per channel, and the ones we have are kept. The process ring is interleaved, so it grows
+    for (;numPlayBuffers<numChannels;numPlayBuffers++)
+        TPSPSCCircularBufferInit(&toPlayBuffers[numPlayBuffers], memoryPlan.playRingBytes);
+    for (;numSpectrumBroadcasts<numChannels;numSpectrumBroadcasts++)
+        SpectrumBroadcastRingInit(&spectrumBroadcasts[numSpectrumBroadcasts], memoryPlan.broadcastFrames, CHUNK_SIZE);
+    TPCircularBufferCleanup(&toProcessBuffer);
+    TPCircularBufferInit(&toProcessBuffer, memoryPlan.processRingBytes);
+    
+    // Every channel's history gets an equal share of the budget, so with more channels they're all made again (and start empty)
+    NSError *error = [self configureSpectrogramHistoryWithDuration:historyDuration fileDirectory:historyDirectory];
+    if (error && [self.delegate respondsToSelector:@selector(audioFileReadingErrorOccurred:withError:)])
+    {
+        NSString *message = [NSString stringWithFormat:@"Couldn't make the spectrogram history for %u channels: %@", (unsigned)numChannels, error.domain];
+        [self.delegate audioFileReadingErrorOccurred:self withError:[NSError errorWithDomain:message code:error.code userInfo:nil]];
+    }
+}
+
+// Every channel's stream gets its broadcast ring and history. A stream that's new to the storage came without them
+- (void)attachChannelTaps
+{
+    for (UInt32 i=0;i<self->processedAudioData.numChannels;i++)
+    {
+        self->processedAudioData.channels[i].broadcast = i < numSpectrumBroadcasts ? &spectrumBroadcasts[i] : NULL;
+        self->processedAudioData.channels[i].history = i < numSpectrogramHistories ? &spectrogramHistories[i] : NULL;
+    }
+}
+
+// Must be called while no audio is being read. Finds the track's cache entry, or starts writing one
+- (void)openSpectrogramCacheForURL:(NSURL *)url numChannels:(UInt32)numChannels
+{
+    for (UInt32 i=0;i<MAX_AUDIO_CHANNELS;i++)
+        self->processedAudioData.channels[i].cache = NULL;
+    
+    SpectrogramCacheClose(&retiredSpectrogramCache);
+    if (SpectrogramCacheIsReadable(&spectrogramCache))
+    {
+        retiredSpectrogramCache = spectrogramCache;
+        spectrogramCache.map = NULL;
+        spectrogramCache.fileDescriptor = -1;
+    }
+    SpectrogramCacheClose(&spectrogramCache);
+    
+    NSString *directory = self.spectrogramCacheDirectory;
+    if (!directory || !url.isFileURL || numChannels > SPECTROGRAM_CACHE_MAX_CHANNELS) return;
+    
+    SpectrogramCacheParameters parameters;
+    memset(&parameters, 0, sizeof(SpectrogramCacheParameters));
+    if (!SpectrogramCacheHashFile(url.fileSystemRepresentation, parameters.contentHash)) return;
+    parameters.chunkSize = CHUNK_SIZE;
+    parameters.jumpSize = self.fftOverlapJumpSize;
+    parameters.window = SpectrogramCacheWindow_Hann;
+    parameters.numChannels = numChannels;
+    parameters.sampleRate = self->processedAudioData.sampleRate; // what the analysis runs at
+    
+    char name[256];
+    SpectrogramCacheFileName(&parameters, name, sizeof(name));
+    NSString *path = [directory stringByAppendingPathComponent:[NSString stringWithUTF8String:name]];
+    
+    if (!SpectrogramCacheOpen(&spectrogramCache, path.fileSystemRepresentation, &parameters))
+    {
+        [[NSFileManager defaultManager] createDirectoryAtPath:directory withIntermediateDirectories:YES attributes:nil error:nil];
+        SInt64 frameCapacity = self.totalFramesCount / self.fftOverlapJumpSize + 1;
+        if (!SpectrogramCacheCreate(&spectrogramCache, path.fileSystemRepresentation, &parameters, frameCapacity)) return;
+    }
+    
+    for (UInt32 i=0;i<numChannels;i++)
+    {
+        self->processedAudioData.channels[i].cache = &spectrogramCache;
+        self->processedAudioData.channels[i].cacheChannel = i;
+    }
+}
+
+// Must be called while no audio is being read
+- (void)resetSeekCacheForChannels:(UInt32)numChannels
+{
+    if (seekCache.blocks && seekCache.numChannels == numChannels)
+    {
+        AudioSeekCacheReset(&seekCache);
+        return;
+    }
+    
+    AudioMemoryBudget *budget = AudioMemoryBudgetShared();
+    AudioSeekCacheCleanup(&seekCache);
+    AudioMemoryBudgetRelease(budget, seekCacheBytesReserved);
+    
+    seekCacheBytesReserved = AudioSeekCacheBytes(numChannels, AUDIO_SEEK_CACHE_BLOCK_FRAMES, AUDIO_SEEK_CACHE_BLOCKS);
+    if (!AudioMemoryBudgetReserve(budget, seekCacheBytesReserved))
+        NSLog(@"AudioFile's seek cache takes the process over its audio memory budget");
+    if (!AudioSeekCacheInit(&seekCache, numChannels, AUDIO_SEEK_CACHE_BLOCK_FRAMES, AUDIO_SEEK_CACHE_BLOCKS))
+    {
+        AudioMemoryBudgetRelease(budget, seekCacheBytesReserved);
+        seekCacheBytesReserved = 0;
+    }
+}
+
+- (BOOL)isUsingSpectrogramCache
+{
+    return SpectrogramCacheIsReadable(&spectrogramCache);
+}
+
+- (const float *)bandEnergiesAtFrame:(SInt64)frame forChannel:(UInt32)channelID
+{
+    if (frame < 0 || self.amplitudeFactor != 1) return NULL; // the cache has the unscaled audio's
+    return SpectrogramCacheGetBandEnergies(&spectrogramCache, [self streamForChannelID:channelID]->cacheChannel, frame / self.fftOverlapJumpSize);
+}
+
+- (const SpectrogramCachePeak *)peakAtFrame:(SInt64)frame forChannel:(UInt32)channelID
+{
+    if (frame < 0 || self.amplitudeFactor != 1) return NULL;
+    return SpectrogramCacheGetPeak(&spectrogramCache, [self streamForChannelID:channelID]->cacheChannel, frame / self.fftOverlapJumpSize);
+}
+
+- (AudioStreamMemoryUsage)memoryUsage
+{
+    AudioStreamMemoryUsage usage = CircularAudioStorageMemoryUsage(&self->processedAudioData);
+    usage.transportBytes = toProcessBuffer.length + seekCacheBytesReserved;
+    for (UInt32 i=0;i<numPlayBuffers;i++) usage.transportBytes += toPlayBuffers[i].length;
+    usage.totalBytes += usage.transportBytes;
+    return usage;
+}
+
+- (UInt32)numChannelsToDecodeForFormat:(AudioStreamBasicDescription)format
+{
+    return MAX(1, MIN(format.mChannelsPerFrame, MAX_AUDIO_CHANNELS));
+}
+
+// A file's frame count at another rate
+static SInt64 FramesAtRate(SInt64 numFrames, Float64 sampleRate, Float64 otherRate)
+{
+    return sampleRate == otherRate ? numFrames : (SInt64)llround(numFrames * otherRate / sampleRate);
+}
+
+// The rate a track with the given rate is decoded at: its own, unless the resampler can't take it
+// from there to the output's, in which case the asset reader converts it
+static Float64 DecodingRateForSourceRate(Float64 sourceRate, Float64 outputRate)
+{
+    return AudioResamplerCanConvert(sourceRate, outputRate) ? sourceRate : outputRate;
+}
+
+// Local files one of our own decoders can read skip AVFoundation altogether
+static BOOL OpenPlayableDecoder(AudioDecoder *decoder, NSURL *url, Float64 outputRate, AudioStreamBasicDescription *format)
+{
+    AudioDecoderClose(decoder);
+    if (!url.isFileURL || !AudioDecoderOpen(decoder, url.fileSystemRepresentation)) return NO;
+    
+    // Decoded at the file's own rate, and resampled on the way into the rings. Rates the resampler
+    // can't take to the output's go through the asset reader, which converts them itself
+    if (!AudioResamplerCanConvert(decoder->sampleRate, outputRate) || decoder->numChannels > MAX_AUDIO_CHANNELS)
+    {
+        AudioDecoderClose(decoder);
+        return NO;
+    }
+    
+    memset(format, 0, sizeof(AudioStreamBasicDescription));
+    format->mSampleRate = decoder->sampleRate;
+    format->mFormatID = kAudioFormatLinearPCM;
+    format->mFormatFlags = kAudioFormatFlagIsFloat | kAudioFormatFlagIsPacked;
+    format->mChannelsPerFrame = decoder->numChannels;
+    format->mBitsPerChannel = 32;
+    format->mBytesPerFrame = format->mBytesPerPacket = decoder->numChannels * sizeof(float);
+    format->mFramesPerPacket = 1;
+    
+    return YES;
+}
+
+- (BOOL)openDecoderWithURL:(NSURL *)url resultFormat:(AudioStreamBasicDescription *)format
+{
+    if (!OpenPlayableDecoder(&decoder, url, self->processedAudioData.sampleRate, format)) return NO;
+    
+    self.assetReader = nil;
+    self.samplesReader = nil;
+    self.totalFramesCount = FramesAtRate(decoder.numFrames, decoder.sampleRate, self->processedAudioData.sampleRate);
+    self.durationInSeconds = AudioDecoderDuration(&decoder);
+    
+    assetReaderStatus = AVAssetReaderStatusReading;
+    currentBlockSize = 0;
+    currentBlockRef = NULL;
+    nextDecodedFrame = 0;
+    nextSourceFrame = 0;
+    
+    return YES;
+}
+
 - (NSError *)initializeReaderWithURL:(NSURL *)url andTimeRange:(CMTimeRange *)timeRange resultFormat:(AudioStreamBasicDescription *)format
+{
+    AVAssetReader *reader = nil;
+    AVAssetReaderTrackOutput *output = nil;
+    SInt64 totalFrames = 0;
+    NSError *error = [self createReaderWithURL:url timeRange:timeRange reader:&reader output:&output format:format totalFrames:&totalFrames];
+    if (error) return error;
+    
+    self.assetReader = reader;
+    self.samplesReader = output;
+    self.totalFramesCount = totalFrames;
+    self.durationInSeconds = totalFrames / self->processedAudioData.sampleRate;
+    
+    assetReaderStatus = AVAssetReaderStatusReading;
+    
+    currentBlockSize = 0;
+    currentBlockRef = NULL;
+    nextDecodedFrame = 0;
+    
+    return nil;
+}
+
+// Creates and starts a reader that decodes every channel of url's first audio track to interleaved 44.1 kHz floats.
+// Doesn't touch the reader being used, so it can run on any thread
+- (NSError *)createReaderWithURL:(NSURL *)url timeRange:(CMTimeRange *)timeRange reader:(AVAssetReader **)reader output:(AVAssetReaderTrackOutput **)output format:(AudioStreamBasicDescription *)format totalFrames:(SInt64 *)totalFrames
 {
     NSError *error;
     
+    AVURLAsset *asset = [[AVURLAsset alloc] initWithURL:url options:[NSDictionary dictionary]];
+    
+    if ([asset tracksWithMediaType:AVMediaTypeAudio].count == 0)
+        return [NSError errorWithDomain:@"No tracks available!" code:0 userInfo:nil];
+    AVAssetTrack* track = [[asset tracksWithMediaType:AVMediaTypeAudio] objectAtIndex:0];
+    
+    // Decoding every channel of the source as-is, so mono isn't duplicated and surround isn't folded down
+    AudioStreamBasicDescription trackFormat = *CMAudioFormatDescriptionGetStreamBasicDescription((__bridge CMAudioFormatDescriptionRef)[track.formatDescriptions objectAtIndex:0]);
+    UInt32 numChannels = [self numChannelsToDecodeForFormat:trackFormat];
+    Float64 outputRate = self->processedAudioData.sampleRate;
+    AudioChannelLayout channelLayout = {0};
+    channelLayout.mChannelLayoutTag = kAudioChannelLayoutTag_DiscreteInOrder | numChannels;
+    
     NSDictionary* outputSettingsDict = [[NSDictionary alloc] initWithObjectsAndKeys:
                                         [NSNumber numberWithInt:kAudioFormatLinearPCM],AVFormatIDKey,
                                         [NSNumber numberWithInt:32],AVLinearPCMBitDepthKey,
                                         [NSNumber numberWithBool:NO],AVLinearPCMIsBigEndianKey,
                                         [NSNumber numberWithBool:YES],AVLinearPCMIsFloatKey,
                                         [NSNumber numberWithBool:NO],AVLinearPCMIsNonInterleaved,
-                                        [NSNumber numberWithFloat:44100.0],AVSampleRateKey,
-                                        [NSNumber numberWithInt:2],AVNumberOfChannelsKey,
+                                        [NSNumber numberWithDouble:DecodingRateForSourceRate(trackFormat.mSampleRate, outputRate)],AVSampleRateKey,
+                                        [NSNumber numberWithInt:numChannels],AVNumberOfChannelsKey,
+                                        [NSData dataWithBytes:&channelLayout length:sizeof(AudioChannelLayout)],AVChannelLayoutKey,
                                     nil];
     
-    AVURLAsset *asset = [[AVURLAsset alloc] initWithURL:url options:[NSDictionary dictionary]];
-    
-    if ([asset tracksWithMediaType:AVMediaTypeAudio].count == 0)
-        return [NSError errorWithDomain:@"No tracks available!" code:0 userInfo:nil];
-    AVAssetTrack* track = [[asset tracksWithMediaType:AVMediaTypeAudio] objectAtIndex:0];
-    
-    self.totalFramesCount = CMTimeConvertScale(asset.duration, 44100, kCMTimeRoundingMethod_RoundHalfAwayFromZero).value;
-    self.durationInSeconds = (double)asset.duration.value / asset.duration.timescale;
+    *totalFrames = CMTimeConvertScale(asset.duration, (int32_t)outputRate, kCMTimeRoundingMethod_RoundHalfAwayFromZero).value;
     //self.samplesReader.supportsRandomAccess = YES; // TODO: check this thing
-    self.assetReader = [[AVAssetReader alloc] initWithAsset:asset error:&error];
+    *reader = [[AVAssetReader alloc] initWithAsset:asset error:&error];
     if (error) return error;
-    self.samplesReader = [[AVAssetReaderTrackOutput alloc] initWithTrack:track outputSettings:outputSettingsDict];
+    *output = [[AVAssetReaderTrackOutput alloc] initWithTrack:track outputSettings:outputSettingsDict];
     
-    if ([self.assetReader canAddOutput:self.samplesReader] && self.assetReader.outputs.count == 0)
-        [self.assetReader addOutput:self.samplesReader];
+    if ([*reader canAddOutput:*output] && (*reader).outputs.count == 0)
+        [*reader addOutput:*output];
     else
         return [NSError errorWithDomain:@"Can't add an output to the asset reader." code:0 userInfo:nil];
     if (timeRange)
-        self.assetReader.timeRange = *timeRange;
-    BOOL success = [self.assetReader startReading];
+        (*reader).timeRange = *timeRange;
+    BOOL success = [*reader startReading];
     if (!success)
     {
-        return [NSError errorWithDomain:@"Couldn't start reading!" code:self.assetReader.status userInfo:nil];
+        return [NSError errorWithDomain:@"Couldn't start reading!" code:(*reader).status userInfo:nil];
     }
     
     if (format)
     {
-        *format = *CMAudioFormatDescriptionGetStreamBasicDescription((__bridge CMAudioFormatDescriptionRef)[track.formatDescriptions objectAtIndex:0]);
+        *format = trackFormat;
     }
     
-    assetReaderStatus = AVAssetReaderStatusReading;
-    
-    currentBlockSize = 0;
-    currentBlockRef = NULL;
-    
     return nil;
 }
 
+static void AddClockPoint(AudioClock *clock, const AudioTimeStamp *time, SInt64 frame, UInt32 frames, UInt32 numFramesPlayed, Float64 frameRate)
+{
+    if (!(time->mFlags & kAudioTimeStampHostTimeValid)) return;
+    AudioClockAddPoint(clock, time->mHostTime, (time->mFlags & kAudioTimeStampSampleTimeValid) ? time->mSampleTime : NAN, frame, frames, numFramesPlayed, frameRate);
+}
+
+// How many source frames the next numFrames played frames stand for, by the spans the play stage wrote for
+// them. Frames without one (the ring was full) count as one each
+static Float64 SourceFramesPlayed(__unsafe_unretained AudioFile *THIS, UInt32 numFrames)
+{
+    Float64 numSourceFrames = 0;
+    while (numFrames > 0)
+    {
+        if (THIS->playbackSpanFramesLeft == 0)
+        {
+            int32_t availableBytes = 0;
+            PlaybackSpan *span = (PlaybackSpan *)TPSPSCCircularBufferTailAtLeast(&THIS->playbackSpans, &availableBytes, sizeof(PlaybackSpan));
+            if (availableBytes < sizeof(PlaybackSpan)) return numSourceFrames + numFrames;
+            THIS->playbackSpanFramesLeft = span->numFrames;
+            THIS->playbackSpanRate = span->numFrames > 0 ? span->numSourceFrames / span->numFrames : 1;
+            TPSPSCCircularBufferConsume(&THIS->playbackSpans, sizeof(PlaybackSpan));
+            continue;
+        }
+        
+        UInt32 numSpanFrames = MIN(numFrames, THIS->playbackSpanFramesLeft);
+        numSourceFrames += numSpanFrames * THIS->playbackSpanRate;
+        THIS->playbackSpanFramesLeft -= numSpanFrames;
+        numFrames -= numSpanFrames;
+    }
+    return numSourceFrames;
+}
+
+// Drops what the play rings had when clearBuffers was last called, and starts the spans and play head over
+static void ApplyPlayRingsClear(__unsafe_unretained AudioFile *THIS)
+{
+    UInt32 numClearsRequested = atomic_load_explicit(&THIS->numPlayRingsClearsRequested, memory_order_acquire);
+    if (numClearsRequested == THIS->numPlayRingsClearsApplied) return;
+    
+    for (UInt32 i=0;i<THIS->numPlayBuffers;i++)
+        TPSPSCCircularBufferConsumeTo(&THIS->toPlayBuffers[i], THIS->playRingsClearHeads[i]);
+    TPSPSCCircularBufferConsumeTo(&THIS->playbackSpans, THIS->playbackSpansClearHead);
+    THIS->playbackSpanFramesLeft = 0;
+    THIS->playHeadFraction = 0;
+    THIS->numPlayRingsClearsApplied = numClearsRequested;
+}
+
 static OSStatus renderCallback(__unsafe_unretained id channel, __unsafe_unretained AEAudioController *audioController, const AudioTimeStamp *time, UInt32 frames, AudioBufferList *audio)
 {
     __unsafe_unretained AudioFile *THIS = channel;
+    ApplyPlayRingsClear(THIS);
     
-    if (!THIS->_isPlaying) return noErr;
-    
-    int32_t avaliableBytes = 0;
-    float *samples = (float *)TPCircularBufferTail(&THIS->toPlayBuffer, &avaliableBytes);
-    UInt32 numFramesToPass = (UInt32)MIN(avaliableBytes / audio->mNumberBuffers / sizeof(float), frames);
+    // Paused buffers go on the clock too, so it keeps track of the output while the play head stands still
+    if (!THIS->_isPlaying)
+    {
+        AddClockPoint(&THIS->playbackClock, time, THIS->processedAudioData.currentlyPlayingFrame, frames, 0, 1);
+        return noErr;
+    }
     
-    if (audio->mNumberBuffers == 2)
+    // The play rings are planar, so every output buffer is a straight copy out of its channel's ring.
+    // The pull thread fills them one after the other; we play what all of them have
+    UInt32 numChannels = THIS->processedAudioData.numChannels;
+    float *channelSamples[MAX_AUDIO_CHANNELS];
+    int32_t avaliableBytes = INT32_MAX;
+    for (UInt32 i=0;i<numChannels;i++)
     {
-        SplitStereoSamples(samples, numFramesToPass * 2, (float *)audio->mBuffers[0].mData, (float *)audio->mBuffers[1].mData);
-        audio->mBuffers[0].mDataByteSize = numFramesToPass * sizeof(float);
-        audio->mBuffers[1].mDataByteSize = numFramesToPass * sizeof(float);
-        //NSLog(@"time: %f, passing frames #%lld-%lld for playing",machToMiliseconds(mach_absolute_time())/1000.0f, THIS.currentlyPlayingFrame,THIS.currentlyPlayingFrame+numFramesToPass);
+        int32_t channelBytes = 0;
+        channelSamples[i] = (float *)TPSPSCCircularBufferTailAtLeast(&THIS->toPlayBuffers[i], &channelBytes, frames * sizeof(float));
+        avaliableBytes = MIN(avaliableBytes, channelBytes);
     }
-    else if (audio->mNumberBuffers == 1)
+    UInt32 numFramesToPass = (UInt32)MIN(avaliableBytes / sizeof(float), frames);
+    
+    // Every output buffer gets its matching source channel. A mono source goes to all of them,
+    // and channels beyond what the output has are not played (they're still analysed).
+    for (UInt32 i=0;i<audio->mNumberBuffers;i++)
     {
-        memcpy(audio->mBuffers[0].mData, (void *)samples, numFramesToPass * sizeof(float));
-        audio->mBuffers[0].mDataByteSize = numFramesToPass * sizeof(float);
+        if (numFramesToPass > 0) memcpy(audio->mBuffers[i].mData, channelSamples[MIN(i, numChannels - 1)], numFramesToPass * sizeof(float));
+        audio->mBuffers[i].mDataByteSize = numFramesToPass * sizeof(float);
+        //NSLog(@"time: %f, passing frames #%lld-%lld for playing",machToMiliseconds(mach_absolute_time())/1000.0f, THIS.currentlyPlayingFrame,THIS.currentlyPlayingFrame+numFramesToPass);
     }
     
-    TPCircularBufferConsume(&THIS->toPlayBuffer, numFramesToPass * audio->mNumberBuffers * sizeof(float));
+    for (UInt32 i=0;i<numChannels;i++)
+        TPSPSCCircularBufferConsume(&THIS->toPlayBuffers[i], numFramesToPass * sizeof(float));
 
-    THIS->processedAudioData.currentlyPlayingFrame += numFramesToPass;
+    // The play head is in source frames, which stretched playback goes through at its own rate. The clock's
+    // point starts at the whole frame, so its rate takes in the fraction past it
+    Float64 numSourceFrames = SourceFramesPlayed(THIS, numFramesToPass);
+    AddClockPoint(&THIS->playbackClock, time, THIS->processedAudioData.currentlyPlayingFrame, frames, numFramesToPass,
+                  numFramesToPass > 0 ? (THIS->playHeadFraction + numSourceFrames) / numFramesToPass : 1);
+    THIS->playHeadFraction += numSourceFrames;
+    SInt64 numWholeSourceFrames = (SInt64)floor(THIS->playHeadFraction);
+    THIS->playHeadFraction -= numWholeSourceFrames;
+    THIS->processedAudioData.currentlyPlayingFrame += numWholeSourceFrames;
+    
+    // the pull thread may be sleeping until there's room for more audio
+    if (THIS->processedAudioData.currentlyPlayingFrame >= atomic_load_explicit(&THIS->playHeadWakeupFrame, memory_order_relaxed))
+        AudioWakeupSignal(&THIS->playHeadAdvanced);
     
-    if (THIS->toPlayBuffer.fillCount == 0 && THIS.assetReader.status == AVAssetReaderStatusCompleted)
+    // The handed-over track starts playing here, to the sample. Whatever its audio needs was set up when it was handed over
+    SInt64 nextTrackStart = atomic_load_explicit(&THIS->nextTrackStartFrame, memory_order_acquire);
+    if (nextTrackStart >= 0 && THIS->processedAudioData.currentlyPlayingFrame >= nextTrackStart &&
+        atomic_compare_exchange_strong(&THIS->nextTrackStartFrame, &nextTrackStart, PENDING_TRACK_REACHED))
+        [THIS performSelectorOnMainThread:@selector(queuedTrackStarted) withObject:nil waitUntilDone:NO];
+    
+    // The tail above only looked for a callback's worth, so its count can be stale. The end is when the
+    // rings are really empty, by the producer's own head
+    BOOL hasPlayedEverything = THIS->assetReaderStatus == AVAssetReaderStatusCompleted;
+    for (UInt32 i=0;i<numChannels && hasPlayedEverything;i++)
+        hasPlayedEverything = TPSPSCCircularBufferFillCount(&THIS->toPlayBuffers[i]) == 0;
+    if (hasPlayedEverything)
     {
         THIS->_isPlaying = NO;
         [THIS performSelectorOnMainThread:@selector(playbackFinished) withObject:nil waitUntilDone:NO];
@@ -267,12 +856,25 @@ uint64_t starttime = 0;
         return;
     }
     [self clearBuffers];
+    
+    // Nothing needs computing when the track's analysis is cached
+    CircularAudioStorageSetLazyAnalysis(&self->processedAudioData, requestedLazyAnalysis || SpectrogramCacheIsReadable(&spectrogramCache));
     shouldFillBuffersAsync = YES;
     
     dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^
     {
+        self->isFillingBuffers = YES;
+        AudioWakeupSignal(&self->pullLoopProgressed);
+        
         [self audioPullLoop];
         
+        // the stages finish what was queued, so nothing writes to the rings once we say we've stopped
+        AudioPipelineDrain(&self->pipeline);
+        [self retireProcessedChunks];
+        
+        self->isFillingBuffers = NO;
+        AudioWakeupSignal(&self->pullLoopProgressed);
+        
         // the audio loop has stopped. chechking if it failed
         if (self.assetReader.status == AVAssetReaderStatusFailed)
         {
@@ -285,9 +887,14 @@ uint64_t starttime = 0;
             [self.delegate audioFileReadingErrorOccurred:self withError:[NSError errorWithDomain:@"AVAssetReaderStatusCancelled" code:0 userInfo:nil]];
         }
     });
-    uint64_t timeout = machToMiliseconds(mach_absolute_time()) + 500;
-    while (!isFillingBuffers && machToMiliseconds(mach_absolute_time()) < timeout) {}
+    [self waitForPullLoop:^BOOL{ return self->isFillingBuffers; } timeout:0.5];
+}
 
+// Sleeps until condition holds, checking it whenever the pull loop starts, stops or adds audio.
+// Returns NO if it still doesn't hold after the timeout
+- (BOOL)waitForPullLoop:(BOOL (^)(void))condition timeout:(NSTimeInterval)timeout
+{
+    return AudioWakeupWait(&pullLoopProgressed, condition, dispatch_time(DISPATCH_TIME_NOW, (int64_t)(timeout * NSEC_PER_SEC)));
 }
 
 // What we want to have is an FFT of the future at any given moment.
@@ -295,11 +902,10 @@ uint64_t starttime = 0;
 
 - (BOOL)audioPullLoop
 {
-    isFillingBuffers = YES;
     [[NSThread currentThread] setName:@"Audio Pull Thread"];
     
     UInt32 numSamplesToRead = 4096;
-    if (!assetReaderStatus == AVAssetReaderStatusReading)
+    if (assetReaderStatus != AVAssetReaderStatusReading && !readerNeedsRestart)
     {
         NSLog(@"can't start audioPullLoop because assetReaderStatus is not AVAssetReaderStatusReading");
         return NO;
@@ -310,80 +916,338 @@ uint64_t starttime = 0;
         return NO;
     }
     
-    while (assetReaderStatus == AVAssetReaderStatusReading && shouldFillBuffersAsync)
+    // After a seek into audio that's still cached, it goes in first and the decoder is restarted after it
+    UInt32 numChannels = self->processedAudioData.numChannels;
+    while (cachedAudioCursor < cachedAudioEnd && shouldFillBuffersAsync)
     {
-        if (isThereEnoughPlaceToWrite(&toProcessBuffer, numSamplesToRead * sizeof(float)))
+        UInt32 numFramesAvailable = 0;
+        const float *samples = AudioSeekCacheGetAudio(&seekCache, cachedAudioCursor, &numFramesAvailable);
+        if (!samples) break;
+        
+        UInt32 numFramesToAdd = (UInt32)MIN(MIN(numFramesAvailable, numSamplesToRead / numChannels), cachedAudioEnd - cachedAudioCursor);
+        if (isThereEnoughPlaceToWrite(&toProcessBuffer, numFramesToAdd * numChannels * sizeof(float)))
         {
-            UInt32 numSamplesRead = 0;
-            float *samples = [self readSamplesFromFile:numSamplesToRead numSamplesRead:&numSamplesRead];
-            if (!samples) break;
-            
-            // process audio here to make it sound
-            
-            /*float extractedChannel[numSamplesRead];
-            CenterCut(samples, numSamplesRead, extractedChannel, self.playedAudioFormat.mSampleRate, false, false);
-            samples = extractedChannel;*/
-            
-            TPCircularBufferProduceBytes(&toProcessBuffer, samples, numSamplesRead * sizeof(float));
-            [self processLiveAudio]; // Empties the toProcess buffer
+            TPCircularBufferProduceBytes(&toProcessBuffer, samples, numFramesToAdd * numChannels * sizeof(float));
+            processedAudioData.numSampleBytesCopied += numFramesToAdd * numChannels * sizeof(float);
+            cachedAudioCursor += numFramesToAdd;
+            [self processLiveAudio];
+        }
+        else [self waitForPipeline];
+    }
+    if (readerNeedsRestart && shouldFillBuffersAsync)
+    {
+        cachedAudioEnd = cachedAudioCursor;
+        readerNeedsRestart = NO;
+        NSError *error = [self restartReaderAtFrame:cachedAudioCursor];
+        if (error)
+        {
+            NSLog(@"can't restart reading after the cached audio: %@", error);
+            [self.delegate audioFileReadingErrorOccurred:self withError:error];
+            return NO;
+        }
+    }
+    
+    while (YES)
+    {
+        while (assetReaderStatus == AVAssetReaderStatusReading && shouldFillBuffersAsync)
+        {
+            if (isThereEnoughPlaceToWrite(&toProcessBuffer, numSamplesToRead * sizeof(float)))
+            {
+                // Decoded (and resampled, if need be) straight into the ring
+                uint64_t decodeStartTime = mach_absolute_time();
+                int32_t space = 0;
+                float *head = (float *)TPCircularBufferHead(&toProcessBuffer, &space);
+                UInt32 numSamplesRead = [self decodeSamples:numSamplesToRead intoBuffer:head];
+                if (!numSamplesRead) break;
+                TPCircularBufferProduce(&toProcessBuffer, numSamplesRead * sizeof(float));
+                AudioPipelineNoteDecoded(&pipeline, numSamplesRead / numChannels, mach_absolute_time() - decodeStartTime);
+                
+                [self processLiveAudio]; // Queues what the toProcess buffer has for the pipeline
+            }
+            else [self waitForPipeline];
         }
         
+        // Every frame of the track went through the streams once the stages are done with what's queued,
+        // and then its cache entry is complete. Finishing unmaps it, so no stage may still be writing to it
+        if (assetReaderStatus == AVAssetReaderStatusCompleted && spectrogramCache.isWritable)
+        {
+            AudioPipelineDrain(&pipeline);
+            [self retireProcessedChunks];
+            SpectrogramCacheFinish(&spectrogramCache);
+        }
+        
+        // The next queued track goes right on after this one, into the same rings. Not when analysing offline
+        if (assetReaderStatus != AVAssetReaderStatusCompleted || !shouldFillBuffersAsync || self.isAnalysingOffline || ![self handOverToNextQueuedURL])
+            break;
+    }
+    
+    return YES;
+
+}
+
+// Called by the pull thread once the track it's reading is done. Reading moves on to the prefetched track,
+// and its audio goes into the rings right after this one's last frame. Returns NO if there's nothing to move on to.
+- (BOOL)handOverToNextQueuedURL
+{
+    // Only one handover is tracked at a time. A track shorter than what the rings hold waits for the previous one to start playing
+    atomic_store_explicit(&playHeadWakeupFrame, decodingTrackStartFrame, memory_order_relaxed);
+    while (atomic_load_explicit(&nextTrackStartFrame, memory_order_acquire) != NO_PENDING_TRACK && shouldFillBuffersAsync)
+    {
+        AudioWakeupWait(&playHeadAdvanced, ^BOOL{
+            return !self->shouldFillBuffersAsync || atomic_load_explicit(&self->nextTrackStartFrame, memory_order_acquire) == NO_PENDING_TRACK;
+        }, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC));
     }
-    isFillingBuffers = NO;
+    if (!shouldFillBuffersAsync) return NO;
+    
+    __block BOOL handedOver = NO;
+    dispatch_sync(prefetchQueue, ^{ handedOver = [self takePrefetchedTrack]; });
+    if (!handedOver) return NO;
+    
+    // The seek cache held the previous track's audio, by file frame. The next track's frames aren't on the
+    // jump grid of its own cache entry, so it neither reads nor writes one. The stages are still adding the
+    // previous track's last chunks to both, so they're done with them before the caches are switched
+    AudioPipelineDrain(&pipeline);
+    [self retireProcessedChunks];
+    UInt32 numChannels = self->processedAudioData.numChannels;
+    [self resetSeekCacheForChannels:numChannels];
+    [self openSpectrogramCacheForURL:nil numChannels:numChannels];
+    
+    atomic_store_explicit(&nextTrackStartFrame, decodingTrackStartFrame, memory_order_release);
+    dispatch_async(prefetchQueue, ^{ [self prefetchNextQueuedURL]; });
     
     return YES;
+}
 
+// Runs on prefetchQueue, for the pull thread. The prefetched track becomes the one being read
+- (BOOL)takePrefetchedTrack
+{
+    NSURL *url = prefetchedURL;
+    @synchronized(queuedURLs)
+    {
+        if (url == nil || queuedURLs.firstObject != url) return NO;
+        
+        // The rings and the analysis are set up for this many channels. Anything else is loaded when this track ends
+        if ([self numChannelsToDecodeForFormat:prefetchedFormat] != self->processedAudioData.numChannels) return NO;
+        
+        [queuedURLs removeObjectAtIndex:0];
+    }
+    
+    SInt64 trackStart = decodingTrackStartFrame + nextDecodedFrame;
+    
+    AudioDecoderClose(&decoder);
+    decoder = prefetchedDecoder;
+    memset(&prefetchedDecoder, 0, sizeof(AudioDecoder));
+    self.assetReader = prefetchedAssetReader;
+    self.samplesReader = prefetchedSamplesReader;
+    prefetchedAssetReader = nil;
+    prefetchedSamplesReader = nil;
+    
+    if (currentBlockRef) CFRelease(currentBlockRef);
+    currentBlockRef = NULL;
+    currentBlock = NULL;
+    currentBlockSize = 0;
+    currentBlockOffset = 0;
+    firstBlockRef = prefetchedBlockRef;
+    prefetchedBlockRef = NULL;
+    
+    handedOverURL = url;
+    handedOverTotalFrames = prefetchedTotalFrames;
+    handedOverFormat = prefetchedFormat;
+    prefetchedURL = nil;
+    
+    decodingTrackStartFrame = trackStart;
+    nextDecodedFrame = 0;
+    nextSourceFrame = 0;
+    [self setUpResamplerForFormat:prefetchedFormat];
+    assetReaderStatus = AVAssetReaderStatusReading;
+    
+    return YES;
 }
 
 - (void)processLiveAudio
 {
     // As long as we can we read new samples from the hard disk and add them to the toProcess buffer.
     
-    // Samples from the toProcess buffer will be pulled to the processedAudioData and to the toPlay buffer
-    // whenever possible, in this method.
+    // Whole chunks from the toProcess buffer are queued for the pipeline, whose stages analyse them into
+    // processedAudioData and fill the toPlay buffers in parallel. They stay in the toProcess buffer until
+    // every stage is done with them.
+    
+    UInt32 numChannels = self->processedAudioData.numChannels;
+    UInt32 chunkBytes = CHUNK_SIZE * numChannels * sizeof(float);
+    
+    while (shouldFillBuffersAsync)
+    {
+        [self retireProcessedChunks];
+        
+        UInt32 numChunksInFlight = AudioPipelineNumChunksInFlight(&pipeline);
+        if (toProcessBuffer.fillCount < (numChunksInFlight + 1) * chunkBytes) break;
+        
+        if (numChunksInFlight >= AUDIO_PIPELINE_DEPTH)
+        {
+            AudioPipelineWaitForProgress(&pipeline, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC));
+            continue;
+        }
+        
+        // Offline, the play head moves as chunks retire, so it's the pipeline to wait for
+        if (self->_isAnalysingOffline)
+        {
+            if (![self hasRoomToProcessChunks:numChunksInFlight + 1])
+            {
+                if (!AudioPipelineWaitForProgress(&pipeline, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC))) break;
+                continue;
+            }
+        }
+        // if there is not enough space to store the samples, it means that there's too much
+        // future data. we'll wait for the playing point to proceed
+        else if (![self hasRoomToProcessChunks:numChunksInFlight + 1] || self.isStopped)
+        {
+            [self waitForPlayHead];
+            continue;
+        }
+        
+        int avaiableBytes = 0;
+        float *samples = (float *)TPCircularBufferTail(&toProcessBuffer, &avaiableBytes) + numChunksInFlight * chunkBytes / sizeof(float);
+        
+        UInt32 numFramesToSkip = MIN(framesToSkipPlaying, CHUNK_SIZE);
+        framesToSkipPlaying -= numFramesToSkip;
+        AudioPipelineQueueChunk(&pipeline, samples, CHUNK_SIZE, numFramesToSkip);
+    }
+}
+
+// Frees the toProcess buffer of the chunks every stage is done with
+- (void)retireProcessedChunks
+{
+    UInt32 numChunksRetired = AudioPipelineRetireChunks(&pipeline);
+    if (numChunksRetired == 0) return;
+    
+    TPCircularBufferConsume(&toProcessBuffer, numChunksRetired * CHUNK_SIZE * self->processedAudioData.numChannels * sizeof(float));
+    if (self->_isAnalysingOffline) [self sendOfflineSpectraForChunks:numChunksRetired];
+    if (seekStartTime) [self noteSeekProgress];
+    AudioWakeupSignal(&pullLoopProgressed);
+}
+
+// Offline, the sink gets every spectrum the retired chunks completed (a spectrum at t takes the samples up
+// to t + CHUNK_SIZE), all channels of one before the next. Then the play head moves past them
+- (void)sendOfflineSpectraForChunks:(UInt32)numChunks
+{
+    offlineAnalysedEnd += (SInt64)numChunks * CHUNK_SIZE;
+    
+    UInt32 numChannels = self->processedAudioData.numChannels;
+    SInt32 jumpSize = self->processedAudioData.fftOverlapJumpSize;
+    float spectrum[CHUNK_SIZE];
+    for (;offlineNextSpectrumTime + CHUNK_SIZE <= offlineAnalysedEnd;offlineNextSpectrumTime += jumpSize)
+    {
+        for (UInt32 i=0;i<numChannels && offlineSink;i++)
+        {
+            if (AudioStreamGetSpectrumAtTime(&self->processedAudioData.channels[i], offlineNextSpectrumTime, spectrum))
+                offlineSink(offlineNextSpectrumTime, i, spectrum);
+        }
+        offlineNumSpectra++;
+    }
+    
+    self->processedAudioData.currentlyPlayingFrame = offlineNextSpectrumTime;
+}
+
+// Called by the pull thread when the toProcess buffer is full. Sleeps until the pipeline frees some of it, or
+// queues what's left to queue if nothing's in flight
+- (void)waitForPipeline
+{
+    AudioPipelineWaitForProgress(&pipeline, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC));
+    [self processLiveAudio];
+}
+
+// Deinterleaves into the play rings, so the render thread only has to copy
+- (void)addSamplesToPlay:(const float *)samples numFrames:(UInt32)numFrames
+{
+    UInt32 numChannels = self->processedAudioData.numChannels;
+    float *destinations[MAX_AUDIO_CHANNELS];
+    for (UInt32 i=0;i<numChannels;i++)
+    {
+        int32_t space = 0;
+        destinations[i] = (float *)TPSPSCCircularBufferHeadAtLeast(&toPlayBuffers[i], &space, numFrames * sizeof(float));
+    }
+    
+    ScaleAndDeinterleaveSamples(samples, numChannels, numFrames, 1.0f, destinations);
+    [self addPlaybackSpanWithNumFrames:numFrames numSourceFrames:numFrames];
+    for (UInt32 i=0;i<numChannels;i++)
+        TPSPSCCircularBufferProduce(&toPlayBuffers[i], numFrames * sizeof(float));
+}
+
+// Stretches into the play rings, as much as they have room for. The rest waits in the vocoder for the next chunk
+- (void)stretchSamplesToPlay:(const float *)samples numFrames:(UInt32)numFrames rate:(Float64)rate pitch:(Float64)pitch
+{
+    UInt32 numChannels = self->processedAudioData.numChannels;
+    float *destinations[MAX_AUDIO_CHANNELS];
+    int32_t space = INT32_MAX;
+    for (UInt32 i=0;i<numChannels;i++)
+    {
+        int32_t channelSpace = 0;
+        destinations[i] = (float *)TPSPSCCircularBufferHead(&toPlayBuffers[i], &channelSpace);
+        space = MIN(space, channelSpace);
+    }
+    
+    Float64 numSourceFrames = 0;
+    UInt32 numFramesMade = PhaseVocoderProcess(&vocoder, samples, numFrames, rate, pitch, destinations, (UInt32)(space / sizeof(float)), &numSourceFrames);
+    if (numFramesMade == 0) return;
+    
+    [self addPlaybackSpanWithNumFrames:numFramesMade numSourceFrames:numSourceFrames];
+    for (UInt32 i=0;i<numChannels;i++)
+        TPSPSCCircularBufferProduce(&toPlayBuffers[i], numFramesMade * sizeof(float));
+}
+
+// Before the frames it's for, so the render thread never gets to them first. If the ring's full they play as one source frame each
+- (void)addPlaybackSpanWithNumFrames:(UInt32)numFrames numSourceFrames:(Float64)numSourceFrames
+{
+    PlaybackSpan span = {numFrames, numSourceFrames};
+    TPSPSCCircularBufferProduceBytes(&playbackSpans, &span, sizeof(PlaybackSpan));
+}
+
+// Whether the streams and the play rings can take numChunks more chunks, counting the ones in flight.
+// Stretched, that's what the vocoder will make of them on top of what it's holding back
+- (BOOL)hasRoomToProcessChunks:(UInt32)numChunks
+{
+    if (!AudioPipelineHasRoomForChunk(&pipeline)) return NO;
+    
+    UInt32 numFramesToPlay = numChunks * CHUNK_SIZE;
+    Float64 rate = self.playbackRate;
+    if (isStretching || rate != 1 || self.playbackPitch != 0)
+        numFramesToPlay = PhaseVocoderOutputFramesForInput(&vocoder, numFramesToPlay, rate) + PhaseVocoderNumPendingFrames(&vocoder);
     
-    while (toProcessBuffer.fillCount >= CHUNK_SIZE * 2 * sizeof(float) && shouldFillBuffersAsync)
+    for (UInt32 i=0;i<self->processedAudioData.numChannels && !self->_isAnalysingOffline;i++)
     {
-        int avaiableBytes = 0;
-        float *samples = (float *)TPCircularBufferTail(&toProcessBuffer, &avaiableBytes);
-        
-        UInt32 numSamplesToProcessPerChannel = CHUNK_SIZE;
-        UInt32 numSamplesToProcess = numSamplesToProcessPerChannel * 2;
-        
-        // if there is not enough space to store the samples, it means that there's too much
-        // future data. we'll wait for the playing point to proceed
-        if (!canAddToLiveAudioData(&self->processedAudioData, numSamplesToProcessPerChannel) ||
-            !isThereEnoughPlaceToWrite(&toPlayBuffer, numSamplesToProcess * sizeof(float)))
-            continue;
-        
-        BOOL success = NO;
-        
-        // -- Center Channel Extration ---
-        // takes ~36 ms on device, so we'll see how it can be optimized.
-        
-        /*
-         float extractedChannel[numSamplesToProcessPerChannel*2], samples1[numSamplesToProcessPerChannel], samples2[numSamplesToProcessPerChannel];
-        CenterCut(samples, numSamplesToProcessPerChannel*2, extractedChannel, self.playedAudioFormat.mSampleRate, true, false);
-        SplitStereoSamples(extractedChannel, numSamplesToProcessPerChannel*2, samples1, samples2);
-        success = AddAudioToLiveStream(samples1, numSamplesToProcessPerChannel, &self->processedAudioData.extractedChannel);
-         */
-        
-        
-        // Process the samples, store the result and send to play
-        success = AddStereoAudioToLiveStream(samples, numSamplesToProcessPerChannel, &processedAudioData);
-        if (success && !self.isStopped)
-        {
-            TPCircularBufferProduceBytes(&toPlayBuffer, samples, numSamplesToProcess * sizeof(float));
-            TPCircularBufferConsume(&toProcessBuffer, numSamplesToProcess * sizeof(float));
-        }
-        
+        int32_t toPlaySpace = 0;
+        TPSPSCCircularBufferHeadAtLeast(&toPlayBuffers[i], &toPlaySpace, numFramesToPlay * sizeof(float));
+        if (toPlaySpace < numFramesToPlay * sizeof(float)) return NO;
     }
+    return YES;
+}
 
+// Called by the pull thread when everything buffered is yet to play. Sleeps until the render thread
+// moves the play head a chunk on, or the loop is told to stop. A paused stream is checked on 10 times a second
+- (void)waitForPlayHead
+{
+    UInt32 numChunks = AudioPipelineNumChunksInFlight(&pipeline) + 1;
+    atomic_store_explicit(&playHeadWakeupFrame, self->processedAudioData.currentlyPlayingFrame + CHUNK_SIZE, memory_order_relaxed);
+    AudioWakeupWait(&playHeadAdvanced, ^BOOL{
+        return !self->shouldFillBuffersAsync || [self hasRoomToProcessChunks:numChunks];
+    }, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC));
+}
+
+// Called by the pull thread while a seek waits for its first spectrum at the target
+- (void)noteSeekProgress
+{
+    CircularAudioStream *stream = &self->processedAudioData.channels[0];
+    SInt64 numFrames = stream->fftResults.circularBuffer.fillCount / (CHUNK_SIZE * sizeof(float));
+    if (numFrames == 0 || stream->fftResults.offset + (numFrames - 1) * self->processedAudioData.fftOverlapJumpSize < seekTarget) return;
+    
+    self.lastSeekLatency = machToMiliseconds(mach_absolute_time() - seekStartTime) / 1000.0;
+    seekStartTime = 0;
 }
 
 - (void)stopFillingBufferAsync
 {
     shouldFillBuffersAsync = NO;
+    AudioWakeupSignal(&playHeadAdvanced);
 }
 
 -(void)seekToOffset:(SInt64)offset withCompletionCallback:(void (^)(NSError *))completion
@@ -394,25 +1258,41 @@ uint64_t starttime = 0;
         {
             [self playbackFinished];
             completion(nil);
+            return;
+        }
+        
+        if (self.isAnalysingOffline)
+        {
+            completion([NSError errorWithDomain:@"Can't seek while analysing offline" code:0 userInfo:nil]);
+            return;
         }
         
         self.isFinished = NO;
         
         NSError *error;
         BOOL wasPlaying = self.isPlaying;
+        uint64_t startTime = mach_absolute_time();
         
         [self stopFillingBufferAsync];
-        while (isFillingBuffers) {}
-        
-        CMTimeRange timeRange = CMTimeRangeMake(CMTimeMake(offset, self.playedAudioFormat.mSampleRate), kCMTimePositiveInfinity);
-        error = [self setReaderToTimeRange:&timeRange]; if (error) completion(error); // takes ~18 ms (or 44 ms ?!)
+        if (![self waitForPullLoop:^BOOL{ return !self->isFillingBuffers; } timeout:2.0])
+        {
+            // Reading was told to stop, so nothing will fill the rings: we're stopped, and the next play starts it over
+            self.isPlaying = NO;
+            self.isStopped = YES;
+            error = [NSError errorWithDomain:@"Audio reading didn't stop in time for the seek" code:0 userInfo:nil];
+            if ([self.delegate respondsToSelector:@selector(audioFileReadingErrorOccurred:withError:)])
+                [self.delegate audioFileReadingErrorOccurred:self withError:error];
+            completion(error);
+            return;
+        }
         
-        self.isPlaying = NO;
-        [self clearBuffers];
-        self->processedAudioData.currentlyPlayingFrame = self.assetReader.timeRange.start.value;
-        AudioStreamSetBuffersOffset(&self->processedAudioData.channel1, self.assetReader.timeRange.start.value);
-        AudioStreamSetBuffersOffset(&self->processedAudioData.channel2, self.assetReader.timeRange.start.value);
-        AudioStreamSetBuffersOffset(&self->processedAudioData.extractedChannel, self.assetReader.timeRange.start.value);
+        error = [self moveReadingToOffset:offset];
+        if (error)
+        {
+            completion(error);
+            return;
+        }
+        seekStartTime = startTime;
         
         [self startFillingBufferAsync];
         
@@ -422,6 +1302,225 @@ uint64_t starttime = 0;
     });
 }
 
+// Must be called while no audio is being read. Empties the rings and has reading start over at offset in
+// the playing track (a pre-roll before it, see seekPreRollFrames), with the play head there
+- (NSError *)moveReadingToOffset:(SInt64)offset
+{
+    // The offset is in the track that's playing, which the pull thread may have already moved on from
+    SInt64 nextTrackStart = atomic_load_explicit(&self->nextTrackStartFrame, memory_order_acquire);
+    if (nextTrackStart >= 0 && atomic_compare_exchange_strong(&self->nextTrackStartFrame, &nextTrackStart, NO_PENDING_TRACK))
+    {
+        NSError *error = [self reopenPlayingTrack];
+        if (error) return error;
+    }
+    else if (nextTrackStart == PENDING_TRACK_REACHED)
+        dispatch_sync(dispatch_get_main_queue(), ^{ [self queuedTrackStarted]; });
+    
+    // From here on the rings' timeline starts at the playing track's start again
+    if (self->playingTrackStartFrame != 0 || self->decodingTrackStartFrame != 0)
+    {
+        self->playingTrackStartFrame = self->decodingTrackStartFrame = 0;
+        [self openSpectrogramCacheForURL:self.URL numChannels:self->processedAudioData.numChannels];
+    }
+    
+    // Analysis starts a pre-roll before the target, on the jump grid, so the target's frames are
+    // there (and line up with frames from before the seek) by the time it plays
+    SInt32 jumpSize = self->processedAudioData.fftOverlapJumpSize;
+    SInt64 start = MAX(offset - (SInt64)self.seekPreRollFrames, 0) / jumpSize * jumpSize;
+    
+    // Restarting the reader takes ~18 ms (or 44 ms ?!). If what comes after start is cached,
+    // the pull thread does it once that's in, instead of making everyone wait for it here
+    cachedAudioCursor = start;
+    cachedAudioEnd = AudioSeekCacheContiguousEnd(&seekCache, start);
+    self.lastSeekUsedCachedAudio = cachedAudioEnd > start;
+    readerNeedsRestart = self.lastSeekUsedCachedAudio;
+    if (readerNeedsRestart)
+        assetReaderStatus = AVAssetReaderStatusUnknown; // not the old reader's status, which may say it's done
+    else
+    {
+        NSError *error = [self restartReaderAtFrame:start];
+        if (error) return error;
+    }
+    
+    self.isPlaying = NO;
+    for (UInt32 i=0;i<self->processedAudioData.numChannels;i++)
+        AudioStreamFlushToHistory(&self->processedAudioData.channels[i]);
+    [self clearBuffers];
+    self->processedAudioData.currentlyPlayingFrame = offset;
+    for (UInt32 i=0;i<self->processedAudioData.numChannels;i++)
+        AudioStreamSetBuffersOffset(&self->processedAudioData.channels[i], start);
+    AudioStreamSetBuffersOffset(&self->processedAudioData.extractedChannel, start);
+    framesToSkipPlaying = (UInt32)(offset - start);
+    seekTarget = offset;
+    
+    return nil;
+}
+
+- (void)analyseOfflineWithSpectrumSink:(AudioFileSpectrumSink)sink completion:(void (^)(AudioFileOfflineAnalysisResult, NSError *))completion
+{
+    dispatch_async(dispatch_get_global_queue(DISPATCH_QUEUE_PRIORITY_DEFAULT, 0), ^
+    {
+        AudioFileOfflineAnalysisResult result;
+        memset(&result, 0, sizeof(AudioFileOfflineAnalysisResult));
+        if (!self.canPlay)
+        {
+            completion(result, [NSError errorWithDomain:@"Audio must be initialized" code:0 userInfo:nil]);
+            return;
+        }
+        if (self.isPlaying || self.isAnalysingOffline)
+        {
+            completion(result, [NSError errorWithDomain:@"Can't analyse offline while playing or analysing" code:0 userInfo:nil]);
+            return;
+        }
+        
+        [self stopFillingBufferAsync];
+        if (![self waitForPullLoop:^BOOL{ return !self->isFillingBuffers; } timeout:2.0])
+        {
+            completion(result, [NSError errorWithDomain:@"Audio reading didn't stop in time for offline analysis" code:0 userInfo:nil]);
+            return;
+        }
+        
+        NSError *error = [self moveReadingToOffset:0];
+        if (error)
+        {
+            completion(result, error);
+            return;
+        }
+        
+        // From the start, so a cache entry that isn't complete yet is written over whole
+        UInt32 numChannels = self->processedAudioData.numChannels;
+        if (!SpectrogramCacheIsReadable(&self->spectrogramCache))
+            [self openSpectrogramCacheForURL:self.URL numChannels:numChannels];
+        CircularAudioStorageSetLazyAnalysis(&self->processedAudioData, SpectrogramCacheIsReadable(&self->spectrogramCache));
+        
+        self.isAnalysingOffline = YES;
+        self->offlineSink = sink;
+        self->offlineAnalysedEnd = self->offlineNextSpectrumTime = 0;
+        self->offlineNumSpectra = 0;
+        self->shouldFillBuffersAsync = YES;
+        self->isFillingBuffers = YES;
+        AudioWakeupSignal(&self->pullLoopProgressed);
+        
+        uint64_t startTime = mach_absolute_time();
+        [self audioPullLoop];
+        AudioPipelineDrain(&self->pipeline);
+        [self retireProcessedChunks];
+        result.seconds = machToMiliseconds(mach_absolute_time() - startTime) / 1000.0;
+        
+        result.numFrames = self->offlineAnalysedEnd;
+        result.numSpectra = self->offlineNumSpectra;
+        if (result.seconds > 0) result.realtimeFactor = result.numFrames / self->processedAudioData.sampleRate / result.seconds;
+        NSLog(@"Analysed %lld frames offline in %.1f ms (%.1fx realtime)", result.numFrames, result.seconds * 1000.0, result.realtimeFactor);
+        
+        if (!self->shouldFillBuffersAsync)
+            error = [NSError errorWithDomain:@"Offline analysis was cancelled" code:0 userInfo:nil];
+        else if (self->assetReaderStatus != AVAssetReaderStatusCompleted)
+            error = [NSError errorWithDomain:@"Offline analysis stopped before the end of the track" code:0 userInfo:nil];
+        
+        self->offlineSink = nil;
+        self.isAnalysingOffline = NO;
+        self->isFillingBuffers = NO;
+        AudioWakeupSignal(&self->pullLoopProgressed);
+        
+        // Ready to play from the start, and a cache entry that was just finished is read from then on
+        if (!error && self->spectrogramCache.isWritable)
+            [self openSpectrogramCacheForURL:self.URL numChannels:numChannels];
+        NSError *rewindError = [self moveReadingToOffset:0];
+        completion(result, error ? error : rewindError);
+    });
+}
+
+- (void)cancelOfflineAnalysis
+{
+    if (self.isAnalysingOffline) [self stopFillingBufferAsync];
+}
+
++ (AudioFileSpectrumSink)spectrumSinkWritingToFile:(NSString *)path
+{
+    if (![[NSFileManager defaultManager] createFileAtPath:path contents:nil attributes:nil]) return nil;
+    NSFileHandle *file = [NSFileHandle fileHandleForWritingAtPath:path];
+    if (!file) return nil;
+    
+    return ^(SInt64 timeInFrames, UInt32 channelIndex, const float *spectrum)
+    {
+        [file writeData:[NSData dataWithBytesNoCopy:(void *)spectrum length:CHUNK_SIZE * sizeof(float) freeWhenDone:NO]];
+    };
+}
+
+// For a seek back into the playing track after the pull thread moved on to the next one. The next one goes
+// back to the head of the queue, and is prefetched again
+- (NSError *)reopenPlayingTrack
+{
+    @synchronized(queuedURLs)
+    {
+        [queuedURLs insertObject:handedOverURL atIndex:0];
+    }
+    handedOverURL = nil;
+    if (firstBlockRef)
+    {
+        CFRelease(firstBlockRef);
+        firstBlockRef = NULL;
+    }
+    
+    NSError *error = nil;
+    AudioStreamBasicDescription format;
+    if (OpenPlayableDecoder(&decoder, self.URL, self->processedAudioData.sampleRate, &format))
+    {
+        self.assetReader = nil;
+        self.samplesReader = nil;
+    }
+    else
+    {
+        AVAssetReader *reader = nil;
+        AVAssetReaderTrackOutput *output = nil;
+        SInt64 totalFrames = 0;
+        error = [self createReaderWithURL:self.URL timeRange:nil reader:&reader output:&output format:&format totalFrames:&totalFrames];
+        self.assetReader = reader;
+        self.samplesReader = output;
+    }
+    if (!error) [self setUpResamplerForFormat:format];
+    
+    [self resetSeekCacheForChannels:self->processedAudioData.numChannels];
+    dispatch_async(prefetchQueue, ^{ [self prefetchNextQueuedURL]; });
+    
+    return error;
+}
+
+// Makes frame the next one readSamplesFromFile returns. The reader starts from the closest position before
+// it that it's known to start a buffer at, if there's one close enough, and what comes before frame is dropped.
+- (NSError *)restartReaderAtFrame:(SInt64)frame
+{
+    // the resampler starts over from the source frame closest to frame
+    SInt64 sourceFrame = AudioResamplerInputFrameForOutputFrame(&resampler, frame);
+    AudioResamplerReset(&resampler);
+    
+    if (AudioDecoderIsOpen(&decoder))
+    {
+        if (!AudioDecoderSeek(&decoder, sourceFrame)) return [NSError errorWithDomain:@"Couldn't seek in the file" code:0 userInfo:nil];
+        assetReaderStatus = AVAssetReaderStatusReading;
+        nextDecodedFrame = frame;
+        nextSourceFrame = sourceFrame;
+        return nil;
+    }
+    
+    SInt64 readerStart = AudioSeekCacheIndexPointBefore(&seekCache, frame);
+    if (readerStart < 0 || frame - readerStart > AUDIO_SEEK_INDEX_SPACING) readerStart = frame;
+    
+    CMTimeRange timeRange = CMTimeRangeMake(CMTimeMake(readerStart, (int32_t)self->processedAudioData.sampleRate), kCMTimePositiveInfinity);
+    NSError *error = [self setReaderToTimeRange:&timeRange];
+    nextDecodedFrame = frame;
+    nextSourceFrame = sourceFrame;
+    return error;
+}
+
+// Sets the resampler up to take the format's audio to the rings' rate, or to pass it through
+- (void)setUpResamplerForFormat:(AudioStreamBasicDescription)format
+{
+    Float64 outputRate = self->processedAudioData.sampleRate;
+    AudioResamplerCleanup(&resampler);
+    AudioResamplerInit(&resampler, DecodingRateForSourceRate(format.mSampleRate, outputRate), outputRate, self->processedAudioData.numChannels);
+}
+
 - (NSError *)setReaderToTimeRange:(CMTimeRange *)timeRange
 {
     if (!self.assetReader.asset) return [NSError errorWithDomain:@"asset is empty" code:0 userInfo:nil];
@@ -487,6 +1586,7 @@ uint64_t starttime = 0;
 -(NSError *)play
 {
     if (!self.canPlay) return [NSError errorWithDomain:@"Audio must be initialized" code:0 userInfo:nil];
+    if (self.isAnalysingOffline) return [NSError errorWithDomain:@"Can't play while analysing offline" code:0 userInfo:nil];
     
     if (![self.audioController.channels containsObject:self])
     {
@@ -499,6 +1599,7 @@ uint64_t starttime = 0;
     
     if (self.isStopped) [self clearBuffers];
     if (!isFillingBuffers) [self startFillingBufferAsync];
+    [self updateOutputLatency];
     self.isPlaying = YES;
     self.isStopped = NO;
 
@@ -546,11 +1647,11 @@ uint64_t starttime = 0;
 
 -(NSError *)stopSynchronously
 {
-    uint64_t timeout = machToMiliseconds(mach_absolute_time()) + 500;
     self.isPlaying = NO;
     self.isStopped = YES;
     
-    [self stopFillingBufferAsync]; while (isFillingBuffers && machToMiliseconds(mach_absolute_time()) < timeout) {}
+    [self stopFillingBufferAsync];
+    [self waitForPullLoop:^BOOL{ return !self->isFillingBuffers; } timeout:0.5];
     [self clearBuffers];
     [self.audioController removeChannels:@[self]];
     
@@ -566,50 +1667,275 @@ uint64_t starttime = 0;
     {
         [self.delegate audioFilePlaybackFinished:self];
     }
+    
+    // What's still queued couldn't be handed over (it didn't open in time, or has a different number of channels)
+    NSURL *nextURL;
+    @synchronized(queuedURLs)
+    {
+        nextURL = queuedURLs.firstObject;
+        if (nextURL) [queuedURLs removeObjectAtIndex:0];
+    }
+    if (nextURL == nil) return;
+    
+    [self loadAudioWithURL:nextURL withCompletionCallback:^(NSError *error)
+    {
+        if (error)
+        {
+            if ([self.delegate respondsToSelector:@selector(audioFileReadingErrorOccurred:withError:)])
+                [self.delegate audioFileReadingErrorOccurred:self withError:error];
+            return;
+        }
+        [[NSOperationQueue mainQueue] addOperationWithBlock:^{ [self play]; }];
+    }];
+}
+
+// On the main thread, once the play head got to the handed-over track
+- (void)queuedTrackStarted
+{
+    if (atomic_load_explicit(&nextTrackStartFrame, memory_order_acquire) != PENDING_TRACK_REACHED) return;
+    
+    NSURL *url = handedOverURL;
+    handedOverURL = nil;
+    playingTrackStartFrame = decodingTrackStartFrame;
+    self.URL = url;
+    self.sourceAudioFormat = handedOverFormat;
+    self.totalFramesCount = handedOverTotalFrames;
+    self.durationInSeconds = handedOverTotalFrames / self->processedAudioData.sampleRate;
+    
+    // the pull thread may be waiting for this to hand over the track after it
+    atomic_store_explicit(&nextTrackStartFrame, NO_PENDING_TRACK, memory_order_release);
+    AudioWakeupSignal(&playHeadAdvanced);
+    
+    if ([self.delegate respondsToSelector:@selector(audioFile:didStartPlayingQueuedURL:)])
+        [self.delegate audioFile:self didStartPlayingQueuedURL:url];
+}
+
+// The output's timestamps already have its latency in them when the controller manages it
+- (void)updateOutputLatency
+{
+    AudioClockSetOutputLatency(&playbackClock, self.audioController.automaticLatencyManagement ? 0 : self.audioController.outputLatency);
+}
+
+- (Float64)frameHeardAtHostTime:(uint64_t)hostTime
+{
+    Float64 frame;
+    if (!AudioClockFrameAtHostTime(&playbackClock, hostTime, &frame)) return self.currentlyPlayingFrame;
+    return frame;
+}
+
+- (uint64_t)liveHostTime
+{
+    return AECurrentTimeInHostTicks() + AEHostTicksFromSeconds(self.timeDelay);
+}
+
+- (Float64)measuredOutputSampleRate
+{
+    return AudioClockMeasuredSampleRate(&playbackClock);
 }
 
 - (LiveAudioData)liveAudioData
 {
-    NSUInteger delayOffset = TimeToSampleTime(self.timeDelay, self.playedAudioFormat.mSampleRate);
+    return [self liveAudioDataAtHostTime:[self liveHostTime]];
+}
+
+- (LiveAudioData)liveAudioDataAtHostTime:(uint64_t)hostTime
+{
     LiveAudioData audioData;
-    audioData.timeInFrames = self.currentlyPlayingFrame + delayOffset;
-    audioData.channel1 = [self getAudioDataForFrame:audioData.timeInFrames andChannel:&self->processedAudioData.channel1];
-    audioData.channel2 = [self getAudioDataForFrame:audioData.timeInFrames andChannel:&self->processedAudioData.channel2];
+    audioData.timeInFrames = (SInt64)floor([self frameHeardAtHostTime:hostTime]);
+    audioData.sampleRate = self->processedAudioData.sampleRate;
+    audioData.numChannels = self->processedAudioData.numChannels;
+    for (UInt32 i=0;i<audioData.numChannels;i++)
+        audioData.channels[i] = [self getAudioDataForFrame:audioData.timeInFrames andChannel:&self->processedAudioData.channels[i]];
+    audioData.channel1 = LiveAudioDataChannel(&audioData, 0);
+    audioData.channel2 = LiveAudioDataChannel(&audioData, 1);
+    if (self.extractsCenterChannel && audioData.numChannels == 2)
+        audioData.extractedChannel = [self getAudioDataForFrame:audioData.timeInFrames andChannel:&self->processedAudioData.extractedChannel];
+    else
+        audioData.extractedChannel = (LiveAudioChannelData){NO, 0, 0};
     
     return audioData;
 }
 
 - (LiveAudioChannelData)getAudioDataForFrame:(SInt64)frameOffsetFromFile andChannel:(CircularAudioStream *)stream
 {
-    LiveAudioChannelData audioData;
-    
     /*if (self.isReverbrating)
     {
         CGFloat timeSinceReverb = machToMiliseconds(mach_absolute_time() - reverbStartTime) / 1000.0;
         frameOffsetFromFile += TimeToSampleTime(timeSinceReverb, self.playedAudioFormat.mSampleRate);
     }*/
     
-    SInt32 offset = (SInt32)(frameOffsetFromFile - stream->samples.offset);
-    SInt32 fftOffset = (SInt32)((frameOffsetFromFile - stream->fftResults.offset) / self->processedAudioData.fftOverlapJumpSize * CHUNK_SIZE);
-    if (offset < 0 || offset * sizeof(float) > stream->samples.circularBuffer.fillCount || fftOffset < 0 || fftOffset * sizeof(float) > stream->fftResults.circularBuffer.fillCount)
+    return AudioStreamGetLiveData(stream, frameOffsetFromFile);
+}
+
+- (BOOL)getLiveAudioDataSnapshot:(LiveAudioData *)snapshot withBuffers:(LiveAudioSnapshotBuffer[MAX_AUDIO_CHANNELS])buffers
+{
+    // The pull thread never waits for us, so if it reclaims what we're copying we just try again
+    int numberOfTries = 4;
+    while (numberOfTries-- > 0)
     {
-        //NSLog(@"Requested time is outside the currently stored buffer");
-        return (LiveAudioChannelData){NO, 0,0};
+        LiveAudioData audioData = self.liveAudioData;
+        snapshot->timeInFrames = audioData.timeInFrames;
+        snapshot->sampleRate = audioData.sampleRate;
+        snapshot->extractedChannel = (LiveAudioChannelData){NO, 0, 0};
+        snapshot->numChannels = audioData.numChannels;
+        
+        BOOL isCopied = YES;
+        for (UInt32 i=0;i<audioData.numChannels && isCopied;i++)
+            isCopied = LiveAudioChannelDataCopy(&audioData.channels[i], &buffers[i], &snapshot->channels[i]);
+        if (isCopied)
+        {
+            snapshot->channel1 = LiveAudioDataChannel(snapshot, 0);
+            snapshot->channel2 = LiveAudioDataChannel(snapshot, 1);
+            return YES;
+        }
     }
     
-    int availableBytes = 0;
-    float *samples = (float *)TPCircularBufferTail(&stream->samples.circularBuffer, &availableBytes);
-    SInt32 availableSamples = availableBytes / sizeof(float) - offset;
-    LiveSamples liveSamples = (LiveSamples){frameOffsetFromFile, &samples[offset], availableSamples};
-    float *fftResults = (float *)TPCircularBufferTail(&stream->fftResults.circularBuffer, &availableBytes);
-    SInt32 availableChunks = availableBytes / CHUNK_SIZE / sizeof(float) - fftOffset / CHUNK_SIZE;
-    LiveFFTResults liveFFTResults = (LiveFFTResults){frameOffsetFromFile, &fftResults[fftOffset], availableChunks};
+    return NO;
+}
+
+- (int)addSpectrumReaderForChannel:(UInt32)channelID
+{
+    SpectrumBroadcastRing *broadcast = [self spectrumBroadcastForChannel:channelID];
+    if (!broadcast) return -1;
+    return SpectrumBroadcastRingAddReader(broadcast);
+}
+
+- (void)removeSpectrumReader:(int)readerID forChannel:(UInt32)channelID
+{
+    SpectrumBroadcastRing *broadcast = [self spectrumBroadcastForChannel:channelID];
+    if (broadcast) SpectrumBroadcastRingRemoveReader(broadcast, readerID);
+}
+
+// Channel IDs start from 1. NULL for a channel the file doesn't have
+- (SpectrumBroadcastRing *)spectrumBroadcastForChannel:(UInt32)channelID
+{
+    if (channelID < 1 || channelID > self->processedAudioData.numChannels || channelID > numSpectrumBroadcasts) return NULL;
+    return &spectrumBroadcasts[channelID - 1];
+}
+
+- (NSError *)configureSpectrogramHistoryWithDuration:(NSTimeInterval)seconds fileDirectory:(NSString *)directory
+{
+    if (isFillingBuffers) return [NSError errorWithDomain:@"Can't configure the spectrogram history while reading audio" code:0 userInfo:nil];
+    
+    historyDuration = seconds;
+    historyDirectory = directory;
+    for (UInt32 i=0;i<MAX_AUDIO_CHANNELS;i++) self->processedAudioData.channels[i].history = NULL;
+    for (UInt32 i=0;i<numSpectrogramHistories;i++) SpectrogramHistoryCleanup(&spectrogramHistories[i]);
+    numSpectrogramHistories = 0;
+    AudioMemoryBudgetRelease(AudioMemoryBudgetShared(), historyBytesReserved);
+    historyBytesReserved = 0;
+    if (seconds <= 0) return nil;
     
-    audioData.containsData = availableSamples > 0 || availableChunks > 0;
-    audioData.samples = liveSamples;
-    audioData.fftResults = liveFFTResults;
+    // The history gets whatever the budget has left, up to the requested duration, for every channel there are rings for
+    UInt32 numChannels = MAX(memoryPlan.numChannels, 1);
+    UInt32 requestedFrames = (UInt32)(seconds * self->processedAudioData.sampleRate / self.fftOverlapJumpSize);
+    UInt32 capacityInFrames = AudioMemoryBudgetReserveHistory(AudioMemoryBudgetShared(), numChannels, CHUNK_SIZE, requestedFrames);
+    if (capacityInFrames < requestedFrames)
+        NSLog(@"The memory budget only allows %.1f seconds of spectrogram history", capacityInFrames * self.fftOverlapJumpSize / self->processedAudioData.sampleRate);
+    if (capacityInFrames == 0) return nil;
+    historyBytesReserved = AudioMemoryHistoryBytes(numChannels, CHUNK_SIZE, capacityInFrames);
     
-    return audioData;
+    for (;numSpectrogramHistories<numChannels;numSpectrogramHistories++)
+    {
+        NSString *path = directory ? [directory stringByAppendingPathComponent:[NSString stringWithFormat:@"%p-%u.spectrogram", self, (unsigned)numSpectrogramHistories + 1]] : nil;
+        if (!SpectrogramHistoryInit(&spectrogramHistories[numSpectrogramHistories], CHUNK_SIZE, capacityInFrames, path.fileSystemRepresentation))
+        {
+            for (UInt32 i=0;i<=numSpectrogramHistories;i++) SpectrogramHistoryCleanup(&spectrogramHistories[i]);
+            numSpectrogramHistories = 0;
+            AudioMemoryBudgetRelease(AudioMemoryBudgetShared(), historyBytesReserved);
+            historyBytesReserved = 0;
+            return [NSError errorWithDomain:@"Couldn't allocate the spectrogram history" code:0 userInfo:nil];
+        }
+    }
+    
+    [self attachChannelTaps];
+    return nil;
+}
+
+- (BOOL)getSpectrum:(float *)result atFrame:(SInt64)frame forChannel:(UInt32)channelID
+{
+    return AudioStreamGetSpectrumAtTime([self streamForChannelID:channelID], frame, result);
+}
+
+- (BOOL)getSpectrum:(float *)result atHostTime:(uint64_t)hostTime forChannel:(UInt32)channelID
+{
+    return [self getSpectrum:result atFrame:(SInt64)floor([self frameHeardAtHostTime:hostTime]) forChannel:channelID];
+}
+
+- (int)getSpectra:(float *)results fromFrame:(SInt64)startFrame toFrame:(SInt64)endFrame maxChunks:(int)maxChunks forChannel:(UInt32)channelID
+{
+    return AudioStreamGetSpectraInTimeRange([self streamForChannelID:channelID], startFrame, endFrame, results, maxChunks);
+}
+
+// channel IDs start from 1. Asking a mono file for channel 2 gives channel 1
+- (CircularAudioStream *)streamForChannelID:(UInt32)channelID
+{
+    UInt32 index = MIN(MAX(channelID, 1) - 1, self->processedAudioData.numChannels - 1);
+    return &self->processedAudioData.channels[index];
+}
+
+- (Float64)sampleRate
+{
+    return self->processedAudioData.sampleRate;
+}
+
+- (UInt32)numChannels
+{
+    return self->processedAudioData.numChannels;
+}
+
+// Takes effect when audio starts being read again (on load or seek)
+- (void)setLazyAnalysis:(BOOL)lazyAnalysis
+{
+    requestedLazyAnalysis = lazyAnalysis;
+}
+
+- (BOOL)lazyAnalysis
+{
+    return requestedLazyAnalysis;
+}
+
+- (void)setLazyFramesPerRead:(int)lazyFramesPerRead
+{
+    self->processedAudioData.lazyFramesPerRead = MAX(lazyFramesPerRead, 1);
+}
+
+- (int)lazyFramesPerRead
+{
+    return self->processedAudioData.lazyFramesPerRead;
+}
+
+- (int)addSpectrumReadScheduleWithRate:(Float64)readRate alignment:(SInt64)alignment averageSkippedFrames:(BOOL)averageSkippedFrames
+{
+    return CircularAudioStorageAddReadSchedule(&self->processedAudioData, readRate, alignment, averageSkippedFrames);
+}
+
+- (void)removeSpectrumReadSchedule:(int)scheduleID
+{
+    CircularAudioStorageRemoveReadSchedule(&self->processedAudioData, scheduleID);
+}
+
+- (BOOL)getScheduledSpectrum:(float *)result forSchedule:(int)scheduleID channel:(UInt32)channelID
+{
+    SInt64 timeInFrames = (SInt64)floor([self frameHeardAtHostTime:[self liveHostTime]]);
+    return AudioStreamGetScheduledSpectrum([self streamForChannelID:channelID], scheduleID, timeInFrames, result);
+}
+
+- (double)sampleBytesCopiedPerFrame
+{
+    UInt64 numFramesAdded = self->processedAudioData.numFramesAdded;
+    return numFramesAdded > 0 ? (double)self->processedAudioData.numSampleBytesCopied / numFramesAdded : 0;
+}
+
+- (CGFloat)fractionOfFramesAnalysed
+{
+    UInt64 numFramesProduced = 0, numFramesComputed = 0;
+    for (UInt32 i=0;i<self->processedAudioData.numChannels;i++)
+    {
+        numFramesProduced += self->processedAudioData.channels[i].numFramesProduced;
+        numFramesComputed += atomic_load_explicit(&self->processedAudioData.channels[i].numFramesComputed, memory_order_relaxed);
+    }
+    return numFramesProduced > 0 ? (CGFloat)numFramesComputed / numFramesProduced : 0;
 }
 
 - (NSString *)description
@@ -622,6 +1948,26 @@ uint64_t starttime = 0;
     return self->processedAudioData.currentlyPlayingFrame;
 }
 
+- (Float64)playbackRate
+{
+    return atomic_load_explicit(&playbackRate, memory_order_relaxed);
+}
+
+- (void)setPlaybackRate:(Float64)rate
+{
+    atomic_store_explicit(&playbackRate, MIN(MAX(rate, PHASE_VOCODER_MIN_RATE), PHASE_VOCODER_MAX_RATE), memory_order_relaxed);
+}
+
+- (Float64)playbackPitch
+{
+    return atomic_load_explicit(&playbackPitch, memory_order_relaxed);
+}
+
+- (void)setPlaybackPitch:(Float64)pitch
+{
+    atomic_store_explicit(&playbackPitch, MIN(MAX(pitch, -PHASE_VOCODER_MAX_PITCH), PHASE_VOCODER_MAX_PITCH), memory_order_relaxed);
+}
+
 - (void)setFftOverlapJumpSize:(UInt32)fftOverlapJumpSize
 {
     self->processedAudioData.fftOverlapJumpSize = fftOverlapJumpSize;
@@ -651,33 +1997,39 @@ uint64_t starttime = 0;
     return AudioSupplyMode_Regular;
 }
 
-SInt64 mach_to_sampleTime(UInt64 machTime)
+SInt64 mach_to_sampleTime(UInt64 machTime, Float64 sampleRate)
 {
     mach_timebase_info_data_t timeBaseInfo;
     mach_timebase_info(&timeBaseInfo);
     double miliseconds = machToMiliseconds(machTime-starttime);
-    SInt64 sampleTime = miliseconds / 1000.0 * 44100.0;
+    SInt64 sampleTime = miliseconds / 1000.0 * sampleRate;
     return sampleTime;
 }
 
 - (void)clearBuffers
 {
-    dispatch_barrier_sync(self.synchronizationQueue, ^
-    {
-        TPCircularBufferClear(&toPlayBuffer);
-        TPCircularBufferClear(&toProcessBuffer);
-        TPCircularBufferClear(&self->processedAudioData.channel1.samples.circularBuffer);
-        TPCircularBufferClear(&self->processedAudioData.channel1.fftResults.circularBuffer);
-        TPCircularBufferClear(&self->processedAudioData.channel2.samples.circularBuffer);
-        TPCircularBufferClear(&self->processedAudioData.channel2.fftResults.circularBuffer);
-        TPCircularBufferClear(&self->processedAudioData.extractedChannel.samples.circularBuffer);
-        TPCircularBufferClear(&self->processedAudioData.extractedChannel.fftResults.circularBuffer);
-    });
+    // Readers don't take any lock; clearing bumps the streams' generations so that
+    // anyone still holding pointers into them can tell their data is gone.
+    // The render thread may be playing from the play rings, so it's left to clear them (see ApplyPlayRingsClear)
+    for (UInt32 i=0;i<numPlayBuffers;i++) playRingsClearHeads[i] = TPSPSCCircularBufferHeadIndex(&toPlayBuffers[i]);
+    playbackSpansClearHead = TPSPSCCircularBufferHeadIndex(&playbackSpans);
+    atomic_fetch_add_explicit(&numPlayRingsClearsRequested, 1, memory_order_release);
+    TPCircularBufferClear(&toProcessBuffer);
+    
+    // The vocoder starts over from what comes next, and only if it's still needed
+    PhaseVocoderReset(&vocoder);
+    isStretching = NO;
+    for (UInt32 i=0;i<self->processedAudioData.numChannels;i++)
+        AudioStreamClear(&self->processedAudioData.channels[i]);
+    AudioStreamClear(&self->processedAudioData.extractedChannel);
 }
 
 - (float *)readSamplesFromFile:(UInt32)numSamplesToRead numSamplesRead:(UInt32 *)numSamplesRead
 {
     if (numSamplesToRead <= 0) numSamplesToRead = self.isStereo ? CHUNK_SIZE * 4 * 2 : CHUNK_SIZE * 4;
+    UInt32 numChannels = self->processedAudioData.numChannels;
+    numSamplesToRead -= numSamplesToRead % numChannels; // whole frames, so positions stay exact
+    
     if (currentBlockOffset >= currentBlockSize)
     {
         if (currentBlockRef)
@@ -686,7 +2038,12 @@ SInt64 mach_to_sampleTime(UInt64 machTime)
             currentBlockRef = NULL;
         }
         
-        if (self.assetReader.status == AVAssetReaderStatusReading)
+        if (firstBlockRef)
+        {
+            currentBlockRef = firstBlockRef;
+            firstBlockRef = NULL;
+        }
+        else if (self.assetReader.status == AVAssetReaderStatusReading)
             currentBlockRef = [self.samplesReader copyNextSampleBuffer];
         
         assetReaderStatus = self.assetReader.status;
@@ -720,15 +2077,83 @@ SInt64 mach_to_sampleTime(UInt64 machTime)
         
         currentBlockSize = numBytesRead / sizeof(float);
         currentBlockOffset = 0;
+        
+        // The decoder may start a bit before where it was asked to (or where an index point took it).
+        // Whatever comes before the frame we're after is dropped. Index points are kept at the rings' rate,
+        // like every other position
+        CMTime presentationTime = CMSampleBufferGetPresentationTimeStamp(currentBlockRef);
+        if (CMTIME_IS_NUMERIC(presentationTime))
+        {
+            SInt64 bufferFrame = CMTimeConvertScale(presentationTime, (int32_t)resampler.inputRate, kCMTimeRoundingMethod_RoundHalfAwayFromZero).value;
+            AudioSeekCacheAddIndexPoint(&seekCache, CMTimeConvertScale(presentationTime, (int32_t)resampler.outputRate, kCMTimeRoundingMethod_RoundHalfAwayFromZero).value);
+            if (bufferFrame < nextSourceFrame)
+                currentBlockOffset = (UInt32)MIN((nextSourceFrame - bufferFrame) * numChannels, (SInt64)currentBlockSize);
+            else if (!AudioResamplerIsConverting(&resampler))
+                nextDecodedFrame = nextSourceFrame = bufferFrame;
+        }
     }
     
     float *data = currentBlock + currentBlockOffset;
     *numSamplesRead = MIN(numSamplesToRead,(UInt32)(currentBlockSize - currentBlockOffset));
     currentBlockOffset+= *numSamplesRead;
+    
+    nextSourceFrame += *numSamplesRead / numChannels;
     return data;
 
 }
 
+// The next samples of the track being read, at its own rate: up to maxFrames frames from our own decoder
+// if there's one open, or the asset reader. NULL at the end of the track
+- (const float *)readSourceSamples:(UInt32)maxFrames numFramesRead:(UInt32 *)numFramesRead
+{
+    if (AudioDecoderIsOpen(&decoder))
+    {
+        const float *samples = AudioDecoderReadBlock(&decoder, maxFrames, numFramesRead);
+        if (!samples) assetReaderStatus = AVAssetReaderStatusCompleted;
+        nextSourceFrame += *numFramesRead;
+        return samples;
+    }
+    
+    UInt32 numChannels = self->processedAudioData.numChannels;
+    UInt32 numSamplesRead = 0;
+    float *samples = [self readSamplesFromFile:maxFrames * numChannels numSamplesRead:&numSamplesRead];
+    *numFramesRead = numSamplesRead / numChannels;
+    return samples;
+}
+
+// Decodes up to numSamplesToRead samples, at the rings' rate, into buffer (the head of the toProcess ring),
+// and returns how many it did (0 at the end of the track). A track at another rate goes through the resampler
+// on the way; one that isn't is copied straight in, or, from our own decoders, decoded right there.
+- (UInt32)decodeSamples:(UInt32)numSamplesToRead intoBuffer:(float *)buffer
+{
+    UInt32 numChannels = self->processedAudioData.numChannels;
+    UInt32 numFramesToWrite = numSamplesToRead / numChannels;
+    UInt32 numFramesWritten = 0;
+    
+    if (AudioDecoderIsOpen(&decoder) && !AudioResamplerIsConverting(&resampler))
+    {
+        numFramesWritten = AudioDecoderReadInto(&decoder, buffer, numFramesToWrite);
+        if (numFramesWritten == 0) assetReaderStatus = AVAssetReaderStatusCompleted;
+        nextSourceFrame += numFramesWritten;
+    }
+    else
+    {
+        // The resampler holds on to the last few frames until it knows what comes after them
+        UInt32 numSourceFrames = 0;
+        const float *samples = [self readSourceSamples:AudioResamplerMaxInputFrames(&resampler, numFramesToWrite) numFramesRead:&numSourceFrames];
+        if (samples)
+            numFramesWritten = AudioResamplerProcess(&resampler, samples, numSourceFrames, buffer);
+        else if (assetReaderStatus == AVAssetReaderStatusCompleted)
+            numFramesWritten = AudioResamplerFlush(&resampler, buffer);
+    }
+    if (numFramesWritten == 0) return 0;
+    
+    AudioSeekCacheAddDecodedAudio(&seekCache, nextDecodedFrame, buffer, numFramesWritten);
+    processedAudioData.numSampleBytesCopied += 2 * numFramesWritten * numChannels * sizeof(float); // into the ring, and kept
+    nextDecodedFrame += numFramesWritten;
+    return numFramesWritten * numChannels;
+}
+
 - (void)setReverbDecayTime:(CGFloat)reverbDecayTime
 {
     if (!reverb) return;
@@ -770,7 +2195,7 @@ SInt64 mach_to_sampleTime(UInt64 machTime)
 
 - (BOOL)canPlay
 {
-    return self.samplesReader && self.assetReader && self.URL;
+    return ((self.samplesReader && self.assetReader) || AudioDecoderIsOpen(&decoder)) && self.URL;
 }
 
 -(AEAudioControllerRenderCallback)renderCallback
@@ -780,17 +2205,28 @@ SInt64 mach_to_sampleTime(UInt64 machTime)
 
 -(void)dealloc
 {
-    if (self->processedAudioData.channel1.samples.circularBuffer.buffer)
-    {
-        TPCircularBufferCleanup(&self->processedAudioData.channel1.samples.circularBuffer);
-        TPCircularBufferCleanup(&self->processedAudioData.channel1.fftResults.circularBuffer);
-        TPCircularBufferCleanup(&self->processedAudioData.channel2.samples.circularBuffer);
-        TPCircularBufferCleanup(&self->processedAudioData.channel2.fftResults.circularBuffer);
-    }
+    AudioPipelineCleanup(&self->pipeline);
+    CircularAudioStorageCleanup(&self->processedAudioData);
+    for (UInt32 i=0;i<numSpectrumBroadcasts;i++) SpectrumBroadcastRingCleanup(&spectrumBroadcasts[i]);
+    for (UInt32 i=0;i<numSpectrogramHistories;i++) SpectrogramHistoryCleanup(&spectrogramHistories[i]);
+    SpectrogramCacheClose(&spectrogramCache);
+    SpectrogramCacheClose(&retiredSpectrogramCache);
+    AudioSeekCacheCleanup(&seekCache);
+    AudioDecoderClose(&decoder);
+    AudioDecoderClose(&prefetchedDecoder);
+    AudioResamplerCleanup(&resampler);
+    if (prefetchedBlockRef) CFRelease(prefetchedBlockRef);
+    if (firstBlockRef) CFRelease(firstBlockRef);
+    AudioMemoryBudgetRelease(AudioMemoryBudgetShared(), memoryPlan.liveBytes + historyBytesReserved + seekCacheBytesReserved);
     if ([self.audioController.channels containsObject:self])
     {
         [self.audioController removeChannels:@[self]];
     }
+    for (UInt32 i=0;i<numPlayBuffers;i++) TPSPSCCircularBufferCleanup(&toPlayBuffers[i]);
+    free(toPlayBuffers);
+    TPSPSCCircularBufferCleanup(&playbackSpans);
+    PhaseVocoderCleanup(&vocoder);
+    TPCircularBufferCleanup(&toProcessBuffer);
 }
 
 @end
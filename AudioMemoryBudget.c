@@ -0,0 +1,111 @@
+//
+//  AudioMemoryBudget.c
+//  Equalizer
+//
+
+#include "AudioMemoryBudget.h"
+#include "SpectrogramHistory.h"
+#include <unistd.h>
+
+static size_t RoundToPage(size_t bytes)
+{
+    size_t pageSize = (size_t)getpagesize();
+    return (bytes + pageSize - 1) / pageSize * pageSize;
+}
+
+static UInt32 RoundToPowerOfTwo(UInt32 value)
+{
+    UInt32 rounded = 1;
+    while (rounded < value) rounded <<= 1;
+    return rounded;
+}
+
+AudioMemoryBudget *AudioMemoryBudgetShared(void)
+{
+    static AudioMemoryBudget budget = { AUDIO_MEMORY_DEFAULT_LIMIT, AUDIO_MEMORY_DEFAULT_HISTORY_SECONDS, 0 };
+    return &budget;
+}
+
+// Only affects streams created (or history configured) afterwards
+void AudioMemoryBudgetConfigure(AudioMemoryBudget *budget, size_t limitInBytes, Float64 historySeconds)
+{
+    budget->limitInBytes = limitInBytes;
+    budget->historySeconds = historySeconds > 0 ? historySeconds : 0;
+}
+
+void AudioMemoryBudgetPlanStream(AudioStreamMemoryPlan *plan, UInt32 numChannels, UInt32 chunkSize, UInt32 liveChunks, UInt32 jumpSize, UInt32 numBroadcastChannels, Boolean hasTransportRings)
+{
+    const size_t frameBytes = chunkSize * sizeof(float);
+    if (jumpSize == 0) jumpSize = chunkSize;
+
+    plan->numChannels = numChannels;
+    plan->chunkSize = chunkSize;
+
+    // The FFT ring covers the same stretch of time as the samples ring: one frame per jump
+    plan->samplesRingBytes = (UInt32)RoundToPage(liveChunks * frameBytes);
+    UInt32 numFrames = plan->samplesRingBytes / sizeof(float) / jumpSize;
+    plan->fftResultsRingBytes = (UInt32)RoundToPage(numFrames * frameBytes);
+    plan->broadcastFrames = RoundToPowerOfTwo(numFrames);
+    plan->numBroadcastChannels = numBroadcastChannels;
+
+    // Play as far ahead as the analysis looks ahead. Processing needs a chunk of every channel
+    // plus whatever the decoder hands over in one go
+    plan->playRingBytes = hasTransportRings ? (UInt32)RoundToPage((size_t)liveChunks * frameBytes) : 0;
+    plan->processRingBytes = hasTransportRings ? (UInt32)RoundToPage((size_t)AUDIO_MEMORY_PROCESS_CHUNKS * numChannels * frameBytes) : 0;
+
+    // + 1 for the extracted channel, which has rings but no broadcast
+    size_t broadcastBytes = (size_t)plan->broadcastFrames * (frameBytes + sizeof(SInt64) + sizeof(UInt64));
+    plan->liveBytes = (size_t)(numChannels + 1) * (plan->samplesRingBytes + plan->fftResultsRingBytes) +
+                      numBroadcastChannels * broadcastBytes +
+                      (size_t)numChannels * plan->playRingBytes + plan->processRingBytes;
+}
+
+Boolean AudioMemoryBudgetReserve(AudioMemoryBudget *budget, size_t bytes)
+{
+    size_t reserved = atomic_fetch_add_explicit(&budget->bytesReserved, bytes, memory_order_relaxed) + bytes;
+    return reserved <= budget->limitInBytes;
+}
+
+UInt32 AudioMemoryBudgetReserveHistory(AudioMemoryBudget *budget, UInt32 numChannels, UInt32 chunkSize, UInt32 requestedFrames)
+{
+    size_t bytesPerFrame = AudioMemoryHistoryBytes(numChannels, chunkSize, 1);
+    size_t reserved = atomic_load_explicit(&budget->bytesReserved, memory_order_relaxed);
+
+    while (true)
+    {
+        size_t available = reserved < budget->limitInBytes ? budget->limitInBytes - reserved : 0;
+        UInt32 numFrames = available / bytesPerFrame < requestedFrames ? (UInt32)(available / bytesPerFrame) : requestedFrames;
+        if (numFrames == 0) return 0;
+
+        if (atomic_compare_exchange_weak_explicit(&budget->bytesReserved, &reserved, reserved + numFrames * bytesPerFrame,
+                                                  memory_order_relaxed, memory_order_relaxed))
+            return numFrames;
+    }
+}
+
+void AudioMemoryBudgetRelease(AudioMemoryBudget *budget, size_t bytes)
+{
+    atomic_fetch_sub_explicit(&budget->bytesReserved, bytes, memory_order_relaxed);
+}
+
+size_t AudioMemoryBudgetBytesAvailable(AudioMemoryBudget *budget)
+{
+    size_t reserved = atomic_load_explicit(&budget->bytesReserved, memory_order_relaxed);
+    return reserved < budget->limitInBytes ? budget->limitInBytes - reserved : 0;
+}
+
+size_t AudioMemoryHistoryBytes(UInt32 numChannels, UInt32 chunkSize, UInt32 numFrames)
+{
+    // a record and its slot tag per frame
+    return (size_t)numChannels * numFrames * (SpectrogramHistoryRecordSize(chunkSize) + sizeof(SInt64));
+}
+
+void AudioStreamMemoryUsageAdd(AudioStreamMemoryUsage *usage, const AudioStreamMemoryUsage *other)
+{
+    usage->samplesBytes += other->samplesBytes;
+    usage->fftResultsBytes += other->fftResultsBytes;
+    usage->broadcastBytes += other->broadcastBytes;
+    usage->transportBytes += other->transportBytes;
+    usage->historyBytes += other->historyBytes;
+    usage->totalBytes += other->totalBytes;
+}
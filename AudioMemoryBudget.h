@@ -0,0 +1,83 @@
+//
+//  AudioMemoryBudget.h
+//  Equalizer
+//
+
+// One place that decides how big every analysis ring is.
+//
+// The budget is per process: a byte limit shared by all the streams, and how many seconds of
+// spectrogram history each stream should keep. Streams plan their live rings from a number of
+// chunks of lookahead and their FFT jump size, and reserve the bytes. The live rings are always
+// reserved, since a stream can't work without them. History is what gives way: a stream gets as
+// much of the history it asked for as still fits, possibly none.
+
+#include <stdatomic.h>
+#include <stddef.h>
+#include <MacTypes.h>
+
+#define AUDIO_MEMORY_DEFAULT_LIMIT (64 * 1024 * 1024)
+#define AUDIO_MEMORY_DEFAULT_HISTORY_SECONDS 30.0
+
+// Lookahead of each kind of stream, in chunks per channel. Input has nothing ahead, so it's how far back
+// it keeps: about 3 seconds at 44.1 kHz
+#define AUDIO_MEMORY_FILE_LIVE_CHUNKS 16
+#define AUDIO_MEMORY_INPUT_LIVE_CHUNKS 64
+
+// The decoded audio waiting to be processed, in chunks (of all channels). Room for a read on top of
+// the chunks the analysis pipeline has in flight, which stay in the ring until every stage is done with them
+#define AUDIO_MEMORY_PROCESS_CHUNKS 8
+
+typedef struct AudioMemoryBudget
+{
+    size_t limitInBytes;
+    Float64 historySeconds;
+    _Atomic size_t bytesReserved;
+} AudioMemoryBudget;
+
+// Ring sizes for one stream. Byte sizes are rounded up to whole pages, like the rings round them.
+typedef struct AudioStreamMemoryPlan
+{
+    UInt32 numChannels;
+    UInt32 chunkSize;
+    UInt32 samplesRingBytes;        // per channel
+    UInt32 fftResultsRingBytes;     // per channel
+    UInt32 broadcastFrames;         // per broadcasting channel
+    UInt32 numBroadcastChannels;
+    UInt32 playRingBytes;           // per channel, 0 if the stream doesn't play
+    UInt32 processRingBytes;        // interleaved, 0 if the stream doesn't decode
+    size_t liveBytes;               // everything above, for all the channels
+} AudioStreamMemoryPlan;
+
+// What a stream actually has allocated right now
+typedef struct AudioStreamMemoryUsage
+{
+    size_t samplesBytes;
+    size_t fftResultsBytes;
+    size_t broadcastBytes;
+    size_t transportBytes;          // play and process rings
+    size_t historyBytes;            // in memory only; the file tier isn't counted
+    size_t totalBytes;
+} AudioStreamMemoryUsage;
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+AudioMemoryBudget *AudioMemoryBudgetShared(void);
+void AudioMemoryBudgetConfigure(AudioMemoryBudget *budget, size_t limitInBytes, Float64 historySeconds);
+
+void AudioMemoryBudgetPlanStream(AudioStreamMemoryPlan *plan, UInt32 numChannels, UInt32 chunkSize, UInt32 liveChunks, UInt32 jumpSize, UInt32 numBroadcastChannels, Boolean hasTransportRings);
+
+// Returns false if the reservation took the budget over its limit (it's made anyway)
+Boolean AudioMemoryBudgetReserve(AudioMemoryBudget *budget, size_t bytes);
+// Reserves up to requestedFrames of history for each of numChannels channels. Returns the frames granted
+UInt32 AudioMemoryBudgetReserveHistory(AudioMemoryBudget *budget, UInt32 numChannels, UInt32 chunkSize, UInt32 requestedFrames);
+void AudioMemoryBudgetRelease(AudioMemoryBudget *budget, size_t bytes);
+size_t AudioMemoryBudgetBytesAvailable(AudioMemoryBudget *budget);
+
+size_t AudioMemoryHistoryBytes(UInt32 numChannels, UInt32 chunkSize, UInt32 numFrames);
+void AudioStreamMemoryUsageAdd(AudioStreamMemoryUsage *usage, const AudioStreamMemoryUsage *other);
+
+#if defined __cplusplus
+};
+#endif
@@ -12,8 +12,10 @@
 @interface AudioMixer : NSObject <LiveAudioSupplier>
 
 @property CGFloat fadeInOutTime;
-@property SInt32 memoryLimit;
+@property SInt32 memoryLimit; // in samples per channel
 @property(readonly) SInt32 chunksMemoryLimit;
+@property UInt32 fftOverlapJumpSize; // of the suppliers, to know how many FFT frames memoryLimit samples span
+@property(readonly) AudioStreamMemoryUsage memoryUsage;
 @property NSMutableArray *channels;
 @property(nonatomic) NSArray *activeChannels;
 
@@ -39,6 +41,7 @@
 @property CGFloat totalFadeTimeInSeconds;
 
 - (id)initWithAudioSupplier:(id<LiveAudioSupplier>)audioSupplier;
+- (void)pollAudioSupplier; // refreshes liveAudioData from the supplier
 - (void)startFadingInWithDuration:(CGFloat)fadeTimeInSeconds;
 - (void)startFadingOutWithDuration:(CGFloat)fadeTimeInSeconds;
 - (void)update;
@@ -11,18 +11,20 @@
 @implementation AudioMixer
 {
     LiveAudioData mixedAudioData;
-    float *mixedFFTResults1;
-    float *mixedSamples1;
-    float *mixedFFTResults2;
-    float *mixedSamples2;
+    float *mixedFFTResults[MAX_AUDIO_CHANNELS];
+    float *mixedSamples[MAX_AUDIO_CHANNELS];
+    size_t bytesReserved;
 }
 
 @synthesize memoryLimit = _memoryLimit;
+@synthesize fftOverlapJumpSize = _fftOverlapJumpSize;
 
 - (id)init
 {
     self.channels = [[NSMutableArray alloc] init];
     
+    mixedAudioData.numChannels = 2;
+    _fftOverlapJumpSize = 512;
     self.memoryLimit = 2048;
     self.fadeInOutTime = 0.3f;
     
@@ -53,15 +55,24 @@
 {
     [self cleanup];
     
+    // Ask every supplier for its data once; everything below works on these copies
+    for (AudioMixerChannel *channel in self.channels)
+    {
+        [channel pollAudioSupplier];
+    }
+    
     /*if (self.activeChannels.count == 1)
     {
         return ((AudioMixerChannel *)self.activeChannels.firstObject).liveAudioData;
     }*/
 
-    mixedAudioData.channel1.fftResults.numChunksAvailable = [self numChunksAvailableForChannelID:1];
-    mixedAudioData.channel1.samples.numSamplesAvailable = [self numSamplesAvailableForChannelID:1];
-    mixedAudioData.channel2.fftResults.numChunksAvailable = [self numChunksAvailableForChannelID:2];
-    mixedAudioData.channel2.samples.numSamplesAvailable = [self numSamplesAvailableForChannelID:2];
+    // The mix has as many channels as the widest supplier. Narrower suppliers repeat their last channel
+    mixedAudioData.numChannels = [self numChannelsToMix];
+    for (UInt32 i=0;i<mixedAudioData.numChannels;i++)
+    {
+        mixedAudioData.channels[i].fftResults.numChunksAvailable = [self numChunksAvailableForChannelID:i+1];
+        mixedAudioData.channels[i].samples.numSamplesAvailable = [self numSamplesAvailableForChannelID:i+1];
+    }
     
     LiveAudioDataEmpty(&mixedAudioData);
     for (AudioMixerChannel *channel in self.channels)
@@ -71,51 +82,69 @@
         
         LiveAudioData audioData = channel.liveAudioData;
         mixedAudioData.timeInFrames = audioData.timeInFrames != 0 ? audioData.timeInFrames : mixedAudioData.timeInFrames;
-        mixedAudioData.channel1.containsData |= audioData.channel1.containsData;
-        mixedAudioData.channel2.containsData |= audioData.channel2.containsData;
+        mixedAudioData.sampleRate = audioData.sampleRate != 0 ? audioData.sampleRate : mixedAudioData.sampleRate;
         
-        [self mixSamples:audioData.channel1.samples forChannel:1 withVolume:channel.volume];
-        [self mixFFTResults:audioData.channel1.fftResults forChannel:1 withVolume:channel.volume];
-        [self mixSamples:audioData.channel2.samples forChannel:2 withVolume:channel.volume];
-        [self mixFFTResults:audioData.channel2.fftResults forChannel:2 withVolume:channel.volume];
+        for (UInt32 i=0;i<mixedAudioData.numChannels;i++)
+        {
+            LiveAudioChannelData channelData = LiveAudioDataChannel(&audioData, i);
+            mixedAudioData.channels[i].containsData |= channelData.containsData;
+            
+            [self mixSamples:channelData.samples forChannel:i+1 withVolume:channel.volume];
+            [self mixFFTResults:channelData.fftResults forChannel:i+1 withVolume:channel.volume];
+        }
     }
     
+    mixedAudioData.channel1 = LiveAudioDataChannel(&mixedAudioData, 0);
+    mixedAudioData.channel2 = LiveAudioDataChannel(&mixedAudioData, 1);
+    
     return mixedAudioData;
 }
 
+- (UInt32)numChannelsToMix
+{
+    UInt32 numChannels = 2;
+    for (AudioMixerChannel *channel in self.channels)
+    {
+        if (!channel.isActive) continue;
+        numChannels = MAX(numChannels, MIN(channel.liveAudioData.numChannels, MAX_AUDIO_CHANNELS));
+    }
+    
+    return numChannels;
+}
+
 - (void)mixSamples:(LiveSamples)samples1 forChannel:(SInt32)channelID withVolume:(float)volume
 {
-    UInt64 numSamples = channelID == 1 ? mixedAudioData.channel1.samples.numSamplesAvailable : mixedAudioData.channel2.samples.numSamplesAvailable;
+    LiveSamples *mixedChannelSamples = &mixedAudioData.channels[channelID - 1].samples;
+    UInt64 numSamples = mixedChannelSamples->numSamplesAvailable;
     
     if (numSamples > samples1.numSamplesAvailable || numSamples > self.memoryLimit)
         numSamples = MIN(self.memoryLimit,samples1.numSamplesAvailable);
     
     float modifiedSamples[numSamples];
     AmplitudeFactor(samples1.data, numSamples, volume, modifiedSamples);
-    float *mixed = channelID == 1 ? mixedSamples1 : mixedSamples2;
+    float *mixed = mixedSamples[channelID - 1];
     Mix(modifiedSamples, mixed, mixed, numSamples);
-    if (channelID == 1) mixedAudioData.channel1.samples.numSamplesAvailable = numSamples;
-    else if (channelID == 2) mixedAudioData.channel2.samples.numSamplesAvailable = numSamples;
+    mixedChannelSamples->numSamplesAvailable = numSamples;
 
 }
 
 - (void)mixFFTResults:(LiveFFTResults)fftResults1 forChannel:(SInt32)channelID withVolume:(float)volume
 {
-    UInt64 numChunks = channelID == 1 ? mixedAudioData.channel1.fftResults.numChunksAvailable : mixedAudioData.channel2.fftResults.numChunksAvailable;
+    LiveFFTResults *mixedChannelFFTResults = &mixedAudioData.channels[channelID - 1].fftResults;
+    UInt64 numChunks = mixedChannelFFTResults->numChunksAvailable;
     
     if (numChunks > fftResults1.numChunksAvailable || numChunks > self.chunksMemoryLimit)
         numChunks = MIN(self.chunksMemoryLimit,fftResults1.numChunksAvailable);
     
-    float (*mixedFFTResults)[CHUNK_SIZE] = channelID == 1 ? (float (*)[CHUNK_SIZE])mixedFFTResults1 : (float (*)[CHUNK_SIZE])mixedFFTResults2;
+    float (*mixedFFTResultsData)[CHUNK_SIZE] = (float (*)[CHUNK_SIZE])mixedFFTResults[channelID - 1];
     float (*fftResultsData)[CHUNK_SIZE] = (float (*)[CHUNK_SIZE])fftResults1.data;
     for (int i=0;i<numChunks;i++)
     {
         float modifiedChunk[CHUNK_SIZE];
         AmplitudeFactor(fftResultsData[i], CHUNK_SIZE, volume, modifiedChunk);
-        Mix(mixedFFTResults[i], modifiedChunk, mixedFFTResults[i], CHUNK_SIZE);
+        Mix(mixedFFTResultsData[i], modifiedChunk, mixedFFTResultsData[i], CHUNK_SIZE);
     }
-    if (channelID == 1) mixedAudioData.channel1.fftResults.numChunksAvailable = numChunks;
-    else if (channelID == 2) mixedAudioData.channel2.fftResults.numChunksAvailable = numChunks;
+    mixedChannelFFTResults->numChunksAvailable = numChunks;
 }
 
 -(SInt64)numChunksAvailableForChannelID:(UInt32)channelID
@@ -126,7 +155,7 @@
         if (!channel.isActive) continue;
         
         LiveAudioData audioData = channel.liveAudioData;
-        SInt64 numChunksAvailable = channelID == 1 ? audioData.channel1.fftResults.numChunksAvailable : audioData.channel2.fftResults.numChunksAvailable;
+        SInt64 numChunksAvailable = LiveAudioDataChannel(&audioData, channelID - 1).fftResults.numChunksAvailable;
         if (numChunksAvailable > self.chunksMemoryLimit) numChunksAvailable = self.chunksMemoryLimit;
         if (min == 0 || numChunksAvailable < min) min = numChunksAvailable;
     }
@@ -142,7 +171,7 @@
         if (!channel.isActive) continue;
         
         LiveAudioData audioData = channel.liveAudioData;
-        SInt64 numSamplesAvailable = channelID == 1 ? audioData.channel1.samples.numSamplesAvailable : audioData.channel2.samples.numSamplesAvailable;
+        SInt64 numSamplesAvailable = LiveAudioDataChannel(&audioData, channelID - 1).samples.numSamplesAvailable;
         if (numSamplesAvailable > self.memoryLimit) numSamplesAvailable = self.memoryLimit;
         if (min == 0 || numSamplesAvailable < min) min = numSamplesAvailable;
     }
@@ -186,20 +215,46 @@
     SInt32 storedSamples = memoryLimit;
     SInt32 storedChunks = self.chunksMemoryLimit;
     
-    mixedFFTResults1 = realloc(mixedFFTResults1, sizeof(float[storedChunks][CHUNK_SIZE]));
-    mixedSamples1 = realloc(mixedSamples1, sizeof(float[storedSamples]));
-    mixedFFTResults2 = realloc(mixedFFTResults2, sizeof(float[storedChunks][CHUNK_SIZE]));
-    mixedSamples2 = realloc(mixedSamples2, sizeof(float[storedSamples]));
+    AudioMemoryBudget *budget = AudioMemoryBudgetShared();
+    AudioMemoryBudgetRelease(budget, bytesReserved);
+    bytesReserved = MAX_AUDIO_CHANNELS * (sizeof(float[storedChunks][CHUNK_SIZE]) + sizeof(float[storedSamples]));
+    if (!AudioMemoryBudgetReserve(budget, bytesReserved))
+        NSLog(@"AudioMixer's buffers take the process over its audio memory budget");
     
-    mixedAudioData.channel1.fftResults.data = mixedFFTResults1;
-    mixedAudioData.channel1.samples.data = mixedSamples1;
-    mixedAudioData.channel2.fftResults.data = mixedFFTResults2;
-    mixedAudioData.channel2.samples.data = mixedSamples2;
+    for (int i=0;i<MAX_AUDIO_CHANNELS;i++)
+    {
+        mixedFFTResults[i] = realloc(mixedFFTResults[i], sizeof(float[storedChunks][CHUNK_SIZE]));
+        mixedSamples[i] = realloc(mixedSamples[i], sizeof(float[storedSamples]));
+        
+        mixedAudioData.channels[i].fftResults.data = mixedFFTResults[i];
+        mixedAudioData.channels[i].samples.data = mixedSamples[i];
+    }
 }
 
+// The FFT frames whose windows end within the last memoryLimit samples
 - (SInt32)chunksMemoryLimit
 {
-    return self.memoryLimit / 400;
+    return self.memoryLimit / (SInt32)self.fftOverlapJumpSize + 1;
+}
+
+- (UInt32)fftOverlapJumpSize
+{
+    return _fftOverlapJumpSize;
+}
+
+- (void)setFftOverlapJumpSize:(UInt32)fftOverlapJumpSize
+{
+    _fftOverlapJumpSize = MAX(fftOverlapJumpSize, 1);
+    self.memoryLimit = self.memoryLimit; // resizes the FFT buffers
+}
+
+- (AudioStreamMemoryUsage)memoryUsage
+{
+    AudioStreamMemoryUsage usage = {0};
+    usage.samplesBytes = MAX_AUDIO_CHANNELS * sizeof(float) * self.memoryLimit;
+    usage.fftResultsBytes = MAX_AUDIO_CHANNELS * sizeof(float[CHUNK_SIZE]) * self.chunksMemoryLimit;
+    usage.totalBytes = usage.samplesBytes + usage.fftResultsBytes;
+    return usage;
 }
 
 - (void)cleanup
@@ -214,10 +269,12 @@
 
 - (void)dealloc
 {
-    free(mixedFFTResults1);
-    free(mixedSamples1);
-    free(mixedFFTResults2);
-    free(mixedSamples2);
+    AudioMemoryBudgetRelease(AudioMemoryBudgetShared(), bytesReserved);
+    for (int i=0;i<MAX_AUDIO_CHANNELS;i++)
+    {
+        free(mixedFFTResults[i]);
+        free(mixedSamples[i]);
+    }
 }
 
 /*- (LiveAudioData)liveAudioData
@@ -285,7 +342,7 @@
     }
 }
 
-- (LiveAudioData)liveAudioData
+- (void)pollAudioSupplier
 {
     LiveAudioData audioData = self.audioSupplier.liveAudioData;
     //if (self.audioSupplier.audioSupplyMode == AudioSupplyMode_Regular && audioData.channel1.fftResults.numChunksAvailable > 0)
@@ -293,13 +350,16 @@
     {
         _liveAudioData = audioData;
     }
-    
+}
+
+- (LiveAudioData)liveAudioData
+{
     return _liveAudioData;
 }
 
 - (BOOL)isActive
 {
-    return self.liveAudioData.channel1.containsData;
+    return _liveAudioData.channel1.containsData;
     //return (self.isFadingIn || self.isFadingOut || self.audioSupplier.audioSupplyMode == AudioSupplyMode_Regular) && self.liveAudioData.channel1.containsData;
 }
 
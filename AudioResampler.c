@@ -0,0 +1,258 @@
+//
+//  AudioResampler.c
+//  Equalizer
+//
+
+#include "AudioResampler.h"
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __APPLE__
+#include <Accelerate/Accelerate.h>
+#endif
+
+#define AUDIO_RESAMPLER_PASSBAND 0.95   // of the lower Nyquist, leaving the rest for the filter to roll off
+
+// vDSP where there is one: the batch analyser builds this elsewhere too
+static inline void ScaleTaps(float *taps, float scale, UInt32 numTaps)
+{
+#ifdef __APPLE__
+    vDSP_vsmul(taps, 1, &scale, taps, 1, numTaps);
+#else
+    for (UInt32 j=0;j<numTaps;j++) taps[j] *= scale;
+#endif
+}
+
+static inline void DotProduct(const float *samples, const float *taps, float *result, UInt32 numTaps)
+{
+#ifdef __APPLE__
+    vDSP_dotpr(samples, 1, taps, 1, result, numTaps);
+#else
+    float sum = 0;
+    for (UInt32 j=0;j<numTaps;j++) sum += samples[j] * taps[j];
+    *result = sum;
+#endif
+}
+
+static UInt64 GreatestCommonDivisor(UInt64 a, UInt64 b)
+{
+    while (b != 0)
+    {
+        UInt64 remainder = a % b;
+        a = b;
+        b = remainder;
+    }
+    return a;
+}
+
+// Blackman-windowed sinc, one filter per phase. Tap j of phase f weighs the input frame j - (halfTaps - 1)
+// frames from the output's, which sits f / numPhases of a frame after it
+static void ComputeFilters(AudioResampler *resampler, double cutoff)
+{
+    UInt32 numTaps = 2 * resampler->halfTaps;
+    for (UInt32 f=0;f<resampler->numPhases;f++)
+    {
+        float *filter = resampler->filters + (size_t)f * numTaps;
+        double sum = 0;
+        for (UInt32 j=0;j<numTaps;j++)
+        {
+            double t = (double)j - (resampler->halfTaps - 1) - (double)f / resampler->numPhases;
+            double x = M_PI * cutoff * t;
+            double sinc = x == 0 ? 1.0 : sin(x) / x;
+            double window = 0.42 + 0.5 * cos(M_PI * t / resampler->halfTaps) + 0.08 * cos(2 * M_PI * t / resampler->halfTaps);
+            filter[j] = (float)(sinc * window);
+            sum += filter[j];
+        }
+
+        // unity gain at DC for every phase, so a constant stays constant
+        float scale = (float)(1.0 / sum);
+        ScaleTaps(filter, scale, numTaps);
+    }
+}
+
+Boolean AudioResamplerCanConvert(Float64 inputRate, Float64 outputRate)
+{
+    if (inputRate == outputRate) return true;
+
+    UInt64 input = (UInt64)llround(inputRate), output = (UInt64)llround(outputRate);
+    if (input == 0 || output == 0 || input != inputRate || output != outputRate) return false;
+    return output / GreatestCommonDivisor(input, output) <= AUDIO_RESAMPLER_MAX_PHASES;
+}
+
+Boolean AudioResamplerInit(AudioResampler *resampler, Float64 inputRate, Float64 outputRate, UInt32 numChannels)
+{
+    memset(resampler, 0, sizeof(AudioResampler));
+    resampler->inputRate = inputRate;
+    resampler->outputRate = outputRate;
+    resampler->numChannels = numChannels;
+    resampler->numPhases = resampler->step = 1;
+    if (inputRate == outputRate) return true;
+
+    if (numChannels == 0 || !AudioResamplerCanConvert(inputRate, outputRate)) return false;
+
+    UInt64 input = (UInt64)llround(inputRate), output = (UInt64)llround(outputRate);
+    UInt64 divisor = GreatestCommonDivisor(input, output);
+    resampler->numPhases = (UInt32)(output / divisor);
+    resampler->step = (UInt32)(input / divisor);
+
+    // Going down, the filter has to cut at the output's Nyquist, which takes more taps of the input
+    double cutoff = fmin(1.0, (double)resampler->numPhases / resampler->step) * AUDIO_RESAMPLER_PASSBAND;
+    resampler->halfTaps = (UInt32)ceil(AUDIO_RESAMPLER_HALF_TAPS / cutoff);
+    resampler->historyCapacity = 2 * resampler->halfTaps + AUDIO_RESAMPLER_BLOCK_FRAMES;
+
+    resampler->filters = malloc((size_t)resampler->numPhases * 2 * resampler->halfTaps * sizeof(float));
+    resampler->history = malloc((size_t)numChannels * resampler->historyCapacity * sizeof(float));
+    if (!resampler->filters || !resampler->history)
+    {
+        AudioResamplerCleanup(resampler);
+        return false;
+    }
+
+    ComputeFilters(resampler, cutoff);
+    AudioResamplerReset(resampler);
+    return true;
+}
+
+void AudioResamplerCleanup(AudioResampler *resampler)
+{
+    free(resampler->filters);
+    free(resampler->history);
+    memset(resampler, 0, sizeof(AudioResampler));
+    resampler->numPhases = resampler->step = 1;
+}
+
+Boolean AudioResamplerIsConverting(const AudioResampler *resampler)
+{
+    return resampler->filters != NULL;
+}
+
+void AudioResamplerReset(AudioResampler *resampler)
+{
+    if (!resampler->filters) return;
+
+    // The input before the first frame is silence, so the first output frame sits right on it
+    memset(resampler->history, 0, (size_t)resampler->numChannels * resampler->historyCapacity * sizeof(float));
+    resampler->numHistoryFrames = resampler->halfTaps - 1;
+    resampler->historyStart = -(SInt64)(resampler->halfTaps - 1);
+    resampler->inputFrame = 0;
+    resampler->phase = 0;
+    resampler->numInputFrames = 0;
+    resampler->isFlushed = false;
+}
+
+UInt32 AudioResamplerMaxOutputFrames(const AudioResampler *resampler, UInt32 numInputFrames)
+{
+    if (!resampler->filters) return numInputFrames;
+    return (UInt32)(((UInt64)numInputFrames * resampler->numPhases + resampler->step - 1) / resampler->step) + 1;
+}
+
+UInt32 AudioResamplerMaxInputFrames(const AudioResampler *resampler, UInt32 numOutputFrames)
+{
+    if (!resampler->filters) return numOutputFrames;
+    if (numOutputFrames < 2) return 0;
+    return (UInt32)((UInt64)(numOutputFrames - 1) * resampler->step / resampler->numPhases);
+}
+
+// Writes every output frame whose filter has all its input, and that sits before endFrame
+static UInt32 ProduceFrames(AudioResampler *resampler, float *output, SInt64 endFrame)
+{
+    UInt32 numChannels = resampler->numChannels;
+    UInt32 numTaps = 2 * resampler->halfTaps;
+    SInt64 historyEnd = resampler->historyStart + resampler->numHistoryFrames;
+    UInt32 numFramesWritten = 0;
+
+    while (resampler->inputFrame + resampler->halfTaps < historyEnd && resampler->inputFrame < endFrame)
+    {
+        const float *filter = resampler->filters + (size_t)resampler->phase * numTaps;
+        size_t firstTap = (size_t)(resampler->inputFrame - (resampler->halfTaps - 1) - resampler->historyStart);
+        for (UInt32 c=0;c<numChannels;c++)
+            DotProduct(resampler->history + (size_t)c * resampler->historyCapacity + firstTap, filter, &output[numFramesWritten * numChannels + c], numTaps);
+        numFramesWritten++;
+
+        resampler->phase += resampler->step;
+        resampler->inputFrame += resampler->phase / resampler->numPhases;
+        resampler->phase %= resampler->numPhases;
+    }
+
+    return numFramesWritten;
+}
+
+// Drops the history the next output frame doesn't need
+static void CompactHistory(AudioResampler *resampler)
+{
+    SInt64 numFramesToDrop = resampler->inputFrame - (resampler->halfTaps - 1) - resampler->historyStart;
+    if (numFramesToDrop <= 0) return;
+    if (numFramesToDrop > resampler->numHistoryFrames) numFramesToDrop = resampler->numHistoryFrames;
+
+    UInt32 numFramesLeft = resampler->numHistoryFrames - (UInt32)numFramesToDrop;
+    for (UInt32 c=0;c<resampler->numChannels;c++)
+    {
+        float *history = resampler->history + (size_t)c * resampler->historyCapacity;
+        memmove(history, history + numFramesToDrop, numFramesLeft * sizeof(float));
+    }
+    resampler->historyStart += numFramesToDrop;
+    resampler->numHistoryFrames = numFramesLeft;
+}
+
+static void AppendToHistory(AudioResampler *resampler, const float *input, UInt32 numFrames)
+{
+    UInt32 numChannels = resampler->numChannels;
+    for (UInt32 c=0;c<numChannels;c++)
+    {
+        float *destination = resampler->history + (size_t)c * resampler->historyCapacity + resampler->numHistoryFrames;
+        if (input)
+            for (UInt32 i=0;i<numFrames;i++) destination[i] = input[i * numChannels + c];
+        else
+            memset(destination, 0, numFrames * sizeof(float));
+    }
+    resampler->numHistoryFrames += numFrames;
+}
+
+UInt32 AudioResamplerProcess(AudioResampler *resampler, const float *input, UInt32 numInputFrames, float *output)
+{
+    if (!resampler->filters)
+    {
+        if (output != input) memcpy(output, input, (size_t)numInputFrames * resampler->numChannels * sizeof(float));
+        return numInputFrames;
+    }
+
+    UInt32 numFramesWritten = 0;
+    while (numInputFrames > 0)
+    {
+        UInt32 room = resampler->historyCapacity - resampler->numHistoryFrames;
+        UInt32 numFrames = numInputFrames < room ? numInputFrames : room;
+        AppendToHistory(resampler, input, numFrames);
+        resampler->numInputFrames += numFrames;
+        input += numFrames * resampler->numChannels;
+        numInputFrames -= numFrames;
+
+        numFramesWritten += ProduceFrames(resampler, output + numFramesWritten * resampler->numChannels, INT64_MAX);
+        CompactHistory(resampler);
+    }
+
+    return numFramesWritten;
+}
+
+UInt32 AudioResamplerFlush(AudioResampler *resampler, float *output)
+{
+    if (!resampler->filters || resampler->isFlushed) return 0;
+    resampler->isFlushed = true;
+
+    // silence after the end, and only the frames that sit before it
+    AppendToHistory(resampler, NULL, resampler->halfTaps);
+    UInt32 numFramesWritten = ProduceFrames(resampler, output, resampler->numInputFrames);
+    CompactHistory(resampler);
+    return numFramesWritten;
+}
+
+SInt64 AudioResamplerInputFrameForOutputFrame(const AudioResampler *resampler, SInt64 outputFrame)
+{
+    if (!resampler->filters) return outputFrame;
+    return (SInt64)llround((double)outputFrame * resampler->step / resampler->numPhases);
+}
+
+SInt64 AudioResamplerOutputFrameForInputFrame(const AudioResampler *resampler, SInt64 inputFrame)
+{
+    if (!resampler->filters) return inputFrame;
+    return (SInt64)llround((double)inputFrame * resampler->numPhases / resampler->step);
+}
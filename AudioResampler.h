@@ -0,0 +1,73 @@
+//
+//  AudioResampler.h
+//  Equalizer
+//
+
+// Band-limited sample rate conversion between two rates with a rational ratio (any two of the usual
+// ones: 8k to 192k). A windowed-sinc filter bank is computed at init, one filter per phase of the
+// output grid relative to the input grid, so each output sample is a single dot product over the
+// input around it. The cutoff follows the lower of the two rates.
+//
+// Streaming: interleaved input goes in block by block, interleaved output comes out, and the history
+// between blocks is kept per channel. Output frame n is input time n * inputRate / outputRate, with no
+// delay, so frame positions carry over from one rate to the other. The last frames wait for the input
+// after them, which AudioResamplerFlush makes up with silence at the end of the source.
+
+#include "AudioTypes.h"
+
+#define AUDIO_RESAMPLER_HALF_TAPS 16        // each side of the filter, at a cutoff of the input's Nyquist
+#define AUDIO_RESAMPLER_MAX_PHASES 1024
+#define AUDIO_RESAMPLER_BLOCK_FRAMES 4096   // input is taken this many frames at a time
+
+typedef struct AudioResampler
+{
+    Float64 inputRate;
+    Float64 outputRate;
+    UInt32 numChannels;
+
+    UInt32 numPhases;       // the output rate over the rates' common divisor
+    UInt32 step;            // the input rate over the same. Output frame n sits at input n * step / numPhases
+    UInt32 halfTaps;
+    float *filters;         // numPhases filters of 2 * halfTaps taps. NULL when no conversion is needed
+
+    float *history;         // per channel, the input frames still needed, from historyStart on
+    UInt32 historyCapacity; // in frames, per channel
+    UInt32 numHistoryFrames;
+    SInt64 historyStart;    // the input frame history[0] holds
+
+    SInt64 inputFrame;      // where the next output frame sits: input frame + phase / numPhases
+    UInt32 phase;
+    SInt64 numInputFrames;  // taken since the last reset
+    Boolean isFlushed;
+} AudioResampler;
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+// Fails if the ratio is too fine-grained for the filter bank. Equal rates need no conversion, which
+// AudioResamplerIsConverting then says
+Boolean AudioResamplerInit(AudioResampler *resampler, Float64 inputRate, Float64 outputRate, UInt32 numChannels);
+Boolean AudioResamplerCanConvert(Float64 inputRate, Float64 outputRate);
+void AudioResamplerCleanup(AudioResampler *resampler);
+Boolean AudioResamplerIsConverting(const AudioResampler *resampler);
+
+// Forgets the history, for when the input jumps (a seek). Output frame 0 is then the next input frame
+void AudioResamplerReset(AudioResampler *resampler);
+
+// The most output frames numInputFrames can bring, and the most input frames that fit numOutputFrames
+UInt32 AudioResamplerMaxOutputFrames(const AudioResampler *resampler, UInt32 numInputFrames);
+UInt32 AudioResamplerMaxInputFrames(const AudioResampler *resampler, UInt32 numOutputFrames);
+
+// Takes all of the input and returns how many frames it wrote to output
+UInt32 AudioResamplerProcess(AudioResampler *resampler, const float *input, UInt32 numInputFrames, float *output);
+// At the end of the input, writes the frames that were waiting for more of it. Returns 0 once it's done that
+UInt32 AudioResamplerFlush(AudioResampler *resampler, float *output);
+
+// Frame positions from one rate to the other, rounded to the nearest frame
+SInt64 AudioResamplerInputFrameForOutputFrame(const AudioResampler *resampler, SInt64 outputFrame);
+SInt64 AudioResamplerOutputFrameForInputFrame(const AudioResampler *resampler, SInt64 inputFrame);
+
+#if defined __cplusplus
+};
+#endif
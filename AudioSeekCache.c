@@ -0,0 +1,233 @@
+//
+//  AudioSeekCache.c
+//  Equalizer
+//
+
+#include "AudioSeekCache.h"
+#include <stdlib.h>
+#include <string.h>
+
+#define AUDIO_SEEK_INDEX_INITIAL_CAPACITY 256
+
+static inline size_t BlockBytes(const AudioSeekCache *cache)
+{
+    return (size_t)cache->blockFrames * cache->numChannels * sizeof(float);
+}
+
+static inline AudioSeekCacheBlock *FillingBlock(AudioSeekCache *cache)
+{
+    return &cache->blocks[cache->capacity];
+}
+
+size_t AudioSeekCacheBytes(UInt32 numChannels, UInt32 blockFrames, UInt32 capacity)
+{
+    // the cached blocks, the one being filled and the pinned one
+    return (size_t)(capacity + 2) * blockFrames * numChannels * sizeof(float);
+}
+
+Boolean AudioSeekCacheInit(AudioSeekCache *cache, UInt32 numChannels, UInt32 blockFrames, UInt32 capacity)
+{
+    memset(cache, 0, sizeof(AudioSeekCache));
+    cache->numChannels = numChannels;
+    cache->blockFrames = blockFrames;
+    cache->capacity = capacity;
+    
+    cache->blocks = calloc(capacity + 1, sizeof(AudioSeekCacheBlock));
+    cache->indexFrames = malloc(AUDIO_SEEK_INDEX_INITIAL_CAPACITY * sizeof(SInt64));
+    cache->indexCapacity = AUDIO_SEEK_INDEX_INITIAL_CAPACITY;
+    cache->pinnedBlock.samples = malloc(BlockBytes(cache));
+    if (!cache->blocks || !cache->indexFrames || !cache->pinnedBlock.samples)
+    {
+        AudioSeekCacheCleanup(cache);
+        return false;
+    }
+    
+    for (UInt32 i=0;i<=capacity;i++)
+    {
+        cache->blocks[i].samples = malloc(BlockBytes(cache));
+        if (!cache->blocks[i].samples)
+        {
+            AudioSeekCacheCleanup(cache);
+            return false;
+        }
+    }
+    
+    AudioSeekCacheReset(cache);
+    return true;
+}
+
+void AudioSeekCacheCleanup(AudioSeekCache *cache)
+{
+    if (cache->blocks)
+    {
+        for (UInt32 i=0;i<=cache->capacity;i++) free(cache->blocks[i].samples);
+    }
+    free(cache->blocks);
+    free(cache->indexFrames);
+    free(cache->pinnedBlock.samples);
+    memset(cache, 0, sizeof(AudioSeekCache));
+}
+
+// Forgets everything, e.g. when another file is loaded
+void AudioSeekCacheReset(AudioSeekCache *cache)
+{
+    if (!cache->blocks) return;
+    
+    for (UInt32 i=0;i<=cache->capacity;i++)
+    {
+        cache->blocks[i].startFrame = -1;
+        cache->blocks[i].numFrames = 0;
+        cache->blocks[i].lastUsed = 0;
+    }
+    cache->pinnedBlock.startFrame = -1;
+    cache->pinnedBlock.numFrames = 0;
+    cache->numIndexFrames = 0;
+    cache->useCounter = 0;
+    cache->numHits = 0;
+    cache->numMisses = 0;
+}
+
+static AudioSeekCacheBlock *FindBlock(AudioSeekCache *cache, SInt64 blockStart)
+{
+    if (cache->pinnedBlock.startFrame == blockStart && cache->pinnedBlock.numFrames == cache->blockFrames) return &cache->pinnedBlock;
+    
+    for (UInt32 i=0;i<cache->capacity;i++)
+    {
+        if (cache->blocks[i].startFrame == blockStart) return &cache->blocks[i];
+    }
+    return NULL;
+}
+
+// Moves the filled block into the cache, in place of the least recently used one
+static void StoreFillingBlock(AudioSeekCache *cache)
+{
+    AudioSeekCacheBlock *filling = FillingBlock(cache);
+    
+    if (filling->startFrame == 0)
+    {
+        memcpy(cache->pinnedBlock.samples, filling->samples, BlockBytes(cache));
+        cache->pinnedBlock.startFrame = 0;
+        cache->pinnedBlock.numFrames = filling->numFrames;
+    }
+    else if (!FindBlock(cache, filling->startFrame) && cache->capacity > 0)
+    {
+        AudioSeekCacheBlock *victim = &cache->blocks[0];
+        for (UInt32 i=1;i<cache->capacity;i++)
+        {
+            if (cache->blocks[i].lastUsed < victim->lastUsed) victim = &cache->blocks[i];
+        }
+        
+        // swap buffers instead of copying
+        AudioSeekCacheBlock stored = *filling;
+        stored.lastUsed = ++cache->useCounter;
+        filling->samples = victim->samples;
+        *victim = stored;
+    }
+    
+    filling->startFrame = -1;
+    filling->numFrames = 0;
+}
+
+void AudioSeekCacheAddDecodedAudio(AudioSeekCache *cache, SInt64 startFrame, const float *samples, UInt32 numFrames)
+{
+    if (!cache->blocks || startFrame < 0) return;
+    AudioSeekCacheBlock *filling = FillingBlock(cache);
+    
+    while (numFrames > 0)
+    {
+        // Nothing partial is ever cached, so audio has to start a block or continue the one being filled
+        if (filling->startFrame < 0 || filling->startFrame + filling->numFrames != startFrame)
+        {
+            filling->numFrames = 0;
+            SInt64 framesIntoBlock = startFrame % cache->blockFrames;
+            if (framesIntoBlock == 0)
+                filling->startFrame = startFrame;
+            else
+            {
+                UInt32 numFramesToSkip = (UInt32)(cache->blockFrames - framesIntoBlock);
+                if (numFramesToSkip >= numFrames) return;
+                startFrame += numFramesToSkip;
+                samples += (size_t)numFramesToSkip * cache->numChannels;
+                numFrames -= numFramesToSkip;
+                filling->startFrame = startFrame;
+            }
+        }
+        
+        UInt32 numFramesToCopy = cache->blockFrames - filling->numFrames;
+        if (numFramesToCopy > numFrames) numFramesToCopy = numFrames;
+        memcpy(filling->samples + (size_t)filling->numFrames * cache->numChannels, samples, (size_t)numFramesToCopy * cache->numChannels * sizeof(float));
+        filling->numFrames += numFramesToCopy;
+        startFrame += numFramesToCopy;
+        samples += (size_t)numFramesToCopy * cache->numChannels;
+        numFrames -= numFramesToCopy;
+        
+        if (filling->numFrames == cache->blockFrames) StoreFillingBlock(cache);
+    }
+}
+
+// Returns the cached audio from frame to the end of its block, or NULL if it isn't cached
+const float *AudioSeekCacheGetAudio(AudioSeekCache *cache, SInt64 frame, UInt32 *numFramesAvailable)
+{
+    *numFramesAvailable = 0;
+    if (!cache->blocks || frame < 0) return NULL;
+    
+    SInt64 blockStart = frame / cache->blockFrames * cache->blockFrames;
+    AudioSeekCacheBlock *block = FindBlock(cache, blockStart);
+    if (!block)
+    {
+        cache->numMisses++;
+        return NULL;
+    }
+    
+    cache->numHits++;
+    if (block != &cache->pinnedBlock) block->lastUsed = ++cache->useCounter;
+    UInt32 framesIntoBlock = (UInt32)(frame - blockStart);
+    *numFramesAvailable = block->numFrames - framesIntoBlock;
+    return block->samples + (size_t)framesIntoBlock * cache->numChannels;
+}
+
+// The first frame from `frame` on that isn't cached
+SInt64 AudioSeekCacheContiguousEnd(AudioSeekCache *cache, SInt64 frame)
+{
+    if (!cache->blocks || frame < 0) return frame;
+    
+    SInt64 blockStart = frame / cache->blockFrames * cache->blockFrames;
+    while (FindBlock(cache, blockStart)) blockStart += cache->blockFrames;
+    return blockStart > frame ? blockStart : frame;
+}
+
+void AudioSeekCacheAddIndexPoint(AudioSeekCache *cache, SInt64 frame)
+{
+    if (!cache->indexFrames) return;
+    
+    // keep it sparse and sorted: points only go in at least AUDIO_SEEK_INDEX_SPACING from their neighbours
+    UInt32 position = cache->numIndexFrames;
+    while (position > 0 && cache->indexFrames[position - 1] > frame) position--;
+    if (position > 0 && frame - cache->indexFrames[position - 1] < AUDIO_SEEK_INDEX_SPACING) return;
+    if (position < cache->numIndexFrames && cache->indexFrames[position] - frame < AUDIO_SEEK_INDEX_SPACING) return;
+    
+    if (cache->numIndexFrames == cache->indexCapacity)
+    {
+        SInt64 *indexFrames = realloc(cache->indexFrames, cache->indexCapacity * 2 * sizeof(SInt64));
+        if (!indexFrames) return;
+        cache->indexFrames = indexFrames;
+        cache->indexCapacity *= 2;
+    }
+    
+    memmove(cache->indexFrames + position + 1, cache->indexFrames + position, (cache->numIndexFrames - position) * sizeof(SInt64));
+    cache->indexFrames[position] = frame;
+    cache->numIndexFrames++;
+}
+
+// The latest position at or before frame that the decoder is known to start a buffer at, or -1
+SInt64 AudioSeekCacheIndexPointBefore(const AudioSeekCache *cache, SInt64 frame)
+{
+    UInt32 low = 0, high = cache->numIndexFrames;
+    while (low < high)
+    {
+        UInt32 middle = (low + high) / 2;
+        if (cache->indexFrames[middle] <= frame) low = middle + 1;
+        else high = middle;
+    }
+    return low > 0 ? cache->indexFrames[low - 1] : -1;
+}
@@ -0,0 +1,69 @@
+//
+//  AudioSeekCache.h
+//  Equalizer
+//
+
+// Decoded audio kept around so a seek doesn't have to wait for the decoder.
+//
+// Decoded (interleaved) audio is cut into fixed blocks that start at multiples of blockFrames. The
+// last `capacity` complete blocks are kept, least recently used going first, except the first block
+// of the track, which is kept for good (going back to the start is the most common seek of all).
+// Blocks around a seek target are decoded right after the seek, so they're cached too.
+//
+// There is also a sparse index of the positions the decoder started a sample buffer at, so a seek
+// can restart the decoder on a position it's known to decode from.
+//
+// Not thread safe: use from whichever thread reads the file at the time.
+
+#include <stddef.h>
+#include <MacTypes.h>
+
+#define AUDIO_SEEK_CACHE_BLOCK_FRAMES 32768
+#define AUDIO_SEEK_CACHE_BLOCKS 8
+#define AUDIO_SEEK_INDEX_SPACING 44100  // frames between index points at least: a second at 44.1 kHz, less at higher rates
+
+typedef struct AudioSeekCacheBlock
+{
+    SInt64 startFrame;      // -1 for an empty block
+    UInt32 numFrames;       // blockFrames once complete
+    UInt64 lastUsed;
+    float *samples;
+} AudioSeekCacheBlock;
+
+typedef struct AudioSeekCache
+{
+    UInt32 numChannels;
+    UInt32 blockFrames;
+    UInt32 capacity;
+    AudioSeekCacheBlock *blocks;    // capacity + 1: the last one is being filled
+    AudioSeekCacheBlock pinnedBlock;
+    UInt64 useCounter;
+    
+    SInt64 *indexFrames;            // ascending
+    UInt32 numIndexFrames;
+    UInt32 indexCapacity;
+    
+    UInt64 numHits;
+    UInt64 numMisses;
+} AudioSeekCache;
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+size_t AudioSeekCacheBytes(UInt32 numChannels, UInt32 blockFrames, UInt32 capacity);
+Boolean AudioSeekCacheInit(AudioSeekCache *cache, UInt32 numChannels, UInt32 blockFrames, UInt32 capacity);
+void AudioSeekCacheCleanup(AudioSeekCache *cache);
+void AudioSeekCacheReset(AudioSeekCache *cache);
+
+// Decoded audio, in file order. Audio that doesn't continue what was added before starts a new block
+void AudioSeekCacheAddDecodedAudio(AudioSeekCache *cache, SInt64 startFrame, const float *samples, UInt32 numFrames);
+const float *AudioSeekCacheGetAudio(AudioSeekCache *cache, SInt64 frame, UInt32 *numFramesAvailable);
+SInt64 AudioSeekCacheContiguousEnd(AudioSeekCache *cache, SInt64 frame);
+
+void AudioSeekCacheAddIndexPoint(AudioSeekCache *cache, SInt64 frame);
+SInt64 AudioSeekCacheIndexPointBefore(const AudioSeekCache *cache, SInt64 frame);
+
+#if defined __cplusplus
+};
+#endif
@@ -0,0 +1,21 @@
+//
+//  AudioTypes.h
+//  Equalizer
+//
+
+// The Mac scalar types, for the plain C modules that also build elsewhere (see Tools/BatchAnalyser)
+
+#ifndef AUDIO_TYPES_H
+#define AUDIO_TYPES_H
+
+#ifdef __APPLE__
+#include <MacTypes.h>
+#else
+#include <stdint.h>
+#include <stdbool.h>
+typedef uint8_t UInt8; typedef uint16_t UInt16; typedef int16_t SInt16; typedef uint32_t UInt32; typedef int32_t SInt32;
+typedef int64_t SInt64; typedef uint64_t UInt64;
+typedef double Float64; typedef unsigned char Boolean;
+#endif
+
+#endif
@@ -10,6 +10,13 @@
 #import <MediaPlayer/MediaPlayer.h>
 #import <AudioToolbox/AudioToolbox.h>
 #import "Configuration.h"
+#include <stdatomic.h>
+#include "SpectrumBroadcastRing.h"
+#include "SpectrogramHistory.h"
+#include "SpectrogramCache.h"
+#include "SpectrumAnalysis.h"
+#include "AudioMemoryBudget.h"
+#include "AudioWorkerPool.h"
 
 @class MPMediaItem;
 @class AVAssetReader;
@@ -23,13 +30,31 @@
 #define FFT_BUFFER_DEFINE float[BUFFER_SIZE / CHUNK_SIZE][CHUNK_SIZE]
 
 #define MAX_FFT_LEN(sampleCount) (sampleCount / CHUNK_SIZE * CHUNK_SIZE)
+#define MAX_AUDIO_CHANNELS 8
+
+#define MAX_SPECTRUM_READ_SCHEDULES 4
 
 typedef struct CircularAudioStorage CircularAudioStorage;
 
+// A consumer that reads spectra at a steady rate, e.g. once per display refresh. Reads happen at
+// alignment + k * sampleRate / readRate (in the same time units as LiveAudioData.timeInFrames).
+typedef struct SpectrumReadSchedule
+{
+    _Atomic Boolean isRegistered;
+    Float64 readRate;
+    SInt64 alignment;
+    Boolean averageSkippedFrames; // a read gets the power average of all the frames since the previous read
+} SpectrumReadSchedule;
+
 typedef struct AudioCircularBuffer
 {
     TPCircularBuffer circularBuffer;
     SInt64 offset;
+    
+    // Seqlock-style generation counter. It is odd while the producer reclaims data a reader
+    // may be looking at (consuming, clearing or moving the offset) and even otherwise.
+    // Appending into free space doesn't touch it, since readers never see that space.
+    _Atomic UInt32 generation;
 } AudioCircularBuffer;
 
 typedef struct CircularAudioStream
@@ -38,6 +63,29 @@ typedef struct CircularAudioStream
     AudioCircularBuffer samples;
     AudioCircularBuffer fftResults;
     
+    // Optional. Every FFT frame added to fftResults is also published here, for consumers
+    // that want to see each frame once at their own pace rather than sample the ring.
+    SpectrumBroadcastRing *broadcast;
+    
+    // Optional. Frames that fall off fftResults are kept here, so they can still be
+    // looked up by time after the live ring has moved on.
+    SpectrogramHistory *history;
+    
+    // Optional. The whole track's analysis from an earlier run, as channel cacheChannel. Once it's readable
+    // (the storage should be lazy then), frames are taken from it instead of computed. While it's being
+    // written, every frame computed here is added to it.
+    SpectrogramCache *cache;
+    UInt32 cacheChannel;
+    
+    // Lazy analysis: one state word per fftResults slot, telling which frame (if any) the slot
+    // holds. The epoch changes whenever the ring is cleared or moved, so old states never match.
+    _Atomic UInt64 *frameStates;
+    UInt32 numFrameSlots;
+    _Atomic UInt32 epoch;
+    
+    UInt64 numFramesProduced;
+    _Atomic UInt64 numFramesComputed;
+    
 } CircularAudioStream;
 
 struct CircularAudioStorage
@@ -46,9 +94,31 @@ struct CircularAudioStorage
     SInt32 fftOverlapJumpSize;
     CGFloat amplitudeFactor;
     
-    CircularAudioStream channel1;
-    CircularAudioStream channel2;
+    UInt32 numChannels;
+    CircularAudioStream channels[MAX_AUDIO_CHANNELS];
     CircularAudioStream extractedChannel;
+    
+    // When set, samples are still stored as they come but FFT frames are only computed (once)
+    // when they are first read. Readers of live data get lazyFramesPerRead frames.
+    BOOL lazyAnalysis;
+    int lazyFramesPerRead;
+    
+    // In lazy mode the frames these schedules will read are computed ahead of time, as audio is added.
+    // Frames between reads are left to be computed on demand, if ever.
+    Float64 sampleRate;
+    SpectrumReadSchedule readSchedules[MAX_SPECTRUM_READ_SCHEDULES];
+    
+    // The most frames a single add may bring
+    UInt32 maxFramesPerAdd;
+    
+    // Bytes of sample data written on the way in (by whoever feeds the storage, too), and frames added.
+    // Together they tell how many times each sample is copied
+    UInt64 numSampleBytesCopied;
+    UInt64 numFramesAdded;
+    
+    // Ring sizes, used when more channels are allocated later
+    int samplesBufferSize;
+    int fftResultsBufferSize;
 };
 
 typedef struct LiveSamples
@@ -71,25 +141,133 @@ typedef struct LiveAudioChannelData
     BOOL containsData;
     LiveSamples samples;
     LiveFFTResults fftResults;
+    
+    // The stream samples and fftResults point into, and its buffers' generations at the time
+    // they were read. NULL for data that doesn't live in a ring (e.g. a snapshot copy).
+    const CircularAudioStream *stream;
+    UInt32 samplesGeneration;
+    UInt32 fftResultsGeneration;
 } LiveAudioChannelData;
 
+// Caller-owned memory to copy a LiveAudioChannelData into
+typedef struct LiveAudioSnapshotBuffer
+{
+    float *samples;
+    unsigned long samplesCapacity;
+    float *fftResults;
+    unsigned long chunksCapacity;
+} LiveAudioSnapshotBuffer;
+
+// A wake-up call between audio threads. Waiters sleep on the semaphore until what they wait for holds;
+// the other side changes the state, then signals. It only touches the semaphore when someone is
+// waiting, so a signal from the render thread is usually just an atomic load.
+typedef struct AudioWakeup
+{
+    dispatch_semaphore_t semaphore;
+    _Atomic int numWaiters;
+} AudioWakeup;
+
 typedef struct LiveAudioData
 {
     SInt64 timeInFrames;
+    Float64 sampleRate;     // what timeInFrames counts, and what the spectra's bins are spaced by (see FFTBinToFrequency)
     LiveAudioChannelData channel1;
-    LiveAudioChannelData channel2;
+    LiveAudioChannelData channel2; // same as channel1 for mono audio
     LiveAudioChannelData extractedChannel;
+    
+    UInt32 numChannels;
+    LiveAudioChannelData channels[MAX_AUDIO_CHANNELS]; // channels[0] and channels[1] are channel1 and channel2
 
 } LiveAudioData;
 
-typedef struct LiveMicrophoneData
+typedef struct SpectrumDecimationBenchmarkResult
+{
+    double eagerSeconds;
+    double scheduledSeconds;
+    UInt64 eagerFramesComputed;
+    UInt64 scheduledFramesComputed;
+    UInt64 numReads;
+} SpectrumDecimationBenchmarkResult;
+
+typedef struct DecoderPipelineBenchmarkResult
+{
+    SInt64 numFrames;
+    double seconds;
+    double framesPerSecond;
+    double realtimeFactor;      // how many seconds of audio were processed per second
+    double bytesCopiedPerFrame; // see CircularAudioStorage.numSampleBytesCopied
+    Boolean isZeroCopy;
+} DecoderPipelineBenchmarkResult;
+
+// Analysis split into stages that run in parallel. Whoever decodes (AudioFile's pull thread) queues
+// interleaved chunks, and the stages take them from there on a worker pool: one analysis stage per
+// channel, the center extraction (stereo only, if asked for) and the play fill. Each stage has its own
+// end of the chunk queue, so every hand-off is single-producer / single-consumer, and a stage goes through
+// its chunks in order whichever worker runs it. A chunk's samples stay where the decoder put them until
+// every stage is done with them, and the decoder checks there's room for a chunk before queueing it,
+// so stages never wait on the play head.
+#define AUDIO_PIPELINE_DEPTH 4      // chunks in flight
+#define AUDIO_PIPELINE_MAX_STAGES (MAX_AUDIO_CHANNELS + 3)
+
+typedef struct AudioPipeline AudioPipeline;
+
+// Gets the chunks, in order, from one worker at a time. The first numFramesToSkip frames aren't to be played
+typedef void (*AudioPipelinePlayFunction)(void *context, const float *samples, UInt32 numFrames, UInt32 numFramesToSkip);
+
+typedef enum AudioPipelineStageType
+{
+    AudioPipelineStage_Decode = 0,  // the caller's own thread, reported with AudioPipelineNoteDecoded
+    AudioPipelineStage_Analysis = 1,
+    AudioPipelineStage_CenterExtraction = 2,
+    AudioPipelineStage_Play = 3,
+} AudioPipelineStageType;
+
+typedef struct AudioPipelineChunk
 {
-    float samples1[CHUNK_SIZE_FOR_RECORDING];
-    float samples2[CHUNK_SIZE_FOR_RECORDING];
-    float fftResults1[CHUNK_SIZE_FOR_RECORDING / CHUNK_SIZE_FOR_RECORDING][CHUNK_SIZE_FOR_RECORDING];
-    float fftResults2[CHUNK_SIZE_FOR_RECORDING / CHUNK_SIZE_FOR_RECORDING][CHUNK_SIZE_FOR_RECORDING];
+    const float *samples;
+    UInt32 numFrames;
+    UInt32 numFramesToSkipPlaying;  // analysed, but not played (a seek's pre-roll)
+} AudioPipelineChunk;
+
+typedef struct AudioPipelineStage
+{
+    AudioPipeline *pipeline;
+    AudioPipelineStageType type;
+    UInt32 channel;
+    int laneID;
+    _Atomic UInt64 numChunksDone;   // the stage's end of the queue
+    _Atomic UInt64 numFramesDone;
+    _Atomic UInt64 busyNanoseconds;
+    UInt32 maxQueueDepth;           // written by the producer
+} AudioPipelineStage;
+
+typedef struct AudioPipelineStageStats
+{
+    AudioPipelineStageType type;
+    UInt32 channel;
+    UInt64 numFrames;
+    double busySeconds;
+    double framesPerSecond;         // while busy, i.e. what this stage alone could keep up with
+    UInt32 queueDepth;              // chunks waiting for the stage right now
+    UInt32 maxQueueDepth;
+} AudioPipelineStageStats;
+
+struct AudioPipeline
+{
+    CircularAudioStorage *storage;
+    AudioWorkerPool *pool;
+    AudioPipelinePlayFunction play;
+    void *playContext;
+    
+    AudioPipelineChunk chunks[AUDIO_PIPELINE_DEPTH];
+    _Atomic UInt64 numChunksQueued;
+    UInt64 numChunksRetired;
     
-} LiveMicrophoneData;
+    AudioPipelineStage stages[AUDIO_PIPELINE_MAX_STAGES]; // stages[0] is the decoder
+    UInt32 numStages;
+    
+    AudioWakeup progressed;         // stages -> producer, whenever one finishes a chunk
+};
 
 
 #if defined __cplusplus
@@ -100,13 +278,37 @@ void AudioStreamSetBuffersOffset(CircularAudioStream *stream, int64_t offset);
 void AudioStreamReset(CircularAudioStream *stream);
 void AudioStreamInit(CircularAudioStream *stream, int samplesBufferSize, int fftResultsBufferSize, CircularAudioStorage *father);
 void LiveAudioDataReset(CircularAudioStorage *liveAudioData);
+BOOL CircularAudioStorageInit(CircularAudioStorage *storage, UInt32 numChannels, int samplesBufferSize, int fftResultsBufferSize, UInt32 maxFramesPerAdd);
+BOOL CircularAudioStorageSetNumChannels(CircularAudioStorage *storage, UInt32 numChannels);
+void CircularAudioStorageCleanup(CircularAudioStorage *storage);
+void CircularAudioStorageSetLazyAnalysis(CircularAudioStorage *storage, BOOL lazyAnalysis);
+int AudioStreamComputeFrames(CircularAudioStream *stream, SInt64 timeInFrames, int numFrames);
+int CircularAudioStorageAddReadSchedule(CircularAudioStorage *storage, Float64 readRate, SInt64 alignment, Boolean averageSkippedFrames);
+void CircularAudioStorageRemoveReadSchedule(CircularAudioStorage *storage, int scheduleID);
+BOOL AudioStreamGetScheduledSpectrum(CircularAudioStream *stream, int scheduleID, SInt64 timeInFrames, float *result);
+BOOL BenchmarkSpectrumDecimation(Float64 seconds, UInt32 jumpSize, Float64 readRate, Boolean averageSkippedFrames, SpectrumDecimationBenchmarkResult *result);
+BOOL BenchmarkDecoderPipeline(const char *path, DecoderPipelineBenchmarkResult *result);
+AudioStreamMemoryUsage CircularAudioStorageMemoryUsage(const CircularAudioStorage *storage);
+void AudioStreamClear(CircularAudioStream *stream);
+void AudioStreamFlushToHistory(CircularAudioStream *stream);
+BOOL AudioStreamGetSpectrumAtTime(CircularAudioStream *stream, SInt64 timeInFrames, float *result);
+int AudioStreamGetSpectraInTimeRange(CircularAudioStream *stream, SInt64 startTimeInFrames, SInt64 endTimeInFrames, float *results, int maxChunks);
+LiveAudioChannelData AudioStreamGetLiveData(CircularAudioStream *stream, SInt64 timeInFrames);
+
+void AudioCircularBufferBeginWrite(AudioCircularBuffer *buffer);
+void AudioCircularBufferEndWrite(AudioCircularBuffer *buffer);
+UInt32 AudioCircularBufferBeginRead(AudioCircularBuffer *buffer);
+BOOL AudioCircularBufferValidateRead(AudioCircularBuffer *buffer, UInt32 generation);
+BOOL LiveAudioChannelDataIsValid(const LiveAudioChannelData *channelData);
+BOOL LiveAudioChannelDataCopy(const LiveAudioChannelData *channelData, LiveAudioSnapshotBuffer *buffer, LiveAudioChannelData *snapshot);
     
 void SplitStereoSamples(float *samples, long samplesCount, float *leftChannnel, float *rightChannel);
+void DeinterleaveSamples(const float *samples, UInt32 numChannels, UInt32 numFramesPerChannel, float *planes, UInt32 planeStride);
+void ScaleAndDeinterleaveSamples(const float *samples, UInt32 numChannels, UInt32 numFramesPerChannel, float factor, float *const *destinations);
 void CombineStereoSamples(float *leftChannel, float *rightChannel, float *result, long numSamplesPerChannel);
 
 void CopySamples(float *samples, int numSamples, float *result);
 void AmplitudeFactor(float *samples, UInt64 numSamples, float factor, float *result);
-void Chunked_FFT(float *samples, long samplesCount, float *fftResults, int chunkSize);
 void PhaseCancellation(float *samples1, float* samples2, long numOfSamples, float *results);
 void Normalize(float *samples, int numSamples, float *result);
 float AvaragePowerForSamples(float *samples, int numSamples);
@@ -122,14 +324,31 @@ void LowPassFilter(float *samples, NSUInteger numSamples, float lpfBeta, float *
 void LowPassFilterWithInitializer(float *samples, NSUInteger numSamples, float lpfBeta, float initializer, float *result);
 void LowPassFilterWithOffset(float *samples, NSUInteger offset, NSUInteger numSamples, float lpfBeta, float *result);
 
-int FFTBinToFrequency(int binIndex, int sampleRate, int chunkSize);
-int FrequencyToBinIndex(int frequency, int sampleRate, int chunkSize);
-int TimeToSampleTime(float seconds, int sampleRate);
-float SampleTimeToSeconds(UInt64 sampleTime, int sampleRate);
+int FFTBinToFrequency(int binIndex, Float64 sampleRate, int chunkSize);
+int FrequencyToBinIndex(int frequency, Float64 sampleRate, int chunkSize);
+int TimeToSampleTime(float seconds, Float64 sampleRate);
+float SampleTimeToSeconds(UInt64 sampleTime, Float64 sampleRate);
 
 void LiveAudioDataEmpty(LiveAudioData *liveAudioData);
 BOOL AddStereoAudioToLiveStream(float *stereoSamples, int numSamplesToAddPerChannel, CircularAudioStorage *liveAudioData);
+BOOL AddInterleavedAudioToLiveStream(float *samples, int numSamplesToAddPerChannel, CircularAudioStorage *liveAudioData);
+LiveAudioChannelData LiveAudioDataChannel(const LiveAudioData *liveAudioData, UInt32 channelIndex);
 BOOL AddAudioToLiveStream(float *samples, int numSamplesToAdd, CircularAudioStream *stream);
+void AudioWakeupInit(AudioWakeup *wakeup);
+void AudioWakeupSignal(AudioWakeup *wakeup);
+BOOL AudioWakeupWait(AudioWakeup *wakeup, BOOL (^condition)(void), dispatch_time_t deadline);
+
+BOOL AudioPipelineInit(AudioPipeline *pipeline, CircularAudioStorage *storage, AudioWorkerPool *pool, BOOL extractsCenter, AudioPipelinePlayFunction play, void *playContext);
+void AudioPipelineCleanup(AudioPipeline *pipeline);
+UInt32 AudioPipelineNumChunksInFlight(AudioPipeline *pipeline);
+BOOL AudioPipelineHasRoomForChunk(AudioPipeline *pipeline);
+BOOL AudioPipelineQueueChunk(AudioPipeline *pipeline, const float *samples, UInt32 numFrames, UInt32 numFramesToSkipPlaying);
+UInt32 AudioPipelineRetireChunks(AudioPipeline *pipeline);
+BOOL AudioPipelineWaitForProgress(AudioPipeline *pipeline, dispatch_time_t deadline);
+void AudioPipelineDrain(AudioPipeline *pipeline);
+void AudioPipelineNoteDecoded(AudioPipeline *pipeline, UInt32 numFrames, uint64_t machTime);
+int AudioPipelineGetStats(AudioPipeline *pipeline, AudioPipelineStageStats *stats, int maxStages);
+
 BOOL canAddToLiveAudioData(CircularAudioStorage *liveAudioData, int numSamples);
 BOOL canAddToStream(CircularAudioStream *stream, int numSamples);
     
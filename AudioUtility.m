@@ -15,19 +15,341 @@
 #import <Accelerate/Accelerate.h>
 #import "TPCircularBuffer.h"
 #include "dsp_centercut.h"
+#include <sched.h>
+#include "AudioDecoder.h"
 
 @implementation AudioUtility
 
 BOOL AddStereoAudioToLiveStream(float *stereoSamples, int numSamplesToAddPerChannel, CircularAudioStorage *liveAudioData)
 {
-    float samples1[numSamplesToAddPerChannel], samples2[numSamplesToAddPerChannel];
-    SplitStereoSamples(stereoSamples, numSamplesToAddPerChannel * 2, samples1, samples2);
-    BOOL success1 = AddAudioToLiveStream(samples1, numSamplesToAddPerChannel, &liveAudioData->channel1);
-    BOOL success2 = AddAudioToLiveStream(samples2, numSamplesToAddPerChannel, &liveAudioData->channel2);
-    return success1 && success2;
+    assert(liveAudioData->numChannels == 2);
+    return AddInterleavedAudioToLiveStream(stereoSamples, numSamplesToAddPerChannel, liveAudioData);
 }
 
-BOOL AddAudioToLiveStream(float *samples, int numSamplesToAdd, CircularAudioStream *stream)
+LiveAudioChannelData LiveAudioDataChannel(const LiveAudioData *liveAudioData, UInt32 channelIndex)
+{
+    if (liveAudioData->numChannels == 0) return channelIndex == 0 ? liveAudioData->channel1 : liveAudioData->channel2;
+    
+    // a mono supplier gives its only channel for every index
+    return liveAudioData->channels[MIN(channelIndex, liveAudioData->numChannels - 1)];
+}
+
+#define FRAME_STATE_COMPUTING (1ULL << 63)
+#define FRAME_STATE_TIME_BITS 40
+
+static UInt32 FrameSlot(CircularAudioStream *stream, const float *frame)
+{
+    size_t position = (size_t)((const char *)frame - (const char *)stream->fftResults.circularBuffer.buffer);
+    return (UInt32)(position / (CHUNK_SIZE * sizeof(float)) % stream->numFrameSlots);
+}
+
+static UInt64 FrameTag(CircularAudioStream *stream, SInt64 frameTime)
+{
+    UInt64 epoch = atomic_load_explicit(&stream->epoch, memory_order_acquire) & 0x7FFFFF;
+    return (epoch << FRAME_STATE_TIME_BITS) | ((UInt64)(frameTime + 1) & ((1ULL << FRAME_STATE_TIME_BITS) - 1));
+}
+
+static BOOL IsFrameComputed(CircularAudioStream *stream, const float *frame, SInt64 frameTime)
+{
+    return atomic_load_explicit(&stream->frameStates[FrameSlot(stream, frame)], memory_order_acquire) == FrameTag(stream, frameTime);
+}
+
+// Computes a lazy frame into its slot, unless it's already there. Any thread may call this; a slot is
+// only written by whoever claimed it. Returns NO if the samples the frame needs are gone.
+// Cache entries are spectra of the audio as it is in the file, which is also what the batch analyser writes,
+// so they're only read or written while the amplitude factor leaves the audio as it is
+static BOOL StreamCacheMatchesAudio(const CircularAudioStream *stream)
+{
+    return stream->cache && stream->fatherAudioData->amplitudeFactor == 1;
+}
+
+static BOOL ComputeLazyFrame(CircularAudioStream *stream, float *frame, SInt64 frameTime)
+{
+    _Atomic UInt64 *state = &stream->frameStates[FrameSlot(stream, frame)];
+    UInt64 tag = FrameTag(stream, frameTime);
+    
+    UInt64 currentState = atomic_load_explicit(state, memory_order_acquire);
+    while (true)
+    {
+        if (currentState == tag) return YES;
+        if (currentState & FRAME_STATE_COMPUTING)
+        {
+            // someone else is computing into this slot, which takes a few microseconds
+            sched_yield();
+            currentState = atomic_load_explicit(state, memory_order_acquire);
+            continue;
+        }
+        if (atomic_compare_exchange_weak_explicit(state, &currentState, tag | FRAME_STATE_COMPUTING, memory_order_acquire, memory_order_acquire))
+            break;
+    }
+    
+    // A frame from an earlier run of this track costs a copy instead of an FFT
+    SInt32 jumpSize = stream->fatherAudioData->fftOverlapJumpSize;
+    const float *cachedFrame = NULL;
+    if (StreamCacheMatchesAudio(stream) && frameTime >= 0 && frameTime % jumpSize == 0)
+        cachedFrame = SpectrogramCacheGetFrames(stream->cache, stream->cacheChannel, frameTime / jumpSize, NULL);
+    if (cachedFrame)
+    {
+        memcpy(frame, cachedFrame, CHUNK_SIZE * sizeof(float));
+        atomic_store_explicit(state, tag, memory_order_release);
+        return YES;
+    }
+    
+    // A frame's window starts at the frame's time (see AddAudioChunkToBuffer)
+    UInt32 generation = AudioCircularBufferBeginRead(&stream->samples);
+    SInt64 samplesIndex = frameTime - stream->samples.offset;
+    int availableBytes = 0;
+    float *samples = (float *)TPCircularBufferTail(&stream->samples.circularBuffer, &availableBytes);
+    BOOL success = samplesIndex >= 0 && (samplesIndex + CHUNK_SIZE) * (SInt64)sizeof(float) <= availableBytes;
+    if (success)
+    {
+        float fftResults[CHUNK_SIZE];
+        SpectrumAnalysisFFT(samples + samplesIndex, CHUNK_SIZE, fftResults);
+        success = AudioCircularBufferValidateRead(&stream->samples, generation);
+        if (success)
+        {
+            memcpy(frame, fftResults, sizeof(fftResults));
+            atomic_fetch_add_explicit(&stream->numFramesComputed, 1, memory_order_relaxed);
+        }
+    }
+    
+    atomic_store_explicit(state, success ? tag : 0, memory_order_release);
+    return success;
+}
+
+// Makes sure the numFrames frames starting with the one covering timeInFrames are computed.
+// Returns how many of them are ready, which in eager mode is just how many are in the ring.
+// Validate the fftResults generation afterwards, as with any other read of the ring.
+int AudioStreamComputeFrames(CircularAudioStream *stream, SInt64 timeInFrames, int numFrames)
+{
+    SInt32 jumpSize = stream->fatherAudioData->fftOverlapJumpSize;
+    SInt64 offset = stream->fftResults.offset;
+    
+    int availableBytes = 0;
+    float (*frames)[CHUNK_SIZE] = (float (*)[CHUNK_SIZE])TPCircularBufferTail(&stream->fftResults.circularBuffer, &availableBytes);
+    SInt64 firstFrame = (timeInFrames - offset) / jumpSize;
+    int numFramesInRing = availableBytes / (int)(CHUNK_SIZE * sizeof(float));
+    if (timeInFrames < offset || firstFrame >= numFramesInRing) return 0;
+    numFrames = (int)MIN(numFrames, numFramesInRing - firstFrame);
+    
+    if (!stream->fatherAudioData->lazyAnalysis) return numFrames;
+    
+    for (int i=0;i<numFrames;i++)
+    {
+        SInt64 frame = firstFrame + i;
+        if (!ComputeLazyFrame(stream, frames[frame], offset + frame * jumpSize)) return i;
+    }
+    
+    return numFrames;
+}
+
+// The frames a read at timeInFrames gets: just the one covering it, or with averaging, the ones
+// since the previous read. Frames older than oldestFrameTime are left out.
+static int ScheduledReadWindow(CircularAudioStorage *storage, const SpectrumReadSchedule *schedule, SInt64 timeInFrames, SInt64 oldestFrameTime, SInt64 *firstFrameTime)
+{
+    SInt32 jumpSize = storage->fftOverlapJumpSize;
+    int numFrames = schedule->averageSkippedFrames ? MAX(1, (int)(storage->sampleRate / schedule->readRate / jumpSize)) : 1;
+    
+    *firstFrameTime = timeInFrames - (SInt64)(numFrames - 1) * jumpSize;
+    if (*firstFrameTime < oldestFrameTime)
+    {
+        int numTooOld = (int)((oldestFrameTime - *firstFrameTime + jumpSize - 1) / jumpSize);
+        *firstFrameTime += (SInt64)numTooOld * jumpSize;
+        numFrames -= numTooOld;
+    }
+    
+    return numFrames;
+}
+
+// In lazy mode, computes the frames the registered schedules are going to read out of the frames
+// just added (from firstNewFrame on). Everything else stays lazy.
+static void ComputeScheduledFrames(CircularAudioStream *stream, int firstNewFrame)
+{
+    CircularAudioStorage *storage = stream->fatherAudioData;
+    SInt32 jumpSize = storage->fftOverlapJumpSize;
+    
+    int availableBytes = 0;
+    TPCircularBufferTail(&stream->fftResults.circularBuffer, &availableBytes);
+    int numFrames = availableBytes / (int)(CHUNK_SIZE * sizeof(float));
+    SInt64 offset = stream->fftResults.offset;
+    SInt64 firstNewFrameTime = offset + (SInt64)firstNewFrame * jumpSize;
+    SInt64 endTime = offset + (SInt64)numFrames * jumpSize;
+    
+    for (int i=0;i<MAX_SPECTRUM_READ_SCHEDULES;i++)
+    {
+        SpectrumReadSchedule *schedule = &storage->readSchedules[i];
+        if (!atomic_load_explicit(&schedule->isRegistered, memory_order_acquire) || schedule->readRate <= 0) continue;
+        
+        Float64 period = storage->sampleRate / schedule->readRate;
+        for (SInt64 read = (SInt64)ceil((firstNewFrameTime - schedule->alignment) / period);; read++)
+        {
+            SInt64 readTime = schedule->alignment + (SInt64)floor(read * period);
+            if (readTime >= endTime) break;
+            
+            SInt64 firstFrameTime;
+            int numWindowFrames = ScheduledReadWindow(storage, schedule, readTime, offset, &firstFrameTime);
+            if (numWindowFrames > 0) AudioStreamComputeFrames(stream, firstFrameTime, numWindowFrames);
+        }
+    }
+}
+
+// Registers a consumer that reads readRate times per second, with one of the reads at alignment.
+// Returns -1 if all the schedules are taken. Add and remove schedules from one thread.
+int CircularAudioStorageAddReadSchedule(CircularAudioStorage *storage, Float64 readRate, SInt64 alignment, Boolean averageSkippedFrames)
+{
+    if (readRate <= 0) return -1;
+    
+    for (int i=0;i<MAX_SPECTRUM_READ_SCHEDULES;i++)
+    {
+        SpectrumReadSchedule *schedule = &storage->readSchedules[i];
+        if (atomic_load_explicit(&schedule->isRegistered, memory_order_relaxed)) continue;
+        
+        schedule->readRate = readRate;
+        schedule->alignment = alignment;
+        schedule->averageSkippedFrames = averageSkippedFrames;
+        atomic_store_explicit(&schedule->isRegistered, true, memory_order_release);
+        return i;
+    }
+    
+    return -1;
+}
+
+void CircularAudioStorageRemoveReadSchedule(CircularAudioStorage *storage, int scheduleID)
+{
+    if (scheduleID < 0 || scheduleID >= MAX_SPECTRUM_READ_SCHEDULES) return;
+    atomic_store_explicit(&storage->readSchedules[scheduleID].isRegistered, false, memory_order_release);
+}
+
+// The spectrum a schedule's read at timeInFrames gets. With averaging, that's the power average of
+// the frames since the previous read, so nothing in between is lost. Otherwise it's the frame covering
+// timeInFrames, as with AudioStreamGetSpectrumAtTime.
+BOOL AudioStreamGetScheduledSpectrum(CircularAudioStream *stream, int scheduleID, SInt64 timeInFrames, float *result)
+{
+    CircularAudioStorage *storage = stream->fatherAudioData;
+    if (scheduleID < 0 || scheduleID >= MAX_SPECTRUM_READ_SCHEDULES) return AudioStreamGetSpectrumAtTime(stream, timeInFrames, result);
+    SpectrumReadSchedule *schedule = &storage->readSchedules[scheduleID];
+    if (!atomic_load_explicit(&schedule->isRegistered, memory_order_acquire) || !schedule->averageSkippedFrames)
+        return AudioStreamGetSpectrumAtTime(stream, timeInFrames, result);
+    
+    SInt32 jumpSize = storage->fftOverlapJumpSize;
+    UInt32 generation = AudioCircularBufferBeginRead(&stream->fftResults);
+    SInt64 offset = stream->fftResults.offset;
+    
+    SInt64 firstFrameTime;
+    int numFrames = ScheduledReadWindow(storage, schedule, timeInFrames, offset, &firstFrameTime);
+    if (numFrames > 0) numFrames = AudioStreamComputeFrames(stream, firstFrameTime, numFrames);
+    if (numFrames <= 0) return AudioStreamGetSpectrumAtTime(stream, timeInFrames, result);
+    
+    int availableBytes = 0;
+    float (*frames)[CHUNK_SIZE] = (float (*)[CHUNK_SIZE])TPCircularBufferTail(&stream->fftResults.circularBuffer, &availableBytes);
+    SInt64 firstFrame = (firstFrameTime - offset) / jumpSize;
+    
+    float power[CHUNK_SIZE];
+    vDSP_vclr(power, 1, CHUNK_SIZE);
+    for (int i=0;i<numFrames;i++)
+        vDSP_vma(frames[firstFrame + i], 1, frames[firstFrame + i], 1, power, 1, power, 1, CHUNK_SIZE);
+    float scale = 1.0f / numFrames;
+    vDSP_vsmul(power, 1, &scale, power, 1, CHUNK_SIZE);
+    int count = CHUNK_SIZE;
+    vvsqrtf(result, power, &count);
+    
+    return AudioCircularBufferValidateRead(&stream->fftResults, generation);
+}
+
+static void BroadcastNewFrames(CircularAudioStream *stream, int firstNewFrame)
+{
+    int availableBytes = 0;
+    float (*frames)[CHUNK_SIZE] = (float (*)[CHUNK_SIZE])TPCircularBufferTail(&stream->fftResults.circularBuffer, &availableBytes);
+    int numFrames = availableBytes / (CHUNK_SIZE * sizeof(float));
+    SInt32 jumpSize = stream->fatherAudioData->fftOverlapJumpSize;
+    
+    // A broadcast reader reads every frame, so when there is one, lazy frames are computed right away
+    if (stream->fatherAudioData->lazyAnalysis)
+    {
+        if (!SpectrumBroadcastRingHasReaders(stream->broadcast)) return;
+        numFrames = firstNewFrame + AudioStreamComputeFrames(stream, stream->fftResults.offset + (SInt64)firstNewFrame * jumpSize, numFrames - firstNewFrame);
+    }
+    
+    for (int i=firstNewFrame;i<numFrames;i++)
+        SpectrumBroadcastRingPublish(stream->broadcast, frames[i], stream->fftResults.offset + (SInt64)i * jumpSize);
+}
+
+static void MoveOldestFramesToHistory(CircularAudioStream *stream, int numFrames)
+{
+    int availableBytes = 0;
+    float (*frames)[CHUNK_SIZE] = (float (*)[CHUNK_SIZE])TPCircularBufferTail(&stream->fftResults.circularBuffer, &availableBytes);
+    SInt32 jumpSize = stream->fatherAudioData->fftOverlapJumpSize;
+    numFrames = MIN(numFrames, availableBytes / (int)(CHUNK_SIZE * sizeof(float)));
+    
+    for (int i=0;i<numFrames;i++)
+    {
+        SInt64 frameTime = stream->fftResults.offset + (SInt64)i * jumpSize;
+        
+        // In lazy mode, frames nobody read were never computed, and aren't worth keeping either
+        if (stream->fatherAudioData->lazyAnalysis && !IsFrameComputed(stream, frames[i], frameTime)) continue;
+        SpectrogramHistoryAddFrame(stream->history, frameTime / jumpSize, frames[i]);
+    }
+}
+
+static void AddNewFramesToCache(CircularAudioStream *stream, int firstNewFrame)
+{
+    int availableBytes = 0;
+    float (*frames)[CHUNK_SIZE] = (float (*)[CHUNK_SIZE])TPCircularBufferTail(&stream->fftResults.circularBuffer, &availableBytes);
+    int numFrames = availableBytes / (CHUNK_SIZE * sizeof(float));
+    SInt32 jumpSize = stream->fatherAudioData->fftOverlapJumpSize;
+    
+    // Frames off the jump grid (after a seek), or of scaled audio, get no frame number, which the cache takes as a gap
+    BOOL isScaled = !StreamCacheMatchesAudio(stream);
+    for (int i=firstNewFrame;i<numFrames;i++)
+    {
+        SInt64 frameTime = stream->fftResults.offset + (SInt64)i * jumpSize;
+        SInt64 frameNumber = frameTime % jumpSize == 0 && !isScaled ? frameTime / jumpSize : -1;
+        SpectrogramCacheAddFrame(stream->cache, stream->cacheChannel, frameNumber, frames[i]);
+    }
+}
+
+// The free space right after a ring's data. Same memory as the head, but through the mirror when the
+// ring wraps, so whatever's written there follows on from the data without a seam
+static inline float *RingEnd(TPCircularBuffer *buffer)
+{
+    return (float *)((char *)buffer->buffer + buffer->tail + buffer->fillCount);
+}
+
+// Adds the chunk of samples already written at the end of samplesBuffer, and the frames it completes.
+// The previous chunk sits right before it, so every window is read straight out of the ring, and every
+// frame is computed straight into its slot.
+static void AddAudioChunkToBuffer(AudioCircularBuffer *samplesBuffer, AudioCircularBuffer *fftResultsBuffer, int chunkSize, int jumpSize)
+{
+    int chunkSizeInBytes = chunkSize * sizeof(float);
+    float *newSamples = RingEnd(&samplesBuffer->circularBuffer);
+    if (samplesBuffer->circularBuffer.fillCount < chunkSizeInBytes)
+    {
+        SpectrumAnalysisFFT(newSamples, chunkSize, RingEnd(&fftResultsBuffer->circularBuffer));
+        TPCircularBufferProduce(&fftResultsBuffer->circularBuffer, chunkSizeInBytes);
+        TPCircularBufferProduce(&samplesBuffer->circularBuffer, chunkSizeInBytes);
+        return;
+    }
+    
+    for (float *currentChunk = newSamples - chunkSize + jumpSize; currentChunk <= newSamples; currentChunk+=jumpSize)
+    {
+        SpectrumAnalysisFFT(currentChunk, chunkSize, RingEnd(&fftResultsBuffer->circularBuffer));
+        TPCircularBufferProduce(&fftResultsBuffer->circularBuffer, chunkSizeInBytes);
+    }
+    TPCircularBufferProduce(&samplesBuffer->circularBuffer, chunkSizeInBytes);
+}
+
+// Adds the same frames as AddAudioChunkToBuffer, but leaves them to be computed when first read
+static void AddAudioChunkToBufferLazily(AudioCircularBuffer *samplesBuffer, AudioCircularBuffer *fftResultsBuffer, int chunkSize, int jumpSize)
+{
+    int chunkSizeInBytes = chunkSize * sizeof(float);
+    int numNewFrames = samplesBuffer->circularBuffer.fillCount < chunkSizeInBytes ? 1 : chunkSize / jumpSize;
+    TPCircularBufferProduce(&fftResultsBuffer->circularBuffer, numNewFrames * chunkSizeInBytes);
+    TPCircularBufferProduce(&samplesBuffer->circularBuffer, chunkSizeInBytes);
+}
+
+// Makes room for numSamplesToAdd more samples in a stream and returns where the caller should write them.
+// Returns NULL if there's no room that isn't still to be played.
+static float *BeginAddingAudioToStream(CircularAudioStream *stream, int numSamplesToAdd)
 {
     CircularAudioStorage *liveAudioData = stream->fatherAudioData;
     
@@ -35,45 +357,310 @@ BOOL AddAudioToLiveStream(float *samples, int numSamplesToAdd, CircularAudioStre
     UInt32 floatsNeededToStoreFFTResults = numSamplesToAdd / liveAudioData->fftOverlapJumpSize * CHUNK_SIZE;
     
     // If there is no enough space to add the new audio, remove the oldest data (which must be already-played)
-    if (!canAddToStream(stream, numSamplesToAdd)) return NO;
+    if (!canAddToStream(stream, numSamplesToAdd)) return NULL;
+    if (stream->history && !isThereEnoughPlaceToWrite(&stream->fftResults.circularBuffer, floatsNeededToStoreFFTResults * sizeof(float)))
+        MoveOldestFramesToHistory(stream, floatsNeededToStoreFFTResults / CHUNK_SIZE);
     PrepareAudioCircularBuffer(&stream->samples, floatsNeededToStoreSamples, numSamplesToAdd);
     PrepareAudioCircularBuffer(&stream->fftResults, floatsNeededToStoreFFTResults, numSamplesToAdd);
     
-    // Actually processing and adding the audio
-    
-    float modifiedSamples[numSamplesToAdd];
-    AmplitudeFactor(samples, numSamplesToAdd, liveAudioData->amplitudeFactor, modifiedSamples);
+    return RingEnd(&stream->samples.circularBuffer);
+}
 
+// Analyses and publishes the samples written where BeginAddingAudioToStream said, chunk by chunk
+static void FinishAddingAudioToStream(CircularAudioStream *stream, int numSamplesToAdd)
+{
+    CircularAudioStorage *liveAudioData = stream->fatherAudioData;
+    
     for (int i=0;i<numSamplesToAdd / CHUNK_SIZE;i++)
-        AddAudioChunkToBuffer(&stream->samples, &stream->fftResults, modifiedSamples + i * CHUNK_SIZE, CHUNK_SIZE, liveAudioData->fftOverlapJumpSize);
+    {
+        int numFramesBefore = stream->fftResults.circularBuffer.fillCount / (CHUNK_SIZE * sizeof(float));
+        if (liveAudioData->lazyAnalysis)
+            AddAudioChunkToBufferLazily(&stream->samples, &stream->fftResults, CHUNK_SIZE, liveAudioData->fftOverlapJumpSize);
+        else
+            AddAudioChunkToBuffer(&stream->samples, &stream->fftResults, CHUNK_SIZE, liveAudioData->fftOverlapJumpSize);
+        
+        int numNewFrames = stream->fftResults.circularBuffer.fillCount / (CHUNK_SIZE * sizeof(float)) - numFramesBefore;
+        stream->numFramesProduced += numNewFrames;
+        if (!liveAudioData->lazyAnalysis)
+        {
+            atomic_fetch_add_explicit(&stream->numFramesComputed, numNewFrames, memory_order_relaxed);
+            if (stream->cache && stream->cache->isWritable) AddNewFramesToCache(stream, numFramesBefore);
+        }
+        else ComputeScheduledFrames(stream, numFramesBefore);
+        if (stream->broadcast) BroadcastNewFrames(stream, numFramesBefore);
+    }
+}
+
+BOOL AddAudioToLiveStream(float *samples, int numSamplesToAdd, CircularAudioStream *stream)
+{
+    CircularAudioStorage *liveAudioData = stream->fatherAudioData;
+    
+    float *destination = BeginAddingAudioToStream(stream, numSamplesToAdd);
+    if (!destination) return NO;
+    
+    // Scaled on the way into the ring, so the samples are only moved once
+    AmplitudeFactor(samples, numSamplesToAdd, liveAudioData->amplitudeFactor, destination);
+    liveAudioData->numSampleBytesCopied += numSamplesToAdd * sizeof(float);
     
+    FinishAddingAudioToStream(stream, numSamplesToAdd);
     return YES;
 }
 
-void AddAudioChunkToBuffer(AudioCircularBuffer *samplesBuffer, AudioCircularBuffer *fftResultsBuffer, float *newSamples, int chunkSize, int jumpSize)
+// Adds liveAudioData->numChannels interleaved channels, each to its own stream. Each sample is scaled
+// and moved to its stream's ring in a single pass, and analysed where it lands.
+BOOL AddInterleavedAudioToLiveStream(float *samples, int numSamplesToAddPerChannel, CircularAudioStorage *liveAudioData)
 {
-    float fftResults[chunkSize];
-    int chunkSizeInBytes = chunkSize * sizeof(float);
-    if (samplesBuffer->circularBuffer.fillCount < chunkSizeInBytes)
+    UInt32 numChannels = liveAudioData->numChannels;
+    if (numSamplesToAddPerChannel > liveAudioData->maxFramesPerAdd) return NO;
+    
+    // Checking all the channels first, so they never go out of sync
+    if (!canAddToLiveAudioData(liveAudioData, numSamplesToAddPerChannel)) return NO;
+    
+    float *destinations[MAX_AUDIO_CHANNELS];
+    for (UInt32 i=0;i<numChannels;i++)
+        destinations[i] = BeginAddingAudioToStream(&liveAudioData->channels[i], numSamplesToAddPerChannel);
+    
+    ScaleAndDeinterleaveSamples(samples, numChannels, numSamplesToAddPerChannel, liveAudioData->amplitudeFactor, destinations);
+    liveAudioData->numSampleBytesCopied += (UInt64)numChannels * numSamplesToAddPerChannel * sizeof(float);
+    liveAudioData->numFramesAdded += numSamplesToAddPerChannel;
+    
+    for (UInt32 i=0;i<numChannels;i++)
+        FinishAddingAudioToStream(&liveAudioData->channels[i], numSamplesToAddPerChannel);
+    
+    return YES;
+}
+
+static UInt64 MinChunksDone(AudioPipeline *pipeline)
+{
+    UInt64 numChunksDone = atomic_load_explicit(&pipeline->numChunksQueued, memory_order_acquire);
+    for (UInt32 i=1;i<pipeline->numStages;i++)
+        numChunksDone = MIN(numChunksDone, atomic_load_explicit(&pipeline->stages[i].numChunksDone, memory_order_acquire));
+    return numChunksDone;
+}
+
+// Does one chunk of a stage. Returns NO if there's none for it, or no room for it yet
+static BOOL RunPipelineStageChunk(AudioPipelineStage *stage, const AudioPipelineChunk *chunk)
+{
+    CircularAudioStorage *storage = stage->pipeline->storage;
+    float factor = storage->amplitudeFactor;
+    
+    switch (stage->type)
     {
-        AcceleratedFFT(newSamples, chunkSize, fftResults);
-        TPCircularBufferProduceBytes(&fftResultsBuffer->circularBuffer, fftResults, chunkSizeInBytes);
-        TPCircularBufferProduceBytes(&samplesBuffer->circularBuffer, newSamples, chunkSizeInBytes);
-        return;
+        case AudioPipelineStage_Analysis:
+        {
+            CircularAudioStream *stream = &storage->channels[stage->channel];
+            float *destination = BeginAddingAudioToStream(stream, chunk->numFrames);
+            if (!destination) return NO;
+            vDSP_vsmul(chunk->samples + stage->channel, storage->numChannels, &factor, destination, 1, chunk->numFrames);
+            FinishAddingAudioToStream(stream, chunk->numFrames);
+            return YES;
+        }
+        case AudioPipelineStage_CenterExtraction:
+        {
+            float *destination = BeginAddingAudioToStream(&storage->extractedChannel, chunk->numFrames);
+            if (!destination) return NO;
+            
+            // takes ~36 ms a chunk on device, which is why it gets a stage of its own. The center comes out on both sides
+            float extracted[2 * chunk->numFrames];
+            CenterCut((float *)chunk->samples, 2 * chunk->numFrames, extracted, (int)storage->sampleRate, true, false);
+            vDSP_vsmul(extracted, 2, &factor, destination, 1, chunk->numFrames);
+            FinishAddingAudioToStream(&storage->extractedChannel, chunk->numFrames);
+            return YES;
+        }
+        case AudioPipelineStage_Play:
+        {
+            stage->pipeline->play(stage->pipeline->playContext, chunk->samples, chunk->numFrames, MIN(chunk->numFramesToSkipPlaying, chunk->numFrames));
+            return YES;
+        }
+        default:
+            return NO;
     }
+}
+
+// A stage's lane on the worker pool. Takes the next chunk off the stage's end of the queue
+static Boolean RunPipelineStage(void *context)
+{
+    AudioPipelineStage *stage = (AudioPipelineStage *)context;
+    AudioPipeline *pipeline = stage->pipeline;
     
-    int availableBytes = 0;
-    float *lastChunk = TPCircularBufferTail(&samplesBuffer->circularBuffer, &availableBytes) + availableBytes - chunkSizeInBytes;
-    float mergedChunks[chunkSize * 2];
-    memcpy(mergedChunks, lastChunk, chunkSizeInBytes);
-    memcpy(mergedChunks + chunkSize, newSamples, chunkSizeInBytes);
-    for (float *currentChunk = mergedChunks + jumpSize; currentChunk <= mergedChunks + chunkSize; currentChunk+=jumpSize)
+    UInt64 chunkIndex = atomic_load_explicit(&stage->numChunksDone, memory_order_relaxed);
+    if (chunkIndex >= atomic_load_explicit(&pipeline->numChunksQueued, memory_order_acquire)) return false;
+    const AudioPipelineChunk *chunk = &pipeline->chunks[chunkIndex % AUDIO_PIPELINE_DEPTH];
+    
+    uint64_t startTime = mach_absolute_time();
+    if (!RunPipelineStageChunk(stage, chunk)) return false;
+    atomic_fetch_add_explicit(&stage->busyNanoseconds, (UInt64)(machToMiliseconds(mach_absolute_time() - startTime) * 1000000.0), memory_order_relaxed);
+    atomic_fetch_add_explicit(&stage->numFramesDone, chunk->numFrames, memory_order_relaxed);
+    
+    atomic_store_explicit(&stage->numChunksDone, chunkIndex + 1, memory_order_release);
+    AudioWakeupSignal(&pipeline->progressed);
+    return true;
+}
+
+static void NotifyPipelineStages(AudioPipeline *pipeline)
+{
+    for (UInt32 i=1;i<pipeline->numStages;i++) AudioWorkerPoolNotify(pipeline->pool, pipeline->stages[i].laneID);
+}
+
+static BOOL AddPipelineStage(AudioPipeline *pipeline, AudioPipelineStageType type, UInt32 channel)
+{
+    if (pipeline->numStages >= AUDIO_PIPELINE_MAX_STAGES) return NO;
+    
+    AudioPipelineStage *stage = &pipeline->stages[pipeline->numStages];
+    stage->pipeline = pipeline;
+    stage->type = type;
+    stage->channel = channel;
+    stage->maxQueueDepth = 0;
+    atomic_init(&stage->numChunksDone, 0);
+    atomic_init(&stage->numFramesDone, 0);
+    atomic_init(&stage->busyNanoseconds, 0);
+    stage->laneID = type == AudioPipelineStage_Decode ? -1 : AudioWorkerPoolAddLane(pipeline->pool, RunPipelineStage, stage);
+    if (type != AudioPipelineStage_Decode && stage->laneID < 0) return NO;
+    
+    pipeline->numStages++;
+    return YES;
+}
+
+// Sets up a stage per channel the storage has right now. Call again (after cleaning up) when that changes
+BOOL AudioPipelineInit(AudioPipeline *pipeline, CircularAudioStorage *storage, AudioWorkerPool *pool, BOOL extractsCenter, AudioPipelinePlayFunction play, void *playContext)
+{
+    pipeline->storage = storage;
+    pipeline->pool = pool;
+    pipeline->play = play;
+    pipeline->playContext = playContext;
+    atomic_init(&pipeline->numChunksQueued, 0);
+    pipeline->numChunksRetired = 0;
+    pipeline->numStages = 0;
+    
+    // the wake-up is kept from one init to the next, as someone may still be counted in on it
+    if (!pipeline->progressed.semaphore) AudioWakeupInit(&pipeline->progressed);
+    
+    BOOL success = AddPipelineStage(pipeline, AudioPipelineStage_Decode, 0);
+    for (UInt32 i=0;i<storage->numChannels;i++)
+        success = success && AddPipelineStage(pipeline, AudioPipelineStage_Analysis, i);
+    if (extractsCenter && storage->numChannels == 2)
+        success = success && AddPipelineStage(pipeline, AudioPipelineStage_CenterExtraction, 0);
+    if (play)
+        success = success && AddPipelineStage(pipeline, AudioPipelineStage_Play, 0);
+    
+    if (!success) AudioPipelineCleanup(pipeline);
+    return success;
+}
+
+// Must be called with nothing in flight (see AudioPipelineDrain)
+void AudioPipelineCleanup(AudioPipeline *pipeline)
+{
+    for (UInt32 i=1;i<pipeline->numStages;i++) AudioWorkerPoolRemoveLane(pipeline->pool, pipeline->stages[i].laneID);
+    pipeline->numStages = 0;
+}
+
+// Chunks queued and not retired yet, which is where the producer's next chunk starts in its buffer
+UInt32 AudioPipelineNumChunksInFlight(AudioPipeline *pipeline)
+{
+    return (UInt32)(atomic_load_explicit(&pipeline->numChunksQueued, memory_order_relaxed) - pipeline->numChunksRetired);
+}
+
+// Whether the streams can take one more chunk on top of the ones in flight without reclaiming
+// anything that's still to be played. The play rings are the caller's to check.
+BOOL AudioPipelineHasRoomForChunk(AudioPipeline *pipeline)
+{
+    UInt32 numChunksInFlight = AudioPipelineNumChunksInFlight(pipeline);
+    if (numChunksInFlight >= AUDIO_PIPELINE_DEPTH) return NO;
+    
+    int numSamples = (numChunksInFlight + 1) * CHUNK_SIZE;
+    if (!canAddToLiveAudioData(pipeline->storage, numSamples)) return NO;
+    for (UInt32 i=1;i<pipeline->numStages;i++)
+    {
+        if (pipeline->stages[i].type == AudioPipelineStage_CenterExtraction && !canAddToStream(&pipeline->storage->extractedChannel, numSamples)) return NO;
+    }
+    return YES;
+}
+
+// Called by the producer. samples (interleaved, numFrames a multiple of CHUNK_SIZE) must stay put until
+// AudioPipelineRetireChunks says every stage is done with them. Returns NO if the queue is full.
+BOOL AudioPipelineQueueChunk(AudioPipeline *pipeline, const float *samples, UInt32 numFrames, UInt32 numFramesToSkipPlaying)
+{
+    CircularAudioStorage *storage = pipeline->storage;
+    if (numFrames > storage->maxFramesPerAdd || numFrames % CHUNK_SIZE != 0) return NO;
+    
+    UInt64 chunkIndex = atomic_load_explicit(&pipeline->numChunksQueued, memory_order_relaxed);
+    if (chunkIndex - MinChunksDone(pipeline) >= AUDIO_PIPELINE_DEPTH) return NO;
+    
+    pipeline->chunks[chunkIndex % AUDIO_PIPELINE_DEPTH] = (AudioPipelineChunk){samples, numFrames, numFramesToSkipPlaying};
+    atomic_store_explicit(&pipeline->numChunksQueued, chunkIndex + 1, memory_order_release);
+    NotifyPipelineStages(pipeline);
+    
+    // The counters are the producer's, so the stages never touch them
+    for (UInt32 i=1;i<pipeline->numStages;i++)
     {
-        AcceleratedFFT(currentChunk, chunkSize, fftResults);
-        TPCircularBufferProduceBytes(&fftResultsBuffer->circularBuffer, fftResults, chunkSizeInBytes);
+        AudioPipelineStage *stage = &pipeline->stages[i];
+        stage->maxQueueDepth = MAX(stage->maxQueueDepth, (UInt32)(chunkIndex + 1 - atomic_load_explicit(&stage->numChunksDone, memory_order_relaxed)));
+        if (stage->type == AudioPipelineStage_Play)
+            storage->numSampleBytesCopied += (UInt64)(numFrames - MIN(numFramesToSkipPlaying, numFrames)) * storage->numChannels * sizeof(float);
+        else
+            storage->numSampleBytesCopied += (UInt64)numFrames * (stage->type == AudioPipelineStage_Analysis ? 1 : 2) * sizeof(float);
     }
-    TPCircularBufferProduceBytes(&samplesBuffer->circularBuffer, newSamples, chunkSizeInBytes);
+    storage->numFramesAdded += numFrames;
     
+    return YES;
+}
+
+// Called by the producer. Returns how many more of the oldest chunks every stage is done with, so their samples can go
+UInt32 AudioPipelineRetireChunks(AudioPipeline *pipeline)
+{
+    UInt64 numChunksDone = MinChunksDone(pipeline);
+    UInt32 numChunksRetired = (UInt32)(numChunksDone - pipeline->numChunksRetired);
+    pipeline->numChunksRetired = numChunksDone;
+    return numChunksRetired;
+}
+
+// Sleeps until a stage finishes a chunk, or the deadline passes. Stages that stopped for lack of room are
+// given another go first. Returns NO if nothing was finished
+BOOL AudioPipelineWaitForProgress(AudioPipeline *pipeline, dispatch_time_t deadline)
+{
+    UInt64 numChunksDone = MinChunksDone(pipeline);
+    UInt64 numChunksQueued = atomic_load_explicit(&pipeline->numChunksQueued, memory_order_relaxed);
+    if (numChunksDone == numChunksQueued) return NO;
+    
+    NotifyPipelineStages(pipeline);
+    return AudioWakeupWait(&pipeline->progressed, ^BOOL{ return MinChunksDone(pipeline) != numChunksDone; }, deadline);
+}
+
+// Waits until every stage is done with every chunk queued
+void AudioPipelineDrain(AudioPipeline *pipeline)
+{
+    while (MinChunksDone(pipeline) < atomic_load_explicit(&pipeline->numChunksQueued, memory_order_relaxed))
+        AudioPipelineWaitForProgress(pipeline, dispatch_time(DISPATCH_TIME_NOW, 100 * NSEC_PER_MSEC));
+}
+
+// The decoder isn't a lane, so the producer reports what it decoded and how long that took
+void AudioPipelineNoteDecoded(AudioPipeline *pipeline, UInt32 numFrames, uint64_t machTime)
+{
+    if (pipeline->numStages == 0) return;
+    AudioPipelineStage *stage = &pipeline->stages[0];
+    atomic_fetch_add_explicit(&stage->busyNanoseconds, (UInt64)(machToMiliseconds(machTime) * 1000000.0), memory_order_relaxed);
+    atomic_fetch_add_explicit(&stage->numFramesDone, numFrames, memory_order_relaxed);
+}
+
+// Fills stats with up to maxStages stages, the decoder first. Returns how many it filled.
+// The decoder's queue depth is the chunks in flight.
+int AudioPipelineGetStats(AudioPipeline *pipeline, AudioPipelineStageStats *stats, int maxStages)
+{
+    UInt64 numChunksQueued = atomic_load_explicit(&pipeline->numChunksQueued, memory_order_acquire);
+    int numStages = MIN((int)pipeline->numStages, maxStages);
+    for (int i=0;i<numStages;i++)
+    {
+        AudioPipelineStage *stage = &pipeline->stages[i];
+        AudioPipelineStageStats *stageStats = &stats[i];
+        stageStats->type = stage->type;
+        stageStats->channel = stage->channel;
+        stageStats->numFrames = atomic_load_explicit(&stage->numFramesDone, memory_order_relaxed);
+        stageStats->busySeconds = atomic_load_explicit(&stage->busyNanoseconds, memory_order_relaxed) / 1e9;
+        stageStats->framesPerSecond = stageStats->busySeconds > 0 ? stageStats->numFrames / stageStats->busySeconds : 0;
+        stageStats->queueDepth = i == 0 ? AudioPipelineNumChunksInFlight(pipeline) : (UInt32)(numChunksQueued - atomic_load_explicit(&stage->numChunksDone, memory_order_relaxed));
+        stageStats->maxQueueDepth = i == 0 ? AUDIO_PIPELINE_DEPTH : stage->maxQueueDepth;
+    }
+    return numStages;
 }
 
 void CopySamples(float *samples, int numSamples, float *result)
@@ -149,6 +736,33 @@ void SplitStereoSamples(float *samples, long samplesCount, float *leftChannnel,
     vDSP_vsadd(samples+1, numChannels, &zero, rightChannel, 1, samplesCount/2);
 }
 
+// Splits interleaved samples into numChannels planes, planeStride floats apart
+void DeinterleaveSamples(const float *samples, UInt32 numChannels, UInt32 numFramesPerChannel, float *planes, UInt32 planeStride)
+{
+    if (numChannels == 1)
+    {
+        if (planes != samples) memcpy(planes, samples, numFramesPerChannel * sizeof(float));
+        return;
+    }
+    
+    if (planeStride == numFramesPerChannel)
+    {
+        // Interleaved samples are a numFrames x numChannels matrix, and its transpose is exactly the planes
+        vDSP_mtrans(samples, 1, planes, 1, numChannels, numFramesPerChannel);
+        return;
+    }
+    
+    for (UInt32 i=0;i<numChannels;i++)
+        cblas_scopy(numFramesPerChannel, samples + i, numChannels, planes + i * planeStride, 1);
+}
+
+// Splits interleaved samples into numChannels separate destinations and scales them, in one pass
+void ScaleAndDeinterleaveSamples(const float *samples, UInt32 numChannels, UInt32 numFramesPerChannel, float factor, float *const *destinations)
+{
+    for (UInt32 i=0;i<numChannels;i++)
+        vDSP_vsmul(samples + i, numChannels, &factor, destinations[i], 1, numFramesPerChannel);
+}
+
 void CombineStereoSamples(float *leftChannel, float *rightChannel, float *result, long numSamplesPerChannel)
 {
     int numChannels = 2;
@@ -162,85 +776,25 @@ void Mix(float *samples1, float *samples2, float *result, UInt64 size)
     vDSP_vadd(samples1, 1, samples2, 1, result, 1, size);
 }
 
-int TimeToSampleTime(float seconds, int sampleRate)
+int TimeToSampleTime(float seconds, Float64 sampleRate)
 {
     return sampleRate * (seconds);
 }
 
-float SampleTimeToSeconds(UInt64 sampleTime, int sampleRate)
-{
-    return (float)sampleTime / sampleRate;
-}
-
-int FFTBinToFrequency(int binIndex, int sampleRate, int chunkSize)
-{
-    return binIndex * sampleRate / chunkSize;
-}
-
-int FrequencyToBinIndex(int frequency, int sampleRate, int chunkSize)
+float SampleTimeToSeconds(UInt64 sampleTime, Float64 sampleRate)
 {
-    return frequency * chunkSize / (float)sampleRate;
+    return (float)(sampleTime / sampleRate);
 }
 
-// Takes some samples and a pointer to a two dimensional array in the form of arr[samplesCount / CHUNK_SIZE][CHUNK_SIZE]
-// Fills the array with the FFT results (in magnitudes) divided to chunks of time.
-// The frequencies can later be accessed as arr[chunkIndex][binIndex]
-void Chunked_FFT(float *samples, long sampleCount, float *fftResults, int chunkSize)
+// The rate is the one the spectra were computed at (LiveAudioData.sampleRate), which isn't always 44.1 kHz
+int FFTBinToFrequency(int binIndex, Float64 sampleRate, int chunkSize)
 {
-    for (int i =0;i<sampleCount / chunkSize;i++)
-    {
-        float *currentChunk = &samples[i * chunkSize];
-        float *chunkResult = &(fftResults[i*chunkSize]);
-        AcceleratedFFT(currentChunk, chunkSize, chunkResult);
-    }
+    return (int)(binIndex * sampleRate / chunkSize);
 }
 
-void AcceleratedFFT(float *samples, int numSamples, float *result)
+int FrequencyToBinIndex(int frequency, Float64 sampleRate, int chunkSize)
 {
-    static FFTSetup fftSetup = NULL;
-    static int maxFFTSize = 0;
-    
-    vDSP_Length log2n = log2f(numSamples);
-    
-    if (fftSetup && maxFFTSize < numSamples)
-    {
-        vDSP_destroy_fftsetup(fftSetup);
-        fftSetup = NULL;
-    }
-    
-    if (fftSetup == NULL)
-    {
-        // Calculate the weights array. This is a one-off operation.
-        fftSetup = vDSP_create_fftsetup(log2n, FFT_RADIX2);
-        maxFFTSize = numSamples;
-    }
-    
-    // For an FFT, numSamples must be a power of 2, i.e. is always even
-    int nOver2 = numSamples/2;
-    
-    // Populate *window with the values for a hamming window function
-    float windowed[numSamples];
-    vDSP_hann_window(windowed, numSamples, 0);
-    //vDSP_blkman_window(windowed, numSamples, 0);
-    // Window the samples
-    vDSP_vmul(windowed, 1, samples, 1, windowed, 1, numSamples);
-    float realp[nOver2], imagp[nOver2];
-    // Define complex buffer
-    COMPLEX_SPLIT A;
-    A.realp = (float *)realp;
-    A.imagp = (float *)imagp;
-    
-    // Pack samples:
-    // C(re) -> A[n], C(im) -> A[n+1]
-    vDSP_ctoz((COMPLEX*)windowed, 2, &A, 1, numSamples/2);
-    vDSP_fft_zrip(fftSetup, &A, 1, log2n, FFT_FORWARD);
-    
-    //Convert COMPLEX_SPLIT A result to magnitudes
-    //result[0] = A.realp[0]/(numSamples*2);
-    for(int i=0; i<numSamples; i++)
-    {
-        result[i]=(sqrtf(A.realp[i]*A.realp[i]+A.imagp[i]*A.imagp[i]));
-    }
+    return frequency * chunkSize / sampleRate;
 }
 
 // call this function once in a program, before calling CenterCut()
@@ -272,14 +826,115 @@ void PrepareAudioCircularBuffer(AudioCircularBuffer *buffer, int floatsNeededToS
 {
     if (!isThereEnoughPlaceToWrite(&buffer->circularBuffer, floatsNeededToStoreData * sizeof(float)))
     {
+        // The consumed region is about to be overwritten, so readers still holding it must retry
+        AudioCircularBufferBeginWrite(buffer);
         TPCircularBufferConsume(&buffer->circularBuffer, floatsNeededToStoreData * sizeof(float));
         buffer->offset += numSamples;
+        AudioCircularBufferEndWrite(buffer);
+    }
+}
+
+void AudioCircularBufferBeginWrite(AudioCircularBuffer *buffer)
+{
+    atomic_fetch_add_explicit(&buffer->generation, 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+}
+
+void AudioCircularBufferEndWrite(AudioCircularBuffer *buffer)
+{
+    atomic_fetch_add_explicit(&buffer->generation, 1, memory_order_release);
+}
+
+UInt32 AudioCircularBufferBeginRead(AudioCircularBuffer *buffer)
+{
+    return atomic_load_explicit(&buffer->generation, memory_order_acquire);
+}
+
+// Returns YES if nothing was reclaimed since AudioCircularBufferBeginRead returned generation
+BOOL AudioCircularBufferValidateRead(AudioCircularBuffer *buffer, UInt32 generation)
+{
+    atomic_thread_fence(memory_order_acquire);
+    return (generation & 1) == 0 && atomic_load_explicit(&buffer->generation, memory_order_relaxed) == generation;
+}
+
+// Zero-copy readers call this after they are done with the pointers in channelData.
+// If it returns NO, what they read may be torn and should be thrown away.
+BOOL LiveAudioChannelDataIsValid(const LiveAudioChannelData *channelData)
+{
+    if (channelData->stream == NULL) return YES;
+    
+    CircularAudioStream *stream = (CircularAudioStream *)channelData->stream;
+    return AudioCircularBufferValidateRead(&stream->samples, channelData->samplesGeneration) &&
+           AudioCircularBufferValidateRead(&stream->fftResults, channelData->fftResultsGeneration);
+}
+
+// Copies channelData into caller-owned memory. Returns NO if the producer reclaimed the data
+// while it was being copied, in which case the caller should fetch new data and try again.
+// The producer is never blocked either way.
+BOOL LiveAudioChannelDataCopy(const LiveAudioChannelData *channelData, LiveAudioSnapshotBuffer *buffer, LiveAudioChannelData *snapshot)
+{
+    unsigned long numSamples = MIN(channelData->samples.numSamplesAvailable, buffer->samplesCapacity);
+    unsigned long numChunks = MIN(channelData->fftResults.numChunksAvailable, buffer->chunksCapacity);
+    if (!channelData->containsData) numSamples = numChunks = 0;
+    
+    if (numSamples > 0) memcpy(buffer->samples, channelData->samples.data, numSamples * sizeof(float));
+    if (numChunks > 0) memcpy(buffer->fftResults, channelData->fftResults.data, numChunks * CHUNK_SIZE * sizeof(float));
+    
+    if (!LiveAudioChannelDataIsValid(channelData)) return NO;
+    
+    *snapshot = *channelData;
+    snapshot->samples.data = buffer->samples;
+    snapshot->samples.numSamplesAvailable = numSamples;
+    snapshot->fftResults.data = buffer->fftResults;
+    snapshot->fftResults.numChunksAvailable = numChunks;
+    snapshot->stream = NULL;
+    
+    return YES;
+}
+
+void AudioWakeupInit(AudioWakeup *wakeup)
+{
+    wakeup->semaphore = dispatch_semaphore_create(0);
+    atomic_init(&wakeup->numWaiters, 0);
+}
+
+// Safe to call from the render thread: it only touches the semaphore when someone is waiting
+void AudioWakeupSignal(AudioWakeup *wakeup)
+{
+    // the state change before this must be visible to a waiter that we don't see yet
+    atomic_thread_fence(memory_order_seq_cst);
+    int numWaiters = atomic_load_explicit(&wakeup->numWaiters, memory_order_relaxed);
+    for (int i=0;i<numWaiters;i++) dispatch_semaphore_signal(wakeup->semaphore);
+}
+
+// Sleeps until condition holds or the deadline passes, and returns whether it holds.
+// A waiter counts itself in before checking, so a signal can't slip in between the check and the wait.
+// Wake-ups may be stale (left over from a wait that didn't need them), so the condition is checked after each.
+BOOL AudioWakeupWait(AudioWakeup *wakeup, BOOL (^condition)(void), dispatch_time_t deadline)
+{
+    atomic_fetch_add(&wakeup->numWaiters, 1);
+    
+    BOOL holds;
+    while (!(holds = condition()))
+    {
+        if (dispatch_semaphore_wait(wakeup->semaphore, deadline) != 0)
+        {
+            holds = condition();
+            break;
+        }
     }
+    
+    atomic_fetch_sub(&wakeup->numWaiters, 1);
+    return holds;
 }
 
 BOOL canAddToLiveAudioData(CircularAudioStorage *liveAudioData, int numSamples)
 {
-    return canAddToStream(&liveAudioData->channel1, numSamples) && canAddToStream(&liveAudioData->channel1, numSamples);
+    for (UInt32 i=0;i<liveAudioData->numChannels;i++)
+    {
+        if (!canAddToStream(&liveAudioData->channels[i], numSamples)) return NO;
+    }
+    return YES;
 }
 
 BOOL canAddToStream(CircularAudioStream *stream, int numSamples)
@@ -300,35 +955,160 @@ BOOL canAddToStream(CircularAudioStream *stream, int numSamples)
 
 void LiveAudioDataEmpty(LiveAudioData *liveAudioData)
 {
-    LiveAudioChannelData* channels[] = {&liveAudioData->channel1, &liveAudioData->channel2 , &liveAudioData->extractedChannel};
-    for (int i=0;i<3;i++)
+    for (UInt32 i=0;i<liveAudioData->numChannels + 1;i++)
     {
-        LiveAudioChannelData *channel = channels[i];
-        memset(channel->fftResults.data, 0, channel->fftResults.numChunksAvailable * CHUNK_SIZE * sizeof(float));
-        memset(channel->samples.data, 0, channel->samples.numSamplesAvailable * sizeof(float));
+        LiveAudioChannelData *channel = i < liveAudioData->numChannels ? &liveAudioData->channels[i] : &liveAudioData->extractedChannel;
+        if (channel->fftResults.data) memset(channel->fftResults.data, 0, channel->fftResults.numChunksAvailable * CHUNK_SIZE * sizeof(float));
+        if (channel->samples.data) memset(channel->samples.data, 0, channel->samples.numSamplesAvailable * sizeof(float));
         channel->containsData = NO;
     }
+    liveAudioData->channel1.containsData = NO;
+    liveAudioData->channel2.containsData = NO;
 }
 
 void AudioStreamSetBuffersOffset(CircularAudioStream *stream, int64_t offset)
 {
+    AudioCircularBufferBeginWrite(&stream->fftResults);
+    AudioCircularBufferBeginWrite(&stream->samples);
+    atomic_fetch_add_explicit(&stream->epoch, 1, memory_order_release);
     stream->fftResults.offset = offset;
     stream->samples.offset = offset;
+    AudioCircularBufferEndWrite(&stream->samples);
+    AudioCircularBufferEndWrite(&stream->fftResults);
 }
 
 void AudioStreamReset(CircularAudioStream *stream)
 {
-    stream->fftResults.offset = 0;
-    stream->samples.offset = 0;
+    AudioStreamSetBuffersOffset(stream, 0);
+}
+
+// Moves everything in the live ring to the history, e.g. before the ring is cleared for a seek
+void AudioStreamFlushToHistory(CircularAudioStream *stream)
+{
+    if (!stream->history) return;
+    MoveOldestFramesToHistory(stream, stream->fftResults.circularBuffer.fillCount / (CHUNK_SIZE * sizeof(float)));
+}
+
+// Finds the spectrum frame that covers timeInFrames, in the live ring or else in the history.
+// Returns NO if it was never analysed or is too old for any tier.
+BOOL AudioStreamGetSpectrumAtTime(CircularAudioStream *stream, SInt64 timeInFrames, float *result)
+{
+    SInt32 jumpSize = stream->fatherAudioData->fftOverlapJumpSize;
+    
+    UInt32 generation = AudioCircularBufferBeginRead(&stream->fftResults);
+    SInt64 frameIndex = (timeInFrames - stream->fftResults.offset) / jumpSize;
+    int availableBytes = 0;
+    float (*frames)[CHUNK_SIZE] = (float (*)[CHUNK_SIZE])TPCircularBufferTail(&stream->fftResults.circularBuffer, &availableBytes);
+    if (AudioStreamComputeFrames(stream, timeInFrames, 1) == 1)
+    {
+        memcpy(result, frames[frameIndex], CHUNK_SIZE * sizeof(float));
+        if (AudioCircularBufferValidateRead(&stream->fftResults, generation)) return YES;
+    }
+    
+    if (!stream->history || timeInFrames < 0) return NO;
+    return SpectrogramHistoryGetFrame(stream->history, timeInFrames / jumpSize, result);
+}
+
+// The samples and frames from timeInFrames on, pointing into the stream's rings (or its cache, for a track
+// analysed before). Not a copy: check it with LiveAudioChannelDataIsValid once done reading
+LiveAudioChannelData AudioStreamGetLiveData(CircularAudioStream *stream, SInt64 timeInFrames)
+{
+    CircularAudioStorage *storage = stream->fatherAudioData;
+    LiveAudioChannelData audioData;
+    UInt32 samplesGeneration = AudioCircularBufferBeginRead(&stream->samples);
+    UInt32 fftResultsGeneration = AudioCircularBufferBeginRead(&stream->fftResults);
+    
+    SInt32 offset = (SInt32)(timeInFrames - stream->samples.offset);
+    SInt32 fftOffset = (SInt32)((timeInFrames - stream->fftResults.offset) / storage->fftOverlapJumpSize * CHUNK_SIZE);
+    if (offset < 0 || offset * sizeof(float) > stream->samples.circularBuffer.fillCount || fftOffset < 0 || fftOffset * sizeof(float) > stream->fftResults.circularBuffer.fillCount)
+    {
+        //NSLog(@"Requested time is outside the currently stored buffer");
+        return (LiveAudioChannelData){NO, 0,0};
+    }
+    
+    int availableBytes = 0;
+    float *samples = (float *)TPCircularBufferTail(&stream->samples.circularBuffer, &availableBytes);
+    SInt32 availableSamples = availableBytes / sizeof(float) - offset;
+    LiveSamples liveSamples = (LiveSamples){timeInFrames, &samples[offset], availableSamples};
+    float *fftResults = (float *)TPCircularBufferTail(&stream->fftResults.circularBuffer, &availableBytes);
+    SInt32 availableChunks = availableBytes / CHUNK_SIZE / sizeof(float) - fftOffset / CHUNK_SIZE;
+    
+    // A track analysed before is read right out of the mapped cache file, no copying and no FFT
+    SInt64 numCachedChunks = 0;
+    const float *cachedFFTResults = NULL;
+    if (StreamCacheMatchesAudio(stream) && timeInFrames >= 0)
+        cachedFFTResults = SpectrogramCacheGetFrames(stream->cache, stream->cacheChannel, timeInFrames / storage->fftOverlapJumpSize, &numCachedChunks);
+    if (cachedFFTResults)
+    {
+        fftResults = (float *)cachedFFTResults;
+        fftOffset = 0;
+        availableChunks = (SInt32)MIN(numCachedChunks, INT32_MAX);
+    }
+    else if (storage->lazyAnalysis)
+        availableChunks = AudioStreamComputeFrames(stream, timeInFrames, MIN(availableChunks, storage->lazyFramesPerRead));
+    LiveFFTResults liveFFTResults = (LiveFFTResults){timeInFrames, &fftResults[fftOffset], availableChunks};
+    
+    audioData.containsData = availableSamples > 0 || availableChunks > 0;
+    audioData.samples = liveSamples;
+    audioData.fftResults = liveFFTResults;
+    audioData.stream = stream;
+    audioData.samplesGeneration = samplesGeneration;
+    audioData.fftResultsGeneration = fftResultsGeneration;
+    
+    return audioData;
+}
+
+// Fills results (as float[maxChunks][CHUNK_SIZE]) with one frame per jump from startTimeInFrames up to endTimeInFrames.
+// Frames that aren't available anywhere are zeroed. Returns the number of frames that were found.
+int AudioStreamGetSpectraInTimeRange(CircularAudioStream *stream, SInt64 startTimeInFrames, SInt64 endTimeInFrames, float *results, int maxChunks)
+{
+    SInt32 jumpSize = stream->fatherAudioData->fftOverlapJumpSize;
+    float (*chunks)[CHUNK_SIZE] = (float (*)[CHUNK_SIZE])results;
+    
+    int numFound = 0, i = 0;
+    for (SInt64 time = startTimeInFrames; time < endTimeInFrames && i < maxChunks; time += jumpSize, i++)
+    {
+        if (AudioStreamGetSpectrumAtTime(stream, time, chunks[i])) numFound++;
+        else memset(chunks[i], 0, CHUNK_SIZE * sizeof(float));
+    }
+    
+    return numFound;
+}
+
+void AudioStreamClear(CircularAudioStream *stream)
+{
+    AudioCircularBufferBeginWrite(&stream->fftResults);
+    AudioCircularBufferBeginWrite(&stream->samples);
+    atomic_fetch_add_explicit(&stream->epoch, 1, memory_order_release);
+    TPCircularBufferClear(&stream->samples.circularBuffer);
+    TPCircularBufferClear(&stream->fftResults.circularBuffer);
+    AudioCircularBufferEndWrite(&stream->samples);
+    AudioCircularBufferEndWrite(&stream->fftResults);
 }
 
 void AudioStreamInit(CircularAudioStream *stream, int samplesBufferSize, int fftResultsBufferSize, CircularAudioStorage *father)
 {
     TPCircularBufferInit(&stream->samples.circularBuffer, samplesBufferSize);
     TPCircularBufferInit(&stream->fftResults.circularBuffer, fftResultsBufferSize);
+    atomic_init(&stream->samples.generation, 0);
+    atomic_init(&stream->fftResults.generation, 0);
     stream->fftResults.offset = 0;
     stream->samples.offset = 0;
     stream->fatherAudioData = father;
+    stream->broadcast = NULL;
+    stream->history = NULL;
+    stream->cache = NULL;
+    stream->cacheChannel = 0;
+    
+    // Frames never straddle the end of the ring, so each one has a fixed slot
+    stream->numFrameSlots = stream->fftResults.circularBuffer.length / (CHUNK_SIZE * sizeof(float));
+    assert(stream->fftResults.circularBuffer.length % (CHUNK_SIZE * sizeof(float)) == 0);
+    stream->frameStates = calloc(stream->numFrameSlots, sizeof(_Atomic UInt64));
+    for (UInt32 i=0;i<stream->numFrameSlots;i++) atomic_init(&stream->frameStates[i], 0);
+    atomic_init(&stream->epoch, 0);
+    atomic_init(&stream->numFramesComputed, 0);
+    stream->numFramesProduced = 0;
+    
     AudioStreamReset(stream);
 }
 
@@ -336,9 +1116,217 @@ void LiveAudioDataReset(CircularAudioStorage *liveAudioData)
 {
     liveAudioData->currentlyPlayingFrame = 0;
     liveAudioData->amplitudeFactor = 1.0;
-    AudioStreamReset(&liveAudioData->channel1);
-    AudioStreamReset(&liveAudioData->channel2);
+    for (UInt32 i=0;i<liveAudioData->numChannels + 1;i++)
+    {
+        CircularAudioStream *stream = i < liveAudioData->numChannels ? &liveAudioData->channels[i] : &liveAudioData->extractedChannel;
+        AudioStreamReset(stream);
+        stream->numFramesProduced = 0;
+        atomic_store_explicit(&stream->numFramesComputed, 0, memory_order_relaxed);
+    }
     if (liveAudioData->fftOverlapJumpSize == 0) liveAudioData->fftOverlapJumpSize = CHUNK_SIZE;
 }
 
+BOOL CircularAudioStorageInit(CircularAudioStorage *storage, UInt32 numChannels, int samplesBufferSize, int fftResultsBufferSize, UInt32 maxFramesPerAdd)
+{
+    storage->samplesBufferSize = samplesBufferSize;
+    storage->fftResultsBufferSize = fftResultsBufferSize;
+    storage->maxFramesPerAdd = maxFramesPerAdd;
+    storage->numChannels = 0;
+    storage->lazyAnalysis = NO;
+    storage->lazyFramesPerRead = 1;
+    storage->sampleRate = 44100.0;
+    for (int i=0;i<MAX_SPECTRUM_READ_SCHEDULES;i++) atomic_init(&storage->readSchedules[i].isRegistered, false);
+    AudioStreamInit(&storage->extractedChannel, samplesBufferSize, fftResultsBufferSize, storage);
+    
+    return CircularAudioStorageSetNumChannels(storage, numChannels);
+}
+
+// Must not be called while audio is being added. Rings of channels that were used before are kept,
+// so going back and forth between, say, mono and stereo files doesn't reallocate anything.
+BOOL CircularAudioStorageSetNumChannels(CircularAudioStorage *storage, UInt32 numChannels)
+{
+    if (numChannels == 0 || numChannels > MAX_AUDIO_CHANNELS) return NO;
+    
+    for (UInt32 i=0;i<numChannels;i++)
+    {
+        if (storage->channels[i].samples.circularBuffer.buffer == NULL)
+            AudioStreamInit(&storage->channels[i], storage->samplesBufferSize, storage->fftResultsBufferSize, storage);
+    }
+    
+    storage->numChannels = numChannels;
+    
+    return YES;
+}
+
+void CircularAudioStorageCleanup(CircularAudioStorage *storage)
+{
+    for (int i=0;i<MAX_AUDIO_CHANNELS + 1;i++)
+    {
+        CircularAudioStream *stream = i < MAX_AUDIO_CHANNELS ? &storage->channels[i] : &storage->extractedChannel;
+        if (stream->samples.circularBuffer.buffer == NULL) continue;
+        TPCircularBufferCleanup(&stream->samples.circularBuffer);
+        TPCircularBufferCleanup(&stream->fftResults.circularBuffer);
+        free((void *)stream->frameStates);
+        stream->frameStates = NULL;
+    }
+    storage->numChannels = 0;
+}
+
+// What the rings of all the allocated channels (used or not) take right now
+AudioStreamMemoryUsage CircularAudioStorageMemoryUsage(const CircularAudioStorage *storage)
+{
+    AudioStreamMemoryUsage usage = {0};
+    for (int i=0;i<MAX_AUDIO_CHANNELS + 1;i++)
+    {
+        const CircularAudioStream *stream = i < MAX_AUDIO_CHANNELS ? &storage->channels[i] : &storage->extractedChannel;
+        if (stream->samples.circularBuffer.buffer == NULL) continue;
+        
+        usage.samplesBytes += stream->samples.circularBuffer.length;
+        usage.fftResultsBytes += stream->fftResults.circularBuffer.length + stream->numFrameSlots * sizeof(UInt64);
+        if (stream->broadcast)
+            usage.broadcastBytes += (size_t)stream->broadcast->capacity * (stream->broadcast->frameSize * sizeof(float) + sizeof(SInt64) + sizeof(UInt64));
+        if (stream->history)
+            usage.historyBytes += (size_t)stream->history->capacity * (stream->history->recordSize + sizeof(SInt64));
+    }
+    usage.totalBytes = usage.samplesBytes + usage.fftResultsBytes + usage.broadcastBytes + usage.historyBytes;
+    
+    return usage;
+}
+
+// Must be called while no audio is being added, and takes effect for audio added afterwards.
+// Frames already in the rings keep whatever they had, so clear the streams when turning it off.
+void CircularAudioStorageSetLazyAnalysis(CircularAudioStorage *storage, BOOL lazyAnalysis)
+{
+    storage->lazyAnalysis = lazyAnalysis;
+}
+
+static BOOL RunSpectrumDecimationBenchmark(const AudioStreamMemoryPlan *plan, const float *signal, UInt32 numSignalChunks, UInt32 numChunks, UInt32 jumpSize,
+                                           BOOL lazyAnalysis, Float64 readRate, Boolean averageSkippedFrames, double *seconds, UInt64 *numFramesComputed, UInt64 *numReads)
+{
+    CircularAudioStorage storage;
+    memset(&storage, 0, sizeof(CircularAudioStorage));
+    if (!CircularAudioStorageInit(&storage, 2, plan->samplesRingBytes, plan->fftResultsRingBytes, CHUNK_SIZE)) return NO;
+    LiveAudioDataReset(&storage);
+    storage.fftOverlapJumpSize = jumpSize;
+    CircularAudioStorageSetLazyAnalysis(&storage, lazyAnalysis);
+    int scheduleID = CircularAudioStorageAddReadSchedule(&storage, readRate, 0, averageSkippedFrames);
+    
+    float spectrum[CHUNK_SIZE];
+    Float64 period = storage.sampleRate / readRate;
+    SInt64 read = 0;
+    *numReads = 0;
+    
+    uint64_t startTime = mach_absolute_time();
+    for (UInt32 i=0;i<numChunks;i++)
+    {
+        storage.currentlyPlayingFrame = (SInt64)i * CHUNK_SIZE; // as if everything so far was played already
+        if (!AddInterleavedAudioToLiveStream((float *)signal + (i % numSignalChunks) * 2 * CHUNK_SIZE, CHUNK_SIZE, &storage)) break;
+        
+        // Every read whose frame is complete now, on both channels
+        for (SInt64 readTime = (SInt64)floor(read * period); readTime <= (SInt64)i * CHUNK_SIZE; readTime = (SInt64)floor(++read * period))
+        {
+            AudioStreamGetScheduledSpectrum(&storage.channels[0], scheduleID, readTime, spectrum);
+            AudioStreamGetScheduledSpectrum(&storage.channels[1], scheduleID, readTime, spectrum);
+            (*numReads)++;
+        }
+    }
+    *seconds = machToMiliseconds(mach_absolute_time() - startTime) / 1000.0;
+    
+    *numFramesComputed = atomic_load(&storage.channels[0].numFramesComputed) + atomic_load(&storage.channels[1].numFramesComputed);
+    CircularAudioStorageCleanup(&storage);
+    return YES;
+}
+
+// Feeds `seconds` of a stereo test signal through a stream twice: analysed eagerly, and lazily with a
+// read schedule of readRate. Both runs read at that rate. Reports how long each took and how many
+// frames each computed.
+BOOL BenchmarkSpectrumDecimation(Float64 seconds, UInt32 jumpSize, Float64 readRate, Boolean averageSkippedFrames, SpectrumDecimationBenchmarkResult *result)
+{
+    memset(result, 0, sizeof(SpectrumDecimationBenchmarkResult));
+    if (jumpSize == 0 || CHUNK_SIZE % jumpSize != 0 || readRate <= 0) return NO;
+    
+    AudioStreamMemoryPlan plan;
+    AudioMemoryBudgetPlanStream(&plan, 2, CHUNK_SIZE, AUDIO_MEMORY_FILE_LIVE_CHUNKS, jumpSize, 0, NO);
+    
+    // A few seconds of two sines, looped
+    UInt32 numSignalChunks = 64;
+    float *signal = malloc(numSignalChunks * 2 * CHUNK_SIZE * sizeof(float));
+    if (!signal) return NO;
+    for (UInt32 i=0;i<numSignalChunks * CHUNK_SIZE;i++)
+    {
+        signal[2 * i] = sinf(2 * M_PI * 440.0f * i / 44100.0f);
+        signal[2 * i + 1] = 0.5f * sinf(2 * M_PI * 3000.0f * i / 44100.0f);
+    }
+    UInt32 numChunks = (UInt32)(seconds * 44100.0 / CHUNK_SIZE);
+    
+    UInt64 numReads = 0;
+    BOOL success = RunSpectrumDecimationBenchmark(&plan, signal, numSignalChunks, numChunks, jumpSize, NO, readRate, averageSkippedFrames,
+                                                  &result->eagerSeconds, &result->eagerFramesComputed, &numReads);
+    success = success && RunSpectrumDecimationBenchmark(&plan, signal, numSignalChunks, numChunks, jumpSize, YES, readRate, averageSkippedFrames,
+                                                        &result->scheduledSeconds, &result->scheduledFramesComputed, &result->numReads);
+    free(signal);
+    
+    if (success)
+        NSLog(@"Spectrum decimation at %.0f Hz%@: eager %.1f ms (%llu frames), scheduled %.1f ms (%llu frames), %llu reads",
+              readRate, averageSkippedFrames ? @" with averaging" : @"", result->eagerSeconds * 1000.0, result->eagerFramesComputed,
+              result->scheduledSeconds * 1000.0, result->scheduledFramesComputed, result->numReads);
+    
+    return success;
+}
+
+
+// Decodes a whole file with AudioDecoderOpen and pushes it through the analysis streams as fast as
+// they take it, so the decode + analysis path can be measured without the asset reader or playback.
+BOOL BenchmarkDecoderPipeline(const char *path, DecoderPipelineBenchmarkResult *result)
+{
+    memset(result, 0, sizeof(DecoderPipelineBenchmarkResult));
+    
+    AudioDecoder decoder;
+    memset(&decoder, 0, sizeof(AudioDecoder));
+    if (!AudioDecoderOpen(&decoder, path)) return NO;
+    if (decoder.numChannels > MAX_AUDIO_CHANNELS)
+    {
+        AudioDecoderClose(&decoder);
+        return NO;
+    }
+    
+    AudioStreamMemoryPlan plan;
+    AudioMemoryBudgetPlanStream(&plan, decoder.numChannels, CHUNK_SIZE, AUDIO_MEMORY_FILE_LIVE_CHUNKS, 512, 0, NO); // AudioFile's default jump
+    
+    CircularAudioStorage storage;
+    memset(&storage, 0, sizeof(CircularAudioStorage));
+    if (!CircularAudioStorageInit(&storage, decoder.numChannels, plan.samplesRingBytes, plan.fftResultsRingBytes, CHUNK_SIZE))
+    {
+        AudioDecoderClose(&decoder);
+        return NO;
+    }
+    LiveAudioDataReset(&storage);
+    storage.fftOverlapJumpSize = 512;
+    
+    uint64_t startTime = mach_absolute_time();
+    const float *block;
+    UInt32 numFramesRead;
+    while ((block = AudioDecoderReadBlock(&decoder, CHUNK_SIZE, &numFramesRead)))
+    {
+        storage.currentlyPlayingFrame = result->numFrames; // as if everything so far was played already
+        if (!AddInterleavedAudioToLiveStream((float *)block, numFramesRead, &storage)) break;
+        result->numFrames += numFramesRead;
+    }
+    result->seconds = machToMiliseconds(mach_absolute_time() - startTime) / 1000.0;
+    
+    result->isZeroCopy = decoder.isZeroCopy;
+    if (result->numFrames > 0) result->bytesCopiedPerFrame = (double)storage.numSampleBytesCopied / result->numFrames;
+    if (result->seconds > 0)
+    {
+        result->framesPerSecond = result->numFrames / result->seconds;
+        result->realtimeFactor = result->framesPerSecond / decoder.sampleRate;
+    }
+    NSLog(@"Decoded and analysed %lld frames of %s in %.1f ms (%.0fx realtime, %@, %.0f bytes copied per frame)",
+          result->numFrames, path, result->seconds * 1000.0, result->realtimeFactor, result->isZeroCopy ? @"zero-copy" : @"converted", result->bytesCopiedPerFrame);
+    
+    CircularAudioStorageCleanup(&storage);
+    AudioDecoderClose(&decoder);
+    return YES;
+}
+
 @end
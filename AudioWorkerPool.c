@@ -0,0 +1,194 @@
+//
+//  AudioWorkerPool.c
+//  Equalizer
+//
+
+#include "AudioWorkerPool.h"
+#include <unistd.h>
+#include <string.h>
+
+// Lets go of a claimed lane, waking whoever's waiting to remove one
+static void ReleaseLane(AudioWorkerPool *pool, AudioWorkerLane *lane)
+{
+    atomic_store_explicit(&lane->isRunning, false, memory_order_release);
+
+    // a remover counts itself before it looks at the lane, so one we don't see will see it released
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->numRemoving, memory_order_relaxed) == 0) return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_broadcast(&pool->laneReleased);
+    pthread_mutex_unlock(&pool->mutex);
+}
+
+// Claims and runs every lane that has work. Returns true if it ran any
+static Boolean RunLanes(AudioWorkerPool *pool)
+{
+    Boolean didWork = false;
+
+    for (int i=0;i<AUDIO_WORKER_POOL_MAX_LANES;i++)
+    {
+        AudioWorkerLane *lane = &pool->lanes[i];
+        if (!atomic_load_explicit(&lane->hasWork, memory_order_acquire)) continue;
+
+        Boolean expected = false;
+        if (!atomic_compare_exchange_strong(&lane->isRunning, &expected, true)) continue;
+
+        // checked after claiming, so a lane being removed is either seen as gone here or waited for there
+        if (atomic_load(&lane->isRegistered) && atomic_exchange(&lane->hasWork, false))
+        {
+            while (lane->function(lane->context));
+            didWork = true;
+        }
+
+        // a notification that came in while the lane ran left hasWork set, and the next pass takes it
+        ReleaseLane(pool, lane);
+    }
+
+    return didWork;
+}
+
+// True if a lane has work that no worker is on
+static Boolean HasUnclaimedWork(AudioWorkerPool *pool)
+{
+    for (int i=0;i<AUDIO_WORKER_POOL_MAX_LANES;i++)
+    {
+        AudioWorkerLane *lane = &pool->lanes[i];
+        if (atomic_load(&lane->hasWork) && !atomic_load(&lane->isRunning)) return true;
+    }
+    return false;
+}
+
+static void *WorkerThread(void *userInfo)
+{
+    AudioWorkerPool *pool = (AudioWorkerPool *)userInfo;
+
+    while (!atomic_load_explicit(&pool->shouldStop, memory_order_acquire))
+    {
+        if (RunLanes(pool)) continue;
+
+        // A worker counts itself as asleep before checking for work, so a notification can't slip in between
+        pthread_mutex_lock(&pool->mutex);
+        atomic_fetch_add(&pool->numSleeping, 1);
+        while (!HasUnclaimedWork(pool) && !atomic_load(&pool->shouldStop))
+            pthread_cond_wait(&pool->wakeup, &pool->mutex);
+        atomic_fetch_sub(&pool->numSleeping, 1);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return NULL;
+}
+
+static AudioWorkerPool sharedPool;
+
+static void InitSharedPool(void)
+{
+    long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+    AudioWorkerPoolInit(&sharedPool, numCores > 2 ? (UInt32)numCores - 1 : 1);
+}
+
+AudioWorkerPool *AudioWorkerPoolShared(void)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, InitSharedPool);
+    return &sharedPool;
+}
+
+Boolean AudioWorkerPoolInit(AudioWorkerPool *pool, UInt32 numThreads)
+{
+    memset(pool, 0, sizeof(AudioWorkerPool));
+    for (int i=0;i<AUDIO_WORKER_POOL_MAX_LANES;i++)
+    {
+        atomic_init(&pool->lanes[i].isRegistered, false);
+        atomic_init(&pool->lanes[i].isRunning, false);
+        atomic_init(&pool->lanes[i].hasWork, false);
+    }
+    atomic_init(&pool->numSleeping, 0);
+    atomic_init(&pool->numRemoving, 0);
+    atomic_init(&pool->shouldStop, false);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+    pthread_cond_init(&pool->laneReleased, NULL);
+
+    if (numThreads < 1) numThreads = 1;
+    if (numThreads > AUDIO_WORKER_POOL_MAX_THREADS) numThreads = AUDIO_WORKER_POOL_MAX_THREADS;
+    for (pool->numThreads=0;pool->numThreads<numThreads;pool->numThreads++)
+    {
+        if (pthread_create(&pool->threads[pool->numThreads], NULL, WorkerThread, pool) != 0) break;
+    }
+
+    return pool->numThreads > 0;
+}
+
+void AudioWorkerPoolCleanup(AudioWorkerPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    atomic_store(&pool->shouldStop, true);
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (UInt32 i=0;i<pool->numThreads;i++) pthread_join(pool->threads[i], NULL);
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_cond_destroy(&pool->laneReleased);
+    pool->numThreads = 0;
+}
+
+int AudioWorkerPoolAddLane(AudioWorkerPool *pool, AudioWorkerLaneFunction function, void *context)
+{
+    for (int i=0;i<AUDIO_WORKER_POOL_MAX_LANES;i++)
+    {
+        AudioWorkerLane *lane = &pool->lanes[i];
+
+        // a slot is only reused once nothing runs it, so no worker sees the new function with the old context
+        Boolean expected = false;
+        if (!atomic_compare_exchange_strong(&lane->isRunning, &expected, true)) continue;
+        if (atomic_load(&lane->isRegistered))
+        {
+            ReleaseLane(pool, lane);
+            continue;
+        }
+
+        lane->function = function;
+        lane->context = context;
+        atomic_store(&lane->hasWork, false);
+        atomic_store(&lane->isRegistered, true);
+        ReleaseLane(pool, lane);
+        return i;
+    }
+
+    return -1;
+}
+
+void AudioWorkerPoolRemoveLane(AudioWorkerPool *pool, int laneID)
+{
+    if (laneID < 0 || laneID >= AUDIO_WORKER_POOL_MAX_LANES) return;
+
+    AudioWorkerLane *lane = &pool->lanes[laneID];
+    atomic_store(&lane->isRegistered, false);
+
+    // A run can take a while (a whole chunk's analysis), so this sleeps until the worker lets go
+    atomic_fetch_add(&pool->numRemoving, 1);
+    pthread_mutex_lock(&pool->mutex);
+    while (atomic_load(&lane->isRunning))
+        pthread_cond_wait(&pool->laneReleased, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+    atomic_fetch_sub(&pool->numRemoving, 1);
+
+    atomic_store(&lane->hasWork, false);
+}
+
+void AudioWorkerPoolNotify(AudioWorkerPool *pool, int laneID)
+{
+    if (laneID < 0 || laneID >= AUDIO_WORKER_POOL_MAX_LANES) return;
+
+    atomic_store(&pool->lanes[laneID].hasWork, true);
+
+    // the work must be visible to a worker that we don't see asleep yet
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&pool->numSleeping, memory_order_relaxed) == 0) return;
+
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->mutex);
+}
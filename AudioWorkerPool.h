@@ -0,0 +1,65 @@
+//
+//  AudioWorkerPool.h
+//  Equalizer
+//
+
+// A small fixed set of threads that run lanes of work.
+//
+// A lane is a function and its context. Whoever has work for a lane notifies it, and a free worker
+// runs its function until it says there's nothing left. A lane only ever runs on one worker at a
+// time, so it sees its work in order and needs no locking of its own, while different lanes run in
+// parallel. Workers with nothing to do sleep until a lane is notified.
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include <MacTypes.h>
+
+#define AUDIO_WORKER_POOL_MAX_THREADS 8
+#define AUDIO_WORKER_POOL_MAX_LANES 32
+
+// Does one piece of the lane's work. Returns false once there's nothing left to do
+typedef Boolean (*AudioWorkerLaneFunction)(void *context);
+
+typedef struct AudioWorkerLane
+{
+    AudioWorkerLaneFunction function;
+    void *context;
+    _Atomic Boolean isRegistered;
+    _Atomic Boolean isRunning;      // a worker has claimed the lane
+    _Atomic Boolean hasWork;        // set by AudioWorkerPoolNotify, cleared by the worker that takes it on
+} AudioWorkerLane;
+
+typedef struct AudioWorkerPool
+{
+    UInt32 numThreads;
+    pthread_t threads[AUDIO_WORKER_POOL_MAX_THREADS];
+    AudioWorkerLane lanes[AUDIO_WORKER_POOL_MAX_LANES];
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;
+    pthread_cond_t laneReleased;    // for AudioWorkerPoolRemoveLane, which waits out a run under the mutex
+    _Atomic UInt32 numSleeping;
+    _Atomic UInt32 numRemoving;
+    _Atomic Boolean shouldStop;
+} AudioWorkerPool;
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+// One worker per core, leaving one for the decoder and the UI, and at most AUDIO_WORKER_POOL_MAX_THREADS
+AudioWorkerPool *AudioWorkerPoolShared(void);
+
+Boolean AudioWorkerPoolInit(AudioWorkerPool *pool, UInt32 numThreads);
+void AudioWorkerPoolCleanup(AudioWorkerPool *pool);
+
+// Returns -1 if all the lanes are taken
+int AudioWorkerPoolAddLane(AudioWorkerPool *pool, AudioWorkerLaneFunction function, void *context);
+// Waits for a run that's in progress, so the context can be freed right after
+void AudioWorkerPoolRemoveLane(AudioWorkerPool *pool, int laneID);
+// Safe to call from any thread, as often as needed. Wakes a worker only if one is asleep
+void AudioWorkerPoolNotify(AudioWorkerPool *pool, int laneID);
+
+#if defined __cplusplus
+};
+#endif
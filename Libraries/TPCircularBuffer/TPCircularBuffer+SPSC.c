@@ -0,0 +1,175 @@
+//
+//  TPCircularBuffer+SPSC.c
+//  Circular/Ring buffer implementation
+//
+//  https://github.com/michaeltyson/TPCircularBuffer
+//
+//  Copyright (C) 2012-2013 A Tasty Pixel
+//
+//  This software is provided 'as-is', without any express or implied
+//  warranty.  In no event will the authors be held liable for any damages
+//  arising from the use of this software.
+//
+//  Permission is granted to anyone to use this software for any purpose,
+//  including commercial applications, and to alter it and redistribute it
+//  freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software
+//     in a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source distribution.
+//
+
+#include "TPCircularBuffer+SPSC.h"
+#include <mach/mach_time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdlib.h>
+
+bool TPSPSCCircularBufferInit(TPSPSCCircularBuffer *buffer, int32_t length) {
+    // Borrow the mirrored allocation from TPCircularBuffer
+    TPCircularBuffer mirrored;
+    if ( !TPCircularBufferInit(&mirrored, length) ) return false;
+
+    buffer->buffer = mirrored.buffer;
+    buffer->length = mirrored.length;
+    buffer->cachedTail = 0;
+    buffer->cachedHead = 0;
+    atomic_init(&buffer->head, 0);
+    atomic_init(&buffer->tail, 0);
+    atomic_thread_fence(memory_order_release);
+
+    return true;
+}
+
+void TPSPSCCircularBufferCleanup(TPSPSCCircularBuffer *buffer) {
+    TPCircularBuffer mirrored;
+    memset(&mirrored, 0, sizeof(TPCircularBuffer));
+    mirrored.buffer = buffer->buffer;
+    mirrored.length = buffer->length;
+    TPCircularBufferCleanup(&mirrored);
+    memset(buffer, 0, sizeof(TPSPSCCircularBuffer));
+}
+
+void TPSPSCCircularBufferClear(TPSPSCCircularBuffer *buffer) {
+    uint32_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+    buffer->cachedHead = head;
+    atomic_store_explicit(&buffer->tail, head, memory_order_release);
+}
+
+#pragma mark - Benchmark
+
+typedef struct {
+    bool                  useSPSC;
+    TPCircularBuffer     *locked;
+    TPSPSCCircularBuffer *spsc;
+    int32_t               blockSize;
+    int64_t               totalBytes;
+    bool                  inOrder;
+} _TPSPSCBenchmarkContext;
+
+static void _fillBlock(uint32_t *block, int32_t blockSize, uint32_t *sequence) {
+    int32_t words = blockSize / (int32_t)sizeof(uint32_t);
+    for ( int32_t i=0; i<words; i++ ) block[i] = (*sequence)++;
+}
+
+static bool _checkBlock(const uint32_t *block, int32_t blockSize, uint32_t *sequence) {
+    int32_t words = blockSize / (int32_t)sizeof(uint32_t);
+    bool ok = block[0] == *sequence && block[words-1] == *sequence + (uint32_t)words - 1;
+    *sequence += (uint32_t)words;
+    return ok;
+}
+
+static void *_benchmarkProducer(void *userInfo) {
+    _TPSPSCBenchmarkContext *context = (_TPSPSCBenchmarkContext*)userInfo;
+    uint32_t sequence = 0;
+    for ( int64_t produced = 0; produced < context->totalBytes; ) {
+        int32_t space;
+        void *head = context->useSPSC
+                        ? TPSPSCCircularBufferHeadAtLeast(context->spsc, &space, context->blockSize)
+                        : TPCircularBufferHead(context->locked, &space);
+        if ( space < context->blockSize ) { sched_yield(); continue; }
+        _fillBlock((uint32_t*)head, context->blockSize, &sequence);
+        if ( context->useSPSC ) TPSPSCCircularBufferProduce(context->spsc, context->blockSize);
+        else TPCircularBufferProduce(context->locked, context->blockSize);
+        produced += context->blockSize;
+    }
+    return NULL;
+}
+
+static void *_benchmarkConsumer(void *userInfo) {
+    _TPSPSCBenchmarkContext *context = (_TPSPSCBenchmarkContext*)userInfo;
+    uint32_t sequence = 0;
+    context->inOrder = true;
+    for ( int64_t consumed = 0; consumed < context->totalBytes; ) {
+        int32_t available;
+        void *tail = context->useSPSC
+                        ? TPSPSCCircularBufferTailAtLeast(context->spsc, &available, context->blockSize)
+                        : TPCircularBufferTail(context->locked, &available);
+        if ( available < context->blockSize ) { sched_yield(); continue; }
+        context->inOrder &= _checkBlock((const uint32_t*)tail, context->blockSize, &sequence);
+        if ( context->useSPSC ) TPSPSCCircularBufferConsume(context->spsc, context->blockSize);
+        else TPCircularBufferConsume(context->locked, context->blockSize);
+        consumed += context->blockSize;
+    }
+    return NULL;
+}
+
+static bool _runBenchmark(_TPSPSCBenchmarkContext *context, double *seconds) {
+    static mach_timebase_info_data_t timebase;
+    if ( timebase.denom == 0 ) mach_timebase_info(&timebase);
+
+    pthread_t producer, consumer;
+    uint64_t start = mach_absolute_time();
+    if ( pthread_create(&consumer, NULL, _benchmarkConsumer, context) != 0 ) return false;
+    if ( pthread_create(&producer, NULL, _benchmarkProducer, context) != 0 ) {
+        pthread_join(consumer, NULL);
+        return false;
+    }
+    pthread_join(producer, NULL);
+    pthread_join(consumer, NULL);
+    uint64_t elapsed = mach_absolute_time() - start;
+
+    *seconds = (double)elapsed * timebase.numer / timebase.denom / 1e9;
+    return context->inOrder;
+}
+
+bool TPSPSCCircularBufferBenchmark(int32_t bufferLength, int32_t blockSize, int64_t totalBytes, TPSPSCCircularBufferBenchmarkResult *result) {
+    assert(blockSize > 0 && blockSize % sizeof(uint32_t) == 0);
+    memset(result, 0, sizeof(TPSPSCCircularBufferBenchmarkResult));
+    totalBytes -= totalBytes % blockSize;
+
+    TPCircularBuffer locked;
+    TPSPSCCircularBuffer *spsc = NULL;
+    if ( posix_memalign((void**)&spsc, kTPCircularBufferCacheLineSize, sizeof(TPSPSCCircularBuffer)) != 0 ) return false;
+    if ( !TPCircularBufferInit(&locked, bufferLength) ) {
+        free(spsc);
+        return false;
+    }
+    if ( !TPSPSCCircularBufferInit(spsc, bufferLength) ) {
+        TPCircularBufferCleanup(&locked);
+        free(spsc);
+        return false;
+    }
+
+    _TPSPSCBenchmarkContext context = { false, &locked, spsc, blockSize, totalBytes, false };
+    bool success = _runBenchmark(&context, &result->lockedSeconds);
+
+    context.useSPSC = true;
+    success = _runBenchmark(&context, &result->spscSeconds) && success;
+
+    result->bytesTransferred = totalBytes;
+    if ( result->lockedSeconds > 0 ) result->lockedBytesPerSecond = totalBytes / result->lockedSeconds;
+    if ( result->spscSeconds > 0 ) result->spscBytesPerSecond = totalBytes / result->spscSeconds;
+
+    TPCircularBufferCleanup(&locked);
+    TPSPSCCircularBufferCleanup(spsc);
+    free(spsc);
+
+    return success;
+}
@@ -0,0 +1,320 @@
+//
+//  TPCircularBuffer+SPSC.h
+//  Circular/Ring buffer implementation
+//
+//  https://github.com/michaeltyson/TPCircularBuffer
+//
+//  Single producer / single consumer variant of TPCircularBuffer.
+//
+//  TPCircularBuffer keeps head, tail and fillCount next to each other and updates the
+//  shared fillCount with a full barrier from both sides, so every produce and consume
+//  bounces the same cache line between the two threads. This variant drops the shared
+//  fill count: the producer owns the head index and the consumer owns the tail index,
+//  each on its own cache line, and both are published with release/acquire ordering.
+//  Each side also keeps a cached copy of the other side's index and only reloads it
+//  when the cached view cannot satisfy the request.
+//
+//  The memory itself is allocated with TPCircularBufferInit, so the same virtual memory
+//  mirroring applies and clients can treat returned pointers as contiguous space.
+//
+//  Copyright (C) 2012-2013 A Tasty Pixel
+//
+//  This software is provided 'as-is', without any express or implied
+//  warranty.  In no event will the authors be held liable for any damages
+//  arising from the use of this software.
+//
+//  Permission is granted to anyone to use this software for any purpose,
+//  including commercial applications, and to alter it and redistribute it
+//  freely, subject to the following restrictions:
+//
+//  1. The origin of this software must not be misrepresented; you must not
+//     claim that you wrote the original software. If you use this software
+//     in a product, an acknowledgment in the product documentation would be
+//     appreciated but is not required.
+//
+//  2. Altered source versions must be plainly marked as such, and must not be
+//     misrepresented as being the original software.
+//
+//  3. This notice may not be removed or altered from any source distribution.
+//
+
+#ifndef TPCircularBuffer_SPSC_h
+#define TPCircularBuffer_SPSC_h
+
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <string.h>
+#include <assert.h>
+#include "TPCircularBuffer.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define kTPCircularBufferCacheLineSize 64
+
+/*!
+ * SPSC circular buffer
+ *
+ *  head and tail are byte indices in the range [0, 2 * length). Keeping one extra
+ *  lap lets a full buffer be told apart from an empty one without a shared fill count.
+ */
+typedef struct {
+    // Shared, written only by TPSPSCCircularBufferInit
+    _Alignas(kTPCircularBufferCacheLineSize) void *buffer;
+    int32_t           length;
+
+    // Producer side
+    _Alignas(kTPCircularBufferCacheLineSize) _Atomic uint32_t head;
+    uint32_t          cachedTail;
+
+    // Consumer side
+    _Alignas(kTPCircularBufferCacheLineSize) _Atomic uint32_t tail;
+    uint32_t          cachedHead;
+} TPSPSCCircularBuffer;
+
+/*!
+ * Initialise buffer
+ *
+ *  As with TPCircularBufferInit, the length is rounded up to whole pages.
+ *
+ * @param buffer Circular buffer
+ * @param length Length of buffer
+ */
+bool  TPSPSCCircularBufferInit(TPSPSCCircularBuffer *buffer, int32_t length);
+
+/*!
+ * Cleanup buffer
+ *
+ *  Releases buffer resources.
+ */
+void  TPSPSCCircularBufferCleanup(TPSPSCCircularBuffer *buffer);
+
+/*!
+ * Clear buffer
+ *
+ *  Resets buffer to original, empty state.
+ *
+ *  This is safe for use by consumer while producer is accessing
+ *  buffer.
+ */
+void  TPSPSCCircularBufferClear(TPSPSCCircularBuffer *buffer);
+
+static __inline__ __attribute__((always_inline)) uint32_t _TPSPSCCircularBufferDistance(const TPSPSCCircularBuffer *buffer, uint32_t from, uint32_t to) {
+    uint32_t lap = 2 * (uint32_t)buffer->length;
+    return to >= from ? to - from : to + lap - from;
+}
+
+static __inline__ __attribute__((always_inline)) uint32_t _TPSPSCCircularBufferAdvance(const TPSPSCCircularBuffer *buffer, uint32_t index, int32_t amount) {
+    uint32_t lap = 2 * (uint32_t)buffer->length;
+    index += (uint32_t)amount;
+    return index >= lap ? index - lap : index;
+}
+
+static __inline__ __attribute__((always_inline)) void* _TPSPSCCircularBufferPointer(const TPSPSCCircularBuffer *buffer, uint32_t index) {
+    uint32_t offset = index >= (uint32_t)buffer->length ? index - (uint32_t)buffer->length : index;
+    return (void*)((char*)buffer->buffer + offset);
+}
+
+// Reading (consuming)
+
+/*!
+ * Access end of buffer, reloading the producer's index only if needed
+ *
+ *  Like TPSPSCCircularBufferTail, but the producer's head index is only reloaded when
+ *  the consumer's cached copy shows fewer than requiredBytes ready. On a hot read path
+ *  this avoids touching the producer's cache line at all.
+ *
+ * @param buffer Circular buffer
+ * @param availableBytes On output, the number of bytes ready for reading
+ * @param requiredBytes The number of bytes the caller wants to read
+ * @return Pointer to the first bytes ready for reading, or NULL if buffer is empty
+ */
+static __inline__ __attribute__((always_inline)) void* TPSPSCCircularBufferTailAtLeast(TPSPSCCircularBuffer *buffer, int32_t* availableBytes, int32_t requiredBytes) {
+    uint32_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+    uint32_t available = _TPSPSCCircularBufferDistance(buffer, tail, buffer->cachedHead);
+    if ( available < (uint32_t)requiredBytes ) {
+        buffer->cachedHead = atomic_load_explicit(&buffer->head, memory_order_acquire);
+        available = _TPSPSCCircularBufferDistance(buffer, tail, buffer->cachedHead);
+    }
+    *availableBytes = (int32_t)available;
+    if ( available == 0 ) return NULL;
+    return _TPSPSCCircularBufferPointer(buffer, tail);
+}
+
+/*!
+ * Access end of buffer
+ *
+ *  This gives you a pointer to the end of the buffer, ready
+ *  for reading, and the number of available bytes to read.
+ *
+ * @param buffer Circular buffer
+ * @param availableBytes On output, the number of bytes ready for reading
+ * @return Pointer to the first bytes ready for reading, or NULL if buffer is empty
+ */
+static __inline__ __attribute__((always_inline)) void* TPSPSCCircularBufferTail(TPSPSCCircularBuffer *buffer, int32_t* availableBytes) {
+    return TPSPSCCircularBufferTailAtLeast(buffer, availableBytes, buffer->length);
+}
+
+/*!
+ * Consume bytes in buffer
+ *
+ *  This frees up the just-read bytes, ready for writing again. The store is
+ *  a release, so all reads of the consumed region happen before the producer
+ *  can see the space as free.
+ *
+ * @param buffer Circular buffer
+ * @param amount Number of bytes to consume
+ */
+static __inline__ __attribute__((always_inline)) void TPSPSCCircularBufferConsume(TPSPSCCircularBuffer *buffer, int32_t amount) {
+    uint32_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+    assert(amount >= 0 && (uint32_t)amount <= _TPSPSCCircularBufferDistance(buffer, tail, atomic_load_explicit(&buffer->head, memory_order_relaxed)));
+    atomic_store_explicit(&buffer->tail, _TPSPSCCircularBufferAdvance(buffer, tail, amount), memory_order_release);
+}
+
+/*!
+ * Consume everything up to a producer's position
+ *
+ *  Drops what was produced before the producer took index with
+ *  TPSPSCCircularBufferHeadIndex, and keeps what it produced after. This is
+ *  how the producer's side gets the buffer cleared: it takes the index and
+ *  hands it to the consumer, who calls this. Does nothing if the tail is
+ *  already past index.
+ *
+ * @param buffer Circular buffer
+ * @param index The producer's position, from TPSPSCCircularBufferHeadIndex
+ */
+static __inline__ __attribute__((always_inline)) void TPSPSCCircularBufferConsumeTo(TPSPSCCircularBuffer *buffer, uint32_t index) {
+    uint32_t tail = atomic_load_explicit(&buffer->tail, memory_order_relaxed);
+    uint32_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+    if ( _TPSPSCCircularBufferDistance(buffer, tail, index) > _TPSPSCCircularBufferDistance(buffer, tail, head) ) return;
+    atomic_store_explicit(&buffer->tail, index, memory_order_release);
+}
+
+// Writing (producing)
+
+/*!
+ * Access front of buffer, reloading the consumer's index only if needed
+ *
+ *  Like TPSPSCCircularBufferHead, but the consumer's tail index is only reloaded
+ *  when the producer's cached copy shows less than requiredBytes of free space.
+ *
+ * @param buffer Circular buffer
+ * @param availableBytes On output, the number of bytes ready for writing
+ * @param requiredBytes The number of bytes the caller wants to write
+ * @return Pointer to the first bytes ready for writing, or NULL if buffer is full
+ */
+static __inline__ __attribute__((always_inline)) void* TPSPSCCircularBufferHeadAtLeast(TPSPSCCircularBuffer *buffer, int32_t* availableBytes, int32_t requiredBytes) {
+    uint32_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    uint32_t space = (uint32_t)buffer->length - _TPSPSCCircularBufferDistance(buffer, buffer->cachedTail, head);
+    if ( space < (uint32_t)requiredBytes ) {
+        buffer->cachedTail = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+        space = (uint32_t)buffer->length - _TPSPSCCircularBufferDistance(buffer, buffer->cachedTail, head);
+    }
+    *availableBytes = (int32_t)space;
+    if ( space == 0 ) return NULL;
+    return _TPSPSCCircularBufferPointer(buffer, head);
+}
+
+/*!
+ * Access front of buffer
+ *
+ *  This gives you a pointer to the front of the buffer, ready
+ *  for writing, and the number of available bytes to write.
+ *
+ * @param buffer Circular buffer
+ * @param availableBytes On output, the number of bytes ready for writing
+ * @return Pointer to the first bytes ready for writing, or NULL if buffer is full
+ */
+static __inline__ __attribute__((always_inline)) void* TPSPSCCircularBufferHead(TPSPSCCircularBuffer *buffer, int32_t* availableBytes) {
+    return TPSPSCCircularBufferHeadAtLeast(buffer, availableBytes, buffer->length);
+}
+
+/*!
+ * Produce bytes in buffer
+ *
+ *  This marks the given section of the buffer ready for reading. The store is
+ *  a release, so the written bytes are visible before the consumer sees them.
+ *
+ * @param buffer Circular buffer
+ * @param amount Number of bytes to produce
+ */
+static __inline__ __attribute__((always_inline)) void TPSPSCCircularBufferProduce(TPSPSCCircularBuffer *buffer, int32_t amount) {
+    uint32_t head = atomic_load_explicit(&buffer->head, memory_order_relaxed);
+    atomic_store_explicit(&buffer->head, _TPSPSCCircularBufferAdvance(buffer, head, amount), memory_order_release);
+}
+
+/*!
+ * The producer's position
+ *
+ *  Where the next bytes produced will go. For TPSPSCCircularBufferConsumeTo.
+ *  Producer only.
+ */
+static __inline__ __attribute__((always_inline)) uint32_t TPSPSCCircularBufferHeadIndex(TPSPSCCircularBuffer *buffer) {
+    return atomic_load_explicit(&buffer->head, memory_order_relaxed);
+}
+
+/*!
+ * Helper routine to copy bytes to buffer
+ *
+ *  This copies the given bytes to the buffer, and marks them ready for writing.
+ *
+ * @param buffer Circular buffer
+ * @param src Source buffer
+ * @param len Number of bytes in source buffer
+ * @return true if bytes copied, false if there was insufficient space
+ */
+static __inline__ __attribute__((always_inline)) bool TPSPSCCircularBufferProduceBytes(TPSPSCCircularBuffer *buffer, const void* src, int32_t len) {
+    int32_t space;
+    void *ptr = TPSPSCCircularBufferHeadAtLeast(buffer, &space, len);
+    if ( space < len ) return false;
+    memcpy(ptr, src, len);
+    TPSPSCCircularBufferProduce(buffer, len);
+    return true;
+}
+
+/*!
+ * Number of bytes currently stored
+ *
+ *  Loads both indices, so the result is exact only when called from the producer
+ *  or the consumer thread; from anywhere else it is a snapshot.
+ */
+static __inline__ __attribute__((always_inline)) int32_t TPSPSCCircularBufferFillCount(TPSPSCCircularBuffer *buffer) {
+    uint32_t tail = atomic_load_explicit(&buffer->tail, memory_order_acquire);
+    uint32_t head = atomic_load_explicit(&buffer->head, memory_order_acquire);
+    return (int32_t)_TPSPSCCircularBufferDistance(buffer, tail, head);
+}
+
+// Benchmarking
+
+typedef struct {
+    int64_t bytesTransferred;
+    double  lockedSeconds;      // TPCircularBuffer, shared fill count with full barriers
+    double  spscSeconds;        // TPSPSCCircularBuffer
+    double  lockedBytesPerSecond;
+    double  spscBytesPerSecond;
+} TPSPSCCircularBufferBenchmarkResult;
+
+/*!
+ * Two-thread throughput benchmark
+ *
+ *  Runs a producer thread and a consumer thread that move totalBytes through a buffer of
+ *  bufferLength bytes in blocks of blockSize bytes, once through TPCircularBuffer and once
+ *  through TPSPSCCircularBuffer, and returns the wall time of each run for the caller to
+ *  report. Each consumed block is checked against the sequence the producer wrote, so a
+ *  broken ordering shows up as a failed run rather than as a fast one.
+ *
+ * @param bufferLength Length of the buffer under test
+ * @param blockSize Number of bytes moved per produce/consume call
+ * @param totalBytes Number of bytes to move in each run
+ * @param result On output, the timings of both runs
+ * @return true if both runs completed and all data arrived in order
+ */
+bool TPSPSCCircularBufferBenchmark(int32_t bufferLength, int32_t blockSize, int64_t totalBytes, TPSPSCCircularBufferBenchmarkResult *result);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif
@@ -10,20 +10,24 @@
 #import "AudioUtility.h"
 #include "AEAudioController.h"
 
+// Input goes through the same overlapped STFT as AudioFile's (see CircularAudioStorage): every sample is
+// analysed once per jump, and the last few seconds of samples and frames are kept, on a timeline of input
+// frames that starts at 0 when recording starts. liveAudioData is the newest frame. Each Microphone analyses
+// on a thread of its own, which the input callback wakes once there's a chunk to analyse. Microphones keep
+// nothing in common, so several can record at once, from different controllers or different input channels.
 @interface Microphone : NSObject <AEAudioReceiver, LiveAudioSupplier>
-{
-    LiveMicrophoneData liveMicrophoneData;
-@public
-    dispatch_queue_t syncQueue;
-}
 
 @property AEAudioController *audioController;
 
 @property(readonly) LiveAudioData liveAudioData;
 @property BOOL isRecording;
 @property AudioStreamBasicDescription audioFormat;
-@property UInt32 numOfChannels;
+@property UInt32 numOfChannels; // analysed, each with its own STFT: the input channels, up to MAX_AUDIO_CHANNELS
+@property(readonly) NSArray *inputChannels; // NSNumbers indexing the controller's input channels. nil for all of them
 @property CGFloat amplitudeFactor;
+@property UInt32 fftOverlapJumpSize; // 512 by default. Divides CHUNK_SIZE_FOR_RECORDING. Only while not recording
+@property(readonly) AudioStreamMemoryUsage memoryUsage;
+@property(readonly) UInt64 numInputFramesDropped; // since recording started, for want of room while the analysis caught up
 
 @property(readonly) enum AudioSupplyMode audioSupplyMode;
 
@@ -32,5 +36,20 @@
 -(NSError *)resumeRecording;
 
 -(id)initWithAudioController:(AEAudioController *)audioController;
+-(id)initWithAudioController:(AEAudioController *)audioController inputChannels:(NSArray *)inputChannels;
+
+// Input is timestamped as it comes in, so every frame on the timeline (an FFT frame's timeInFrames is the
+// frame it starts at) has the input's own sample time (the AudioTimeStamp's mSampleTime), and the host time
+// it was captured at, fitted to the input's timestamps like AudioFile's frameHeardAtHostTime: is to the
+// output's. Input dropped for want of room is analysed as silence, so the two don't drift apart.
+// frameAtHostTime: gives the end of what's been analysed while nothing's coming in, and hostTimeAtFrame: 0
+// before anything has. Passing both an AudioFile and a Microphone the same host time lines their spectra up
+- (Float64)sampleTimeAtFrame:(SInt64)frame;
+- (uint64_t)hostTimeAtFrame:(SInt64)frame;
+- (Float64)frameAtHostTime:(uint64_t)hostTime;
+- (LiveAudioData)liveAudioDataAtHostTime:(uint64_t)hostTime; // liveAudioData is the newest frame, whenever that was captured
+
+// From frameOffset on, as far as it's been analysed. Channel IDs start from 1
+- (LiveAudioChannelData)getLiveAudioDataForFrame:(SInt64)frameOffset andChannel:(UInt32)channelID;
 
 @end
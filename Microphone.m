@@ -12,14 +12,52 @@
 #import "Configuration.h"
 #import "Microphone.h"
 #import "AppDelegate.h"
+#import "TPCircularBuffer+SPSC.h"
+#import "AudioClock.h"
+#import "AEUtilities.h"
+#include <pthread.h>
 
 #define USE_REALTIME_EFFECTS 0
+#define MICROPHONE_INPUT_RING_CHUNKS 4  // input waiting to be analysed, per channel
+#define MICROPHONE_INPUT_BLOCKS_BYTES 4096
+#define MICROPHONE_MAX_SILENCE_FRAMES (AUDIO_MEMORY_INPUT_LIVE_CHUNKS * CHUNK_SIZE_FOR_RECORDING) // what's kept, so nothing older is left after it
+
+// The timestamp of a block of input, which the callback puts in a ring of its own after the block's samples
+typedef struct MicrophoneInputBlock
+{
+    Float64 sampleTime;     // the input's, NAN if it had none
+    UInt64 hostTime;        // 0 if it had none
+    UInt32 numFrames;
+} MicrophoneInputBlock;
+
+static void *AnalysisThreadMain(void *context);
 
 @implementation Microphone
 {
     AudioQueueTimelineRef timeline;
-    TPCircularBuffer circularBuffer1;
-    TPCircularBuffer circularBuffer2;
+    TPSPSCCircularBuffer *inputBuffers;     // one per channel. Render thread -> analysis thread
+    UInt32 numInputBuffers;
+    TPSPSCCircularBuffer inputBlocks;       // MicrophoneInputBlocks, for what's in inputBuffers
+    _Atomic UInt64 numFramesCaptured;       // by the render thread, once their block is in
+    UInt64 numFramesTaken;                  // from inputBuffers
+    float *stagedSamples;                   // a chunk per channel, filled a block at a time until it's analysed
+    UInt32 numStagedFrames;
+    AudioStreamMemoryPlan memoryPlan;
+    CircularAudioStorage processedAudioData; // its currentlyPlayingFrame is the end of what's been analysed
+    
+    pthread_t analysisThread;
+    BOOL hasAnalysisThread;
+    pthread_mutex_t analysisLock;       // held while analysing, so the storage can be reset or replaced in between
+    AudioWakeup inputArrived;           // render thread -> analysis thread
+    _Atomic BOOL shouldStopAnalysis;
+    _Atomic UInt64 numInputFramesDropped;
+    
+    // The analysis thread's: frame f on the timeline was the input's sample time f + sampleTimeOffset.
+    // Dropped blocks are analysed as silence, which keeps it that way
+    _Atomic Float64 sampleTimeOffset;
+    BOOL hasSampleTimeOffset;
+    AudioClock inputClock;              // for which frame was captured when
+    UInt64 inputLatencyTicks;           // what the timestamps are late by, when the controller doesn't take it out
 }
 
 - (id)init
@@ -30,24 +68,123 @@
 
 -(id)initWithAudioController:(AEAudioController *)audioController
 {
-    self = [Microphone alloc];
-    _refToSelf = self;
+    return [self initWithAudioController:audioController inputChannels:nil];
+}
+
+-(id)initWithAudioController:(AEAudioController *)audioController inputChannels:(NSArray *)inputChannels
+{
+    self = [super init];
+    if (!self) return nil;
     
     self.audioController = audioController;
-    self.amplitudeFactor = 1.0f;
-    
-    syncQueue = dispatch_queue_create("microphoneDataQueue", DISPATCH_QUEUE_SERIAL);
+    _inputChannels = [inputChannels copy];
     
     self.audioFormat = self.audioController.inputAudioDescription;
-    self.numOfChannels = self.audioController.numberOfInputChannels;
+    UInt32 numChannels = inputChannels ? (UInt32)inputChannels.count : (UInt32)self.audioController.numberOfInputChannels;
+    self.numOfChannels = MAX(1, MIN(numChannels, MAX_AUDIO_CHANNELS));
+    
+    posix_memalign((void **)&inputBuffers, kTPCircularBufferCacheLineSize, self.numOfChannels * sizeof(TPSPSCCircularBuffer));
+    for (numInputBuffers=0;numInputBuffers<self.numOfChannels;numInputBuffers++)
+        TPSPSCCircularBufferInit(&inputBuffers[numInputBuffers], MICROPHONE_INPUT_RING_CHUNKS * CHUNK_SIZE_FOR_RECORDING * sizeof(float));
+    TPSPSCCircularBufferInit(&inputBlocks, MICROPHONE_INPUT_BLOCKS_BYTES);
+    stagedSamples = (float *)malloc(self.numOfChannels * CHUNK_SIZE_FOR_RECORDING * sizeof(float));
+    if (!AudioMemoryBudgetReserve(AudioMemoryBudgetShared(), [self inputBuffersBytes]))
+        NSLog(@"Microphone's buffers take the process over its audio memory budget");
+    
+    pthread_mutex_init(&analysisLock, NULL);
+    AudioWakeupInit(&inputArrived);
+    atomic_init(&shouldStopAnalysis, NO);
+    atomic_init(&numInputFramesDropped, 0);
+    atomic_init(&numFramesCaptured, 0);
+    atomic_init(&sampleTimeOffset, 0);
+    [self setUpAnalysisWithJumpSize:512];
     
-    TPCircularBufferInit(&circularBuffer1, CHUNK_SIZE_FOR_RECORDING * 4 * sizeof(float));
-    TPCircularBufferInit(&circularBuffer2, CHUNK_SIZE_FOR_RECORDING * 4 * sizeof(float));
+    // Lives as long as we do, and only holds on to us weakly, so dealloc is what stops it
+    hasAnalysisThread = pthread_create(&analysisThread, NULL, AnalysisThreadMain, (__bridge void *)self) == 0;
+    if (!hasAnalysisThread) NSLog(@"Microphone couldn't start its analysis thread");
     
     return self;
     
 }
 
+-(void)dealloc
+{
+    if (hasAnalysisThread)
+    {
+        atomic_store(&shouldStopAnalysis, YES);
+        AudioWakeupSignal(&inputArrived);
+        pthread_join(analysisThread, NULL);
+    }
+    pthread_mutex_destroy(&analysisLock);
+    
+    AudioMemoryBudget *budget = AudioMemoryBudgetShared();
+    AudioMemoryBudgetRelease(budget, memoryPlan.liveBytes + [self inputBuffersBytes]);
+    CircularAudioStorageCleanup(&self->processedAudioData);
+    for (UInt32 i=0;i<numInputBuffers;i++) TPSPSCCircularBufferCleanup(&inputBuffers[i]);
+    free(inputBuffers);
+    TPSPSCCircularBufferCleanup(&inputBlocks);
+    free(stagedSamples);
+}
+
+- (unsigned long)inputBuffersBytes
+{
+    unsigned long numBytes = 0;
+    for (UInt32 i=0;i<numInputBuffers;i++) numBytes += inputBuffers[i].length;
+    return numBytes + inputBlocks.length + numInputBuffers * CHUNK_SIZE_FOR_RECORDING * sizeof(float);
+}
+
+// The rings' sizes depend on the jump, so they're made again whenever it changes
+- (void)setUpAnalysisWithJumpSize:(UInt32)jumpSize
+{
+    pthread_mutex_lock(&analysisLock);
+    
+    CGFloat amplitudeFactor = self->processedAudioData.numChannels > 0 ? self->processedAudioData.amplitudeFactor : 1.0f;
+    
+    AudioMemoryBudget *budget = AudioMemoryBudgetShared();
+    AudioMemoryBudgetRelease(budget, memoryPlan.liveBytes);
+    CircularAudioStorageCleanup(&self->processedAudioData);
+    
+    AudioMemoryBudgetPlanStream(&memoryPlan, self.numOfChannels, CHUNK_SIZE_FOR_RECORDING, AUDIO_MEMORY_INPUT_LIVE_CHUNKS, jumpSize, 0, NO);
+    if (!AudioMemoryBudgetReserve(budget, memoryPlan.liveBytes))
+        NSLog(@"Microphone's analysis rings take the process over its audio memory budget");
+    
+    CircularAudioStorageInit(&self->processedAudioData, self.numOfChannels, memoryPlan.samplesRingBytes, memoryPlan.fftResultsRingBytes, CHUNK_SIZE_FOR_RECORDING);
+    self->processedAudioData.fftOverlapJumpSize = jumpSize;
+    self->processedAudioData.sampleRate = self.audioFormat.mSampleRate;
+    [self resetAnalysisLocked];
+    self->processedAudioData.amplitudeFactor = amplitudeFactor;
+    
+    pthread_mutex_unlock(&analysisLock);
+}
+
+// Starts the timeline over at 0, with nothing analysed and nothing waiting
+- (void)resetAnalysis
+{
+    pthread_mutex_lock(&analysisLock);
+    [self resetAnalysisLocked];
+    pthread_mutex_unlock(&analysisLock);
+}
+
+// Clearing the input rings is the consumer's to do, and holding the lock makes us the consumer
+- (void)resetAnalysisLocked
+{
+    CGFloat amplitudeFactor = self->processedAudioData.amplitudeFactor;
+    for (UInt32 i=0;i<numInputBuffers;i++) TPSPSCCircularBufferClear(&inputBuffers[i]);
+    TPSPSCCircularBufferClear(&inputBlocks);
+    for (UInt32 i=0;i<self->processedAudioData.numChannels;i++)
+        AudioStreamClear(&self->processedAudioData.channels[i]);
+    LiveAudioDataReset(&self->processedAudioData);
+    self->processedAudioData.amplitudeFactor = amplitudeFactor;
+    atomic_store(&numInputFramesDropped, 0);
+    
+    atomic_store(&numFramesCaptured, 0);
+    numFramesTaken = 0;
+    numStagedFrames = 0;
+    hasSampleTimeOffset = NO;
+    AudioClockInit(&inputClock, self.audioFormat.mSampleRate);
+    inputLatencyTicks = self.audioController.automaticLatencyManagement ? 0 : AEHostTicksFromSeconds(self.audioController.inputLatency);
+}
+
 + (AEAudioController *)sharedPlayAndRecordAudioController
 {
     static AEAudioController *controller = nil;
@@ -62,67 +199,142 @@
     return controller;
 }
 
-id _refToSelf = NULL;
-
-double previousCallbackTime = 0;
-int counter = 0;
-
-uint64_t micGenTime = 0;
-
+// Runs on the render thread, so it doesn't allocate, lock or wait. A block goes into every channel's ring
+// or none of them, so they stay in step; if the analysis has fallen that far behind, the block is dropped.
 static void receiverCallback(id receiver, AEAudioController *audioController, void *source, const AudioTimeStamp *time, UInt32 frames, AudioBufferList *audio)
 {
-    // TODO: support for more than one channel
-    micGenTime = time->mHostTime;
     __unsafe_unretained Microphone *microphone = (Microphone*)receiver;
+    UInt32 numChannels = microphone->numInputBuffers;
+    int32_t numBytes = frames * sizeof(float);
+    
+    float *destinations[MAX_AUDIO_CHANNELS];
+    int32_t availableBytes = 0;
+    MicrophoneInputBlock *block = (MicrophoneInputBlock *)TPSPSCCircularBufferHeadAtLeast(&microphone->inputBlocks, &availableBytes, sizeof(MicrophoneInputBlock));
+    BOOL hasRoom = availableBytes >= (int32_t)sizeof(MicrophoneInputBlock);
+    for (UInt32 i=0;i<numChannels && hasRoom;i++)
+    {
+        destinations[i] = (float *)TPSPSCCircularBufferHeadAtLeast(&microphone->inputBuffers[i], &availableBytes, numBytes);
+        hasRoom = availableBytes >= numBytes;
+    }
+    if (!hasRoom)
+    {
+        atomic_fetch_add_explicit(&microphone->numInputFramesDropped, frames, memory_order_relaxed);
+        return;
+    }
     
-    // Adding the received audio to the toProcess buffers. If the buffer is full, overwrite from the beginning
-    AppendToCircularBuffer(&microphone->circularBuffer1, audio->mBuffers[0].mData, frames * sizeof(float));
-    AppendToCircularBuffer(&microphone->circularBuffer2, audio->mBuffers[1].mData, frames * sizeof(float));
-    dispatch_async(microphone->syncQueue, ^
+    for (UInt32 i=0;i<numChannels;i++)
     {
-        processLiveAudio();
-    });
+        memcpy(destinations[i], audio->mBuffers[MIN(i, audio->mNumberBuffers - 1)].mData, numBytes);
+        TPSPSCCircularBufferProduce(&microphone->inputBuffers[i], numBytes);
+    }
+    block->sampleTime = (time->mFlags & kAudioTimeStampSampleTimeValid) ? time->mSampleTime : NAN;
+    block->hostTime = (time->mFlags & kAudioTimeStampHostTimeValid) ? time->mHostTime : 0;
+    block->numFrames = frames;
+    TPSPSCCircularBufferProduce(&microphone->inputBlocks, sizeof(MicrophoneInputBlock));
+    atomic_fetch_add_explicit(&microphone->numFramesCaptured, frames, memory_order_release);
     
-    // TOOD: make sure those oporations are performed serially. for example, it must not be possible that
-    // two instances of processLiveAudio() will run concurrency. (Or, that two instances of this function, if somehow this inputReceiver is added multiple times to the audio controller)
+    AudioWakeupSignal(&microphone->inputArrived);
 }
 
-void processLiveAudio()
+// Whether what's come in makes up the rest of the staged chunk
+static BOOL HasInputChunk(__unsafe_unretained Microphone *THIS)
 {
-    static BOOL isProcessingAudio = NO;
-    while (isProcessingAudio) {}
-    isProcessingAudio = YES;
-    
-    __unsafe_unretained Microphone *THIS = (Microphone *)_refToSelf;
-    
-    // Processing only the last CHUNK_SIZE_FOR_RECORDING samples in the circular buffer
+    UInt64 numFramesWaiting = atomic_load_explicit(&THIS->numFramesCaptured, memory_order_acquire) - THIS->numFramesTaken;
+    return THIS->numStagedFrames + numFramesWaiting >= CHUNK_SIZE_FOR_RECORDING;
+}
+
+// Every chunk goes to the storage whole, in order, so every sample is analysed once per jump. The storage
+// keeps the previous chunk, so the frames that overlap two chunks come out too
+static void AnalyseStagedChunk(__unsafe_unretained Microphone *THIS)
+{
+    CircularAudioStorage *storage = &THIS->processedAudioData;
+    for (UInt32 i=0;i<storage->numChannels;i++)
+        AddAudioToLiveStream(THIS->stagedSamples + i * CHUNK_SIZE_FOR_RECORDING, CHUNK_SIZE_FOR_RECORDING, &storage->channels[i]);
     
-    if (THIS->circularBuffer1.fillCount >= CHUNK_SIZE_FOR_RECORDING * sizeof(float))
+    // Nothing's ahead of the input, so the oldest audio can always make room
+    storage->currentlyPlayingFrame += CHUNK_SIZE_FOR_RECORDING;
+    THIS->numStagedFrames = 0;
+}
+
+// Takes numFrames from the input rings, or silence in their place, into the staged chunks
+static void StageInput(__unsafe_unretained Microphone *THIS, UInt64 numFrames, BOOL isSilence)
+{
+    while (numFrames > 0)
     {
-        int avaliableBytes = 0;
-        float *samples = (float *)TPCircularBufferTail(&THIS->circularBuffer1, &avaliableBytes) + THIS->circularBuffer1.fillCount / sizeof(float) - CHUNK_SIZE_FOR_RECORDING;
-        AmplitudeFactor(samples, CHUNK_SIZE_FOR_RECORDING, THIS->_amplitudeFactor, THIS->liveMicrophoneData.samples1);
+        UInt32 numFramesToStage = (UInt32)MIN(numFrames, CHUNK_SIZE_FOR_RECORDING - THIS->numStagedFrames);
+        int32_t numBytes = numFramesToStage * sizeof(float);
+        for (UInt32 i=0;i<THIS->numInputBuffers;i++)
+        {
+            float *destination = THIS->stagedSamples + i * CHUNK_SIZE_FOR_RECORDING + THIS->numStagedFrames;
+            if (isSilence)
+            {
+                memset(destination, 0, numBytes);
+                continue;
+            }
+            int32_t availableBytes = 0;
+            float *samples = (float *)TPSPSCCircularBufferTailAtLeast(&THIS->inputBuffers[i], &availableBytes, numBytes);
+            memcpy(destination, samples, numBytes);
+            TPSPSCCircularBufferConsume(&THIS->inputBuffers[i], numBytes);
+        }
+        THIS->processedAudioData.numSampleBytesCopied += THIS->numInputBuffers * numBytes;
         
-        // FFting
-        Chunked_FFT(THIS->liveMicrophoneData.samples1, CHUNK_SIZE_FOR_RECORDING, (float *)THIS->liveMicrophoneData.fftResults1, CHUNK_SIZE_FOR_RECORDING);
+        THIS->numStagedFrames += numFramesToStage;
+        numFrames -= numFramesToStage;
+        if (THIS->numStagedFrames == CHUNK_SIZE_FOR_RECORDING) AnalyseStagedChunk(THIS);
     }
-    
-    if (THIS->_audioController.numberOfInputChannels == 1)
+}
+
+// Takes in every block that's come in, by its timestamp. A gap since the last one (blocks the callback
+// dropped) is filled with silence, up to what's kept; past that, or if the input's time went back (it
+// restarted), the timeline just goes on from where it is, and the sample times before that are lost
+static void ProcessLiveAudio(__unsafe_unretained Microphone *THIS)
+{
+    while (YES)
     {
-        memcpy(THIS->liveMicrophoneData.samples2, THIS->liveMicrophoneData.samples1, CHUNK_SIZE_FOR_RECORDING * sizeof(float));
-        memcpy(THIS->liveMicrophoneData.fftResults2, THIS->liveMicrophoneData.fftResults1, CHUNK_SIZE_FOR_RECORDING * sizeof(float));
+        int32_t availableBytes = 0;
+        MicrophoneInputBlock *block = (MicrophoneInputBlock *)TPSPSCCircularBufferTailAtLeast(&THIS->inputBlocks, &availableBytes, sizeof(MicrophoneInputBlock));
+        if (availableBytes < (int32_t)sizeof(MicrophoneInputBlock)) break;
+        
+        SInt64 frame = THIS->processedAudioData.currentlyPlayingFrame + THIS->numStagedFrames;
+        Float64 expectedSampleTime = frame + atomic_load_explicit(&THIS->sampleTimeOffset, memory_order_relaxed);
+        Float64 sampleTime = isnan(block->sampleTime) ? expectedSampleTime : block->sampleTime;
+        Float64 numFramesMissing = round(sampleTime - expectedSampleTime);
+        if (THIS->hasSampleTimeOffset && numFramesMissing > 0 && numFramesMissing <= MICROPHONE_MAX_SILENCE_FRAMES)
+        {
+            StageInput(THIS, (UInt64)numFramesMissing, YES);
+            frame += (SInt64)numFramesMissing;
+        }
+        else if (!THIS->hasSampleTimeOffset || numFramesMissing != 0)
+        {
+            atomic_store_explicit(&THIS->sampleTimeOffset, sampleTime - frame, memory_order_relaxed);
+            THIS->hasSampleTimeOffset = YES;
+        }
+        
+        if (block->hostTime)
+            AudioClockAddPoint(&THIS->inputClock, block->hostTime - THIS->inputLatencyTicks, sampleTime, frame, block->numFrames, block->numFrames, 1);
+        
+        UInt32 numFrames = block->numFrames;
+        TPSPSCCircularBufferConsume(&THIS->inputBlocks, sizeof(MicrophoneInputBlock));
+        StageInput(THIS, numFrames, NO);
+        THIS->numFramesTaken += numFrames;
     }
-    else if (THIS->circularBuffer2.fillCount >= CHUNK_SIZE_FOR_RECORDING * sizeof(float))
+}
+
+// Sleeps until there's a whole chunk of input, then takes in everything that's there by then
+static void *AnalysisThreadMain(void *context)
+{
+    __unsafe_unretained Microphone *THIS = (__bridge Microphone *)context;
+    pthread_setname_np("Microphone Analysis Thread");
+    
+    while (!atomic_load(&THIS->shouldStopAnalysis))
     {
-        int avaliableBytes = 0;
-        float *samples = (float *)TPCircularBufferTail(&THIS->circularBuffer2, &avaliableBytes) + THIS->circularBuffer2.fillCount / sizeof(float) - CHUNK_SIZE_FOR_RECORDING;;
-        AmplitudeFactor(samples, CHUNK_SIZE_FOR_RECORDING, THIS->_amplitudeFactor, THIS->liveMicrophoneData.samples2);
+        AudioWakeupWait(&THIS->inputArrived, ^BOOL{ return atomic_load(&THIS->shouldStopAnalysis) || HasInputChunk(THIS); }, DISPATCH_TIME_FOREVER);
         
-        // FFting
-        Chunked_FFT(THIS->liveMicrophoneData.samples2, CHUNK_SIZE_FOR_RECORDING, (float *)THIS->liveMicrophoneData.fftResults2, CHUNK_SIZE_FOR_RECORDING);
+        pthread_mutex_lock(&THIS->analysisLock);
+        ProcessLiveAudio(THIS);
+        pthread_mutex_unlock(&THIS->analysisLock);
     }
-    isProcessingAudio = NO;
-
+    return NULL;
 }
 
 -(AEAudioControllerAudioCallback)receiverCallback
@@ -140,7 +352,10 @@ void processLiveAudio()
     NSError *error;
     if (!self.audioController.running) [self.audioController start:&error]; if (error) return error;
     if (self.isRecording || [self.audioController.inputReceivers containsObject:self]) return nil;
-    [self.audioController addInputReceiver:self];
+    
+    // After whatever the last recording left queued
+    [self resetAnalysis];
+    [self.audioController addInputReceiver:self forChannels:self.inputChannels];
     self.isRecording = YES;
     
     return nil;
@@ -150,8 +365,9 @@ void processLiveAudio()
 {
     if (!self.isRecording || !self.audioController.running) return nil;
     
+    // Another Microphone may still be recording from the same controller
     [self.audioController removeInputReceiver:self];
-    [self.audioController stop];
+    if (self.audioController.inputReceivers.count == 0) [self.audioController stop];
     self.isRecording = NO;
     
     return nil;
@@ -160,30 +376,102 @@ void processLiveAudio()
 - (LiveAudioData)liveAudioData
 {
     LiveAudioData audioData;
-    audioData.timeInFrames = 0; // TODO: provide true frame time
-    audioData.channel1 = [self getAudioDataForChannelID:1];
-    audioData.channel2 = [self getAudioDataForChannelID:2];
+    audioData.timeInFrames = self->processedAudioData.currentlyPlayingFrame - CHUNK_SIZE_FOR_RECORDING;
+    audioData.sampleRate = self.audioFormat.mSampleRate;
+    audioData.numChannels = self->processedAudioData.numChannels;
+    for (UInt32 i=0;i<audioData.numChannels;i++)
+        audioData.channels[i] = [self getLiveAudioDataForFrame:audioData.timeInFrames andChannel:i + 1];
+    audioData.channel1 = audioData.channels[0];
+    audioData.channel2 = audioData.numChannels > 1 ? audioData.channels[1] : audioData.channels[0];
+    audioData.extractedChannel.containsData = NO;
     
     return audioData;
 }
 
-- (LiveAudioChannelData)getAudioDataForChannelID:(UInt32)channelID
+// The newest frame, unless hostTime is before it was captured
+- (LiveAudioData)liveAudioDataAtHostTime:(uint64_t)hostTime
 {
-    LiveAudioChannelData audioData;
-    
-    float *samples = channelID == 2 && self.audioFormat.mChannelsPerFrame == 2 ? liveMicrophoneData.samples2 : liveMicrophoneData.samples1;
-    float *fftResults = (float *)(channelID == 2 && self.audioFormat.mChannelsPerFrame == 2 ? liveMicrophoneData.fftResults2 : liveMicrophoneData.fftResults1);
-    
-    LiveSamples liveSamples = (LiveSamples){0, samples, CHUNK_SIZE_FOR_RECORDING};
-    LiveFFTResults liveFFTResults = (LiveFFTResults) {0,fftResults, 1};
-    
-    audioData.containsData = YES;
-    audioData.samples = liveSamples;
-    audioData.fftResults = liveFFTResults;
+    LiveAudioData audioData = self.liveAudioData;
+    SInt64 frame = MIN((SInt64)floor([self frameAtHostTime:hostTime]), audioData.timeInFrames);
+    if (frame == audioData.timeInFrames) return audioData;
     
+    audioData.timeInFrames = frame;
+    for (UInt32 i=0;i<audioData.numChannels;i++)
+        audioData.channels[i] = [self getLiveAudioDataForFrame:frame andChannel:i + 1];
+    audioData.channel1 = audioData.channels[0];
+    audioData.channel2 = audioData.numChannels > 1 ? audioData.channels[1] : audioData.channels[0];
     return audioData;
 }
 
+- (Float64)sampleTimeAtFrame:(SInt64)frame
+{
+    return frame + atomic_load_explicit(&sampleTimeOffset, memory_order_relaxed);
+}
+
+- (uint64_t)hostTimeAtFrame:(SInt64)frame
+{
+    UInt64 hostTime;
+    if (!AudioClockHostTimeAtFrame(&inputClock, frame, &hostTime)) return 0;
+    return hostTime;
+}
+
+- (Float64)frameAtHostTime:(uint64_t)hostTime
+{
+    Float64 frame;
+    if (!AudioClockFrameAtHostTime(&inputClock, hostTime, &frame)) return self->processedAudioData.currentlyPlayingFrame;
+    return frame;
+}
+
+- (LiveAudioChannelData)getAudioDataForChannelID:(UInt32)channelID
+{
+    return [self getLiveAudioDataForFrame:self->processedAudioData.currentlyPlayingFrame - CHUNK_SIZE_FOR_RECORDING andChannel:channelID];
+}
+
+// Asking for a channel past the last gives the last
+- (LiveAudioChannelData)getLiveAudioDataForFrame:(SInt64)frameOffset andChannel:(UInt32)channelID
+{
+    UInt32 index = MIN(MAX(channelID, 1) - 1, self->processedAudioData.numChannels - 1);
+    return AudioStreamGetLiveData(&self->processedAudioData.channels[index], frameOffset);
+}
+
+- (CGFloat)amplitudeFactor
+{
+    return self->processedAudioData.amplitudeFactor;
+}
+
+- (void)setAmplitudeFactor:(CGFloat)amplitudeFactor
+{
+    self->processedAudioData.amplitudeFactor = amplitudeFactor;
+}
+
+- (UInt32)fftOverlapJumpSize
+{
+    return self->processedAudioData.fftOverlapJumpSize;
+}
+
+- (void)setFftOverlapJumpSize:(UInt32)fftOverlapJumpSize
+{
+    if (fftOverlapJumpSize == 0 || CHUNK_SIZE_FOR_RECORDING % fftOverlapJumpSize != 0 || self.isRecording)
+    {
+        NSLog(@"The microphone's FFT jump size must divide %d, and can't change while recording", CHUNK_SIZE_FOR_RECORDING);
+        return;
+    }
+    [self setUpAnalysisWithJumpSize:fftOverlapJumpSize];
+}
+
+- (AudioStreamMemoryUsage)memoryUsage
+{
+    AudioStreamMemoryUsage usage = CircularAudioStorageMemoryUsage(&self->processedAudioData);
+    usage.transportBytes = [self inputBuffersBytes];
+    usage.totalBytes += usage.transportBytes;
+    return usage;
+}
+
+- (UInt64)numInputFramesDropped
+{
+    return atomic_load_explicit(&numInputFramesDropped, memory_order_relaxed);
+}
+
 - (enum AudioSupplyMode)audioSupplyMode
 {
     if (!self.isRecording) return AudioSupplyMode_NotSupplying;
@@ -191,37 +479,6 @@ void processLiveAudio()
     return AudioSupplyMode_Regular;
 }
 
-/*
- - (void)processLiveAudio
- {
- // TODO: do this on another thread to improve render times
- //__unsafe_unretained Microphone *THIS = (Microphone *)_refToSelf;
- 
- if (circularBuffer1.fillCount >= CHUNK_SIZE_FOR_RECORDING * sizeof(float))
- {
- // Processing only the last CHUNK_SIZE_FOR_RECORDING samples in the circular buffer
- 
- int avaliableBytes = 0;
- float *samples = (float *)TPCircularBufferTail(&circularBuffer1, &avaliableBytes) + circularBuffer1.fillCount / sizeof(float) - CHUNK_SIZE_FOR_RECORDING;
- memcpy((void *)liveMicrophoneData.samples1, (void *)samples, CHUNK_SIZE_FOR_RECORDING * sizeof(float));
- 
- // FFting
- Chunked_FFT(liveMicrophoneData.samples1, CHUNK_SIZE_FOR_RECORDING, (float *)liveMicrophoneData.fftResults1, CHUNK_SIZE_FOR_RECORDING);
- }
- 
- if (circularBuffer2.fillCount >= CHUNK_SIZE_FOR_RECORDING * sizeof(float))
- {
- // Processing only the last CHUNK_SIZE_FOR_RECORDING samples in the circular buffer
- 
- int avaliableBytes = 0;
- float *samples = (float *)TPCircularBufferTail(&circularBuffer2, &avaliableBytes) + circularBuffer2.fillCount / sizeof(float) - CHUNK_SIZE_FOR_RECORDING;;
- memcpy((void *)liveMicrophoneData.samples2, (void *)samples, CHUNK_SIZE_FOR_RECORDING * sizeof(float));
- 
- // FFting
- Chunked_FFT(liveMicrophoneData.samples2, CHUNK_SIZE_FOR_RECORDING, (float *)liveMicrophoneData.fftResults2, CHUNK_SIZE_FOR_RECORDING);
- }
- }
- */
 
 
 @end
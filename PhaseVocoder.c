@@ -0,0 +1,434 @@
+//
+//  PhaseVocoder.c
+//  Equalizer
+//
+
+#include "PhaseVocoder.h"
+#include "SpectrumAnalysis.h"
+#include <stdlib.h>
+#include <string.h>
+#include <assert.h>
+#include <math.h>
+
+#define PHASE_VOCODER_ONSET_RISE 2.0        // a bin's energy going up this much (3 dB) from the previous frame's
+#define PHASE_VOCODER_ONSET_FRACTION 0.5    // in this many of the bins that have any, makes an onset
+#define PHASE_VOCODER_SILENCE 1e-10f        // bin energy that counts as none
+
+// Frames are centered on what they stand for, so the stretched audio lags the frames' starts by half a window
+#define CENTER_HOPS (PHASE_VOCODER_OVERLAP / 2)
+
+static inline float WrapPhase(float phase)
+{
+    return phase - 2 * (float)M_PI * roundf(phase / (2 * (float)M_PI));
+}
+
+static Float64 ClampedRate(Float64 rate)
+{
+    if (!(rate >= PHASE_VOCODER_MIN_RATE)) return PHASE_VOCODER_MIN_RATE;
+    if (rate > PHASE_VOCODER_MAX_RATE) return PHASE_VOCODER_MAX_RATE;
+    return rate;
+}
+
+static Float64 PitchRatio(Float64 pitch)
+{
+    if (!(pitch >= -PHASE_VOCODER_MAX_PITCH)) pitch = -PHASE_VOCODER_MAX_PITCH;
+    if (pitch > PHASE_VOCODER_MAX_PITCH) pitch = PHASE_VOCODER_MAX_PITCH;
+    return pow(2, pitch / 12);
+}
+
+// Stretching by the pitch ratio as well as the rate, so resampling by it takes the length back to the rate's.
+// Fast and down can take hops past the window, which just skip what's between the frames
+static UInt32 MaxAnalysisHop(const PhaseVocoder *vocoder)
+{
+    return 2 * vocoder->windowSize;
+}
+
+static UInt32 AnalysisHop(const PhaseVocoder *vocoder, Float64 rate, Float64 pitchRatio)
+{
+    long hop = lround(vocoder->synthesisHop * rate / pitchRatio);
+    if (hop < 1) hop = 1;
+    if (hop > MaxAnalysisHop(vocoder)) hop = MaxAnalysisHop(vocoder);
+    return (UInt32)hop;
+}
+
+Boolean PhaseVocoderInit(PhaseVocoder *vocoder, UInt32 numChannels, UInt32 windowSize)
+{
+    memset(vocoder, 0, sizeof(PhaseVocoder));
+    if (numChannels == 0 || numChannels > PHASE_VOCODER_MAX_CHANNELS || windowSize < 4 * PHASE_VOCODER_OVERLAP ||
+        windowSize > (1 << MAX_FFT_LOG2N) || (windowSize & (windowSize - 1)) != 0)
+        return false;
+
+    vocoder->numChannels = numChannels;
+    vocoder->windowSize = windowSize;
+    vocoder->synthesisHop = windowSize / PHASE_VOCODER_OVERLAP;
+    vocoder->numBins = windowSize / 2 + 1;
+    vocoder->inputCapacity = 4 * windowSize;
+    vocoder->stretchedCapacity = 12 * windowSize;
+
+    Boolean success = true;
+    vocoder->window = malloc(windowSize * sizeof(float));
+    vocoder->previousEnergies = malloc(vocoder->numBins * sizeof(float));
+    vocoder->energies = malloc(vocoder->numBins * sizeof(float));
+    vocoder->stretchedSteps = malloc(vocoder->stretchedCapacity * sizeof(float));
+    success = vocoder->window && vocoder->previousEnergies && vocoder->energies && vocoder->stretchedSteps;
+
+    for (UInt32 i=0;i<numChannels && success;i++)
+    {
+        PhaseVocoderChannel *channel = &vocoder->channels[i];
+        channel->input = malloc(vocoder->inputCapacity * sizeof(float));
+        channel->analysisPhases = malloc(vocoder->numBins * sizeof(float));
+        channel->synthesisPhases = malloc(vocoder->numBins * sizeof(float));
+        channel->magnitudes = malloc(vocoder->numBins * sizeof(float));
+        channel->phases = malloc(vocoder->numBins * sizeof(float));
+        channel->overlap = malloc(windowSize * sizeof(float));
+        channel->stretched = malloc(vocoder->stretchedCapacity * sizeof(float));
+        success = channel->input && channel->analysisPhases && channel->synthesisPhases && channel->magnitudes &&
+                  channel->phases && channel->overlap && channel->stretched;
+    }
+
+    if (!success)
+    {
+        PhaseVocoderCleanup(vocoder);
+        return false;
+    }
+
+    SpectrumAnalysisHannWindow(vocoder->window, windowSize);
+    atomic_init(&vocoder->numPendingFrames, 0);
+    PhaseVocoderReset(vocoder);
+    return true;
+}
+
+void PhaseVocoderCleanup(PhaseVocoder *vocoder)
+{
+    for (UInt32 i=0;i<PHASE_VOCODER_MAX_CHANNELS;i++)
+    {
+        PhaseVocoderChannel *channel = &vocoder->channels[i];
+        free(channel->input);
+        free(channel->analysisPhases);
+        free(channel->synthesisPhases);
+        free(channel->magnitudes);
+        free(channel->phases);
+        free(channel->overlap);
+        free(channel->stretched);
+    }
+    free(vocoder->window);
+    free(vocoder->previousEnergies);
+    free(vocoder->energies);
+    free(vocoder->stretchedSteps);
+    memset(vocoder, 0, sizeof(PhaseVocoder));
+}
+
+void PhaseVocoderReset(PhaseVocoder *vocoder)
+{
+    vocoder->inputStart = vocoder->inputEnd = 0;
+    vocoder->playStart = -1;
+    vocoder->nextAnalysisFrame = 0;
+    vocoder->numFramesMade = 0;
+    vocoder->wasOnset = false;
+    vocoder->numStretched = 0;
+    vocoder->readPosition = 0;
+    for (UInt32 i=0;i<vocoder->numChannels;i++) memset(vocoder->channels[i].overlap, 0, vocoder->windowSize * sizeof(float));
+    atomic_store_explicit(&vocoder->numPendingFrames, 0, memory_order_relaxed);
+}
+
+// Deinterleaves into the input, after dropping what no frame needs any more: before the next frame once
+// playing, and all but what the first frames reach back to before that. Returns the frames it kept: none
+// when a hop past the window skips all of them, and only what it had room for when the input's full
+static UInt32 AppendInput(PhaseVocoder *vocoder, const float *samples, UInt32 numFrames)
+{
+    UInt32 numChannels = vocoder->numChannels;
+    SInt64 keepFrom = vocoder->nextAnalysisFrame;
+    if (vocoder->playStart < 0) keepFrom = vocoder->inputEnd + numFrames - (vocoder->windowSize / 2 + MaxAnalysisHop(vocoder));
+
+    if (keepFrom > vocoder->inputEnd)
+    {
+        UInt32 numFramesToSkip = keepFrom - vocoder->inputEnd < numFrames ? (UInt32)(keepFrom - vocoder->inputEnd) : numFrames;
+        samples += numFramesToSkip * numChannels;
+        numFrames -= numFramesToSkip;
+        vocoder->inputStart = vocoder->inputEnd = vocoder->inputEnd + numFramesToSkip;
+        if (numFrames == 0) return 0;
+    }
+    if (keepFrom > vocoder->inputStart)
+    {
+        UInt32 numFramesToDrop = (UInt32)(keepFrom - vocoder->inputStart);
+        UInt32 numFramesToKeep = (UInt32)(vocoder->inputEnd - keepFrom);
+        for (UInt32 i=0;i<numChannels;i++)
+            memmove(vocoder->channels[i].input, vocoder->channels[i].input + numFramesToDrop, numFramesToKeep * sizeof(float));
+        vocoder->inputStart = keepFrom;
+    }
+
+    UInt32 room = vocoder->inputCapacity - (UInt32)(vocoder->inputEnd - vocoder->inputStart);
+    if (numFrames > room) numFrames = room;
+
+    UInt32 offset = (UInt32)(vocoder->inputEnd - vocoder->inputStart);
+    for (UInt32 i=0;i<numChannels;i++)
+    {
+        float *input = vocoder->channels[i].input + offset;
+        for (UInt32 j=0;j<numFrames;j++) input[j] = samples[j * numChannels + i];
+    }
+    vocoder->inputEnd += numFrames;
+    return numFrames;
+}
+
+void PhaseVocoderAddHistory(PhaseVocoder *vocoder, const float *samples, UInt32 numFrames)
+{
+    if (vocoder->playStart >= 0) return;
+
+    // Only what the first frames reach back to is kept, which is well inside the input
+    UInt32 numFramesReachedBack = vocoder->windowSize / 2 + MaxAnalysisHop(vocoder);
+    UInt32 numFramesKept = AppendInput(vocoder, samples, numFrames);
+    assert(numFramesKept == (numFrames < numFramesReachedBack ? numFrames : numFramesReachedBack));
+    (void)numFramesKept;
+}
+
+// The bins of a frame whose phases lead: louder than the two bins on either side
+static UInt32 FindPeaks(const float *magnitudes, UInt32 numBins, UInt32 *peaks)
+{
+    UInt32 numPeaks = 0;
+    for (UInt32 bin=1;bin+1<numBins;bin++)
+    {
+        float magnitude = magnitudes[bin];
+        if (magnitude <= magnitudes[bin - 1] || magnitude < magnitudes[bin + 1]) continue;
+        if (bin >= 2 && magnitude <= magnitudes[bin - 2]) continue;
+        if (bin + 2 < numBins && magnitude < magnitudes[bin + 2]) continue;
+        peaks[numPeaks++] = bin;
+    }
+    return numPeaks;
+}
+
+// Identity phase locking (Laroche and Dolson). A peak's phase advances by its measured frequency over the
+// synthesis hop, and the bins around it, up to the quietest bin between it and the next peak, keep the
+// phase difference to it they had in the analysis
+static void LockPhases(PhaseVocoder *vocoder, PhaseVocoderChannel *channel, UInt32 analysisHop)
+{
+    UInt32 numBins = vocoder->numBins;
+    UInt32 peaks[numBins];
+    UInt32 numPeaks = FindPeaks(channel->magnitudes, numBins, peaks);
+
+    // Silence, or noise with no peaks to speak of: every bin for itself
+    Boolean everyBin = numPeaks == 0;
+    if (everyBin)
+    {
+        for (UInt32 bin=0;bin<numBins;bin++) peaks[bin] = bin;
+        numPeaks = numBins;
+    }
+
+    for (UInt32 i=0;i<numPeaks;i++)
+    {
+        UInt32 peak = peaks[i];
+        float binFrequency = 2 * (float)M_PI * peak / vocoder->windowSize;
+        float deviation = WrapPhase(channel->phases[peak] - channel->analysisPhases[peak] - binFrequency * analysisHop);
+        float frequency = binFrequency + deviation / analysisHop;
+        channel->synthesisPhases[peak] = WrapPhase(channel->synthesisPhases[peak] + frequency * vocoder->synthesisHop);
+    }
+    if (everyBin) return;
+
+    UInt32 regionStart = 0;
+    for (UInt32 i=0;i<numPeaks;i++)
+    {
+        UInt32 peak = peaks[i];
+        UInt32 regionEnd = numBins;
+        if (i + 1 < numPeaks)
+        {
+            regionEnd = peak + 1;
+            for (UInt32 bin=peak+1;bin<peaks[i + 1];bin++)
+            {
+                if (channel->magnitudes[bin] < channel->magnitudes[regionEnd]) regionEnd = bin;
+            }
+            regionEnd++;
+        }
+
+        float peakSynthesisPhase = channel->synthesisPhases[peak], peakPhase = channel->phases[peak];
+        for (UInt32 bin=regionStart;bin<regionEnd;bin++)
+        {
+            if (bin != peak) channel->synthesisPhases[bin] = peakSynthesisPhase + channel->phases[bin] - peakPhase;
+        }
+        regionStart = regionEnd;
+    }
+}
+
+// An onset is when most of the bins with any energy get a lot louder at once. Only the first frame of one
+// counts, or the phases would keep starting over through the attack
+static Boolean IsOnset(PhaseVocoder *vocoder)
+{
+    UInt32 numBinsWithEnergy = 0, numBinsRising = 0;
+    for (UInt32 bin=1;bin<vocoder->numBins;bin++)
+    {
+        if (vocoder->energies[bin] < PHASE_VOCODER_SILENCE) continue;
+        numBinsWithEnergy++;
+        if (vocoder->energies[bin] > PHASE_VOCODER_ONSET_RISE * vocoder->previousEnergies[bin]) numBinsRising++;
+    }
+
+    Boolean isOnset = numBinsWithEnergy > 0 && numBinsRising > PHASE_VOCODER_ONSET_FRACTION * numBinsWithEnergy && !vocoder->wasOnset;
+    vocoder->wasOnset = isOnset;
+    return isOnset;
+}
+
+// Analyses the frame at nextAnalysisFrame and overlap-adds it one synthesis hop on from the previous one.
+// The synthesis hop that's then complete goes to the stretched audio, unless it's from before the first frame to play
+static void MakeFrame(PhaseVocoder *vocoder, UInt32 nextAnalysisHop)
+{
+    UInt32 windowSize = vocoder->windowSize, numBins = vocoder->numBins, hop = vocoder->synthesisHop;
+    float frame[windowSize], real[numBins], imag[numBins];
+
+    memset(vocoder->energies, 0, numBins * sizeof(float));
+    for (UInt32 i=0;i<vocoder->numChannels;i++)
+    {
+        PhaseVocoderChannel *channel = &vocoder->channels[i];
+        SInt64 offset = vocoder->nextAnalysisFrame - vocoder->inputStart;
+        for (UInt32 n=0;n<windowSize;n++)
+            frame[n] = offset + (SInt64)n >= 0 ? channel->input[offset + n] * vocoder->window[n] : 0;
+
+        SpectrumAnalysisForwardFFT(frame, windowSize, real, imag);
+        for (UInt32 bin=0;bin<numBins;bin++)
+        {
+            float energy = real[bin] * real[bin] + imag[bin] * imag[bin];
+            channel->magnitudes[bin] = sqrtf(energy);
+            channel->phases[bin] = atan2f(imag[bin], real[bin]);
+            vocoder->energies[bin] += energy;
+        }
+    }
+
+    Boolean startsOver = IsOnset(vocoder) || vocoder->numFramesMade == 0;
+    memcpy(vocoder->previousEnergies, vocoder->energies, numBins * sizeof(float));
+
+    // The window twice (in and out) overlapped PHASE_VOCODER_OVERLAP times sums to a constant, which this undoes
+    float windowEnergy = 0;
+    for (UInt32 n=0;n<windowSize;n++) windowEnergy += vocoder->window[n] * vocoder->window[n];
+    float gain = hop / windowEnergy;
+
+    for (UInt32 i=0;i<vocoder->numChannels;i++)
+    {
+        PhaseVocoderChannel *channel = &vocoder->channels[i];
+        if (startsOver) memcpy(channel->synthesisPhases, channel->phases, numBins * sizeof(float));
+        else LockPhases(vocoder, channel, vocoder->lastAnalysisHop);
+        memcpy(channel->analysisPhases, channel->phases, numBins * sizeof(float));
+
+        for (UInt32 bin=0;bin<numBins;bin++)
+        {
+            real[bin] = channel->magnitudes[bin] * cosf(channel->synthesisPhases[bin]);
+            imag[bin] = channel->magnitudes[bin] * sinf(channel->synthesisPhases[bin]);
+        }
+        imag[0] = imag[numBins - 1] = 0;
+        SpectrumAnalysisInverseFFT(real, imag, windowSize, frame);
+        for (UInt32 n=0;n<windowSize;n++) channel->overlap[n] += frame[n] * vocoder->window[n] * gain;
+    }
+
+    // The hop that's complete stands for the source between the frames centered on its ends
+    UInt64 frameIndex = vocoder->numFramesMade;
+    vocoder->recentAnalysisHops[frameIndex % PHASE_VOCODER_OVERLAP] = vocoder->lastAnalysisHop;
+    if (frameIndex > CENTER_HOPS)
+    {
+        float step = (float)vocoder->recentAnalysisHops[(frameIndex - CENTER_HOPS + 1) % PHASE_VOCODER_OVERLAP] / hop;
+        for (UInt32 i=0;i<vocoder->numChannels;i++)
+            memcpy(vocoder->channels[i].stretched + vocoder->numStretched, vocoder->channels[i].overlap, hop * sizeof(float));
+        for (UInt32 n=0;n<hop;n++) vocoder->stretchedSteps[vocoder->numStretched + n] = step;
+        vocoder->numStretched += hop;
+    }
+
+    for (UInt32 i=0;i<vocoder->numChannels;i++)
+    {
+        float *overlap = vocoder->channels[i].overlap;
+        memmove(overlap, overlap + hop, (windowSize - hop) * sizeof(float));
+        memset(overlap + windowSize - hop, 0, hop * sizeof(float));
+    }
+
+    vocoder->numFramesMade++;
+    vocoder->nextAnalysisFrame += nextAnalysisHop;
+    vocoder->lastAnalysisHop = nextAnalysisHop;
+}
+
+// Catmull-Rom through the stretched frames around position
+static inline float Interpolate(const float *samples, UInt32 index, float fraction)
+{
+    float y0 = samples[index > 0 ? index - 1 : 0], y1 = samples[index], y2 = samples[index + 1], y3 = samples[index + 2];
+    return y1 + 0.5f * fraction * (y2 - y0 + fraction * (2 * y0 - 5 * y1 + 4 * y2 - y3 + fraction * (3 * (y1 - y2) + y3 - y0)));
+}
+
+UInt32 PhaseVocoderProcess(PhaseVocoder *vocoder, const float *samples, UInt32 numFrames, Float64 rate, Float64 pitch,
+                           float *const *outputs, UInt32 maxOutputFrames, Float64 *numSourceFrames)
+{
+    UInt32 numChannels = vocoder->numChannels, windowSize = vocoder->windowSize;
+    Float64 pitchRatio = PitchRatio(pitch);
+    UInt32 analysisHop = AnalysisHop(vocoder, ClampedRate(rate), pitchRatio);
+
+    // The first frame to play is centered on the second frame, so the first hop that's played has the whole overlap in it
+    if (vocoder->playStart < 0 && numFrames > 0)
+    {
+        vocoder->playStart = vocoder->inputEnd;
+        vocoder->nextAnalysisFrame = vocoder->playStart - windowSize / 2 - analysisHop;
+        vocoder->lastAnalysisHop = analysisHop;
+    }
+
+    // A window at a time, so the input never holds more than a couple of them
+    UInt32 offset = 0;
+    do
+    {
+        UInt32 numFramesToAppend = numFrames - offset < windowSize ? numFrames - offset : windowSize;
+
+        // Frames are made until less than a window is left past the next one, unless the stretched frames
+        // are full. The caller only gives what the output has room for, so they never are and this always fits
+        assert(vocoder->inputEnd - vocoder->inputStart + numFramesToAppend <= vocoder->inputCapacity);
+        if (numFramesToAppend > 0) AppendInput(vocoder, samples + offset * numChannels, numFramesToAppend);
+        offset += numFramesToAppend;
+
+        while (vocoder->nextAnalysisFrame + windowSize <= vocoder->inputEnd &&
+               vocoder->numStretched + vocoder->synthesisHop <= vocoder->stretchedCapacity)
+            MakeFrame(vocoder, analysisHop);
+    }
+    while (offset < numFrames);
+
+    Float64 sourceFrames = 0;
+    UInt32 numOutputFrames = 0;
+    if (pitchRatio == 1)
+    {
+        for (;numOutputFrames<maxOutputFrames && (UInt32)vocoder->readPosition < vocoder->numStretched;numOutputFrames++)
+        {
+            UInt32 index = (UInt32)vocoder->readPosition;
+            for (UInt32 i=0;i<numChannels;i++) outputs[i][numOutputFrames] = vocoder->channels[i].stretched[index];
+            sourceFrames += vocoder->stretchedSteps[index];
+            vocoder->readPosition += 1;
+        }
+    }
+    else
+    {
+        for (;numOutputFrames<maxOutputFrames && (UInt32)vocoder->readPosition + 2 < vocoder->numStretched;numOutputFrames++)
+        {
+            UInt32 index = (UInt32)vocoder->readPosition;
+            float fraction = (float)(vocoder->readPosition - index);
+            for (UInt32 i=0;i<numChannels;i++) outputs[i][numOutputFrames] = Interpolate(vocoder->channels[i].stretched, index, fraction);
+            sourceFrames += vocoder->stretchedSteps[index] * pitchRatio;
+            vocoder->readPosition += pitchRatio;
+        }
+    }
+
+    // Keeps the frame before the read position, which the interpolation looks back to
+    UInt32 numFramesRead = (UInt32)vocoder->readPosition;
+    if (numFramesRead > 1)
+    {
+        UInt32 numFramesToDrop = numFramesRead - 1;
+        UInt32 numFramesToKeep = vocoder->numStretched - numFramesToDrop;
+        for (UInt32 i=0;i<numChannels;i++)
+            memmove(vocoder->channels[i].stretched, vocoder->channels[i].stretched + numFramesToDrop, numFramesToKeep * sizeof(float));
+        memmove(vocoder->stretchedSteps, vocoder->stretchedSteps + numFramesToDrop, numFramesToKeep * sizeof(float));
+        vocoder->numStretched = numFramesToKeep;
+        vocoder->readPosition -= numFramesToDrop;
+    }
+
+    Float64 numPendingFrames = (vocoder->numStretched - vocoder->readPosition) / pitchRatio;
+    atomic_store_explicit(&vocoder->numPendingFrames, numPendingFrames > 0 ? (UInt32)numPendingFrames : 0, memory_order_relaxed);
+
+    *numSourceFrames = sourceFrames;
+    return numOutputFrames;
+}
+
+UInt32 PhaseVocoderNumPendingFrames(PhaseVocoder *vocoder)
+{
+    return atomic_load_explicit(&vocoder->numPendingFrames, memory_order_relaxed);
+}
+
+// Off by no more than the analysis hop's rounding (under 1%), and a hop or two at either end
+UInt32 PhaseVocoderOutputFramesForInput(const PhaseVocoder *vocoder, UInt32 numFrames, Float64 rate)
+{
+    return (UInt32)ceil(numFrames / ClampedRate(rate) * 1.01) + 4 * vocoder->synthesisHop;
+}
@@ -0,0 +1,97 @@
+//
+//  PhaseVocoder.h
+//  Equalizer
+//
+
+// Playback at another speed, and/or another pitch, in real time.
+//
+// A streaming phase vocoder: frames of windowSize samples (the analysis' chunk size, with the same Hann
+// window and FFT setup) are taken every analysis hop and put back every synthesis hop, a quarter of the
+// window. The analysis hop is what sets the speed. Phases are kept coherent with identity phase locking:
+// the peaks' phases advance at their own frequency, and every other bin keeps its phase relative to the
+// peak whose region it's in, which keeps a partial's bins together and the sound from going "phasey".
+// Where a frame has an onset (most bins jump in energy) the phases start over from the frame's own, so
+// attacks stay sharp. A pitch shift stretches the time by the pitch ratio on top, and resamples that by it.
+//
+// Output frame 0 is the first frame to play, and every output frame carries how many source frames it
+// stands for, so the caller can move its play head in source time whatever the rate was.
+
+#include <stdatomic.h>
+#include "AudioTypes.h"
+
+#define PHASE_VOCODER_MAX_CHANNELS 8
+#define PHASE_VOCODER_OVERLAP 4         // synthesis hops per window
+#define PHASE_VOCODER_MIN_RATE 0.25
+#define PHASE_VOCODER_MAX_RATE 4.0
+#define PHASE_VOCODER_MAX_PITCH 12.0    // semitones either way
+
+typedef struct PhaseVocoderChannel
+{
+    float *input;               // inputCapacity frames, from inputStart on
+    float *analysisPhases;      // the previous frame's, per bin
+    float *synthesisPhases;     // same
+    float *magnitudes;          // this frame's
+    float *phases;              // same
+    float *overlap;             // windowSize frames being overlap-added, from the next synthesis hop on
+    float *stretched;           // finished, yet to be resampled to the output
+} PhaseVocoderChannel;
+
+typedef struct PhaseVocoder
+{
+    UInt32 numChannels;
+    UInt32 windowSize;
+    UInt32 synthesisHop;
+    UInt32 numBins;             // windowSize / 2 + 1
+    float *window;
+    PhaseVocoderChannel channels[PHASE_VOCODER_MAX_CHANNELS];
+
+    // Input, in source frames counted from the last reset
+    UInt32 inputCapacity;
+    SInt64 inputStart;
+    SInt64 inputEnd;
+    SInt64 playStart;           // the first frame to play, -1 until it's come in
+    SInt64 nextAnalysisFrame;   // where the next frame starts. Frames before the input are silence
+
+    // Frames
+    UInt64 numFramesMade;
+    UInt32 lastAnalysisHop;     // between the previous frame and this one
+    UInt32 recentAnalysisHops[PHASE_VOCODER_OVERLAP];
+    float *previousEnergies;    // the previous frame's, per bin, over all the channels
+    float *energies;
+    Boolean wasOnset;
+
+    // Stretched audio, between the overlap-add and the output
+    UInt32 stretchedCapacity;
+    UInt32 numStretched;
+    float *stretchedSteps;      // per stretched frame, the source frames it stands for
+    Float64 readPosition;       // of the next output frame, in the stretched frames
+    _Atomic UInt32 numPendingFrames;    // output frames it has ready, for the caller's room check
+} PhaseVocoder;
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+Boolean PhaseVocoderInit(PhaseVocoder *vocoder, UInt32 numChannels, UInt32 windowSize);
+void PhaseVocoderCleanup(PhaseVocoder *vocoder);
+// Forgets everything, for when the input jumps (a seek)
+void PhaseVocoderReset(PhaseVocoder *vocoder);
+
+// Interleaved frames that lead up to the first frame to play (a seek's pre-roll, or what was played before
+// the vocoder was switched on), so it starts with whole frames instead of fading in. Only before it plays
+void PhaseVocoderAddHistory(PhaseVocoder *vocoder, const float *samples, UInt32 numFrames);
+
+// Takes interleaved frames to play and writes up to maxOutputFrames to the planar outputs, at rate (1 is
+// as is) and pitch (in semitones). What doesn't fit waits for the next call, which can have no input.
+// numSourceFrames is set to how many source frames the output stands for
+UInt32 PhaseVocoderProcess(PhaseVocoder *vocoder, const float *samples, UInt32 numFrames, Float64 rate, Float64 pitch,
+                           float *const *outputs, UInt32 maxOutputFrames, Float64 *numSourceFrames);
+
+// Any thread
+UInt32 PhaseVocoderNumPendingFrames(PhaseVocoder *vocoder);
+// The most output frames numFrames of input bring at rate, not counting what's pending
+UInt32 PhaseVocoderOutputFramesForInput(const PhaseVocoder *vocoder, UInt32 numFrames, Float64 rate);
+
+#if defined __cplusplus
+};
+#endif
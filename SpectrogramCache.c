@@ -0,0 +1,298 @@
+//
+//  SpectrogramCache.c
+//  Equalizer
+//
+
+#include "SpectrogramCache.h"
+#ifdef __APPLE__
+#include <CommonCrypto/CommonDigest.h>
+#else
+#include <openssl/evp.h>
+#endif
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define SPECTROGRAM_CACHE_MAGIC "EQSPGRAM"
+#define SPECTROGRAM_CACHE_HASH_BLOCK_SIZE (1 << 20)
+
+static inline UInt64 PageAligned(UInt64 offset)
+{
+    UInt64 pageSize = (UInt64)getpagesize();
+    return (offset + pageSize - 1) / pageSize * pageSize;
+}
+
+static void PartialPath(const SpectrogramCache *cache, char *path, size_t pathLength)
+{
+    snprintf(path, pathLength, "%s.partial", cache->path);
+}
+
+static void ResetCache(SpectrogramCache *cache)
+{
+    memset(cache, 0, sizeof(SpectrogramCache));
+    cache->fileDescriptor = -1;
+}
+
+Boolean SpectrogramCacheHashFile(const char *path, UInt8 hash[SPECTROGRAM_CACHE_HASH_LENGTH])
+{
+    int fileDescriptor = open(path, O_RDONLY);
+    if (fileDescriptor < 0) return false;
+
+    UInt8 *block = malloc(SPECTROGRAM_CACHE_HASH_BLOCK_SIZE);
+    if (!block)
+    {
+        close(fileDescriptor);
+        return false;
+    }
+
+    ssize_t bytesRead;
+#ifdef __APPLE__
+    CC_SHA256_CTX context;
+    CC_SHA256_Init(&context);
+    while ((bytesRead = read(fileDescriptor, block, SPECTROGRAM_CACHE_HASH_BLOCK_SIZE)) > 0)
+        CC_SHA256_Update(&context, block, (CC_LONG)bytesRead);
+    CC_SHA256_Final(hash, &context);
+#else
+    EVP_MD_CTX *context = EVP_MD_CTX_new();
+    EVP_DigestInit_ex(context, EVP_sha256(), NULL);
+    while ((bytesRead = read(fileDescriptor, block, SPECTROGRAM_CACHE_HASH_BLOCK_SIZE)) > 0)
+        EVP_DigestUpdate(context, block, (size_t)bytesRead);
+    EVP_DigestFinal_ex(context, hash, NULL);
+    EVP_MD_CTX_free(context);
+#endif
+    free(block);
+    close(fileDescriptor);
+
+    return bytesRead == 0;
+}
+
+void SpectrogramCacheFileName(const SpectrogramCacheParameters *parameters, char *name, size_t nameLength)
+{
+    char hex[SPECTROGRAM_CACHE_HASH_LENGTH * 2 + 1];
+    for (int i=0;i<SPECTROGRAM_CACHE_HASH_LENGTH;i++) sprintf(hex + i * 2, "%02x", parameters->contentHash[i]);
+
+    snprintf(name, nameLength, "%s-%u-%u-%u.spectrogram", hex,
+             (unsigned)parameters->chunkSize, (unsigned)parameters->jumpSize, (unsigned)parameters->window);
+}
+
+static Boolean MapFile(SpectrogramCache *cache, size_t length, Boolean writable)
+{
+    int protection = writable ? PROT_READ | PROT_WRITE : PROT_READ;
+    void *map = mmap(NULL, length, protection, MAP_SHARED, cache->fileDescriptor, 0);
+    if (map == MAP_FAILED) return false;
+
+    cache->map = map;
+    cache->mapLength = length;
+    return true;
+}
+
+Boolean SpectrogramCacheOpen(SpectrogramCache *cache, const char *path, const SpectrogramCacheParameters *parameters)
+{
+    ResetCache(cache);
+
+    cache->fileDescriptor = open(path, O_RDONLY);
+    if (cache->fileDescriptor < 0) return false;
+
+    SpectrogramCacheHeader header;
+    struct stat fileStatus;
+    if (pread(cache->fileDescriptor, &header, sizeof(header), 0) != sizeof(header) ||
+        fstat(cache->fileDescriptor, &fileStatus) != 0 ||
+        memcmp(header.magic, SPECTROGRAM_CACHE_MAGIC, sizeof(header.magic)) != 0 ||
+        header.version != SPECTROGRAM_CACHE_VERSION ||
+        header.headerSize != sizeof(SpectrogramCacheHeader) ||
+        memcmp(&header.parameters, parameters, sizeof(SpectrogramCacheParameters)) != 0 ||
+        header.numBands != SPECTROGRAM_CACHE_NUM_BANDS ||
+        !header.isComplete ||
+        header.numFrames > header.frameCapacity)
+    {
+        SpectrogramCacheClose(cache);
+        return false;
+    }
+
+    UInt64 expectedLength = header.peaksOffset + (UInt64)header.parameters.numChannels * header.frameCapacity * sizeof(SpectrogramCachePeak);
+    if ((UInt64)fileStatus.st_size < expectedLength || !MapFile(cache, (size_t)expectedLength, false))
+    {
+        SpectrogramCacheClose(cache);
+        return false;
+    }
+
+    // the spectra are read in order, frame after frame
+    madvise(cache->map, cache->mapLength, MADV_SEQUENTIAL);
+
+    cache->header = header;
+    snprintf(cache->path, sizeof(cache->path), "%s", path);
+    return true;
+}
+
+Boolean SpectrogramCacheCreate(SpectrogramCache *cache, const char *path, const SpectrogramCacheParameters *parameters, SInt64 frameCapacity)
+{
+    ResetCache(cache);
+    if (parameters->numChannels == 0 || parameters->numChannels > SPECTROGRAM_CACHE_MAX_CHANNELS || frameCapacity <= 0) return false;
+
+    SpectrogramCacheHeader *header = &cache->header;
+    memcpy(header->magic, SPECTROGRAM_CACHE_MAGIC, sizeof(header->magic));
+    header->version = SPECTROGRAM_CACHE_VERSION;
+    header->headerSize = sizeof(SpectrogramCacheHeader);
+    header->parameters = *parameters;
+    header->numBands = SPECTROGRAM_CACHE_NUM_BANDS;
+    header->frameCapacity = frameCapacity;
+
+    UInt64 framesInFile = (UInt64)parameters->numChannels * frameCapacity;
+    header->spectraOffset = PageAligned(sizeof(SpectrogramCacheHeader));
+    header->bandsOffset = PageAligned(header->spectraOffset + framesInFile * parameters->chunkSize * sizeof(float));
+    header->peaksOffset = PageAligned(header->bandsOffset + framesInFile * SPECTROGRAM_CACHE_NUM_BANDS * sizeof(float));
+    UInt64 length = header->peaksOffset + framesInFile * sizeof(SpectrogramCachePeak);
+
+    snprintf(cache->path, sizeof(cache->path), "%s", path);
+    char partialPath[sizeof(cache->path) + 16];
+    PartialPath(cache, partialPath, sizeof(partialPath));
+
+    cache->fileDescriptor = open(partialPath, O_RDWR | O_CREAT | O_TRUNC, 0644);
+    if (cache->fileDescriptor < 0) return false;
+
+    cache->isWritable = true;
+    if (ftruncate(cache->fileDescriptor, (off_t)length) != 0 || !MapFile(cache, (size_t)length, true))
+    {
+        SpectrogramCacheClose(cache);
+        return false;
+    }
+
+    // the header goes in last, once every frame is there
+    return true;
+}
+
+void SpectrogramCacheWriteFrame(SpectrogramCache *cache, UInt32 channel, SInt64 frameNumber, const float *magnitudes)
+{
+    const SpectrogramCacheHeader *header = &cache->header;
+    if (!cache->isWritable || channel >= header->parameters.numChannels || frameNumber < 0 || frameNumber >= header->frameCapacity) return;
+
+    SInt64 index = (SInt64)channel * header->frameCapacity + frameNumber;
+    UInt32 chunkSize = header->parameters.chunkSize;
+
+    memcpy(cache->map + header->spectraOffset + (UInt64)index * chunkSize * sizeof(float), magnitudes, chunkSize * sizeof(float));
+
+    float *bands = (float *)(cache->map + header->bandsOffset) + (UInt64)index * SPECTROGRAM_CACHE_NUM_BANDS;
+    SpectrumAnalysisBandEnergies(magnitudes, chunkSize, header->parameters.sampleRate, bands);
+
+    SpectrogramCachePeak *peak = (SpectrogramCachePeak *)(cache->map + header->peaksOffset) + index;
+    SpectrumAnalysisPeak(magnitudes, chunkSize, &peak->bin, &peak->magnitude);
+}
+
+// Called by the producer for every frame it analyses. Frames have to come in order, starting from 0,
+// or the entry is abandoned. Different channels can be added from different threads at once
+void SpectrogramCacheAddFrame(SpectrogramCache *cache, UInt32 channel, SInt64 frameNumber, const float *magnitudes)
+{
+    const SpectrogramCacheHeader *header = &cache->header;
+    if (!cache->isWritable || channel >= header->parameters.numChannels || cache->hasGaps[channel]) return;
+    if (frameNumber != cache->nextFrame[channel] || frameNumber >= header->frameCapacity)
+    {
+        cache->hasGaps[channel] = true;
+        return;
+    }
+
+    SpectrogramCacheWriteFrame(cache, channel, frameNumber, magnitudes);
+    cache->nextFrame[channel]++;
+}
+
+Boolean SpectrogramCacheFinish(SpectrogramCache *cache)
+{
+    if (!cache->isWritable) return false;
+
+    SInt64 numFrames = cache->nextFrame[0];
+    for (UInt32 i=0;i<cache->header.parameters.numChannels;i++)
+    {
+        if (cache->nextFrame[i] < numFrames) numFrames = cache->nextFrame[i];
+        if (cache->hasGaps[i]) numFrames = 0;
+    }
+
+    return SpectrogramCacheFinishWithNumFrames(cache, numFrames);
+}
+
+// Writes the header and moves the entry into place. Closes the cache either way.
+Boolean SpectrogramCacheFinishWithNumFrames(SpectrogramCache *cache, SInt64 numFrames)
+{
+    if (!cache->isWritable) return false;
+
+    SpectrogramCacheHeader *header = &cache->header;
+    if (numFrames <= 0 || numFrames > header->frameCapacity)
+    {
+        SpectrogramCacheClose(cache);
+        return false;
+    }
+
+    // only the file's header says complete: this one stays a writer, which readers keep away from
+    SpectrogramCacheHeader completeHeader = *header;
+    completeHeader.numFrames = numFrames;
+    completeHeader.isComplete = 1;
+    memcpy(cache->map, &completeHeader, sizeof(SpectrogramCacheHeader));
+
+    char partialPath[sizeof(cache->path) + 16];
+    PartialPath(cache, partialPath, sizeof(partialPath));
+
+    Boolean success = msync(cache->map, cache->mapLength, MS_SYNC) == 0 && rename(partialPath, cache->path) == 0;
+
+    cache->isWritable = false;
+    SpectrogramCacheClose(cache);
+    if (!success) unlink(partialPath);
+    return success;
+}
+
+void SpectrogramCacheClose(SpectrogramCache *cache)
+{
+    if (cache->map) munmap(cache->map, cache->mapLength);
+    if (cache->fileDescriptor >= 0) close(cache->fileDescriptor);
+
+    // an entry that was never finished is of no use to anyone
+    if (cache->isWritable)
+    {
+        char partialPath[sizeof(cache->path) + 16];
+        PartialPath(cache, partialPath, sizeof(partialPath));
+        unlink(partialPath);
+    }
+
+    ResetCache(cache);
+}
+
+Boolean SpectrogramCacheIsReadable(const SpectrogramCache *cache)
+{
+    return cache->map != NULL && cache->header.isComplete;
+}
+
+static inline SInt64 FrameIndex(const SpectrogramCache *cache, UInt32 channel, SInt64 frameNumber)
+{
+    if (!SpectrogramCacheIsReadable(cache) || frameNumber < 0 || frameNumber >= cache->header.numFrames) return -1;
+
+    // a mono entry serves every channel
+    if (channel >= cache->header.parameters.numChannels) channel = cache->header.parameters.numChannels - 1;
+    return (SInt64)channel * cache->header.frameCapacity + frameNumber;
+}
+
+// Points straight into the mapped file. The frames of a channel are contiguous, chunkSize floats apart
+const float *SpectrogramCacheGetFrames(const SpectrogramCache *cache, UInt32 channel, SInt64 frameNumber, SInt64 *numFramesAvailable)
+{
+    SInt64 index = FrameIndex(cache, channel, frameNumber);
+    if (numFramesAvailable) *numFramesAvailable = index < 0 ? 0 : cache->header.numFrames - frameNumber;
+    if (index < 0) return NULL;
+
+    return (const float *)(cache->map + cache->header.spectraOffset) + (UInt64)index * cache->header.parameters.chunkSize;
+}
+
+const float *SpectrogramCacheGetBandEnergies(const SpectrogramCache *cache, UInt32 channel, SInt64 frameNumber)
+{
+    SInt64 index = FrameIndex(cache, channel, frameNumber);
+    if (index < 0) return NULL;
+
+    return (const float *)(cache->map + cache->header.bandsOffset) + (UInt64)index * SPECTROGRAM_CACHE_NUM_BANDS;
+}
+
+const SpectrogramCachePeak *SpectrogramCacheGetPeak(const SpectrogramCache *cache, UInt32 channel, SInt64 frameNumber)
+{
+    SInt64 index = FrameIndex(cache, channel, frameNumber);
+    if (index < 0) return NULL;
+
+    return (const SpectrogramCachePeak *)(cache->map + cache->header.peaksOffset) + index;
+}
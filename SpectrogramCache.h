@@ -0,0 +1,102 @@
+//
+//  SpectrogramCache.h
+//  Equalizer
+//
+
+// A track's whole analysis, stored in a memory-mapped file so the next time the track is played
+// nothing has to be FFTed again.
+//
+// An entry is keyed by the content hash of the audio file and the analysis parameters. It holds,
+// for every channel and every frame (one per jump), the spectrum as it's laid out in the live rings
+// (chunkSize floats), the energy in each octave band and the strongest bin. Sections are channel
+// major, so a channel's frames are contiguous and can be handed out in place.
+//
+// Entries are written while a track is analysed from its beginning, one frame after the other, to a
+// partial file that's renamed into place when complete. Anything else (a seek, a failure) abandons it.
+// The batch analyser writes its frames in any order instead, from many threads at once, and says how
+// many there are when it's done.
+
+#include "SpectrumAnalysis.h"
+#include <stddef.h>
+
+#define SPECTROGRAM_CACHE_VERSION 1
+#define SPECTROGRAM_CACHE_MAX_CHANNELS 8
+#define SPECTROGRAM_CACHE_NUM_BANDS SPECTRUM_ANALYSIS_NUM_BANDS
+#define SPECTROGRAM_CACHE_HASH_LENGTH 32    // SHA-256
+
+typedef enum SpectrogramCacheWindow
+{
+    SpectrogramCacheWindow_Hann = 1,
+} SpectrogramCacheWindow;
+
+typedef struct SpectrogramCacheParameters
+{
+    UInt8 contentHash[SPECTROGRAM_CACHE_HASH_LENGTH];
+    UInt32 chunkSize;
+    UInt32 jumpSize;
+    UInt32 window;
+    UInt32 numChannels;
+    Float64 sampleRate;
+} SpectrogramCacheParameters;
+
+typedef struct SpectrogramCacheHeader
+{
+    char magic[8];
+    UInt32 version;
+    UInt32 headerSize;
+    SpectrogramCacheParameters parameters;
+    UInt32 numBands;
+    UInt32 isComplete;
+    SInt64 frameCapacity;       // frames per channel the sections have room for
+    SInt64 numFrames;           // frames per channel that were analysed
+    UInt64 spectraOffset;       // float[numChannels][frameCapacity][chunkSize]
+    UInt64 bandsOffset;         // float[numChannels][frameCapacity][numBands]
+    UInt64 peaksOffset;         // SpectrogramCachePeak[numChannels][frameCapacity]
+} SpectrogramCacheHeader;
+
+typedef struct SpectrogramCachePeak
+{
+    UInt32 bin;
+    float magnitude;
+} SpectrogramCachePeak;
+
+typedef struct SpectrogramCache
+{
+    int fileDescriptor;         // -1 when closed
+    UInt8 *map;
+    size_t mapLength;
+    SpectrogramCacheHeader header;
+
+    // writing
+    Boolean isWritable;
+    // Per channel, since each channel's frames may be added from a thread of its own
+    Boolean hasGaps[SPECTROGRAM_CACHE_MAX_CHANNELS];
+    SInt64 nextFrame[SPECTROGRAM_CACHE_MAX_CHANNELS];
+    char path[1024];
+} SpectrogramCache;
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+Boolean SpectrogramCacheHashFile(const char *path, UInt8 hash[SPECTROGRAM_CACHE_HASH_LENGTH]);
+void SpectrogramCacheFileName(const SpectrogramCacheParameters *parameters, char *name, size_t nameLength);
+
+// Opens a complete entry for reading. Fails if there's none, or it was made with other parameters or by another version
+Boolean SpectrogramCacheOpen(SpectrogramCache *cache, const char *path, const SpectrogramCacheParameters *parameters);
+Boolean SpectrogramCacheCreate(SpectrogramCache *cache, const char *path, const SpectrogramCacheParameters *parameters, SInt64 frameCapacity);
+void SpectrogramCacheAddFrame(SpectrogramCache *cache, UInt32 channel, SInt64 frameNumber, const float *magnitudes);
+Boolean SpectrogramCacheFinish(SpectrogramCache *cache);
+// Out of order: any frame, from any thread, as long as no two threads write the same one
+void SpectrogramCacheWriteFrame(SpectrogramCache *cache, UInt32 channel, SInt64 frameNumber, const float *magnitudes);
+Boolean SpectrogramCacheFinishWithNumFrames(SpectrogramCache *cache, SInt64 numFrames);
+void SpectrogramCacheClose(SpectrogramCache *cache);
+
+Boolean SpectrogramCacheIsReadable(const SpectrogramCache *cache);
+const float *SpectrogramCacheGetFrames(const SpectrogramCache *cache, UInt32 channel, SInt64 frameNumber, SInt64 *numFramesAvailable);
+const float *SpectrogramCacheGetBandEnergies(const SpectrogramCache *cache, UInt32 channel, SInt64 frameNumber);
+const SpectrogramCachePeak *SpectrogramCacheGetPeak(const SpectrogramCache *cache, UInt32 channel, SInt64 frameNumber);
+
+#if defined __cplusplus
+};
+#endif
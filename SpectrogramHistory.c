@@ -0,0 +1,178 @@
+//
+//  SpectrogramHistory.c
+//  Equalizer
+//
+
+#include "SpectrogramHistory.h"
+#include <Accelerate/Accelerate.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+
+#define SPECTROGRAM_HISTORY_MIN_MAGNITUDE 1e-7f
+
+static inline SpectrogramHistoryRecord *RecordAtSlot(SpectrogramHistory *history, UInt32 slot)
+{
+    return (SpectrogramHistoryRecord *)(history->records + (size_t)slot * history->recordSize);
+}
+
+UInt32 SpectrogramHistoryRecordSize(UInt32 chunkSize)
+{
+    UInt32 recordSize = (UInt32)(sizeof(SpectrogramHistoryRecord) + SPECTROGRAM_HISTORY_BINS(chunkSize));
+    return (recordSize + 7) & ~7; // keep the tags aligned
+}
+
+Boolean SpectrogramHistoryInit(SpectrogramHistory *history, UInt32 chunkSize, UInt32 capacityInFrames, const char *filePath)
+{
+    memset(history, 0, sizeof(SpectrogramHistory));
+    history->chunkSize = chunkSize;
+    history->recordSize = SpectrogramHistoryRecordSize(chunkSize);
+    history->capacity = capacityInFrames > 0 ? capacityInFrames : 1;
+    history->fileDescriptor = -1;
+    atomic_init(&history->hasFileFailed, false);
+
+    history->records = calloc(history->capacity, history->recordSize);
+    history->slotTags = calloc(history->capacity, sizeof(_Atomic SInt64));
+    if (!history->records || !history->slotTags)
+    {
+        SpectrogramHistoryCleanup(history);
+        return false;
+    }
+    for (UInt32 i=0;i<history->capacity;i++) atomic_init(&history->slotTags[i], 0);
+
+    if (filePath)
+    {
+        history->fileDescriptor = open(filePath, O_RDWR | O_CREAT | O_TRUNC, 0600);
+        if (history->fileDescriptor < 0)
+        {
+            SpectrogramHistoryCleanup(history);
+            return false;
+        }
+        unlink(filePath);
+    }
+
+    return true;
+}
+
+void SpectrogramHistoryCleanup(SpectrogramHistory *history)
+{
+    free(history->records);
+    free((void *)history->slotTags);
+    if (history->capacity > 0 && history->fileDescriptor >= 0) close(history->fileDescriptor);
+    memset(history, 0, sizeof(SpectrogramHistory));
+    history->fileDescriptor = -1;
+}
+
+void SpectrogramHistoryReset(SpectrogramHistory *history)
+{
+    for (UInt32 i=0;i<history->capacity;i++) atomic_store_explicit(&history->slotTags[i], 0, memory_order_release);
+    if (history->capacity > 0 && history->fileDescriptor >= 0 && ftruncate(history->fileDescriptor, 0) != 0)
+        atomic_store(&history->hasFileFailed, true);
+    history->numFramesCompressed = 0;
+    history->numFramesWrittenToFile = 0;
+}
+
+static void CompressFrame(SpectrogramHistory *history, const float *magnitudes, SpectrogramHistoryRecord *record)
+{
+    vDSP_Length numBins = SPECTROGRAM_HISTORY_BINS(history->chunkSize);
+    float decibels[numBins];
+
+    float floor = SPECTROGRAM_HISTORY_MIN_MAGNITUDE, reference = 1.0f;
+    vDSP_vthr(magnitudes, 1, &floor, decibels, 1, numBins);
+    vDSP_vdbcon(decibels, 1, &reference, decibels, 1, numBins, 1);
+
+    vDSP_minv(decibels, 1, &record->minDb, numBins);
+    vDSP_maxv(decibels, 1, &record->maxDb, numBins);
+
+    float range = record->maxDb - record->minDb;
+    float scale = range > 0 ? 255.0f / range : 0.0f;
+    float offset = -record->minDb * scale + 0.5f; // +0.5 rounds instead of truncating
+    vDSP_vsmsa(decibels, 1, &scale, &offset, decibels, 1, numBins);
+    vDSP_vfixu8(decibels, 1, record->bins, 1, numBins);
+}
+
+static void DecompressFrame(SpectrogramHistory *history, const SpectrogramHistoryRecord *record, float *magnitudes)
+{
+    vDSP_Length numBins = SPECTROGRAM_HISTORY_BINS(history->chunkSize);
+
+    // dB back to magnitude: exp(dB * ln(10) / 20)
+    vDSP_vfltu8(record->bins, 1, magnitudes, 1, numBins);
+    float scale = (record->maxDb - record->minDb) / 255.0f * (float)M_LN10 / 20.0f;
+    float offset = record->minDb * (float)M_LN10 / 20.0f;
+    vDSP_vsmsa(magnitudes, 1, &scale, &offset, magnitudes, 1, numBins);
+    int count = (int)numBins;
+    vvexpf(magnitudes, magnitudes, &count);
+
+    // bins above Nyquist aren't stored
+    memset(magnitudes + numBins, 0, (history->chunkSize - numBins) * sizeof(float));
+}
+
+static void WriteRecordToFile(SpectrogramHistory *history, const SpectrogramHistoryRecord *record)
+{
+    off_t position = (off_t)(record->tag - 1) * history->recordSize;
+
+    // data first, tag last, so a reader never sees a tag for data that isn't there yet. A short write
+    // (a full disk) leaves the tag out, and the frame is just not stored
+    size_t dataSize = history->recordSize - sizeof(SInt64);
+    if (pwrite(history->fileDescriptor, (const UInt8 *)record + sizeof(SInt64), dataSize, position + sizeof(SInt64)) != (ssize_t)dataSize) return;
+    if (pwrite(history->fileDescriptor, &record->tag, sizeof(SInt64), position) != sizeof(SInt64)) return;
+    history->numFramesWrittenToFile++;
+}
+
+// Called by the producer when a frame falls off the live ring
+void SpectrogramHistoryAddFrame(SpectrogramHistory *history, SInt64 frameNumber, const float *magnitudes)
+{
+    if (frameNumber < 0) return;
+
+    UInt32 slot = (UInt32)(frameNumber % history->capacity);
+    SpectrogramHistoryRecord *record = RecordAtSlot(history, slot);
+    SInt64 previousTag = atomic_load_explicit(&history->slotTags[slot], memory_order_relaxed);
+
+    // the frame that lived in this slot moves down to the file tier
+    if (previousTag > 0 && previousTag != frameNumber + 1 && history->fileDescriptor >= 0 && !atomic_load_explicit(&history->hasFileFailed, memory_order_relaxed))
+        WriteRecordToFile(history, record);
+
+    atomic_store_explicit(&history->slotTags[slot], -1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    CompressFrame(history, magnitudes, record);
+    record->tag = frameNumber + 1;
+
+    atomic_store_explicit(&history->slotTags[slot], frameNumber + 1, memory_order_release);
+    history->numFramesCompressed++;
+}
+
+// Safe to call from any thread. Returns false if the frame isn't stored in any tier.
+Boolean SpectrogramHistoryGetFrame(SpectrogramHistory *history, SInt64 frameNumber, float *magnitudes)
+{
+    if (frameNumber < 0) return false;
+
+    UInt32 slot = (UInt32)(frameNumber % history->capacity);
+    if (atomic_load_explicit(&history->slotTags[slot], memory_order_acquire) == frameNumber + 1)
+    {
+        SInt64 copy[history->recordSize / sizeof(SInt64)];
+        memcpy(copy, RecordAtSlot(history, slot), history->recordSize);
+        atomic_thread_fence(memory_order_acquire);
+        if (atomic_load_explicit(&history->slotTags[slot], memory_order_relaxed) == frameNumber + 1)
+        {
+            DecompressFrame(history, (SpectrogramHistoryRecord *)copy, magnitudes);
+            return true;
+        }
+    }
+
+    if (history->fileDescriptor >= 0 && !atomic_load_explicit(&history->hasFileFailed, memory_order_relaxed))
+    {
+        SInt64 copy[history->recordSize / sizeof(SInt64)];
+        SpectrogramHistoryRecord *record = (SpectrogramHistoryRecord *)copy;
+        ssize_t bytesRead = pread(history->fileDescriptor, copy, history->recordSize, (off_t)frameNumber * history->recordSize);
+        if (bytesRead == history->recordSize && record->tag == frameNumber + 1)
+        {
+            DecompressFrame(history, record, magnitudes);
+            return true;
+        }
+    }
+
+    return false;
+}
@@ -0,0 +1,59 @@
+//
+//  SpectrogramHistory.h
+//  Equalizer
+//
+
+// Older spectrum frames of a stream, indexed by absolute frame number (timeInFrames / jump size).
+//
+// The live ring of a CircularAudioStream is the hot tier. Frames that fall off it are compressed
+// (8-bit log magnitudes, bins up to Nyquist) into a fixed in-memory ring of slots, found directly
+// at frameNumber % capacity. Frames that fall off that ring are optionally written to a file at
+// frameNumber * recordSize. Either way a lookup is a single slot/record access plus decoding.
+// The file is unlinked as soon as it's open, so nothing is left behind when the process goes.
+
+#include <stdatomic.h>
+#include <MacTypes.h>
+
+#define SPECTROGRAM_HISTORY_BINS(chunkSize) ((chunkSize) / 2)
+
+typedef struct SpectrogramHistoryRecord
+{
+    SInt64 tag;         // frameNumber + 1, 0 for an empty record
+    float minDb;
+    float maxDb;
+    UInt8 bins[];       // SPECTROGRAM_HISTORY_BINS(chunkSize) quantized dB values
+} SpectrogramHistoryRecord;
+
+typedef struct SpectrogramHistory
+{
+    UInt32 chunkSize;
+    UInt32 recordSize;
+
+    // warm tier
+    UInt32 capacity;
+    UInt8 *records;
+    _Atomic SInt64 *slotTags;   // same as the record tags, -1 while a slot is being rewritten
+
+    // cold tier
+    int fileDescriptor;         // -1 if there's no file tier
+    _Atomic Boolean hasFileFailed;  // a reset couldn't empty it, so it's neither written nor read any more
+
+    SInt64 numFramesCompressed;
+    SInt64 numFramesWrittenToFile;
+} SpectrogramHistory;
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+UInt32 SpectrogramHistoryRecordSize(UInt32 chunkSize);
+Boolean SpectrogramHistoryInit(SpectrogramHistory *history, UInt32 chunkSize, UInt32 capacityInFrames, const char *filePath);
+void SpectrogramHistoryCleanup(SpectrogramHistory *history);
+void SpectrogramHistoryReset(SpectrogramHistory *history);
+
+void SpectrogramHistoryAddFrame(SpectrogramHistory *history, SInt64 frameNumber, const float *magnitudes);
+Boolean SpectrogramHistoryGetFrame(SpectrogramHistory *history, SInt64 frameNumber, float *magnitudes);
+
+#if defined __cplusplus
+};
+#endif
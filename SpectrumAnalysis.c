@@ -0,0 +1,289 @@
+//
+//  SpectrumAnalysis.c
+//  Equalizer
+//
+
+#include "SpectrumAnalysis.h"
+#include <pthread.h>
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
+#ifdef __APPLE__
+#include <Accelerate/Accelerate.h>
+#endif
+
+#ifdef __APPLE__
+
+static FFTSetup fftSetup = NULL;
+
+// The weights are computed once, for the largest size we take, so every thread can share them
+static void CreateFFTSetup(void)
+{
+    fftSetup = vDSP_create_fftsetup(MAX_FFT_LOG2N, FFT_RADIX2);
+}
+
+void SpectrumAnalysisFFT(const float *samples, int numSamples, float *result)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, CreateFFTSetup);
+
+    vDSP_Length log2n = log2f(numSamples);
+    assert(log2n <= MAX_FFT_LOG2N);
+
+    // For an FFT, numSamples must be a power of 2, i.e. is always even
+    int nOver2 = numSamples / 2;
+
+    float windowed[numSamples];
+    vDSP_hann_window(windowed, numSamples, 0);
+    vDSP_vmul(windowed, 1, samples, 1, windowed, 1, numSamples);
+
+    // Pack samples: C(re) -> A[n], C(im) -> A[n+1]
+    float realp[nOver2], imagp[nOver2];
+    DSPSplitComplex A = {realp, imagp};
+    vDSP_ctoz((DSPComplex *)windowed, 2, &A, 1, nOver2);
+    vDSP_fft_zrip(fftSetup, &A, 1, log2n, FFT_FORWARD);
+
+    // DC and Nyquist share the first bin, as vDSP packs them
+    vDSP_zvabs(&A, 1, result, 1, nOver2);
+    memset(result + nOver2, 0, nOver2 * sizeof(float));
+}
+
+void SpectrumAnalysisHannWindow(float *window, int numSamples)
+{
+    vDSP_hann_window(window, numSamples, 0);
+}
+
+void SpectrumAnalysisForwardFFT(const float *samples, int numSamples, float *real, float *imag)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, CreateFFTSetup);
+
+    vDSP_Length log2n = log2f(numSamples);
+    assert(log2n <= MAX_FFT_LOG2N);
+    int nOver2 = numSamples / 2;
+
+    DSPSplitComplex A = {real, imag};
+    vDSP_ctoz((const DSPComplex *)samples, 2, &A, 1, nOver2);
+    vDSP_fft_zrip(fftSetup, &A, 1, log2n, FFT_FORWARD);
+
+    // Unpack Nyquist from the first bin, and halve vDSP's scale
+    real[nOver2] = imag[0];
+    imag[0] = imag[nOver2] = 0;
+    float half = 0.5f;
+    vDSP_vsmul(real, 1, &half, real, 1, nOver2 + 1);
+    vDSP_vsmul(imag, 1, &half, imag, 1, nOver2 + 1);
+}
+
+void SpectrumAnalysisInverseFFT(const float *real, const float *imag, int numSamples, float *samples)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, CreateFFTSetup);
+
+    vDSP_Length log2n = log2f(numSamples);
+    assert(log2n <= MAX_FFT_LOG2N);
+    int nOver2 = numSamples / 2;
+
+    float realp[nOver2], imagp[nOver2];
+    memcpy(realp, real, nOver2 * sizeof(float));
+    memcpy(imagp, imag, nOver2 * sizeof(float));
+    imagp[0] = real[nOver2];
+
+    // The inverse of a DFT-scaled spectrum comes out numSamples times too big
+    DSPSplitComplex A = {realp, imagp};
+    vDSP_fft_zrip(fftSetup, &A, 1, log2n, FFT_INVERSE);
+    vDSP_ztoc(&A, 1, (DSPComplex *)samples, 2, nOver2);
+    float scale = 1.0f / numSamples;
+    vDSP_vsmul(samples, 1, &scale, samples, 1, numSamples);
+}
+
+#else
+
+#define FFT_TABLE_SIZE (1 << MAX_FFT_LOG2N)
+
+// cos and sin of 2 * pi * k / FFT_TABLE_SIZE, for k up to half of it. Every size's twiddles and window are in there
+static float *cosTable = NULL;
+static float *sinTable = NULL;
+
+static void CreateTables(void)
+{
+    cosTable = malloc((FFT_TABLE_SIZE / 2 + 1) * sizeof(float));
+    sinTable = malloc((FFT_TABLE_SIZE / 2 + 1) * sizeof(float));
+    for (int k=0;k<=FFT_TABLE_SIZE / 2;k++)
+    {
+        cosTable[k] = (float)cos(2 * M_PI * k / FFT_TABLE_SIZE);
+        sinTable[k] = (float)sin(2 * M_PI * k / FFT_TABLE_SIZE);
+    }
+}
+
+// In place, forward, n a power of 2 up to FFT_TABLE_SIZE / 2
+static void ComplexFFT(float *re, float *im, int n)
+{
+    for (int i=1, j=0;i<n;i++)
+    {
+        int bit = n >> 1;
+        for (;j & bit;bit >>= 1) j ^= bit;
+        j ^= bit;
+        if (i < j)
+        {
+            float t = re[i]; re[i] = re[j]; re[j] = t;
+            t = im[i]; im[i] = im[j]; im[j] = t;
+        }
+    }
+
+    for (int length=2;length<=n;length<<=1)
+    {
+        int half = length / 2, stride = FFT_TABLE_SIZE / length;
+        for (int start=0;start<n;start+=length)
+        {
+            for (int j=0;j<half;j++)
+            {
+                float wr = cosTable[j * stride], wi = -sinTable[j * stride];
+                int a = start + j, b = a + half;
+                float tr = re[b] * wr - im[b] * wi, ti = re[b] * wi + im[b] * wr;
+                re[b] = re[a] - tr;
+                im[b] = im[a] - ti;
+                re[a] += tr;
+                im[a] += ti;
+            }
+        }
+    }
+}
+
+// The real FFT is done as a complex one of half the size, over the even samples as the real parts and the
+// odd ones as the imaginary parts, then split into the real spectrum. real and imag take nOver2 + 1 bins
+static void RealFFT(const float *samples, int numSamples, float *real, float *imag)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, CreateTables);
+    assert(numSamples >= 4 && numSamples <= FFT_TABLE_SIZE && (numSamples & (numSamples - 1)) == 0);
+
+    int nOver2 = numSamples / 2, stride = FFT_TABLE_SIZE / numSamples;
+
+    float re[nOver2], im[nOver2];
+    for (int n=0;n<nOver2;n++)
+    {
+        re[n] = samples[2 * n];
+        im[n] = samples[2 * n + 1];
+    }
+    ComplexFFT(re, im, nOver2);
+
+    real[0] = re[0] + im[0];
+    real[nOver2] = re[0] - im[0];
+    imag[0] = imag[nOver2] = 0;
+    for (int k=1;k<nOver2;k++)
+    {
+        float zr = re[k], zi = im[k], cr = re[nOver2 - k], ci = -im[nOver2 - k];
+        float evenRe = (zr + cr) / 2, evenIm = (zi + ci) / 2;
+        float oddRe = (zi - ci) / 2, oddIm = -(zr - cr) / 2;
+        float c = cosTable[k * stride], s = sinTable[k * stride];
+        real[k] = evenRe + c * oddRe + s * oddIm;
+        imag[k] = evenIm + c * oddIm - s * oddRe;
+    }
+}
+
+void SpectrumAnalysisHannWindow(float *window, int numSamples)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, CreateTables);
+
+    int stride = FFT_TABLE_SIZE / numSamples;
+    for (int n=0;n<numSamples;n++)
+    {
+        int k = n * stride;
+        window[n] = 0.5f * (1 - (k <= FFT_TABLE_SIZE / 2 ? cosTable[k] : cosTable[FFT_TABLE_SIZE - k]));
+    }
+}
+
+// The same as the vDSP version, whose results are twice the DFT's, with DC and Nyquist packed in the first bin
+void SpectrumAnalysisFFT(const float *samples, int numSamples, float *result)
+{
+    int nOver2 = numSamples / 2;
+
+    float windowed[numSamples];
+    SpectrumAnalysisHannWindow(windowed, numSamples);
+    for (int n=0;n<numSamples;n++) windowed[n] *= samples[n];
+
+    float real[nOver2 + 1], imag[nOver2 + 1];
+    RealFFT(windowed, numSamples, real, imag);
+
+    result[0] = 2 * sqrtf(real[0] * real[0] + real[nOver2] * real[nOver2]);
+    for (int k=1;k<nOver2;k++) result[k] = 2 * sqrtf(real[k] * real[k] + imag[k] * imag[k]);
+    memset(result + nOver2, 0, nOver2 * sizeof(float));
+}
+
+void SpectrumAnalysisForwardFFT(const float *samples, int numSamples, float *real, float *imag)
+{
+    RealFFT(samples, numSamples, real, imag);
+}
+
+// The forward split run backwards: the bins are folded into the spectrum of the even samples plus i times the
+// odd ones', which a complex inverse (a forward one, conjugated) of half the size takes back to the samples
+void SpectrumAnalysisInverseFFT(const float *real, const float *imag, int numSamples, float *samples)
+{
+    static pthread_once_t once = PTHREAD_ONCE_INIT;
+    pthread_once(&once, CreateTables);
+    assert(numSamples >= 4 && numSamples <= FFT_TABLE_SIZE && (numSamples & (numSamples - 1)) == 0);
+
+    int nOver2 = numSamples / 2, stride = FFT_TABLE_SIZE / numSamples;
+
+    float re[nOver2], im[nOver2];
+    for (int k=0;k<nOver2;k++)
+    {
+        float xr = real[k], xi = imag[k], cr = real[nOver2 - k], ci = -imag[nOver2 - k];
+        float evenRe = (xr + cr) / 2, evenIm = (xi + ci) / 2;
+        float dr = (xr - cr) / 2, di = (xi - ci) / 2;
+        float c = cosTable[k * stride], s = sinTable[k * stride];
+        float oddRe = dr * c - di * s, oddIm = dr * s + di * c;
+
+        // conjugated on the way in
+        re[k] = evenRe - oddIm;
+        im[k] = -(evenIm + oddRe);
+    }
+    ComplexFFT(re, im, nOver2);
+
+    for (int n=0;n<nOver2;n++)
+    {
+        samples[2 * n] = re[n] / nOver2;
+        samples[2 * n + 1] = -im[n] / nOver2;
+    }
+}
+
+#endif
+
+void Chunked_FFT(float *samples, long sampleCount, float *fftResults, int chunkSize)
+{
+    for (int i=0;i<sampleCount / chunkSize;i++)
+        SpectrumAnalysisFFT(&samples[i * chunkSize], chunkSize, &fftResults[i * chunkSize]);
+}
+
+void SpectrumAnalysisBandEnergies(const float *magnitudes, UInt32 chunkSize, Float64 sampleRate, float bands[SPECTRUM_ANALYSIS_NUM_BANDS])
+{
+    UInt32 nyquistBin = chunkSize / 2;
+    Float64 binsPerHz = chunkSize / sampleRate;
+
+    for (int band=0;band<SPECTRUM_ANALYSIS_NUM_BANDS;band++)
+    {
+        Float64 lowFrequency = SPECTRUM_ANALYSIS_LOWEST_BAND_FREQUENCY * (1 << band);
+        UInt32 lowBin = (UInt32)ceil(lowFrequency * binsPerHz);
+        UInt32 highBin = (UInt32)ceil(2 * lowFrequency * binsPerHz);
+        if (band == SPECTRUM_ANALYSIS_NUM_BANDS - 1 || highBin > nyquistBin) highBin = nyquistBin;
+
+        bands[band] = 0;
+        for (UInt32 bin=lowBin;bin<highBin;bin++) bands[band] += magnitudes[bin] * magnitudes[bin];
+    }
+}
+
+void SpectrumAnalysisPeak(const float *magnitudes, UInt32 chunkSize, UInt32 *bin, float *magnitude)
+{
+    *bin = 1;
+    *magnitude = magnitudes[1];
+    for (UInt32 i=2;i<chunkSize / 2;i++)
+    {
+        if (magnitudes[i] > *magnitude)
+        {
+            *bin = i;
+            *magnitude = magnitudes[i];
+        }
+    }
+}
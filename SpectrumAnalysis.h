@@ -0,0 +1,46 @@
+//
+//  SpectrumAnalysis.h
+//  Equalizer
+//
+
+// What a frame of the analysis is: the magnitudes of a Hann-windowed FFT of a chunk of samples, and
+// what's derived from them (the energy per octave band, the strongest bin). The live streams, the
+// spectrogram cache and the batch analyser all use these, so their frames are the same.
+//
+// Plain C. On Apple platforms the FFT is vDSP's; elsewhere it's a radix-2 FFT of our own, scaled the way
+// vDSP's is (twice the DFT), so a frame comes out the same either way.
+
+#include "AudioTypes.h"
+
+#define MAX_FFT_LOG2N 16
+#define SPECTRUM_ANALYSIS_NUM_BANDS 10                  // octaves, from the lowest band's
+#define SPECTRUM_ANALYSIS_LOWEST_BAND_FREQUENCY 31.25
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+// numSamples (a power of 2, up to 2^MAX_FFT_LOG2N) samples in, as many magnitudes out. The bins above
+// Nyquist are zeros. Can be called from any number of threads at once
+void SpectrumAnalysisFFT(const float *samples, int numSamples, float *result);
+
+// The Hann window the analysis uses, 0.5 * (1 - cos(2 * pi * n / numSamples))
+void SpectrumAnalysisHannWindow(float *window, int numSamples);
+
+// The complex spectrum of numSamples samples, as they are (no window), scaled like a DFT: numSamples / 2 + 1
+// bins, DC to Nyquist. The inverse takes those bins back to numSamples samples, so one undoes the other
+void SpectrumAnalysisForwardFFT(const float *samples, int numSamples, float *real, float *imag);
+void SpectrumAnalysisInverseFFT(const float *real, const float *imag, int numSamples, float *samples);
+
+// Takes some samples and a pointer to a two dimensional array in the form of arr[samplesCount / CHUNK_SIZE][CHUNK_SIZE]
+// Fills the array with the FFT results (in magnitudes) divided to chunks of time.
+// The frequencies can later be accessed as arr[chunkIndex][binIndex]
+void Chunked_FFT(float *samples, long samplesCount, float *fftResults, int chunkSize);
+
+void SpectrumAnalysisBandEnergies(const float *magnitudes, UInt32 chunkSize, Float64 sampleRate, float bands[SPECTRUM_ANALYSIS_NUM_BANDS]);
+// The strongest bin below Nyquist, DC aside
+void SpectrumAnalysisPeak(const float *magnitudes, UInt32 chunkSize, UInt32 *bin, float *magnitude);
+
+#if defined __cplusplus
+};
+#endif
@@ -0,0 +1,164 @@
+//
+//  SpectrumBroadcastRing.c
+//  Equalizer
+//
+
+#include "SpectrumBroadcastRing.h"
+#include <stdlib.h>
+#include <string.h>
+
+Boolean SpectrumBroadcastRingInit(SpectrumBroadcastRing *ring, UInt32 capacity, UInt32 frameSize)
+{
+    // round the capacity up to a power of two so slots can be found with a mask
+    UInt32 roundedCapacity = 1;
+    while (roundedCapacity < capacity) roundedCapacity <<= 1;
+
+    memset(ring, 0, sizeof(SpectrumBroadcastRing));
+    ring->capacity = roundedCapacity;
+    ring->frameSize = frameSize;
+    ring->frames = calloc((size_t)roundedCapacity * frameSize, sizeof(float));
+    ring->frameTimes = calloc(roundedCapacity, sizeof(SInt64));
+    ring->slotSequences = calloc(roundedCapacity, sizeof(_Atomic UInt64));
+    if (!ring->frames || !ring->frameTimes || !ring->slotSequences)
+    {
+        SpectrumBroadcastRingCleanup(ring);
+        return false;
+    }
+
+    for (UInt32 i=0;i<roundedCapacity;i++) atomic_init(&ring->slotSequences[i], 0);
+    for (int i=0;i<SPECTRUM_BROADCAST_MAX_READERS;i++) atomic_init(&ring->readers[i].isRegistered, false);
+    atomic_init(&ring->numFramesPublished, 0);
+
+    return true;
+}
+
+void SpectrumBroadcastRingCleanup(SpectrumBroadcastRing *ring)
+{
+    free(ring->frames);
+    free(ring->frameTimes);
+    free((void *)ring->slotSequences);
+    memset(ring, 0, sizeof(SpectrumBroadcastRing));
+}
+
+void SpectrumBroadcastRingPublish(SpectrumBroadcastRing *ring, const float *frame, SInt64 timeInFrames)
+{
+    UInt64 frameIndex = atomic_load_explicit(&ring->numFramesPublished, memory_order_relaxed);
+    UInt32 slot = (UInt32)(frameIndex & (ring->capacity - 1));
+
+    // mark the slot as being written before touching its data, so a reader copying
+    // the frame that used to live here can tell it was overwritten
+    atomic_store_explicit(&ring->slotSequences[slot], 2 * frameIndex + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+
+    memcpy(ring->frames + (size_t)slot * ring->frameSize, frame, ring->frameSize * sizeof(float));
+    ring->frameTimes[slot] = timeInFrames;
+
+    atomic_store_explicit(&ring->slotSequences[slot], 2 * frameIndex + 2, memory_order_release);
+    atomic_store_explicit(&ring->numFramesPublished, frameIndex + 1, memory_order_release);
+}
+
+int SpectrumBroadcastRingAddReader(SpectrumBroadcastRing *ring)
+{
+    for (int i=0;i<SPECTRUM_BROADCAST_MAX_READERS;i++)
+    {
+        SpectrumBroadcastReader *reader = &ring->readers[i];
+        Boolean expected = false;
+        if (atomic_compare_exchange_strong(&reader->isRegistered, &expected, true))
+        {
+            // new readers start at the live edge
+            reader->cursor = atomic_load_explicit(&ring->numFramesPublished, memory_order_acquire);
+            reader->framesSkipped = 0;
+            return i;
+        }
+    }
+
+    return -1;
+}
+
+void SpectrumBroadcastRingRemoveReader(SpectrumBroadcastRing *ring, int readerID)
+{
+    if (readerID < 0 || readerID >= SPECTRUM_BROADCAST_MAX_READERS) return;
+    atomic_store_explicit(&ring->readers[readerID].isRegistered, false, memory_order_release);
+}
+
+Boolean SpectrumBroadcastRingHasReaders(SpectrumBroadcastRing *ring)
+{
+    for (int i=0;i<SPECTRUM_BROADCAST_MAX_READERS;i++)
+    {
+        if (atomic_load_explicit(&ring->readers[i].isRegistered, memory_order_acquire)) return true;
+    }
+    return false;
+}
+
+UInt64 SpectrumBroadcastRingFramesAvailable(SpectrumBroadcastRing *ring, int readerID)
+{
+    UInt64 numFramesPublished = atomic_load_explicit(&ring->numFramesPublished, memory_order_acquire);
+    UInt64 cursor = ring->readers[readerID].cursor;
+    UInt64 available = numFramesPublished - cursor;
+    return available > ring->capacity ? ring->capacity : available;
+}
+
+static SpectrumBroadcastReadResult ReadFrameAtCursor(SpectrumBroadcastRing *ring, SpectrumBroadcastReader *reader, float *frame, SInt64 *timeInFrames)
+{
+    SpectrumBroadcastReadResult result = SpectrumBroadcastReadResult_Frame;
+
+    while (true)
+    {
+        UInt64 numFramesPublished = atomic_load_explicit(&ring->numFramesPublished, memory_order_acquire);
+        if (reader->cursor >= numFramesPublished) return SpectrumBroadcastReadResult_NoNewFrame;
+
+        // lapped by the producer: move past the frames that are already gone
+        if (numFramesPublished - reader->cursor > ring->capacity)
+        {
+            UInt64 oldestAvailable = numFramesPublished - ring->capacity + 1;
+            reader->framesSkipped += oldestAvailable - reader->cursor;
+            reader->cursor = oldestAvailable;
+            result = SpectrumBroadcastReadResult_FrameAfterSkipping;
+        }
+
+        UInt32 slot = (UInt32)(reader->cursor & (ring->capacity - 1));
+        UInt64 expectedSequence = 2 * reader->cursor + 2;
+        if (atomic_load_explicit(&ring->slotSequences[slot], memory_order_acquire) == expectedSequence)
+        {
+            memcpy(frame, ring->frames + (size_t)slot * ring->frameSize, ring->frameSize * sizeof(float));
+            SInt64 time = ring->frameTimes[slot];
+
+            atomic_thread_fence(memory_order_acquire);
+            if (atomic_load_explicit(&ring->slotSequences[slot], memory_order_relaxed) == expectedSequence)
+            {
+                if (timeInFrames) *timeInFrames = time;
+                reader->cursor++;
+                return result;
+            }
+        }
+
+        // the slot was overwritten while we were looking at it. The next pass will see that we were lapped
+        result = SpectrumBroadcastReadResult_FrameAfterSkipping;
+        if (atomic_load_explicit(&ring->numFramesPublished, memory_order_acquire) - reader->cursor <= ring->capacity)
+        {
+            reader->framesSkipped++;
+            reader->cursor++;
+        }
+    }
+}
+
+// Reads the next frame this reader hasn't seen yet
+SpectrumBroadcastReadResult SpectrumBroadcastRingRead(SpectrumBroadcastRing *ring, int readerID, float *frame, SInt64 *timeInFrames)
+{
+    if (readerID < 0 || readerID >= SPECTRUM_BROADCAST_MAX_READERS) return SpectrumBroadcastReadResult_NoNewFrame;
+    return ReadFrameAtCursor(ring, &ring->readers[readerID], frame, timeInFrames);
+}
+
+// Reads the newest frame, dropping anything older this reader hasn't seen yet.
+// Useful for consumers that only care about "now", like a visualizer drawing at display rate.
+SpectrumBroadcastReadResult SpectrumBroadcastRingReadLatest(SpectrumBroadcastRing *ring, int readerID, float *frame, SInt64 *timeInFrames)
+{
+    if (readerID < 0 || readerID >= SPECTRUM_BROADCAST_MAX_READERS) return SpectrumBroadcastReadResult_NoNewFrame;
+
+    SpectrumBroadcastReader *reader = &ring->readers[readerID];
+    UInt64 numFramesPublished = atomic_load_explicit(&ring->numFramesPublished, memory_order_acquire);
+    if (reader->cursor >= numFramesPublished) return SpectrumBroadcastReadResult_NoNewFrame;
+
+    reader->cursor = numFramesPublished - 1;
+    return ReadFrameAtCursor(ring, reader, frame, timeInFrames);
+}
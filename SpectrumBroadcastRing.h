@@ -0,0 +1,64 @@
+//
+//  SpectrumBroadcastRing.h
+//  Equalizer
+//
+
+// A single-producer / multi-consumer ring of fixed-size spectrum frames.
+// The producer writes every frame once; each reader owns a cursor and reads at its own pace.
+// The producer never waits for readers: a reader that falls more than a ring behind is moved
+// forward past the frames it lost, and the number of skipped frames is reported to it.
+
+#include <stdatomic.h>
+#include <MacTypes.h>
+
+#define SPECTRUM_BROADCAST_MAX_READERS 8
+
+typedef struct SpectrumBroadcastReader
+{
+    _Atomic Boolean isRegistered;
+    UInt64 cursor;          // index of the next frame this reader will get. Owned by the reader
+    UInt64 framesSkipped;   // frames that were overwritten before this reader got to them
+} SpectrumBroadcastReader;
+
+typedef struct SpectrumBroadcastRing
+{
+    UInt32 capacity;        // in frames, a power of two
+    UInt32 frameSize;       // in floats
+    float *frames;
+    SInt64 *frameTimes;
+
+    // Per slot: 2 * frameIndex + 1 while the frame is being written, 2 * frameIndex + 2 once it's published
+    _Atomic UInt64 *slotSequences;
+
+    _Atomic UInt64 numFramesPublished;
+    SpectrumBroadcastReader readers[SPECTRUM_BROADCAST_MAX_READERS];
+} SpectrumBroadcastRing;
+
+typedef enum SpectrumBroadcastReadResult
+{
+    SpectrumBroadcastReadResult_NoNewFrame = 0,
+    SpectrumBroadcastReadResult_Frame = 1,
+    SpectrumBroadcastReadResult_FrameAfterSkipping = 2,
+} SpectrumBroadcastReadResult;
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+Boolean SpectrumBroadcastRingInit(SpectrumBroadcastRing *ring, UInt32 capacity, UInt32 frameSize);
+void SpectrumBroadcastRingCleanup(SpectrumBroadcastRing *ring);
+
+// Producer
+void SpectrumBroadcastRingPublish(SpectrumBroadcastRing *ring, const float *frame, SInt64 timeInFrames);
+
+// Readers
+int SpectrumBroadcastRingAddReader(SpectrumBroadcastRing *ring);
+void SpectrumBroadcastRingRemoveReader(SpectrumBroadcastRing *ring, int readerID);
+Boolean SpectrumBroadcastRingHasReaders(SpectrumBroadcastRing *ring);
+UInt64 SpectrumBroadcastRingFramesAvailable(SpectrumBroadcastRing *ring, int readerID);
+SpectrumBroadcastReadResult SpectrumBroadcastRingRead(SpectrumBroadcastRing *ring, int readerID, float *frame, SInt64 *timeInFrames);
+SpectrumBroadcastReadResult SpectrumBroadcastRingReadLatest(SpectrumBroadcastRing *ring, int readerID, float *frame, SInt64 *timeInFrames);
+
+#if defined __cplusplus
+};
+#endif
@@ -0,0 +1,236 @@
+//
+//  WorkStealingPool.c
+//  Equalizer
+//
+
+#include "WorkStealingPool.h"
+#include <unistd.h>
+#include <stdlib.h>
+
+#define WORK_STEALING_POOL_INITIAL_CAPACITY 64
+
+// Which pool's worker the current thread is, so a task's pushes go to its own deque
+static _Thread_local WorkStealingPool *currentPool = NULL;
+static _Thread_local UInt32 currentWorker = 0;
+
+typedef struct WorkerStart
+{
+    WorkStealingPool *pool;
+    UInt32 index;
+} WorkerStart;
+
+static Boolean PushBottom(WorkStealingDeque *deque, WorkStealingTask task)
+{
+    pthread_mutex_lock(&deque->mutex);
+
+    if (deque->bottom - deque->top == deque->capacity)
+    {
+        UInt32 newCapacity = deque->capacity * 2;
+        WorkStealingTask *newTasks = malloc(newCapacity * sizeof(WorkStealingTask));
+        if (!newTasks)
+        {
+            pthread_mutex_unlock(&deque->mutex);
+            return false;
+        }
+
+        UInt32 numTasks = (UInt32)(deque->bottom - deque->top);
+        for (UInt32 i=0;i<numTasks;i++) newTasks[i] = deque->tasks[(deque->top + i) % deque->capacity];
+        free(deque->tasks);
+        deque->tasks = newTasks;
+        deque->capacity = newCapacity;
+        deque->top = 0;
+        deque->bottom = numTasks;
+    }
+
+    deque->tasks[deque->bottom % deque->capacity] = task;
+    deque->bottom++;
+
+    pthread_mutex_unlock(&deque->mutex);
+    return true;
+}
+
+static Boolean PopBottom(WorkStealingDeque *deque, WorkStealingTask *task)
+{
+    pthread_mutex_lock(&deque->mutex);
+    Boolean found = deque->bottom > deque->top;
+    if (found)
+    {
+        deque->bottom--;
+        *task = deque->tasks[deque->bottom % deque->capacity];
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return found;
+}
+
+static Boolean PopTop(WorkStealingDeque *deque, WorkStealingTask *task)
+{
+    pthread_mutex_lock(&deque->mutex);
+    Boolean found = deque->bottom > deque->top;
+    if (found)
+    {
+        *task = deque->tasks[deque->top % deque->capacity];
+        deque->top++;
+    }
+    pthread_mutex_unlock(&deque->mutex);
+    return found;
+}
+
+// Our own deque first, then the others', starting from the next worker's so thieves spread out
+static Boolean TakeTask(WorkStealingPool *pool, UInt32 index, WorkStealingTask *task)
+{
+    if (PopBottom(&pool->deques[index], task)) return true;
+
+    for (UInt32 i=1;i<pool->numThreads;i++)
+    {
+        if (PopTop(&pool->deques[(index + i) % pool->numThreads], task)) return true;
+    }
+    return false;
+}
+
+static void *WorkerThread(void *userInfo)
+{
+    WorkerStart *start = (WorkerStart *)userInfo;
+    WorkStealingPool *pool = start->pool;
+    UInt32 index = start->index;
+    free(start);
+
+    currentPool = pool;
+    currentWorker = index;
+
+    while (!atomic_load_explicit(&pool->shouldStop, memory_order_acquire))
+    {
+        WorkStealingTask task;
+        if (TakeTask(pool, index, &task))
+        {
+            atomic_fetch_sub(&pool->numQueued, 1);
+            task.function(task.context);
+
+            if (atomic_fetch_sub(&pool->numPending, 1) == 1)
+            {
+                pthread_mutex_lock(&pool->mutex);
+                pthread_cond_broadcast(&pool->allDone);
+                pthread_mutex_unlock(&pool->mutex);
+            }
+            continue;
+        }
+
+        // A pusher counts its task before signalling under the mutex, so it can't slip in between
+        pthread_mutex_lock(&pool->mutex);
+        while (atomic_load(&pool->numQueued) <= 0 && !atomic_load(&pool->shouldStop))
+            pthread_cond_wait(&pool->wakeup, &pool->mutex);
+        pthread_mutex_unlock(&pool->mutex);
+    }
+
+    return NULL;
+}
+
+static void StopThreads(WorkStealingPool *pool, UInt32 numStarted)
+{
+    atomic_store(&pool->shouldStop, true);
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_broadcast(&pool->wakeup);
+    pthread_mutex_unlock(&pool->mutex);
+
+    for (UInt32 i=0;i<numStarted;i++) pthread_join(pool->threads[i], NULL);
+}
+
+static void FreePool(WorkStealingPool *pool)
+{
+    for (UInt32 i=0;i<pool->numThreads;i++)
+    {
+        pthread_mutex_destroy(&pool->deques[i].mutex);
+        free(pool->deques[i].tasks);
+    }
+
+    pthread_mutex_destroy(&pool->mutex);
+    pthread_cond_destroy(&pool->wakeup);
+    pthread_cond_destroy(&pool->allDone);
+    free(pool->threads);
+    free(pool->deques);
+    pool->threads = NULL;
+    pool->deques = NULL;
+}
+
+Boolean WorkStealingPoolInit(WorkStealingPool *pool, UInt32 numThreads)
+{
+    if (numThreads == 0)
+    {
+        long numCores = sysconf(_SC_NPROCESSORS_ONLN);
+        numThreads = numCores > 0 ? (UInt32)numCores : 1;
+    }
+
+    pool->numThreads = numThreads;
+    pool->threads = calloc(numThreads, sizeof(pthread_t));
+    pool->deques = calloc(numThreads, sizeof(WorkStealingDeque));
+    if (!pool->threads || !pool->deques)
+    {
+        free(pool->threads);
+        free(pool->deques);
+        return false;
+    }
+
+    for (UInt32 i=0;i<numThreads;i++)
+    {
+        WorkStealingDeque *deque = &pool->deques[i];
+        pthread_mutex_init(&deque->mutex, NULL);
+        deque->capacity = WORK_STEALING_POOL_INITIAL_CAPACITY;
+        deque->tasks = malloc(deque->capacity * sizeof(WorkStealingTask));
+    }
+
+    atomic_init(&pool->numQueued, 0);
+    atomic_init(&pool->numPending, 0);
+    atomic_init(&pool->nextDeque, 0);
+    atomic_init(&pool->shouldStop, false);
+    pthread_mutex_init(&pool->mutex, NULL);
+    pthread_cond_init(&pool->wakeup, NULL);
+    pthread_cond_init(&pool->allDone, NULL);
+
+    for (UInt32 i=0;i<numThreads;i++)
+    {
+        WorkerStart *start = malloc(sizeof(WorkerStart));
+        start->pool = pool;
+        start->index = i;
+        if (pthread_create(&pool->threads[i], NULL, WorkerThread, start) != 0)
+        {
+            free(start);
+            StopThreads(pool, i);
+            FreePool(pool);
+            return false;
+        }
+    }
+
+    return true;
+}
+
+void WorkStealingPoolCleanup(WorkStealingPool *pool)
+{
+    StopThreads(pool, pool->numThreads);
+    FreePool(pool);
+}
+
+Boolean WorkStealingPoolPush(WorkStealingPool *pool, WorkStealingTaskFunction function, void *context)
+{
+    UInt32 index = currentPool == pool ? currentWorker : atomic_fetch_add(&pool->nextDeque, 1) % pool->numThreads;
+    WorkStealingTask task = {function, context};
+
+    // pending first, so a wait can't see zero while the task is on its way in
+    atomic_fetch_add(&pool->numPending, 1);
+    if (!PushBottom(&pool->deques[index], task))
+    {
+        atomic_fetch_sub(&pool->numPending, 1);
+        return false;
+    }
+    atomic_fetch_add(&pool->numQueued, 1);
+
+    pthread_mutex_lock(&pool->mutex);
+    pthread_cond_signal(&pool->wakeup);
+    pthread_mutex_unlock(&pool->mutex);
+    return true;
+}
+
+void WorkStealingPoolWait(WorkStealingPool *pool)
+{
+    pthread_mutex_lock(&pool->mutex);
+    while (atomic_load(&pool->numPending) > 0) pthread_cond_wait(&pool->allDone, &pool->mutex);
+    pthread_mutex_unlock(&pool->mutex);
+}
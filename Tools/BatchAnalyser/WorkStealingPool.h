@@ -0,0 +1,69 @@
+//
+//  WorkStealingPool.h
+//  Equalizer
+//
+
+// A thread per core, each with its own deque of tasks.
+//
+// A task pushed from a worker goes to the bottom of that worker's deque, and the worker takes its
+// own tasks from the bottom, newest first, so what a task splits itself into runs while its data is
+// still warm. A worker whose deque is empty steals from the top of another's, oldest first, which is
+// where the big pieces are. Tasks pushed from outside the pool are dealt out round robin.
+//
+// Unlike AudioWorkerPool, nothing here is real time: every deque has a lock of its own, which only
+// thieves ever contend for.
+
+#include <stdatomic.h>
+#include <pthread.h>
+#include "AudioTypes.h"
+
+typedef void (*WorkStealingTaskFunction)(void *context);
+
+typedef struct WorkStealingTask
+{
+    WorkStealingTaskFunction function;
+    void *context;
+} WorkStealingTask;
+
+typedef struct WorkStealingDeque
+{
+    pthread_mutex_t mutex;
+    WorkStealingTask *tasks;    // a ring, grown as needed
+    UInt32 capacity;
+    UInt64 top;                 // the oldest task
+    UInt64 bottom;              // past the newest
+} WorkStealingDeque;
+
+typedef struct WorkStealingPool
+{
+    UInt32 numThreads;
+    pthread_t *threads;
+    WorkStealingDeque *deques;
+
+    _Atomic SInt64 numQueued;   // in the deques
+    _Atomic SInt64 numPending;  // queued or running
+    _Atomic UInt32 nextDeque;   // for tasks pushed from outside
+    _Atomic Boolean shouldStop;
+
+    pthread_mutex_t mutex;
+    pthread_cond_t wakeup;      // there's something to steal
+    pthread_cond_t allDone;
+} WorkStealingPool;
+
+#if defined __cplusplus
+extern "C" {
+#endif
+
+// 0 threads is one per core
+Boolean WorkStealingPoolInit(WorkStealingPool *pool, UInt32 numThreads);
+// Waits for the workers, not for the tasks: call WorkStealingPoolWait first
+void WorkStealingPoolCleanup(WorkStealingPool *pool);
+
+// Any thread, tasks included. Returns false if there was no memory for it
+Boolean WorkStealingPoolPush(WorkStealingPool *pool, WorkStealingTaskFunction function, void *context);
+// Until every task is done, the ones they pushed as well
+void WorkStealingPoolWait(WorkStealingPool *pool);
+
+#if defined __cplusplus
+};
+#endif
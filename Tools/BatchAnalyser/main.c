@@ -0,0 +1,414 @@
+//
+//  main.c
+//  BatchAnalyser
+//
+
+// Analyses whole libraries ahead of time, on any machine with a C compiler.
+//
+//     BatchAnalyser [-j threads] [-n jump] [-s segment seconds] [-r rate] -o directory path...
+//
+// Every audio file under the paths gets a spectrogram cache entry in the directory: the same entries
+// the app writes while it plays, so copying them into its cache directory saves it the analysis.
+// The app analyses at its output's rate and looks entries up by it, so -r should be that rate (44100
+// or 48000 on most devices): files at other rates are resampled to it as the app would. Without -r
+// every file is analysed at its own rate. The directory is created if it isn't there.
+// A file is hashed, then cut into segments of about -s seconds that overlap by a chunk less a jump,
+// so the frames at their edges come out whole. The segments are tasks of their own: a long track
+// spreads over every core, and whoever finishes the last segment of a file finishes its entry.
+//
+// Prints "entry<TAB>path" per file analysed, and the throughput at the end.
+
+// nftw
+#define _XOPEN_SOURCE 700
+
+#include "AudioDecoder.h"
+#include "AudioResampler.h"
+#include "SpectrumAnalysis.h"
+#include "SpectrogramCache.h"
+#include "WorkStealingPool.h"
+#include <ftw.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define BATCH_ANALYSER_CHUNK_SIZE 2048          // the app's CHUNK_SIZE, which its entries are looked up by
+#define BATCH_ANALYSER_DEFAULT_JUMP_SIZE 512    // and its default fftOverlapJumpSize
+#define BATCH_ANALYSER_DEFAULT_SEGMENT_SECONDS 30
+#define BATCH_ANALYSER_READ_FRAMES 16384
+
+typedef struct BatchFile
+{
+    char path[1024];
+    SpectrogramCache cache;
+    SInt64 numSpectra;          // per channel
+    Float64 sampleRate;         // the analysis's
+    Float64 seconds;
+    _Atomic UInt32 numSegmentsLeft;
+    _Atomic Boolean hasFailed;
+} BatchFile;
+
+typedef struct BatchSegment
+{
+    BatchFile *file;
+    SInt64 firstSpectrum;
+    SInt64 numSpectra;
+} BatchSegment;
+
+typedef struct BatchAnalyser
+{
+    WorkStealingPool pool;
+    const char *outputDirectory;
+    UInt32 jumpSize;
+    Float64 segmentSeconds;
+    Float64 sampleRate;         // what every file is analysed at. 0 for each file's own
+
+    _Atomic UInt64 numFilesAnalysed;
+    _Atomic UInt64 numFilesCached;      // had an entry already
+    _Atomic UInt64 numFilesSkipped;     // not audio, or nothing to analyse
+    _Atomic UInt64 numFilesFailed;
+    _Atomic UInt64 audioMicroseconds;   // of the files analysed
+} BatchAnalyser;
+
+// nftw takes no context
+static BatchAnalyser analyser;
+
+static double Now(void)
+{
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static void FinishFile(BatchFile *file)
+{
+    // finishing closes the cache, path and all
+    char entryPath[sizeof(file->cache.path)];
+    memcpy(entryPath, file->cache.path, sizeof(entryPath));
+
+    if (!atomic_load(&file->hasFailed) && SpectrogramCacheFinishWithNumFrames(&file->cache, file->numSpectra))
+    {
+        char *name = strrchr(entryPath, '/');
+        printf("%s\t%s\n", name ? name + 1 : entryPath, file->path);
+        atomic_fetch_add(&analyser.numFilesAnalysed, 1);
+        atomic_fetch_add(&analyser.audioMicroseconds, (UInt64)(file->seconds * 1e6));
+    }
+    else
+    {
+        SpectrogramCacheClose(&file->cache);
+        fprintf(stderr, "Failed to analyse %s\n", file->path);
+        atomic_fetch_add(&analyser.numFilesFailed, 1);
+    }
+    free(file);
+}
+
+static Boolean ReadFrames(AudioDecoder *decoder, SInt64 firstFrame, float *samples, SInt64 numFrames)
+{
+    UInt32 numChannels = decoder->numChannels;
+    if (!AudioDecoderSeek(decoder, firstFrame)) return false;
+
+    SInt64 numFramesRead = 0;
+    while (numFramesRead < numFrames)
+    {
+        SInt64 numFramesLeft = numFrames - numFramesRead;
+        UInt32 maxFrames = numFramesLeft < BATCH_ANALYSER_READ_FRAMES ? (UInt32)numFramesLeft : BATCH_ANALYSER_READ_FRAMES;
+        UInt32 numFramesDecoded = AudioDecoderReadInto(decoder, samples + numFramesRead * numChannels, maxFrames);
+        if (numFramesDecoded == 0) return false;
+        numFramesRead += numFramesDecoded;
+    }
+    return true;
+}
+
+// The same frames at the resampler's output rate. It starts far enough before them for its filter to
+// be full by the first, so a segment's frames come out as they would from the start of the file
+static Boolean ReadResampledFrames(AudioDecoder *decoder, AudioResampler *resampler, SInt64 firstFrame, float *samples, SInt64 numFrames)
+{
+    UInt32 numChannels = decoder->numChannels;
+    SInt64 numFramesToSkip = AudioResamplerOutputFrameForInputFrame(resampler, resampler->halfTaps) + 1;
+    if (numFramesToSkip > firstFrame) numFramesToSkip = firstFrame;
+
+    if (!AudioDecoderSeek(decoder, AudioResamplerInputFrameForOutputFrame(resampler, firstFrame - numFramesToSkip))) return false;
+    AudioResamplerReset(resampler);
+
+    float *input = malloc((size_t)AUDIO_RESAMPLER_BLOCK_FRAMES * numChannels * sizeof(float));
+    float *output = malloc((size_t)AudioResamplerMaxOutputFrames(resampler, AUDIO_RESAMPLER_BLOCK_FRAMES) * numChannels * sizeof(float));
+    SInt64 numFramesRead = -numFramesToSkip;   // counted from firstFrame
+    while (input && output && numFramesRead < numFrames)
+    {
+        UInt32 numInputFrames = AudioDecoderReadInto(decoder, input, AUDIO_RESAMPLER_BLOCK_FRAMES);
+        UInt32 numOutputFrames = numInputFrames > 0 ? AudioResamplerProcess(resampler, input, numInputFrames, output) : AudioResamplerFlush(resampler, output);
+        if (numInputFrames == 0 && numOutputFrames == 0) break;
+
+        for (UInt32 i=0;i<numOutputFrames;i++)
+        {
+            SInt64 frame = numFramesRead + i;
+            if (frame >= 0 && frame < numFrames) memcpy(samples + frame * numChannels, output + i * numChannels, numChannels * sizeof(float));
+        }
+        numFramesRead += numOutputFrames;
+    }
+    free(input);
+    free(output);
+
+    return numFramesRead >= numFrames;
+}
+
+// Reads the samples under the segment's frames and writes their spectra, a frame of every channel at a time
+static Boolean AnalyseSegmentSamples(BatchSegment *segment, AudioDecoder *decoder, AudioResampler *resampler, float *samples)
+{
+    BatchFile *file = segment->file;
+    UInt32 numChannels = decoder->numChannels;
+    UInt32 jumpSize = analyser.jumpSize;
+    SInt64 firstFrame = segment->firstSpectrum * jumpSize;
+    SInt64 numFrames = (segment->numSpectra - 1) * jumpSize + BATCH_ANALYSER_CHUNK_SIZE;
+
+    Boolean success = AudioResamplerIsConverting(resampler) ? ReadResampledFrames(decoder, resampler, firstFrame, samples, numFrames)
+                                                            : ReadFrames(decoder, firstFrame, samples, numFrames);
+    if (!success) return false;
+
+    float chunk[BATCH_ANALYSER_CHUNK_SIZE];
+    float magnitudes[BATCH_ANALYSER_CHUNK_SIZE];
+    for (SInt64 i=0;i<segment->numSpectra;i++)
+    {
+        const float *chunkStart = samples + i * jumpSize * numChannels;
+        for (UInt32 channel=0;channel<numChannels;channel++)
+        {
+            for (int j=0;j<BATCH_ANALYSER_CHUNK_SIZE;j++) chunk[j] = chunkStart[j * numChannels + channel];
+            SpectrumAnalysisFFT(chunk, BATCH_ANALYSER_CHUNK_SIZE, magnitudes);
+            SpectrogramCacheWriteFrame(&file->cache, channel, segment->firstSpectrum + i, magnitudes);
+        }
+    }
+
+    return true;
+}
+
+// Every segment decodes on its own, so segments of the same file can run at once
+static void AnalyseSegment(void *context)
+{
+    BatchSegment *segment = (BatchSegment *)context;
+    BatchFile *file = segment->file;
+
+    if (!atomic_load(&file->hasFailed))
+    {
+        AudioDecoder decoder;
+        AudioResampler resampler;
+        float *samples = NULL;
+        Boolean success = AudioDecoderOpen(&decoder, file->path);
+        if (success)
+        {
+            SInt64 numFrames = (segment->numSpectra - 1) * analyser.jumpSize + BATCH_ANALYSER_CHUNK_SIZE;
+            samples = malloc(numFrames * decoder.numChannels * sizeof(float));
+            success = samples && AudioResamplerInit(&resampler, decoder.sampleRate, file->sampleRate, decoder.numChannels);
+            if (success)
+            {
+                success = AnalyseSegmentSamples(segment, &decoder, &resampler, samples);
+                AudioResamplerCleanup(&resampler);
+            }
+            AudioDecoderClose(&decoder);
+        }
+        free(samples);
+        if (!success) atomic_store(&file->hasFailed, true);
+    }
+
+    if (atomic_fetch_sub(&file->numSegmentsLeft, 1) == 1) FinishFile(file);
+    free(segment);
+}
+
+// Hashes the file, creates its entry and cuts it into segments. Most of what's under a library isn't
+// audio, or is audio the decoders can't read: those are skipped as soon as a decoder turns them down
+static void AnalyseFile(void *context)
+{
+    BatchFile *file = (BatchFile *)context;
+
+    AudioDecoder decoder;
+    if (!AudioDecoderOpen(&decoder, file->path))
+    {
+        atomic_fetch_add(&analyser.numFilesSkipped, 1);
+        free(file);
+        return;
+    }
+
+    SpectrogramCacheParameters parameters;
+    memset(&parameters, 0, sizeof(SpectrogramCacheParameters));
+    parameters.chunkSize = BATCH_ANALYSER_CHUNK_SIZE;
+    parameters.jumpSize = analyser.jumpSize;
+    parameters.window = SpectrogramCacheWindow_Hann;
+    parameters.numChannels = decoder.numChannels;
+    parameters.sampleRate = analyser.sampleRate > 0 ? analyser.sampleRate : decoder.sampleRate;
+
+    // in frames at the analysis's rate, counted as the app counts them
+    SInt64 numFrames = decoder.sampleRate == parameters.sampleRate ? decoder.numFrames : (SInt64)llround(decoder.numFrames * parameters.sampleRate / decoder.sampleRate);
+    Boolean canConvert = AudioResamplerCanConvert(decoder.sampleRate, parameters.sampleRate);
+    file->sampleRate = parameters.sampleRate;
+    file->seconds = AudioDecoderDuration(&decoder);
+    AudioDecoderClose(&decoder);
+
+    if (numFrames < BATCH_ANALYSER_CHUNK_SIZE || parameters.numChannels > SPECTROGRAM_CACHE_MAX_CHANNELS || !canConvert)
+    {
+        atomic_fetch_add(&analyser.numFilesSkipped, 1);
+        free(file);
+        return;
+    }
+
+    if (!SpectrogramCacheHashFile(file->path, parameters.contentHash))
+    {
+        fprintf(stderr, "Failed to read %s\n", file->path);
+        atomic_fetch_add(&analyser.numFilesFailed, 1);
+        free(file);
+        return;
+    }
+
+    char name[256];
+    char entryPath[sizeof(file->cache.path)];
+    SpectrogramCacheFileName(&parameters, name, sizeof(name));
+    snprintf(entryPath, sizeof(entryPath), "%s/%s", analyser.outputDirectory, name);
+
+    if (SpectrogramCacheOpen(&file->cache, entryPath, &parameters))
+    {
+        SpectrogramCacheClose(&file->cache);
+        atomic_fetch_add(&analyser.numFilesCached, 1);
+        free(file);
+        return;
+    }
+
+    file->numSpectra = (numFrames - BATCH_ANALYSER_CHUNK_SIZE) / analyser.jumpSize + 1;
+    if (!SpectrogramCacheCreate(&file->cache, entryPath, &parameters, file->numSpectra))
+    {
+        fprintf(stderr, "Failed to create %s\n", entryPath);
+        atomic_fetch_add(&analyser.numFilesFailed, 1);
+        free(file);
+        return;
+    }
+
+    SInt64 spectraPerSegment = (SInt64)(analyser.segmentSeconds * parameters.sampleRate) / analyser.jumpSize;
+    if (spectraPerSegment < 1) spectraPerSegment = 1;
+    UInt32 numSegments = (UInt32)((file->numSpectra + spectraPerSegment - 1) / spectraPerSegment);
+
+    // counted in full up front, so a segment done before the rest are pushed can't finish the file
+    atomic_init(&file->numSegmentsLeft, numSegments);
+    for (UInt32 i=0;i<numSegments;i++)
+    {
+        BatchSegment *segment = malloc(sizeof(BatchSegment));
+        if (segment)
+        {
+            segment->file = file;
+            segment->firstSpectrum = i * spectraPerSegment;
+            segment->numSpectra = file->numSpectra - segment->firstSpectrum;
+            if (segment->numSpectra > spectraPerSegment) segment->numSpectra = spectraPerSegment;
+        }
+
+        if (!segment || !WorkStealingPoolPush(&analyser.pool, AnalyseSegment, segment))
+        {
+            free(segment);
+            atomic_store(&file->hasFailed, true);
+            if (atomic_fetch_sub(&file->numSegmentsLeft, numSegments - i) == numSegments - i) FinishFile(file);
+            return;
+        }
+    }
+}
+
+static int AddFile(const char *path, const struct stat *status, int type, struct FTW *position)
+{
+    if (type != FTW_F) return 0;
+
+    BatchFile *file = calloc(1, sizeof(BatchFile));
+    if (!file || strlen(path) >= sizeof(file->path))
+    {
+        fprintf(stderr, "Skipping %s\n", path);
+        free(file);
+        return 0;
+    }
+
+    snprintf(file->path, sizeof(file->path), "%s", path);
+    atomic_init(&file->hasFailed, false);
+    if (!WorkStealingPoolPush(&analyser.pool, AnalyseFile, file)) free(file);
+    return 0;
+}
+
+static void PrintUsage(const char *name)
+{
+    fprintf(stderr, "Usage: %s [-j threads] [-n jump] [-s segment seconds] [-r rate] -o directory path...\n", name);
+}
+
+// mkdir -p
+static Boolean CreateDirectory(const char *path)
+{
+    char directory[1024];
+    if (snprintf(directory, sizeof(directory), "%s", path) >= (int)sizeof(directory)) return false;
+
+    for (char *separator = strchr(directory + 1, '/');separator;separator = strchr(separator + 1, '/'))
+    {
+        *separator = '\0';
+        if (mkdir(directory, 0755) != 0 && errno != EEXIST) return false;
+        *separator = '/';
+    }
+    if (mkdir(directory, 0755) != 0 && errno != EEXIST) return false;
+
+    struct stat status;
+    return stat(directory, &status) == 0 && S_ISDIR(status.st_mode);
+}
+
+int main(int argc, char *argv[])
+{
+    UInt32 numThreads = 0;
+    analyser.jumpSize = BATCH_ANALYSER_DEFAULT_JUMP_SIZE;
+    analyser.segmentSeconds = BATCH_ANALYSER_DEFAULT_SEGMENT_SECONDS;
+
+    int option;
+    while ((option = getopt(argc, argv, "j:n:s:r:o:")) != -1)
+    {
+        switch (option)
+        {
+            case 'j': numThreads = (UInt32)atoi(optarg); break;
+            case 'n': analyser.jumpSize = (UInt32)atoi(optarg); break;
+            case 's': analyser.segmentSeconds = atof(optarg); break;
+            case 'r': analyser.sampleRate = atof(optarg); break;
+            case 'o': analyser.outputDirectory = optarg; break;
+            default:
+                PrintUsage(argv[0]);
+                return 1;
+        }
+    }
+
+    if (!analyser.outputDirectory || optind == argc || analyser.jumpSize == 0 || analyser.segmentSeconds <= 0 || analyser.sampleRate < 0)
+    {
+        PrintUsage(argv[0]);
+        return 1;
+    }
+
+    if (!CreateDirectory(analyser.outputDirectory))
+    {
+        fprintf(stderr, "Failed to create %s\n", analyser.outputDirectory);
+        return 1;
+    }
+
+    if (!WorkStealingPoolInit(&analyser.pool, numThreads))
+    {
+        fprintf(stderr, "Failed to start the workers\n");
+        return 1;
+    }
+
+    // Files are handed to the workers while the walk goes on
+    double startTime = Now();
+    for (int i=optind;i<argc;i++)
+    {
+        if (nftw(argv[i], AddFile, 64, FTW_PHYS) != 0) fprintf(stderr, "Failed to walk %s\n", argv[i]);
+    }
+    WorkStealingPoolWait(&analyser.pool);
+    double seconds = Now() - startTime;
+    WorkStealingPoolCleanup(&analyser.pool);
+
+    UInt64 numFilesAnalysed = atomic_load(&analyser.numFilesAnalysed);
+    double audioHours = atomic_load(&analyser.audioMicroseconds) / 1e6 / 3600;
+    fprintf(stderr, "%llu analysed, %llu already there, %llu skipped, %llu failed, on %u threads in %.2f s\n",
+            (unsigned long long)numFilesAnalysed, (unsigned long long)atomic_load(&analyser.numFilesCached),
+            (unsigned long long)atomic_load(&analyser.numFilesSkipped), (unsigned long long)atomic_load(&analyser.numFilesFailed),
+            (unsigned)analyser.pool.numThreads, seconds);
+    fprintf(stderr, "%.2f files/s, %.3f audio hours/s (%.0fx real time)\n",
+            numFilesAnalysed / seconds, audioHours / seconds, audioHours * 3600 / seconds);
+
+    return atomic_load(&analyser.numFilesFailed) > 0 ? 2 : 0;
+}